@@ -0,0 +1,265 @@
+/* Arena (region) allocator.
+   Copyright (C) 2014 Free Software Foundation, Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+/* An arena hands out memory from large blocks obtained with malloc
+   and releases all of it at once when the arena is freed.  Individual
+   objects cannot be freed.  This suits data whose lifetime is bound
+   to a single document, such as the links extracted from an HTML page
+   and the URLs they parse into: a page with thousands of links costs
+   a handful of mallocs instead of tens of thousands, and freeing the
+   link list no longer has to chase every string separately.
+
+   The entry points are:
+
+     arena_new         -- create an arena.
+     arena_alloc       -- allocate uninitialized memory.
+     arena_alloc0      -- allocate zeroed memory.
+     arena_realloc     -- grow an object, in place if it was the most
+                          recent allocation.
+     arena_strdup      -- copy a string into the arena.
+     arena_strdupdelim -- copy [beg, end) into the arena.
+     arena_report      -- print allocation statistics in debug mode.
+     arena_free        -- release the arena and everything in it.  */
+
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "arena.h"
+
+/* Default size of an arena block, used when arena_new is passed 0.  */
+#define ARENA_DEFAULT_BLOCK_SIZE 8192
+
+/* Requests larger than this fraction of the block size get a block of
+   their own, so that they don't waste the tail of the current one.  */
+#define ARENA_LARGE_FRACTION 4
+
+/* Alignment of the pointers handed out by the arena.  */
+union arena_align {
+  long l;
+  double d;
+  void *p;
+  wgint w;
+};
+#define ARENA_ALIGN (sizeof (union arena_align))
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct arena_block {
+  struct arena_block *next;     /* previously allocated block */
+  size_t size;                  /* usable bytes in this block */
+  size_t used;                  /* bytes handed out so far */
+};
+
+/* The header is padded so that the data following it is aligned.  */
+#define BLOCK_HEADER_SIZE ARENA_ROUND (sizeof (struct arena_block))
+#define BLOCK_DATA(b) ((char *) (b) + BLOCK_HEADER_SIZE)
+
+struct arena {
+  struct arena_block *current;  /* block we're allocating from */
+  size_t block_size;            /* size of a regular block */
+  char *last;                   /* most recent allocation, for
+                                   arena_realloc */
+
+  /* Statistics, reported by arena_report. */
+  int allocations;              /* number of allocation requests */
+  wgint bytes;                  /* bytes requested */
+  int blocks;                   /* number of blocks malloced */
+  wgint reserved;               /* bytes malloced for blocks */
+};
+
+static struct arena_block *
+new_block (struct arena *a, size_t size)
+{
+  struct arena_block *b = xmalloc (BLOCK_HEADER_SIZE + size);
+  b->size = size;
+  b->used = 0;
+  ++a->blocks;
+  a->reserved += BLOCK_HEADER_SIZE + size;
+  return b;
+}
+
+/* Create a new arena whose blocks are BLOCK_SIZE bytes large.  If
+   BLOCK_SIZE is 0, a reasonable default is used.  No memory is
+   allocated for the blocks until the first allocation.  */
+
+struct arena *
+arena_new (size_t block_size)
+{
+  struct arena *a = xnew0 (struct arena);
+  a->block_size = block_size ? ARENA_ROUND (block_size)
+                             : ARENA_DEFAULT_BLOCK_SIZE;
+  return a;
+}
+
+/* Release A along with all the memory allocated from it.  */
+
+void
+arena_free (struct arena *a)
+{
+  struct arena_block *b, *next;
+
+  if (!a)
+    return;
+  for (b = a->current; b; b = next)
+    {
+      next = b->next;
+      xfree (b);
+    }
+  xfree (a);
+}
+
+/* Return SIZE bytes of uninitialized memory from A.  The memory is
+   aligned for any basic type and lives until A is freed.  */
+
+void *
+arena_alloc (struct arena *a, size_t size)
+{
+  struct arena_block *b = a->current;
+  char *ptr;
+
+  size = ARENA_ROUND (size ? size : 1);
+  ++a->allocations;
+  a->bytes += size;
+
+  if (!b || b->size - b->used < size)
+    {
+      if (size > a->block_size / ARENA_LARGE_FRACTION)
+        {
+          /* Large object: give it a private block and keep filling
+             the current one.  Note that the new block is linked
+             behind the current one, so it is never allocated from
+             again.  */
+          struct arena_block *big = new_block (a, size);
+          big->used = size;
+          if (b)
+            {
+              big->next = b->next;
+              b->next = big;
+            }
+          else
+            {
+              big->next = NULL;
+              a->current = big;
+            }
+          a->last = NULL;
+          return BLOCK_DATA (big);
+        }
+      b = new_block (a, a->block_size);
+      b->next = a->current;
+      a->current = b;
+    }
+
+  ptr = BLOCK_DATA (b) + b->used;
+  b->used += size;
+  a->last = ptr;
+  return ptr;
+}
+
+/* Like arena_alloc, but zero the memory.  */
+
+void *
+arena_alloc0 (struct arena *a, size_t size)
+{
+  void *ptr = arena_alloc (a, size);
+  memset (ptr, 0, size);
+  return ptr;
+}
+
+/* Grow PTR, an object of OLD_SIZE bytes allocated from A, to
+   NEW_SIZE bytes.  If PTR was the most recent allocation and the
+   current block has room, it is extended in place; otherwise a new
+   object is allocated and the contents are copied.  The old object is
+   not reclaimed until A is freed.  PTR may be NULL, in which case
+   this is equivalent to arena_alloc.  */
+
+void *
+arena_realloc (struct arena *a, void *ptr, size_t old_size, size_t new_size)
+{
+  struct arena_block *b = a->current;
+  void *new_ptr;
+
+  if (!ptr)
+    return arena_alloc (a, new_size);
+  if (new_size <= old_size)
+    return ptr;
+
+  if (ptr == a->last && b)
+    {
+      size_t offset = (char *) ptr - BLOCK_DATA (b);
+      size_t rounded = ARENA_ROUND (new_size);
+      if (rounded <= b->size - offset)
+        {
+          a->bytes += rounded - (b->used - offset);
+          b->used = offset + rounded;
+          return ptr;
+        }
+    }
+
+  new_ptr = arena_alloc (a, new_size);
+  memcpy (new_ptr, ptr, old_size);
+  return new_ptr;
+}
+
+/* Copy the zero-terminated string S into A.  */
+
+char *
+arena_strdup (struct arena *a, const char *s)
+{
+  size_t len = strlen (s);
+  char *copy = arena_alloc (a, len + 1);
+  memcpy (copy, s, len + 1);
+  return copy;
+}
+
+/* Copy the string in [BEG, END) into A and zero-terminate it, like
+   strdupdelim does for the heap.  */
+
+char *
+arena_strdupdelim (struct arena *a, const char *beg, const char *end)
+{
+  char *copy = arena_alloc (a, end - beg + 1);
+  memcpy (copy, beg, end - beg);
+  copy[end - beg] = '\0';
+  return copy;
+}
+
+/* Print allocation statistics for A, identified by WHAT, when
+   running with --debug.  */
+
+void
+arena_report (const struct arena *a, const char *what)
+{
+  DEBUGP (("Arena for %s: %d allocations, %s bytes in %d blocks (%s bytes reserved).\n",
+           what, a->allocations, number_to_static_string (a->bytes),
+           a->blocks, number_to_static_string (a->reserved)));
+}
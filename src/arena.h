@@ -0,0 +1,49 @@
+/* Declarations for arena.c.
+   Copyright (C) 2014 Free Software Foundation, Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+struct arena;			/* forward declaration; all struct
+                                   members are private */
+
+struct arena *arena_new (size_t);
+void arena_free (struct arena *);
+
+void *arena_alloc (struct arena *, size_t);
+void *arena_alloc0 (struct arena *, size_t);
+void *arena_realloc (struct arena *, void *, size_t, size_t);
+char *arena_strdup (struct arena *, const char *);
+char *arena_strdupdelim (struct arena *, const char *, const char *);
+
+void arena_report (const struct arena *, const char *);
+
+#define arena_new_obj(a, type) ((type *) arena_alloc0 (a, sizeof (type)))
+
+#endif /* ARENA_H */
@@ -0,0 +1,230 @@
+/* Bloom filter.
+   Copyright (C) 2014 Free Software Foundation, Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+
+/* A Bloom filter answers "have I seen this string?" with either "no"
+   or "probably", using a fixed number of bits regardless of how many
+   strings have been added.  Recursive retrieval puts one in front of
+   the set of seen URLs, so that the common case of a new URL is
+   decided without consulting the exact set, which may live on disk.
+
+   The filter is split into blocks of one cache line each.  All the
+   bits of a string fall into the same block, so a lookup touches a
+   single cache line at the price of a slightly higher false positive
+   rate than a classic Bloom filter of the same size.
+
+   The entry points are:
+
+     bloom_new            -- create a filter sized for a number of
+                             strings.
+     bloom_add            -- add a string.
+     bloom_maybe_contains -- return false if the string was definitely
+                             never added.
+     bloom_write          -- save the filter to a stream.
+     bloom_read           -- load a filter saved by bloom_write.
+     bloom_free           -- release the filter.  */
+
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "hash.h"
+#include "bloom.h"
+
+/* Number of 64-bit words in a block: 8 words is a 64-byte cache
+   line.  */
+#define BLOCK_WORDS 8
+#define BLOCK_BITS (BLOCK_WORDS * 64)
+
+/* Bounds on the number of bits set per string.  */
+#define MIN_HASHES 1
+#define MAX_HASHES 12
+
+/* Magic number identifying a saved filter.  */
+#define BLOOM_MAGIC "wget-bloom 1"
+
+struct bloom {
+  uint64_t *words;              /* the bits, BLOCK_WORDS per block */
+  unsigned long block_mask;     /* number of blocks - 1; the number of
+                                   blocks is a power of two */
+  int hashes;                   /* bits set per string */
+};
+
+/* Create a Bloom filter expected to hold CAPACITY strings, using
+   BITS_PER_STRING bits for each.  10 bits per string give a false
+   positive rate of about 1%, and every additional 5 bits divide it by
+   ten.  The filter keeps working after CAPACITY strings have been
+   added; only the false positive rate rises.  */
+
+struct bloom *
+bloom_new (unsigned long capacity, int bits_per_string)
+{
+  struct bloom *b = xnew0 (struct bloom);
+  unsigned long blocks = 1;
+
+  if (capacity < 1)
+    capacity = 1;
+  if (bits_per_string < 1)
+    bits_per_string = 10;
+
+  /* Round the number of blocks up to a power of two so that a block
+     can be selected by masking.  */
+  while (blocks * BLOCK_BITS / bits_per_string < capacity)
+    blocks <<= 1;
+  b->block_mask = blocks - 1;
+
+  /* The optimal number of hashes is ln 2 times the bits per
+     string.  */
+  b->hashes = (bits_per_string * 693 + 500) / 1000;
+  if (b->hashes < MIN_HASHES)
+    b->hashes = MIN_HASHES;
+  if (b->hashes > MAX_HASHES)
+    b->hashes = MAX_HASHES;
+
+  b->words = xnew0_array (uint64_t, blocks * BLOCK_WORDS);
+  return b;
+}
+
+/* Release B.  */
+
+void
+bloom_free (struct bloom *b)
+{
+  if (!b)
+    return;
+  xfree (b->words);
+  xfree (b);
+}
+
+/* Select the block of B for the hash H, and compute the two values
+   from which the bit positions inside the block are derived.  */
+
+static inline uint64_t *
+bloom_block (const struct bloom *b, uint64_t h, uint32_t *h1, uint32_t *h2)
+{
+  /* The block is chosen by the low bits of H.  Multiplying by an odd
+     constant spreads the remaining bits into the high half, which
+     yields the positions inside the block.  */
+  uint64_t g = h * 0x9e3779b97f4a7c15ULL;
+  *h1 = (uint32_t) (g >> 32);
+  *h2 = (uint32_t) (g >> 16) | 1;
+  return b->words + (h & b->block_mask) * BLOCK_WORDS;
+}
+
+/* Add the string S to B.  */
+
+void
+bloom_add (struct bloom *b, const char *s)
+{
+  uint32_t h1, h2;
+  uint64_t *block = bloom_block (b, hash_string_64 (s, strlen (s)),
+                                 &h1, &h2);
+  int i;
+
+  for (i = 0; i < b->hashes; i++)
+    {
+      unsigned bit = (h1 + i * h2) % BLOCK_BITS;
+      block[bit / 64] |= (uint64_t) 1 << (bit % 64);
+    }
+}
+
+/* Return false if S has certainly not been added to B, and true if
+   it probably has.  */
+
+bool
+bloom_maybe_contains (const struct bloom *b, const char *s)
+{
+  uint32_t h1, h2;
+  const uint64_t *block = bloom_block (b, hash_string_64 (s, strlen (s)),
+                                       &h1, &h2);
+  int i;
+
+  for (i = 0; i < b->hashes; i++)
+    {
+      unsigned bit = (h1 + i * h2) % BLOCK_BITS;
+      if (!(block[bit / 64] & ((uint64_t) 1 << (bit % 64))))
+        return false;
+    }
+  return true;
+}
+
+/* Write B to FP in a form that bloom_read can load back.  The words
+   are written in host byte order, so the file is only meant to be
+   read by the same machine.  Return false on write error.  */
+
+bool
+bloom_write (const struct bloom *b, FILE *fp)
+{
+  size_t nwords = (b->block_mask + 1) * BLOCK_WORDS;
+
+  fprintf (fp, "%s %lu %d\n", BLOOM_MAGIC, b->block_mask + 1, b->hashes);
+  if (fwrite (b->words, sizeof (uint64_t), nwords, fp) != nwords)
+    return false;
+  return !ferror (fp);
+}
+
+/* Load a Bloom filter written by bloom_write from FP.  Return NULL if
+   FP doesn't contain a valid filter.  */
+
+struct bloom *
+bloom_read (FILE *fp)
+{
+  char magic[sizeof (BLOOM_MAGIC)];
+  unsigned long blocks;
+  int hashes;
+  size_t nwords;
+  struct bloom *b;
+
+  if (fread (magic, 1, sizeof (magic) - 1, fp) != sizeof (magic) - 1)
+    return NULL;
+  magic[sizeof (magic) - 1] = '\0';
+  if (strcmp (magic, BLOOM_MAGIC) != 0
+      || fscanf (fp, " %lu %d", &blocks, &hashes) != 2
+      || getc (fp) != '\n')
+    return NULL;
+  /* The number of blocks must be a power of two.  */
+  if (blocks == 0 || (blocks & (blocks - 1)) != 0
+      || hashes < MIN_HASHES || hashes > MAX_HASHES)
+    return NULL;
+
+  nwords = blocks * BLOCK_WORDS;
+  b = xnew0 (struct bloom);
+  b->block_mask = blocks - 1;
+  b->hashes = hashes;
+  b->words = xnew_array (uint64_t, nwords);
+  if (fread (b->words, sizeof (uint64_t), nwords, fp) != nwords)
+    {
+      bloom_free (b);
+      return NULL;
+    }
+  return b;
+}
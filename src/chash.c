@@ -0,0 +1,418 @@
+/* Concurrent hash tables.
+   Copyright (C) 2014 Free Software Foundation, Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+
+/* A concurrent hash table is a hash table that may be used by several
+   threads at once, such as the tables of downloaded files, robots.txt
+   specs and resolved hosts shared by the --jobs threads.
+
+   The table is split into a fixed number of stripes, each of which is
+   an ordinary hash table (see hash.c) with a lock of its own.  A key
+   always goes to the same stripe, chosen from its hash value, so that
+   operations on different keys mostly take different locks and don't
+   wait for each other.  Without thread support, there is only one
+   stripe and no locking.
+
+   The entry points mirror those of hash.c:
+
+     chash_table_new       -- create the table.
+     chash_table_destroy   -- destroy the table.
+     chash_table_get       -- retrieve value of key.
+     chash_table_get_pair  -- get key/value pair for key.
+     chash_table_contains  -- test whether the table contains key.
+     chash_table_put       -- establish or update key->value mapping.
+     chash_table_remove    -- remove key->value mapping for given key.
+     chash_table_for_each  -- call function for each table entry.
+     chash_table_count     -- return the number of entries in the table.
+
+   Each of them is atomic, but a sequence of them is not.  When the
+   value of a key must be read and updated at once, or when it must
+   not be freed by another thread while it is being used, lock the
+   stripe of the key with chash_table_lock and work on the hash table
+   it returns, then release it with chash_table_unlock:
+
+       struct hash_table *ht = chash_table_lock (ct, key);
+       if (!hash_table_contains (ht, key))
+         hash_table_put (ht, xstrdup (key), value);
+       chash_table_unlock (ct, key);
+
+   The stripe lock is not recursive: don't call other chash_table_*
+   functions on the same table while holding it.  */
+
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef ENABLE_THREADS
+# include <pthread.h>
+#endif
+
+#include "utils.h"
+#include "hash.h"
+#include "chash.h"
+
+#ifdef TESTING
+#include "test.h"
+#endif
+
+/* The number of stripes is 1 << CHASH_STRIPE_BITS.  A few times the
+   number of threads keeps them from waiting for each other.  */
+#ifdef ENABLE_THREADS
+# define CHASH_STRIPE_BITS 6
+#else
+# define CHASH_STRIPE_BITS 0
+#endif
+#define CHASH_STRIPES (1 << CHASH_STRIPE_BITS)
+
+#ifdef ENABLE_THREADS
+# define STRIPE_LOCK(s) pthread_mutex_lock (&(s)->mutex)
+# define STRIPE_UNLOCK(s) pthread_mutex_unlock (&(s)->mutex)
+#else
+# define STRIPE_LOCK(s)
+# define STRIPE_UNLOCK(s)
+#endif
+
+struct chash_stripe {
+#ifdef ENABLE_THREADS
+  pthread_mutex_t mutex;
+#endif
+  struct hash_table *table;
+};
+
+struct chash_table {
+  unsigned long (*hash_function) (const void *);
+  struct chash_stripe stripes[CHASH_STRIPES];
+};
+
+/* Return the stripe of CT that holds KEY.  The stripe is chosen from
+   the upper bits of the hash value scrambled by a multiplier other
+   than the one hash.c uses, so that the keys of a stripe are still
+   spread over its whole table.  */
+
+static inline struct chash_stripe *
+stripe_of (struct chash_table *ct, const void *key)
+{
+#if CHASH_STRIPE_BITS > 0
+  uint64_t h = (uint64_t) ct->hash_function (key) * 0xc2b2ae3d27d4eb4fULL;
+  return &ct->stripes[h >> (64 - CHASH_STRIPE_BITS)];
+#else
+  return &ct->stripes[0];
+#endif
+}
+
+/* Create a concurrent hash table with hash function HASH_FUNCTION and
+   test function TEST_FUNCTION, pre-allocated to store at least ITEMS
+   items.  See hash_table_new for the meaning of the arguments.  */
+
+struct chash_table *
+chash_table_new (int items,
+                 unsigned long (*hash_function) (const void *),
+                 int (*test_function) (const void *, const void *))
+{
+  struct chash_table *ct = xnew (struct chash_table);
+  int i;
+
+  ct->hash_function = hash_function ? hash_function : hash_pointer;
+  for (i = 0; i < CHASH_STRIPES; i++)
+    {
+#ifdef ENABLE_THREADS
+      pthread_mutex_init (&ct->stripes[i].mutex, NULL);
+#endif
+      ct->stripes[i].table = hash_table_new (items / CHASH_STRIPES,
+                                             hash_function, test_function);
+    }
+  return ct;
+}
+
+/* Free the data associated with CT.  No other thread may use it.  */
+
+void
+chash_table_destroy (struct chash_table *ct)
+{
+  int i;
+  for (i = 0; i < CHASH_STRIPES; i++)
+    {
+      hash_table_destroy (ct->stripes[i].table);
+#ifdef ENABLE_THREADS
+      pthread_mutex_destroy (&ct->stripes[i].mutex);
+#endif
+    }
+  xfree (ct);
+}
+
+/* Lock the stripe of CT that holds KEY, and return its hash table,
+   which may be used until chash_table_unlock is called with the same
+   KEY.  */
+
+struct hash_table *
+chash_table_lock (struct chash_table *ct, const void *key)
+{
+  struct chash_stripe *s = stripe_of (ct, key);
+  STRIPE_LOCK (s);
+  return s->table;
+}
+
+/* Release the stripe locked by chash_table_lock (CT, KEY).  */
+
+void
+chash_table_unlock (struct chash_table *ct, const void *key)
+{
+  STRIPE_UNLOCK (stripe_of (ct, key));
+}
+
+/* Get the value that corresponds to KEY in CT, or NULL.  Unless
+   values are never freed, use chash_table_lock instead.  */
+
+void *
+chash_table_get (struct chash_table *ct, const void *key)
+{
+  struct chash_stripe *s = stripe_of (ct, key);
+  void *value;
+
+  STRIPE_LOCK (s);
+  value = hash_table_get (s->table, key);
+  STRIPE_UNLOCK (s);
+  return value;
+}
+
+/* Like hash_table_get_pair, for a concurrent hash table.  */
+
+int
+chash_table_get_pair (struct chash_table *ct, const void *lookup_key,
+                      void *orig_key, void *value)
+{
+  struct chash_stripe *s = stripe_of (ct, lookup_key);
+  int found;
+
+  STRIPE_LOCK (s);
+  found = hash_table_get_pair (s->table, lookup_key, orig_key, value);
+  STRIPE_UNLOCK (s);
+  return found;
+}
+
+/* Return 1 if CT contains KEY, 0 otherwise.  */
+
+int
+chash_table_contains (struct chash_table *ct, const void *key)
+{
+  struct chash_stripe *s = stripe_of (ct, key);
+  int found;
+
+  STRIPE_LOCK (s);
+  found = hash_table_contains (s->table, key);
+  STRIPE_UNLOCK (s);
+  return found;
+}
+
+/* Put VALUE in CT under the key KEY.  */
+
+void
+chash_table_put (struct chash_table *ct, const void *key, const void *value)
+{
+  struct chash_stripe *s = stripe_of (ct, key);
+
+  STRIPE_LOCK (s);
+  hash_table_put (s->table, key, value);
+  STRIPE_UNLOCK (s);
+}
+
+/* Remove KEY->value mapping from CT.  Return 0 if there was no such
+   entry; return 1 if an entry was removed.  */
+
+int
+chash_table_remove (struct chash_table *ct, const void *key)
+{
+  struct chash_stripe *s = stripe_of (ct, key);
+  int removed;
+
+  STRIPE_LOCK (s);
+  removed = hash_table_remove (s->table, key);
+  STRIPE_UNLOCK (s);
+  return removed;
+}
+
+/* Call FN for each entry in CT, as hash_table_for_each does.  Each
+   stripe is locked while FN is called for its entries, so FN must not
+   use CT; entries added or removed by other threads meanwhile may or
+   may not be seen.  */
+
+void
+chash_table_for_each (struct chash_table *ct,
+                      int (*fn) (void *, void *, void *), void *arg)
+{
+  int i;
+  for (i = 0; i < CHASH_STRIPES; i++)
+    {
+      struct chash_stripe *s = &ct->stripes[i];
+      hash_table_iterator iter;
+      int stop = 0;
+
+      STRIPE_LOCK (s);
+      for (hash_table_iterate (s->table, &iter);
+           !stop && hash_table_iter_next (&iter); )
+        stop = fn (iter.key, iter.value, arg);
+      STRIPE_UNLOCK (s);
+      if (stop)
+        break;
+    }
+}
+
+/* Return the number of entries in CT.  */
+
+int
+chash_table_count (struct chash_table *ct)
+{
+  int i, count = 0;
+  for (i = 0; i < CHASH_STRIPES; i++)
+    {
+      struct chash_stripe *s = &ct->stripes[i];
+      STRIPE_LOCK (s);
+      count += hash_table_count (s->table);
+      STRIPE_UNLOCK (s);
+    }
+  return count;
+}
+
+/* Return a concurrent hash table suitable to use strings as keys.  */
+
+struct chash_table *
+make_string_chash_table (int items)
+{
+  return chash_table_new (items, hash_string, cmp_string);
+}
+
+/* Like make_string_chash_table, but the keys are compared
+   case-insensitively.  */
+
+struct chash_table *
+make_nocase_string_chash_table (int items)
+{
+  return chash_table_new (items, hash_string_nocase, string_cmp_nocase);
+}
+
+#ifdef TESTING
+
+#define TEST_THREADS 4
+#define TEST_KEYS 2000
+
+struct test_arg {
+  struct chash_table *ct;
+  int id;
+};
+
+/* Put a key of our own for each I, and bump a counter shared by all
+   the threads under the stripe lock.  */
+
+static void *
+test_chash_worker (void *arg)
+{
+  struct test_arg *ta = arg;
+  int i;
+
+  for (i = 0; i < TEST_KEYS; i++)
+    {
+      char key[32];
+      struct hash_table *ht;
+      char *orig_key;
+      long n;
+
+      sprintf (key, "t%d-%d", ta->id, i);
+      chash_table_put (ta->ct, xstrdup (key), (void *) (long) i);
+
+      sprintf (key, "shared-%d", i % 50);
+      ht = chash_table_lock (ta->ct, key);
+      if (hash_table_get_pair (ht, key, &orig_key, &n))
+        hash_table_put (ht, orig_key, (void *) (n + 1));
+      else
+        hash_table_put (ht, xstrdup (key), (void *) 1L);
+      chash_table_unlock (ta->ct, key);
+    }
+  return NULL;
+}
+
+static int
+test_free_key (void *key, void *value, void *arg)
+{
+  ++*(int *) arg;
+  xfree (key);
+  return 0;
+}
+
+const char *
+test_chash_table (void)
+{
+  struct chash_table *ct = make_string_chash_table (0);
+  struct test_arg args[TEST_THREADS];
+  char *orig_key;
+  int i, freed = 0;
+#ifdef ENABLE_THREADS
+  pthread_t threads[TEST_THREADS];
+
+  for (i = 0; i < TEST_THREADS; i++)
+    {
+      args[i].ct = ct;
+      args[i].id = i;
+      pthread_create (&threads[i], NULL, test_chash_worker, &args[i]);
+    }
+  for (i = 0; i < TEST_THREADS; i++)
+    pthread_join (threads[i], NULL);
+#else
+  for (i = 0; i < TEST_THREADS; i++)
+    {
+      args[i].ct = ct;
+      args[i].id = i;
+      test_chash_worker (&args[i]);
+    }
+#endif
+
+  mu_assert ("test_chash_table: wrong count",
+             chash_table_count (ct) == TEST_THREADS * TEST_KEYS + 50);
+  mu_assert ("test_chash_table: missing key",
+             chash_table_get (ct, "t3-1999") == (void *) 1999L);
+  mu_assert ("test_chash_table: lost update",
+             chash_table_get (ct, "shared-7")
+             == (void *) (long) (TEST_THREADS * TEST_KEYS / 50));
+
+  mu_assert ("test_chash_table: get_pair failed",
+             chash_table_get_pair (ct, "t0-0", &orig_key, NULL));
+  mu_assert ("test_chash_table: remove failed",
+             chash_table_remove (ct, "t0-0") == 1
+             && !chash_table_contains (ct, "t0-0"));
+  xfree (orig_key);
+
+  chash_table_for_each (ct, test_free_key, &freed);
+  mu_assert ("test_chash_table: for_each missed entries",
+             freed == TEST_THREADS * TEST_KEYS + 50 - 1);
+  chash_table_destroy (ct);
+
+  return NULL;
+}
+
+#endif /* TESTING */
@@ -0,0 +1,59 @@
+/* Declarations for chash.c.
+   Copyright (C) 2014 Free Software Foundation, Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+
+#ifndef CHASH_H
+#define CHASH_H
+
+struct hash_table;
+struct chash_table;		/* forward declaration; all struct
+                                   members are private */
+
+struct chash_table *chash_table_new (int, unsigned long (*) (const void *),
+                                     int (*) (const void *, const void *));
+void chash_table_destroy (struct chash_table *);
+
+void *chash_table_get (struct chash_table *, const void *);
+int chash_table_get_pair (struct chash_table *, const void *, void *, void *);
+int chash_table_contains (struct chash_table *, const void *);
+
+void chash_table_put (struct chash_table *, const void *, const void *);
+int chash_table_remove (struct chash_table *, const void *);
+
+void chash_table_for_each (struct chash_table *,
+                           int (*) (void *, void *, void *), void *);
+int chash_table_count (struct chash_table *);
+
+struct hash_table *chash_table_lock (struct chash_table *, const void *);
+void chash_table_unlock (struct chash_table *, const void *);
+
+struct chash_table *make_string_chash_table (int);
+struct chash_table *make_nocase_string_chash_table (int);
+
+#endif /* CHASH_H */
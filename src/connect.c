@@ -58,6 +58,7 @@ as that of the covered work.  */
 #include "host.h"
 #include "connect.h"
 #include "hash.h"
+#include "metrics.h"
 
 /* Apparently needed for Interix: */
 #ifdef HAVE_STDINT_H
@@ -264,7 +265,8 @@ connect_to_ip (const ip_address *ip, int port, const char *print)
 {
   struct sockaddr_storage ss;
   struct sockaddr *sa = (struct sockaddr *)&ss;
-  int sock;
+  struct ptimer *timer;
+  int sock, res;
 
   /* If PRINT is non-NULL, print the "Connecting to..." line, with
      PRINT being the host name we're connecting to.  */
@@ -351,9 +353,13 @@ connect_to_ip (const ip_address *ip, int port, const char *print)
     }
 
   /* Connect the socket to the remote endpoint.  */
-  if (connect_with_timeout (sock, sa, sockaddr_size (sa),
-                            opt.connect_timeout) < 0)
+  timer = metrics_start_timer ();
+  res = connect_with_timeout (sock, sa, sockaddr_size (sa),
+                              opt.connect_timeout);
+  metrics_observe (LATENCY_CONNECT, timer);
+  if (res < 0)
     goto err;
+  metrics_add (METRIC_CONNECTIONS, 1);
 
   /* Success. */
   assert (sock >= 0);
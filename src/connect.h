@@ -62,9 +62,8 @@ enum {
 };
 #ifdef ENABLE_THREADS
 int select_fds (int *, int *, int, double, int);
-#else
-int select_fd (int, double, int);
 #endif
+int select_fd (int, double, int);
 bool test_socket_open (int);
 
 struct transport_implementation {
@@ -36,6 +36,12 @@ as that of the covered work.  */
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined HAVE_SYS_UIO_H && defined HAVE_WRITEV
+# include <sys/uio.h>
+#endif
 #ifdef ENABLE_THREADS
 #include <pthread.h>
 #endif
@@ -44,68 +50,79 @@ as that of the covered work.  */
 #include "recur.h"
 #include "utils.h"
 #include "hash.h"
+#include "chash.h"
+#include "arena.h"
+#include "intern.h"
 #include "ptimer.h"
 #include "res.h"
 #include "html-url.h"
 #include "css-url.h"
 #include "iri.h"
 
-static struct hash_table *dl_file_url_map;
-struct hash_table *dl_url_file_map;
+/* The tables below are shared by all the --jobs threads, so they are
+   concurrent hash tables (see chash.c), created once by create_tables.
+   The compound updates of dl_file_url_map and dl_url_file_map done by
+   register_download and friends are further serialized by
+   register_mutex; plain lookups need no other lock.  */
+
+static struct chash_table *dl_file_url_map;
+static struct chash_table *dl_url_file_map;
 
 /* Set of HTML/CSS files downloaded in this Wget run, used for link
    conversion after Wget is done.  */
-struct hash_table *downloaded_html_set;
-struct hash_table *downloaded_css_set;
+static struct chash_table *downloaded_html_set;
+static struct chash_table *downloaded_css_set;
+
+static struct chash_table *downloaded_files_hash; /* see below */
 
 #ifdef ENABLE_THREADS
-static pthread_mutex_t convert_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t register_mutex = PTHREAD_MUTEX_INITIALIZER;
+# define REGISTER_LOCK pthread_mutex_lock (&register_mutex)
+# define REGISTER_UNLOCK pthread_mutex_unlock (&register_mutex)
+#else
+# define REGISTER_LOCK
+# define REGISTER_UNLOCK
+#endif
 
 static void
-lock_convert_mutex()
+create_tables (void)
 {
-  static int convert_mutex_init_p = 0;
-  if (! convert_mutex_init_p)
-    {
-      pthread_mutexattr_t mta;
-      pthread_mutexattr_init (&mta);
-      pthread_mutexattr_settype (&mta, PTHREAD_MUTEX_RECURSIVE);
-
-      pthread_mutex_init (&convert_mutex, &mta);
-      convert_mutex_init_p = 1;
-    }
-  pthread_mutex_lock (&convert_mutex);
+  dl_file_url_map = make_string_chash_table (0);
+  dl_url_file_map = make_string_chash_table (0);
+  downloaded_html_set = make_string_chash_table (0);
+  downloaded_css_set = make_string_chash_table (0);
+  downloaded_files_hash = make_string_chash_table (0);
 }
 
-
-#define THREAD_SAFE(ret, fn, args, argv)          \
-  ret fn args                                     \
-  {                                               \
-    ret r;                                        \
-    lock_convert_mutex();                         \
-    r = fn##_1 argv;                              \
-    pthread_mutex_unlock (&convert_mutex);        \
-    return r;                                     \
-  }
-
-#define THREAD_SAFE_VOID(fn, args, argv)            \
-  void fn args                                      \
-  {                                                 \
-    lock_convert_mutex();                           \
-    fn##_1 argv;                                    \
-    pthread_mutex_unlock (&convert_mutex);          \
-  }
-
-#define FNNAME_WTHREADS(fn) fn##_1
+#ifdef ENABLE_THREADS
+# define ENSURE_TABLES_EXIST pthread_once (&tables_once, create_tables)
 #else
-#define FNNAME_WTHREADS(fn) fn
+# define ENSURE_TABLES_EXIST do {               \
+  if (!dl_file_url_map)                         \
+    create_tables ();                           \
+} while (0)
 #endif
 
 static void convert_links (const char *, struct urlpos *);
 
 
+struct file_array {
+  char **files;
+  int count, size;
+};
+
+static int
+collect_files_mapper (void *key, void *value, void *arg)
+{
+  struct file_array *array = arg;
+  if (array->count < array->size)
+    array->files[array->count++] = key;
+  return 0;
+}
+
 static void
-convert_links_in_hashtable (struct hash_table *downloaded_set,
+convert_links_in_hashtable (struct chash_table *downloaded_set,
                             int is_css,
                             int *file_count)
 {
@@ -113,14 +130,17 @@ convert_links_in_hashtable (struct hash_table *downloaded_set,
 
   int cnt;
   char **file_array;
+  struct file_array collected;
 
-  cnt = 0;
-  if (downloaded_set)
-    cnt = hash_table_count (downloaded_set);
+  cnt = chash_table_count (downloaded_set);
   if (cnt == 0)
     return;
   file_array = alloca_array (char *, cnt);
-  string_set_to_array (downloaded_set, file_array);
+  collected.files = file_array;
+  collected.count = 0;
+  collected.size = cnt;
+  chash_table_for_each (downloaded_set, collect_files_mapper, &collected);
+  cnt = collected.count;
 
   for (i = 0; i < cnt; i++)
     {
@@ -130,7 +150,7 @@ convert_links_in_hashtable (struct hash_table *downloaded_set,
 
       /* Determine the URL of the file.  get_urls_{html,css} will need
          it.  */
-      url = hash_table_get (dl_file_url_map, file);
+      url = chash_table_get (dl_file_url_map, file);
       if (!url)
         {
           DEBUGP (("Apparently %s has been removed.\n", file));
@@ -140,8 +160,8 @@ convert_links_in_hashtable (struct hash_table *downloaded_set,
       DEBUGP (("Scanning %s (from %s)\n", file, url));
 
       /* Parse the file...  */
-      urls = is_css ? get_urls_css_file (file, url) :
-                      get_urls_html (file, url, NULL, NULL);
+      urls = is_css ? get_urls_css_file (file, url, NULL) :
+                      get_urls_html (file, url, NULL, NULL, NULL);
 
       /* We don't respect meta_disallow_follow here because, even if
          the file is not followed, we might still want to convert the
@@ -173,7 +193,7 @@ convert_links_in_hashtable (struct hash_table *downloaded_set,
           if (!u)
 	    continue;
 
-          local_name = hash_table_get (dl_url_file_map, u->url);
+          local_name = chash_table_get (dl_url_file_map, u->url);
 
           /* Decide on the conversion type.  */
           if (local_name)
@@ -228,12 +248,14 @@ convert_links_in_hashtable (struct hash_table *downloaded_set,
    extracted from these two lists.  */
 
 void
-FNNAME_WTHREADS(convert_all_links) (void)
+convert_all_links (void)
 {
   double secs;
   int file_count = 0;
+  struct ptimer *timer;
 
-  struct ptimer *timer = ptimer_new ();
+  ENSURE_TABLES_EXIST;
+  timer = ptimer_new ();
 
   convert_links_in_hashtable (downloaded_html_set, 0, &file_count);
   convert_links_in_hashtable (downloaded_css_set, 1, &file_count);
@@ -245,13 +267,125 @@ FNNAME_WTHREADS(convert_all_links) (void)
   ptimer_destroy (timer);
 }
 
+#if !(defined HAVE_SYS_UIO_H && defined HAVE_WRITEV)
+/* Minimal writev replacement for systems that lack it.  */
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+
+static ssize_t
+writev (int fd, const struct iovec *iov, int count)
+{
+  ssize_t total = 0;
+  int i;
+  for (i = 0; i < count; i++)
+    {
+      ssize_t res = write (fd, iov[i].iov_base, iov[i].iov_len);
+      if (res < 0)
+        return total ? total : -1;
+      total += res;
+      if ((size_t) res < iov[i].iov_len)
+        break;
+    }
+  return total;
+}
+#endif
+
+#ifndef IOV_MAX
+# define IOV_MAX 16             /* the POSIX minimum */
+#endif
+
+/* The converted document is assembled as a list of pieces, each
+   pointing either into the original file or into replacement text
+   allocated from ARENA, and written out with writev.  This avoids
+   copying the unchanged parts of the document and lets the whole file
+   go out in a few system calls.  */
+
+struct conv_output {
+  struct iovec *iov;            /* pieces of the converted document */
+  int count;                    /* number of pieces */
+  int size;                     /* allocated size of IOV */
+  struct arena *arena;          /* storage for the replacement text */
+};
+
 static void write_backup_file (const char *, downloaded_file_t);
-static const char *replace_plain (const char*, int, FILE*, const char *);
-static const char *replace_attr (const char *, int, FILE *, const char *);
-static const char *replace_attr_refresh_hack (const char *, int, FILE *,
+static const char *replace_plain (const char*, int, struct conv_output *,
+                                  const char *);
+static const char *replace_attr (const char *, int, struct conv_output *,
+                                 const char *);
+static const char *replace_attr_refresh_hack (const char *, int,
+                                              struct conv_output *,
                                               const char *, int);
-static char *local_quote_string (const char *, bool);
-static char *construct_relative (const char *, const char *);
+static char *local_quote_string (struct arena *, const char *, bool);
+static char *construct_relative (struct arena *, const char *, const char *);
+static char *html_quote_string_1 (const char *, struct arena *);
+
+/* Append LEN bytes at P to the converted document.  P must remain
+   valid until the document is written.  */
+
+static void
+conv_emit (struct conv_output *out, const char *p, size_t len)
+{
+  struct iovec *last;
+
+  if (!len)
+    return;
+
+  /* Extend the previous piece if this one immediately follows it, as
+     happens with the text of the original document.  */
+  last = out->count ? &out->iov[out->count - 1] : NULL;
+  if (last && (const char *) last->iov_base + last->iov_len == p)
+    {
+      last->iov_len += len;
+      return;
+    }
+
+  DO_REALLOC (out->iov, out->size, out->count + 1, struct iovec);
+  out->iov[out->count].iov_base = (void *) p;
+  out->iov[out->count].iov_len = len;
+  ++out->count;
+}
+
+static void
+conv_emit_string (struct conv_output *out, const char *s)
+{
+  conv_emit (out, s, strlen (s));
+}
+
+/* Write COUNT pieces described by IOV to FD, at most IOV_MAX at a time,
+   resuming after partial writes.  IOV is modified in the process.
+   Return true on success; on failure, errno describes the error.  */
+
+static bool
+write_iovecs (int fd, struct iovec *iov, int count)
+{
+  while (count > 0)
+    {
+      ssize_t written = writev (fd, iov, count < IOV_MAX ? count : IOV_MAX);
+      if (written < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return false;
+        }
+
+      /* Skip the pieces that have been written completely, and adjust
+         the one that has been written in part.  */
+      while (count > 0 && (size_t) written >= iov->iov_len)
+        {
+          written -= iov->iov_len;
+          ++iov;
+          --count;
+        }
+      if (count > 0)
+        {
+          iov->iov_base = (char *) iov->iov_base + written;
+          iov->iov_len -= written;
+        }
+    }
+  return true;
+}
 
 /* Change the links in one file.  LINKS is a list of links in the
    document, along with their positions and the desired direction of
@@ -260,9 +394,14 @@ static void
 convert_links (const char *file, struct urlpos *links)
 {
   struct file_memory *fm;
-  FILE *fp;
+  struct conv_output out;
   const char *p;
   downloaded_file_t downloaded_file_return;
+  struct stat st;
+  bool have_mode;
+  char *tmpfile;
+  int fd;
+  bool written;
 
   struct urlpos *link;
   int to_url_count = 0, to_file_count = 0;
@@ -293,30 +432,8 @@ convert_links (const char *file, struct urlpos *links)
       return;
     }
 
-  downloaded_file_return = downloaded_file (CHECK_FOR_FILE, file);
-  if (opt.backup_converted && downloaded_file_return)
-    write_backup_file (file, downloaded_file_return);
-
-  /* Before opening the file for writing, unlink the file.  This is
-     important if the data in FM is mmaped.  In such case, nulling the
-     file, which is what fopen() below does, would make us read all
-     zeroes from the mmaped region.  */
-  if (unlink (file) < 0 && errno != ENOENT)
-    {
-      logprintf (LOG_NOTQUIET, _("Unable to delete %s: %s\n"),
-                 quote (file), strerror (errno));
-      wget_read_file_free (fm);
-      return;
-    }
-  /* Now open the file for writing.  */
-  fp = fopen (file, "wb");
-  if (!fp)
-    {
-      logprintf (LOG_NOTQUIET, _("Cannot convert links in %s: %s\n"),
-                 file, strerror (errno));
-      wget_read_file_free (fm);
-      return;
-    }
+  xzero (out);
+  out.arena = arena_new (0);
 
   /* Here we loop through all the URLs in file, replacing those of
      them that are downloaded with relative references.  */
@@ -339,7 +456,7 @@ convert_links (const char *file, struct urlpos *links)
 
       /* Echo the file contents, up to the offending URL's opening
          quote, to the outfile.  */
-      fwrite (p, 1, url_start - p, fp);
+      conv_emit (&out, p, url_start - p);
       p = url_start;
 
       switch (link->convert)
@@ -347,22 +464,22 @@ convert_links (const char *file, struct urlpos *links)
         case CO_CONVERT_TO_RELATIVE:
           /* Convert absolute URL to relative. */
           {
-            char *newname = construct_relative (file, link->local_name);
-            char *quoted_newname = local_quote_string (newname,
+            char *newname = construct_relative (out.arena, file,
+                                                link->local_name);
+            char *quoted_newname = local_quote_string (out.arena, newname,
                                                        link->link_css_p);
 
             if (link->link_css_p)
-              p = replace_plain (p, link->size, fp, quoted_newname);
+              p = replace_plain (p, link->size, &out, quoted_newname);
             else if (!link->link_refresh_p)
-              p = replace_attr (p, link->size, fp, quoted_newname);
+              p = replace_attr (p, link->size, &out, quoted_newname);
             else
-              p = replace_attr_refresh_hack (p, link->size, fp, quoted_newname,
+              p = replace_attr_refresh_hack (p, link->size, &out,
+                                             quoted_newname,
                                              link->refresh_timeout);
 
             DEBUGP (("TO_RELATIVE: %s to %s at position %d in %s.\n",
                      link->url->url, newname, link->pos, file));
-            xfree (newname);
-            xfree (quoted_newname);
             ++to_file_count;
             break;
           }
@@ -370,25 +487,29 @@ convert_links (const char *file, struct urlpos *links)
           /* Convert the link to absolute URL. */
           {
             char *newlink = link->url->url;
-            char *quoted_newlink = html_quote_string (newlink);
 
             if (link->link_css_p)
-              p = replace_plain (p, link->size, fp, newlink);
-            else if (!link->link_refresh_p)
-              p = replace_attr (p, link->size, fp, quoted_newlink);
+              p = replace_plain (p, link->size, &out, newlink);
             else
-              p = replace_attr_refresh_hack (p, link->size, fp, quoted_newlink,
-                                             link->refresh_timeout);
+              {
+                char *quoted_newlink = html_quote_string_1 (newlink,
+                                                            out.arena);
+                if (!link->link_refresh_p)
+                  p = replace_attr (p, link->size, &out, quoted_newlink);
+                else
+                  p = replace_attr_refresh_hack (p, link->size, &out,
+                                                 quoted_newlink,
+                                                 link->refresh_timeout);
+              }
 
             DEBUGP (("TO_COMPLETE: <something> to %s at position %d in %s.\n",
                      newlink, link->pos, file));
-            xfree (quoted_newlink);
             ++to_url_count;
             break;
           }
         case CO_NULLIFY_BASE:
           /* Change the base href to "". */
-          p = replace_attr (p, link->size, fp, "");
+          p = replace_attr (p, link->size, &out, "");
           break;
         case CO_NOCONVERT:
           abort ();
@@ -398,11 +519,57 @@ convert_links (const char *file, struct urlpos *links)
 
   /* Output the rest of the file. */
   if (p - fm->content < fm->length)
-    fwrite (p, 1, fm->length - (p - fm->content), fp);
-  fclose (fp);
-  wget_read_file_free (fm);
+    conv_emit (&out, p, fm->length - (p - fm->content));
+
+  /* Write the converted document to a temporary file next to the
+     original and rename it over the original when complete, so that
+     an interrupted conversion never leaves a truncated file behind.
+     The original stays mapped (or in memory) until then.  */
+  have_mode = stat (file, &st) == 0;
+  tmpfile = aprintf ("%s.XXXXXX", file);
+  fd = mkstemp (tmpfile);
+  if (fd < 0)
+    {
+      logprintf (LOG_NOTQUIET, _("Cannot convert links in %s: %s\n"),
+                 file, strerror (errno));
+      goto cleanup;
+    }
+  DEBUGP (("Writing %s in %d pieces.\n", tmpfile, out.count));
+  written = write_iovecs (fd, out.iov, out.count);
+  if (close (fd) < 0)
+    written = false;
+  if (!written)
+    {
+      logprintf (LOG_NOTQUIET, _("Cannot convert links in %s: %s\n"),
+                 file, strerror (errno));
+      unlink (tmpfile);
+      goto cleanup;
+    }
+
+  /* mkstemp creates the file readable only by the owner; give the
+     converted file the permissions of the original.  */
+  if (have_mode)
+    chmod (tmpfile, st.st_mode & 07777);
+
+  downloaded_file_return = downloaded_file (CHECK_FOR_FILE, file);
+  if (opt.backup_converted && downloaded_file_return)
+    write_backup_file (file, downloaded_file_return);
+
+  if (rename (tmpfile, file) != 0)
+    {
+      logprintf (LOG_NOTQUIET, _("Cannot convert links in %s: %s\n"),
+                 file, strerror (errno));
+      unlink (tmpfile);
+      goto cleanup;
+    }
 
   logprintf (LOG_VERBOSE, "%d-%d\n", to_file_count, to_url_count);
+
+ cleanup:
+  xfree (tmpfile);
+  xfree_null (out.iov);
+  arena_free (out.arena);
+  wget_read_file_free (fm);
 }
 
 /* Construct and return a link that points from BASEFILE to LINKFILE.
@@ -423,7 +590,8 @@ convert_links (const char *file, struct urlpos *links)
    (e.g. using path_simplify).  */
 
 static char *
-construct_relative (const char *basefile, const char *linkfile)
+construct_relative (struct arena *arena, const char *basefile,
+                    const char *linkfile)
 {
   char *link;
   int basedirs;
@@ -461,7 +629,7 @@ construct_relative (const char *basefile, const char *linkfile)
     }
 
   /* Construct LINK as explained above. */
-  link = xmalloc (3 * basedirs + strlen (linkfile) + 1);
+  link = arena_alloc (arena, 3 * basedirs + strlen (linkfile) + 1);
   for (i = 0; i < basedirs; i++)
     memcpy (link + 3 * i, "../", 3);
   strcpy (link + 3 * i, linkfile);
@@ -547,9 +715,10 @@ static bool find_fragment (const char *, int, const char **, const char **);
 
 /* Replace a string with NEW_TEXT.  Ignore quoting. */
 static const char *
-replace_plain (const char *p, int size, FILE *fp, const char *new_text)
+replace_plain (const char *p, int size, struct conv_output *out,
+               const char *new_text)
 {
-  fputs (new_text, fp);
+  conv_emit_string (out, new_text);
   p += size;
   return p;
 }
@@ -557,12 +726,13 @@ replace_plain (const char *p, int size, FILE *fp, const char *new_text)
 /* Replace an attribute's original text with NEW_TEXT. */
 
 static const char *
-replace_attr (const char *p, int size, FILE *fp, const char *new_text)
+replace_attr (const char *p, int size, struct conv_output *out,
+              const char *new_text)
 {
   bool quote_flag = false;
-  char quote_char = '\"';       /* use "..." for quoting, unless the
-                                   original value is quoted, in which
-                                   case reuse its quoting char. */
+  const char *quote_char = "\"";  /* use "..." for quoting, unless the
+                                     original value is quoted, in which
+                                     case reuse its quoting char. */
   const char *frag_beg, *frag_end;
 
   /* Structure of our string is:
@@ -574,21 +744,21 @@ replace_attr (const char *p, int size, FILE *fp, const char *new_text)
 
   if (*p == '\"' || *p == '\'')
     {
-      quote_char = *p;
+      quote_char = p;
       quote_flag = true;
       ++p;
       size -= 2;                /* disregard opening and closing quote */
     }
-  putc (quote_char, fp);
-  fputs (new_text, fp);
+  conv_emit (out, quote_char, 1);
+  conv_emit_string (out, new_text);
 
   /* Look for fragment identifier, if any. */
   if (find_fragment (p, size, &frag_beg, &frag_end))
-    fwrite (frag_beg, 1, frag_end - frag_beg, fp);
+    conv_emit (out, frag_beg, frag_end - frag_beg);
   p += size;
   if (quote_flag)
     ++p;
-  putc (quote_char, fp);
+  conv_emit (out, quote_char, 1);
 
   return p;
 }
@@ -598,17 +768,17 @@ replace_attr (const char *p, int size, FILE *fp, const char *new_text)
    append "timeout_value; URL=" before the next_text.  */
 
 static const char *
-replace_attr_refresh_hack (const char *p, int size, FILE *fp,
+replace_attr_refresh_hack (const char *p, int size, struct conv_output *out,
                            const char *new_text, int timeout)
 {
   /* "0; URL=..." */
-  char *new_with_timeout = (char *)alloca (numdigit (timeout)
-                                           + 6 /* "; URL=" */
-                                           + strlen (new_text)
-                                           + 1);
+  char *new_with_timeout = arena_alloc (out->arena, numdigit (timeout)
+                                        + 6 /* "; URL=" */
+                                        + strlen (new_text)
+                                        + 1);
   sprintf (new_with_timeout, "%d; URL=%s", timeout, new_text);
 
-  return replace_attr (p, size, fp, new_with_timeout);
+  return replace_attr (p, size, out, new_with_timeout);
 }
 
 /* Find the first occurrence of '#' in [BEG, BEG+SIZE) that is not
@@ -657,17 +827,21 @@ find_fragment (const char *beg, int size, const char **bp, const char **ep)
    safe for both local and HTTP-served browsing.
 
    We always quote "#" as "%23", "%" as "%25" and ";" as "%3B"
-   because those characters have special meanings in URLs.  */
+   because those characters have special meanings in URLs.
+
+   The result is allocated from ARENA.  */
 
 static char *
-local_quote_string (const char *file, bool no_html_quote)
+local_quote_string (struct arena *arena, const char *file,
+                    bool no_html_quote)
 {
   const char *from;
   char *newname, *to;
 
   char *any = strpbrk (file, "?#%;");
   if (!any)
-    return no_html_quote ? strdup (file) : html_quote_string (file);
+    return (no_html_quote ? arena_strdup (arena, file)
+            : html_quote_string_1 (file, arena));
 
   /* Allocate space assuming the worst-case scenario, each character
      having to be quoted.  */
@@ -704,19 +878,17 @@ local_quote_string (const char *file, bool no_html_quote)
       }
   *to = '\0';
 
-  return no_html_quote ? strdup (newname) : html_quote_string (newname);
+  return (no_html_quote ? arena_strdup (arena, newname)
+          : html_quote_string_1 (newname, arena));
 }
 
 /* Book-keeping code for dl_file_url_map, dl_url_file_map,
    downloaded_html_list, and downloaded_html_set.  Other code calls
-   these functions to let us know that a file has been downloaded.  */
+   these functions to let us know that a file has been downloaded.
 
-#define ENSURE_TABLES_EXIST do {                        \
-  if (!dl_file_url_map)                                 \
-    dl_file_url_map = make_string_hash_table (0);       \
-  if (!dl_url_file_map)                                 \
-    dl_url_file_map = make_string_hash_table (0);       \
-} while (0)
+   The keys and values of dl_file_url_map and dl_url_file_map are
+   interned strings, shared with the recursive retrieval queue, so they
+   are never freed here.  */
 
 /* Return true if S1 and S2 are the same, except for "/index.html".
    The three cases in which it returns one are (substitute any
@@ -772,18 +944,27 @@ match_except_index (const char *s1, const char *s2)
   return 0 == strcmp (lng, "/index.html");
 }
 
+struct dissociate_arg {
+  const char *file;
+  char **urls;
+  int count, size;
+};
+
 static int
 dissociate_urls_from_file_mapper (void *key, void *value, void *arg)
 {
   char *mapping_url = (char *)key;
   char *mapping_file = (char *)value;
-  char *file = (char *)arg;
+  struct dissociate_arg *da = arg;
 
-  if (0 == strcmp (mapping_file, file))
+  if (0 == strcmp (mapping_file, da->file))
     {
-      hash_table_remove (dl_url_file_map, mapping_url);
-      xfree (mapping_url);
-      xfree (mapping_file);
+      if (da->count == da->size)
+        {
+          da->size = da->size ? da->size * 2 : 8;
+          da->urls = xrealloc (da->urls, da->size * sizeof (char *));
+        }
+      da->urls[da->count++] = mapping_url;
     }
 
   /* Continue mapping. */
@@ -795,9 +976,19 @@ dissociate_urls_from_file_mapper (void *key, void *value, void *arg)
 static void
 dissociate_urls_from_file (const char *file)
 {
-  /* Can't use hash_table_iter_* because the table mutates while mapping.  */
-  hash_table_for_each (dl_url_file_map, dissociate_urls_from_file_mapper,
-                       (char *) file);
+  struct dissociate_arg da;
+  int i;
+
+  /* The URLs are collected first and removed afterwards, because the
+     table can't be changed while chash_table_for_each holds its
+     stripes.  */
+  xzero (da);
+  da.file = file;
+  chash_table_for_each (dl_url_file_map, dissociate_urls_from_file_mapper,
+                        &da);
+  for (i = 0; i < da.count; i++)
+    chash_table_remove (dl_url_file_map, da.urls[i]);
+  xfree_null (da.urls);
 }
 
 /* Register that URL has been successfully downloaded to FILE.  This
@@ -806,35 +997,37 @@ dissociate_urls_from_file (const char *file)
    URL has already been downloaded.  */
 
 void
-FNNAME_WTHREADS(register_download) (const char *url, const char *file)
+register_download (const char *url, const char *file)
 {
   char *old_file, *old_url;
 
   ENSURE_TABLES_EXIST;
+  REGISTER_LOCK;
 
   /* With some forms of retrieval, it is possible, although not likely
      or particularly desirable.  If both are downloaded, the second
      download will override the first one.  When that happens,
      dissociate the old file name from the URL.  */
 
-  if (hash_table_get_pair (dl_file_url_map, file, &old_file, &old_url))
+  if (chash_table_get_pair (dl_file_url_map, file, &old_file, &old_url))
     {
       if (0 == strcmp (url, old_url))
-        /* We have somehow managed to download the same URL twice.
-           Nothing to do.  */
-        return;
+        {
+          /* We have somehow managed to download the same URL twice.
+             Nothing to do.  */
+          REGISTER_UNLOCK;
+          return;
+        }
 
       if (match_except_index (url, old_url)
-          && !hash_table_contains (dl_url_file_map, url))
+          && !chash_table_contains (dl_url_file_map, url))
         /* The two URLs differ only in the "index.html" ending.  For
            example, one is "http://www.server.com/", and the other is
            "http://www.server.com/index.html".  Don't remove the old
            one, just add the new one as a non-canonical entry.  */
         goto url_only;
 
-      hash_table_remove (dl_file_url_map, file);
-      xfree (old_file);
-      xfree (old_url);
+      chash_table_remove (dl_file_url_map, file);
 
       /* Remove all the URLs that point to this file.  Yes, there can
          be more than one such URL, because we store redirections as
@@ -852,7 +1045,7 @@ FNNAME_WTHREADS(register_download) (const char *url, const char *file)
       dissociate_urls_from_file (file);
     }
 
-  hash_table_put (dl_file_url_map, xstrdup (file), xstrdup (url));
+  chash_table_put (dl_file_url_map, intern_string (file), intern_string (url));
 
  url_only:
   /* A URL->FILE mapping is not possible without a FILE->URL mapping.
@@ -871,14 +1064,8 @@ FNNAME_WTHREADS(register_download) (const char *url, const char *file)
      "FILE.1".  In that case, FILE.1 will not be found in
      dl_file_url_map, but URL will still point to FILE in
      dl_url_file_map.  */
-  if (hash_table_get_pair (dl_url_file_map, url, &old_url, &old_file))
-    {
-      hash_table_remove (dl_url_file_map, url);
-      xfree (old_url);
-      xfree (old_file);
-    }
-
-  hash_table_put (dl_url_file_map, xstrdup (url), xstrdup (file));
+  chash_table_put (dl_url_file_map, intern_string (url), intern_string (file));
+  REGISTER_UNLOCK;
 }
 
 /* Register that FROM has been redirected to TO.  This assumes that TO
@@ -886,82 +1073,131 @@ FNNAME_WTHREADS(register_download) (const char *url, const char *file)
    register_download() above.  */
 
 void
-FNNAME_WTHREADS(register_redirection) (const char *from, const char *to)
+register_redirection (const char *from, const char *to)
 {
   char *file;
 
   ENSURE_TABLES_EXIST;
+  REGISTER_LOCK;
 
-  file = hash_table_get (dl_url_file_map, to);
+  file = chash_table_get (dl_url_file_map, to);
   assert (file != NULL);
-  if (!hash_table_contains (dl_url_file_map, from))
-    hash_table_put (dl_url_file_map, xstrdup (from), xstrdup (file));
+  if (!chash_table_contains (dl_url_file_map, from))
+    chash_table_put (dl_url_file_map, intern_string (from), file);
+  REGISTER_UNLOCK;
 }
 
 /* Register that the file has been deleted. */
 
 void
-FNNAME_WTHREADS(register_delete_file) (const char *file)
+register_delete_file (const char *file)
 {
-  char *old_url, *old_file;
-
   ENSURE_TABLES_EXIST;
+  REGISTER_LOCK;
 
-  if (!hash_table_get_pair (dl_file_url_map, file, &old_file, &old_url))
-    return;
+  if (chash_table_remove (dl_file_url_map, file))
+    dissociate_urls_from_file (file);
+  REGISTER_UNLOCK;
+}
+
+/* Add FILE to the downloaded file set SET, unless it is already
+   there.  */
 
-  hash_table_remove (dl_file_url_map, file);
-  xfree (old_file);
-  xfree (old_url);
-  dissociate_urls_from_file (file);
+static void
+downloaded_set_add (struct chash_table *set, const char *file)
+{
+  struct hash_table *ht = chash_table_lock (set, file);
+  string_set_add (ht, file);
+  chash_table_unlock (set, file);
 }
 
 /* Register that FILE is an HTML file that has been downloaded. */
 
 void
-FNNAME_WTHREADS(register_html) (const char *url, const char *file)
+register_html (const char *url, const char *file)
 {
-  if (!downloaded_html_set)
-    downloaded_html_set = make_string_hash_table (0);
-  string_set_add (downloaded_html_set, file);
+  ENSURE_TABLES_EXIST;
+  downloaded_set_add (downloaded_html_set, file);
 }
 
 /* Register that FILE is a CSS file that has been downloaded. */
 
 void
-FNNAME_WTHREADS(register_css) (const char *url, const char *file)
+register_css (const char *url, const char *file)
 {
-  if (!downloaded_css_set)
-    downloaded_css_set = make_string_hash_table (0);
-  string_set_add (downloaded_css_set, file);
+  ENSURE_TABLES_EXIST;
+  downloaded_set_add (downloaded_css_set, file);
 }
 
-static void downloaded_files_free (void);
+/* Return the file URL has been downloaded to, or NULL if it hasn't
+   been downloaded.  The file name stays valid until the end of the
+   run.  */
+
+const char *
+downloaded_url_file (const char *url)
+{
+  ENSURE_TABLES_EXIST;
+  return chash_table_get (dl_url_file_map, url);
+}
+
+/* Return true if FILE has been registered as a downloaded HTML
+   file.  */
+
+bool
+downloaded_html_p (const char *file)
+{
+  ENSURE_TABLES_EXIST;
+  return chash_table_contains (downloaded_html_set, file);
+}
 
-/* Cleanup the data structures associated with this file.  */
+/* Return true if FILE has been registered as a downloaded CSS
+   file.  */
+
+bool
+downloaded_css_p (const char *file)
+{
+  ENSURE_TABLES_EXIST;
+  return chash_table_contains (downloaded_css_set, file);
+}
+
+static int
+free_keys_mapper (void *key, void *value, void *arg)
+{
+  xfree (key);
+  return 0;
+}
+
+/* Free the downloaded file set SET along with its keys.  */
 
 static void
-FNNAME_WTHREADS(convert_cleanup) (void)
+downloaded_set_free (struct chash_table *set)
+{
+  chash_table_for_each (set, free_keys_mapper, NULL);
+  chash_table_destroy (set);
+}
+
+static void downloaded_files_free (void);
+
+/* Cleanup the data structures associated with this file.  Must be
+   called after the other threads are done.  */
+
+void
+convert_cleanup (void)
 {
   if (dl_file_url_map)
     {
-      free_keys_and_values (dl_file_url_map);
-      hash_table_destroy (dl_file_url_map);
-      dl_file_url_map = NULL;
+      chash_table_destroy (dl_file_url_map);
+      chash_table_destroy (dl_url_file_map);
+      downloaded_set_free (downloaded_html_set);
+      downloaded_set_free (downloaded_css_set);
+      dl_file_url_map = dl_url_file_map = NULL;
+      downloaded_html_set = downloaded_css_set = NULL;
     }
-  if (dl_url_file_map)
-    {
-      free_keys_and_values (dl_url_file_map);
-      hash_table_destroy (dl_url_file_map);
-      dl_url_file_map = NULL;
-    }
-  if (downloaded_html_set)
-    string_set_free (downloaded_html_set);
   downloaded_files_free ();
   if (converted_files)
     string_set_free (converted_files);
 }
-
+
 /* Book-keeping code for downloaded files that enables extension
    hacks.  */
 
@@ -970,8 +1206,6 @@ FNNAME_WTHREADS(convert_cleanup) (void)
    it to a hash table beause it was actually taking a lot of time to
    find things in it.  */
 
-static struct hash_table *downloaded_files_hash;
-
 /* We're storing "modes" of type downloaded_file_t in the hash table.
    However, our hash tables only accept pointers for keys and values.
    So when we need a pointer, we use the address of a
@@ -1016,31 +1250,30 @@ downloaded_mode_to_ptr (downloaded_file_t mode)
    URLs.  */
 
 downloaded_file_t
-FNNAME_WTHREADS(downloaded_file) (downloaded_file_t mode, const char *file)
+downloaded_file (downloaded_file_t mode, const char *file)
 {
   downloaded_file_t *ptr;
+  struct hash_table *ht;
+
+  ENSURE_TABLES_EXIST;
 
   if (mode == CHECK_FOR_FILE)
     {
-      if (!downloaded_files_hash)
-        return FILE_NOT_ALREADY_DOWNLOADED;
-      ptr = hash_table_get (downloaded_files_hash, file);
+      ptr = chash_table_get (downloaded_files_hash, file);
       if (!ptr)
         return FILE_NOT_ALREADY_DOWNLOADED;
       return *ptr;
     }
 
-  if (!downloaded_files_hash)
-    downloaded_files_hash = make_string_hash_table (0);
+  /* Look up and add under one lock, so that of two threads saving
+     the same file, only one is told it is new.  */
+  ht = chash_table_lock (downloaded_files_hash, file);
+  ptr = hash_table_get (ht, file);
+  if (!ptr)
+    hash_table_put (ht, xstrdup (file), downloaded_mode_to_ptr (mode));
+  chash_table_unlock (downloaded_files_hash, file);
 
-  ptr = hash_table_get (downloaded_files_hash, file);
-  if (ptr)
-    return *ptr;
-
-  ptr = downloaded_mode_to_ptr (mode);
-  hash_table_put (downloaded_files_hash, xstrdup (file), ptr);
-
-  return FILE_NOT_ALREADY_DOWNLOADED;
+  return ptr ? *ptr : FILE_NOT_ALREADY_DOWNLOADED;
 }
 
 static void
@@ -1048,12 +1281,7 @@ downloaded_files_free (void)
 {
   if (downloaded_files_hash)
     {
-      hash_table_iterator iter;
-      for (hash_table_iterate (downloaded_files_hash, &iter);
-           hash_table_iter_next (&iter);
-           )
-        xfree (iter.key);
-      hash_table_destroy (downloaded_files_hash);
+      downloaded_set_free (downloaded_files_hash);
       downloaded_files_hash = NULL;
     }
 }
@@ -1071,6 +1299,14 @@ downloaded_files_free (void)
    No other entities are recognized or replaced.  */
 char *
 html_quote_string (const char *s)
+{
+  return html_quote_string_1 (s, NULL);
+}
+
+/* Like html_quote_string, but allocate the result from ARENA if it
+   is non-NULL.  */
+static char *
+html_quote_string_1 (const char *s, struct arena *arena)
 {
   const char *b = s;
   char *p, *res;
@@ -1088,7 +1324,7 @@ html_quote_string (const char *s)
       else if (*s == ' ')
         i += 4;                 /* #32; */
     }
-  res = xmalloc (i + 1);
+  res = arena ? arena_alloc (arena, i + 1) : xmalloc (i + 1);
   s = b;
   for (p = res; *s; s++)
     {
@@ -1130,16 +1366,59 @@ html_quote_string (const char *s)
   return res;
 }
 
-#ifdef ENABLE_THREADS
-THREAD_SAFE (downloaded_file_t, downloaded_file, (downloaded_file_t a, const char *b), (a, b));
-THREAD_SAFE_VOID (register_download, (const char *a, const char *b), (a, b));
-THREAD_SAFE_VOID (register_redirection, (const char *a, const char *b), (a, b));
-THREAD_SAFE_VOID (register_html, (const char *a, const char *b), (a, b));
-THREAD_SAFE_VOID (register_css, (const char *a, const char *b), (a, b));
-THREAD_SAFE_VOID (register_delete_file, (const char *a), (a));
-THREAD_SAFE_VOID (convert_cleanup, (void), ());
-THREAD_SAFE_VOID (convert_all_links, (void), ());
-#endif
+#ifdef TESTING
+
+#include "test.h"
+
+const char *
+test_convert_links (void)
+{
+  static const char original[] =
+    "<a href=\"http://example.com/a.html#top\">x</a>\n";
+  static const char converted[] =
+    "<a href=\"http://example.com/b.html#top\">x</a>\n";
+  char name[] = "/tmp/wget-convert-XXXXXX";
+  char buf[sizeof (converted) + 16];
+  struct url url;
+  struct urlpos link;
+  struct stat st;
+  FILE *fp;
+  size_t n;
+  int fd;
+
+  fd = mkstemp (name);
+  mu_assert ("test_convert_links: mkstemp failed", fd >= 0);
+  fchmod (fd, 0640);
+  fp = fdopen (fd, "w");
+  fputs (original, fp);
+  fclose (fp);
+
+  xzero (url);
+  url.url = "http://example.com/b.html";
+  xzero (link);
+  link.url = &url;
+  link.convert = CO_CONVERT_TO_COMPLETE;
+  link.pos = strchr (original, '"') - original;
+  link.size = strrchr (original, '"') + 1 - original - link.pos;
+
+  convert_links (name, &link);
+
+  /* The converted file replaced the original and kept its
+     permissions.  */
+  mu_assert ("test_convert_links: file missing", stat (name, &st) == 0);
+  mu_assert ("test_convert_links: wrong permissions",
+             (st.st_mode & 07777) == 0640);
+  fp = fopen (name, "r");
+  n = fread (buf, 1, sizeof (buf), fp);
+  fclose (fp);
+  unlink (name);
+  mu_assert ("test_convert_links: wrong content",
+             n == strlen (converted) && !memcmp (buf, converted, n));
+
+  return NULL;
+}
+
+#endif /* TESTING */
 
 /*
  * vim: et ts=2 sw=2
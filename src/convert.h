@@ -31,11 +31,6 @@ as that of the covered work.  */
 #ifndef CONVERT_H
 #define CONVERT_H
 
-struct hash_table;		/* forward decl */
-extern struct hash_table *dl_url_file_map;
-extern struct hash_table *downloaded_html_set;
-extern struct hash_table *downloaded_css_set;
-
 enum convert_options {
   CO_NOCONVERT = 0,		/* don't convert this URL */
   CO_CONVERT_TO_RELATIVE,	/* convert to relative, e.g. to
@@ -80,6 +75,14 @@ struct urlpos {
   /* URL's position in the buffer. */
   int pos, size;
 
+  /* The link merged with the base, before parsing, if the links were
+     extracted with a link filter.  */
+  char *link;
+
+  /* Arena holding this structure and its URL, shared by all the links
+     extracted from the same document, or NULL if heap-allocated. */
+  struct arena *arena;
+
   struct urlpos *next;		/* next list element */
 };
 
@@ -104,6 +107,10 @@ void register_delete_file (const char *a);
 void register_redirection (const char *a, const char *b);
 void register_css (const char *a, const char *b);
 void register_html (const char *a, const char *b);
+const char *downloaded_url_file (const char *);
+bool downloaded_html_p (const char *);
+bool downloaded_css_p (const char *);
+void convert_cleanup (void);
 
 char *html_quote_string (const char *);
 
@@ -51,42 +51,115 @@ as that of the covered work.  */
 #include <assert.h>
 #include <errno.h>
 #include <time.h>
+#ifdef ENABLE_THREADS
+# include <pthread.h>
+#endif
 #include "utils.h"
 #include "hash.h"
 #include "cookies.h"
 #include "http.h"               /* for http_atotm */
+
+#ifdef TESTING
+#include "test.h"
+#endif
 
 /* Declarations of `struct cookie' and the most basic functions. */
 
 /* Cookie jar serves as cookie storage and a means of retrieving
-   cookies efficiently.  All cookies with the same domain are stored
-   in a linked list called "chain".  A cookie chain can be reached by
-   looking up the domain in the cookie jar's chains_by_domain table.
+   cookies efficiently.  The cookies are kept in a trie of domain
+   names, indexed by their labels from right to left: the node of
+   "google.com" is the child "google" of the child "com" of the root.
+   Each node holds the cookies set for its domain, sorted by
+   decreasing length of their path.
+
+   When sending a cookie to `www.google.com', one must search for
+   cookies that belong to either `www.google.com' or `google.com' --
+   which are exactly the nodes visited on the way down to
+   "www.google.com", and in reverse order, they are ordered by
+   preference as well.
+
+   The `Cookie' headers generated from the jar are cached by host,
+   port and directory of the path.  Every change of a node's cookies
+   increases its generation number, and a cached header is only used
+   while the generations of the nodes it was built from stay the
+   same.
+
+   The jar is shared by the --jobs threads.  Every request reads it,
+   but only some responses change it, so the trie is guarded by a
+   readers-writer lock: cookie_header and cookie_jar_save take it for
+   reading, and the functions that store and discard cookies take it
+   for writing, only for the time it takes to link or unlink a
+   cookie.  The header cache, which cookie_header updates while
+   reading, has a mutex of its own, taken after the trie lock.  */
+
+struct cookie_node {
+  char *label;                  /* last label of the node's domain */
+  struct hash_table *children;  /* child nodes indexed by label, or
+                                   NULL if there are none. */
+
+  char *domain;                 /* domain of the cookies as first
+                                   stored, or NULL if none were. */
+  struct cookie **cookies;      /* the cookies, sorted by
+                                   cookie_order. */
+  int count, size;
+
+  unsigned long generation;     /* increased whenever the cookies
+                                   change. */
+};
+
+/* A `Cookie' header generated by cookie_header, kept for the
+   following requests to the same host, port and directory.  */
+
+struct header_cache {
+  char *header;                 /* the header, or NULL if no cookies
+                                   match. */
+  unsigned long generation;     /* sum of the generations of the
+                                   nodes of the host. */
+  time_t valid_until;           /* earliest expiry time of the
+                                   cookies in the header, or 0. */
+};
 
-   For example, to reach all the cookies under google.com, one must
-   execute hash_table_get(jar->chains_by_domain, "google.com").  Of
-   course, when sending a cookie to `www.google.com', one must search
-   for cookies that belong to either `www.google.com' or `google.com'
-   -- but the point is that the code doesn't need to go through *all*
-   the cookies.  */
+/* The maximum number of cached headers.  When it is reached, the
+   cache is emptied.  */
+#define HEADER_CACHE_MAX 4096
 
 struct cookie_jar {
-  /* Cookie chains indexed by domain.  */
-  struct hash_table *chains;
+  struct cookie_node root;      /* root of the domain trie */
+
+  /* Cached headers, indexed by header_cache_key.  */
+  struct hash_table *headers;
 
   int cookie_count;             /* number of cookies in the jar. */
+
+#ifdef ENABLE_THREADS
+  pthread_rwlock_t lock;        /* guards the trie and cookie_count */
+  pthread_mutex_t headers_mutex; /* guards headers */
+#endif
 };
 
-/* Value set by entry point functions, so that the low-level
-   routines don't need to call time() all the time.  */
-static time_t cookies_now;
+#ifdef ENABLE_THREADS
+# define JAR_READ_LOCK(jar) pthread_rwlock_rdlock (&(jar)->lock)
+# define JAR_WRITE_LOCK(jar) pthread_rwlock_wrlock (&(jar)->lock)
+# define JAR_UNLOCK(jar) pthread_rwlock_unlock (&(jar)->lock)
+# define HEADERS_LOCK(jar) pthread_mutex_lock (&(jar)->headers_mutex)
+# define HEADERS_UNLOCK(jar) pthread_mutex_unlock (&(jar)->headers_mutex)
+#else
+# define JAR_READ_LOCK(jar)
+# define JAR_WRITE_LOCK(jar)
+# define JAR_UNLOCK(jar)
+# define HEADERS_LOCK(jar)
+# define HEADERS_UNLOCK(jar)
+#endif
 
 struct cookie_jar *
 cookie_jar_new (void)
 {
-  struct cookie_jar *jar = xnew (struct cookie_jar);
-  jar->chains = make_nocase_string_hash_table (0);
-  jar->cookie_count = 0;
+  struct cookie_jar *jar = xnew0 (struct cookie_jar);
+  jar->headers = make_string_hash_table (0);
+#ifdef ENABLE_THREADS
+  pthread_rwlock_init (&jar->lock, NULL);
+  pthread_mutex_init (&jar->headers_mutex, NULL);
+#endif
   return jar;
 }
 
@@ -112,9 +185,6 @@ struct cookie {
 
   char *attr;                   /* cookie attribute name */
   char *value;                  /* cookie attribute value */
-
-  struct cookie *next;          /* used for chaining of cookies in the
-                                   same domain. */
 };
 
 #define PORT_ANY (-1)
@@ -134,13 +204,12 @@ cookie_new (void)
   return cookie;
 }
 
-/* Non-zero if the cookie has expired.  Assumes cookies_now has been
-   set by one of the entry point functions.  */
+/* Non-zero if the cookie has expired at time NOW.  */
 
 static bool
-cookie_expired_p (const struct cookie *c)
+cookie_expired_p (const struct cookie *c, time_t now)
 {
-  return c->expiry_time != 0 && c->expiry_time < cookies_now;
+  return c->expiry_time != 0 && c->expiry_time < now;
 }
 
 /* Deallocate COOKIE and its components. */
@@ -157,102 +226,160 @@ delete_cookie (struct cookie *cookie)
 
 /* Functions for storing cookies.
 
-   All cookies can be reached beginning with jar->chains.  The key in
-   that table is the domain name, and the value is a linked list of
-   all cookies from that domain.  Every new cookie is placed on the
-   head of the list.  */
+   All cookies can be reached beginning with jar->root.  A cookie is
+   stored in the node of its domain, at the place given by
+   cookie_order.  */
 
-/* Find and return a cookie in JAR whose domain, path, and attribute
-   name correspond to COOKIE.  If found, PREVPTR will point to the
-   location of the cookie previous in chain, or NULL if the found
-   cookie is the head of a chain.
+static int count_char (const char *, char);
 
-   If no matching cookie is found, return NULL. */
+/* Copy DOMAIN to BUF and split it into labels at the dots.  Store
+   pointers to the labels, from the first one, to LABELS, and return
+   their count.  BUF must be as large as DOMAIN, and LABELS must have
+   room for 1 + <number of dots> pointers.  */
 
-static struct cookie *
-find_matching_cookie (struct cookie_jar *jar, struct cookie *cookie,
-                      struct cookie **prevptr)
+static int
+split_domain (const char *domain, char *buf, char **labels)
 {
-  struct cookie *chain, *prev;
-
-  chain = hash_table_get (jar->chains, cookie->domain);
-  if (!chain)
-    goto nomatch;
+  int count = 0;
+  char *p;
 
-  prev = NULL;
-  for (; chain; prev = chain, chain = chain->next)
-    if (0 == strcmp (cookie->path, chain->path)
-        && 0 == strcmp (cookie->attr, chain->attr)
-        && cookie->port == chain->port)
+  strcpy (buf, domain);
+  labels[count++] = buf;
+  for (p = buf; *p; p++)
+    if (*p == '.')
       {
-        *prevptr = prev;
-        return chain;
+        *p = '\0';
+        labels[count++] = p + 1;
       }
+  return count;
+}
 
- nomatch:
-  *prevptr = NULL;
-  return NULL;
+/* Return the child of NODE with LABEL.  If there is no such child,
+   create it if CREATE is true, or return NULL.  */
+
+static struct cookie_node *
+node_child (struct cookie_node *node, const char *label, bool create)
+{
+  struct cookie_node *child = NULL;
+
+  if (node->children)
+    child = hash_table_get (node->children, label);
+  if (!child && create)
+    {
+      if (!node->children)
+        node->children = make_nocase_string_hash_table (0);
+      child = xnew0 (struct cookie_node);
+      child->label = xstrdup (label);
+      /* A new node changes the sum of the generations of its
+         subdomains, which invalidates their cached headers.  */
+      child->generation = 1;
+      hash_table_put (node->children, child->label, child);
+    }
+  return child;
 }
 
-/* Store COOKIE to the jar.
+/* Return the node of DOMAIN in JAR.  If it doesn't exist, create it
+   if CREATE is true, or return NULL.  */
 
-   This is done by placing COOKIE at the head of its chain.  However,
-   if COOKIE matches a cookie already in memory, as determined by
-   find_matching_cookie, the old cookie is unlinked and destroyed.
+static struct cookie_node *
+find_node (struct cookie_jar *jar, const char *domain, bool create)
+{
+  char *buf = alloca (strlen (domain) + 1);
+  char **labels = alloca_array (char *, 1 + count_char (domain, '.'));
+  int i = split_domain (domain, buf, labels);
+  struct cookie_node *node = &jar->root;
+
+  while (node && i-- > 0)
+    node = node_child (node, labels[i], create);
+  return node;
+}
 
-   The key of each chain's hash table entry is allocated only the
-   first time; next hash_table_put's reuse the same key.  */
+/* The order of the cookies in a node: by decreasing length of the
+   path, so that the best matches of a path come first, then by path,
+   attribute name and port, so that a cookie is found by binary
+   search.  */
 
-static void
-store_cookie (struct cookie_jar *jar, struct cookie *cookie)
+static int
+cookie_order (const struct cookie *c1, const struct cookie *c2)
 {
-  struct cookie *chain_head;
-  char *chain_key;
+  size_t len1 = strlen (c1->path), len2 = strlen (c2->path);
+  int cmp;
+
+  if (len1 != len2)
+    return len1 > len2 ? -1 : 1;
+  if ((cmp = strcmp (c1->path, c2->path)) != 0)
+    return cmp;
+  if ((cmp = strcmp (c1->attr, c2->attr)) != 0)
+    return cmp;
+  return c1->port - c2->port;
+}
 
-  if (hash_table_get_pair (jar->chains, cookie->domain,
-                           &chain_key, &chain_head))
-    {
-      /* A chain of cookies in this domain already exists.  Check for
-         duplicates -- if an extant cookie exactly matches our domain,
-         port, path, and name, replace it.  */
-      struct cookie *prev;
-      struct cookie *victim = find_matching_cookie (jar, cookie, &prev);
+/* Find COOKIE's place in NODE.  Return its index, and set *FOUND to
+   whether a cookie with the same path, attribute name and port is
+   there already.  */
 
-      if (victim)
+static int
+node_search (const struct cookie_node *node, const struct cookie *cookie,
+             bool *found)
+{
+  int lo = 0, hi = node->count;
+
+  while (lo < hi)
+    {
+      int mid = lo + (hi - lo) / 2;
+      int cmp = cookie_order (node->cookies[mid], cookie);
+      if (cmp == 0)
         {
-          /* Remove VICTIM from the chain.  COOKIE will be placed at
-             the head. */
-          if (prev)
-            {
-              prev->next = victim->next;
-              cookie->next = chain_head;
-            }
-          else
-            {
-              /* prev is NULL; apparently VICTIM was at the head of
-                 the chain.  This place will be taken by COOKIE, so
-                 all we need to do is:  */
-              cookie->next = victim->next;
-            }
-          delete_cookie (victim);
-          --jar->cookie_count;
-          DEBUGP (("Deleted old cookie (to be replaced.)\n"));
+          *found = true;
+          return mid;
         }
+      if (cmp < 0)
+        lo = mid + 1;
       else
-        cookie->next = chain_head;
+        hi = mid;
+    }
+  *found = false;
+  return lo;
+}
+
+/* Store COOKIE to the jar.
+
+   This is done by placing COOKIE in the node of its domain.  However,
+   if COOKIE matches a cookie already in memory, i.e. one with the same
+   domain, port, path, and name, the old cookie is replaced and
+   destroyed.  */
+
+static void
+store_cookie (struct cookie_jar *jar, struct cookie *cookie)
+{
+  struct cookie_node *node = find_node (jar, cookie->domain, true);
+  bool found;
+  int pos = node_search (node, cookie, &found);
+
+  if (found)
+    {
+      delete_cookie (node->cookies[pos]);
+      --jar->cookie_count;
+      DEBUGP (("Deleted old cookie (to be replaced.)\n"));
     }
   else
     {
-      /* We are now creating the chain.  Use a copy of cookie->domain
-         as the key for the life-time of the chain.  Using
-         cookie->domain would be unsafe because the life-time of the
-         chain may exceed the life-time of the cookie.  (Cookies may
-         be deleted from the chain by this very function.)  */
-      cookie->next = NULL;
-      chain_key = xstrdup (cookie->domain);
+      if (!node->domain)
+        /* Use a copy of cookie->domain, because the node outlives
+           its cookies.  */
+        node->domain = xstrdup (cookie->domain);
+      if (node->count == node->size)
+        {
+          node->size = node->size ? node->size * 2 : 4;
+          node->cookies = xrealloc (node->cookies,
+                                    node->size * sizeof (struct cookie *));
+        }
+      memmove (node->cookies + pos + 1, node->cookies + pos,
+               (node->count - pos) * sizeof (struct cookie *));
+      ++node->count;
     }
-
-  hash_table_put (jar->chains, chain_key, cookie);
+  node->cookies[pos] = cookie;
+  ++node->generation;
   ++jar->cookie_count;
 
   IF_DEBUG
@@ -278,43 +405,30 @@ store_cookie (struct cookie_jar *jar, struct cookie *cookie)
 static void
 discard_matching_cookie (struct cookie_jar *jar, struct cookie *cookie)
 {
-  struct cookie *prev, *victim;
+  struct cookie_node *node;
+  bool found;
+  int pos;
 
-  if (!hash_table_count (jar->chains))
+  if (!jar->cookie_count)
     /* No elements == nothing to discard. */
     return;
 
-  victim = find_matching_cookie (jar, cookie, &prev);
-  if (victim)
-    {
-      if (prev)
-        /* Simply unchain the victim. */
-        prev->next = victim->next;
-      else
-        {
-          /* VICTIM was head of its chain.  We need to place a new
-             cookie at the head.  */
-          char *chain_key = NULL;
-          int res;
-
-          res = hash_table_get_pair (jar->chains, victim->domain,
-                                     &chain_key, NULL);
-          assert (res != 0);
-          if (!victim->next)
-            {
-              /* VICTIM was the only cookie in the chain.  Destroy the
-                 chain and deallocate the chain key.  */
-              hash_table_remove (jar->chains, victim->domain);
-              xfree (chain_key);
-            }
-          else
-            hash_table_put (jar->chains, chain_key, victim->next);
-        }
-      delete_cookie (victim);
-      DEBUGP (("Discarded old cookie.\n"));
-    }
+  node = find_node (jar, cookie->domain, false);
+  if (!node)
+    return;
+  pos = node_search (node, cookie, &found);
+  if (!found)
+    return;
+
+  delete_cookie (node->cookies[pos]);
+  --node->count;
+  memmove (node->cookies + pos, node->cookies + pos + 1,
+           (node->count - pos) * sizeof (struct cookie *));
+  ++node->generation;
+  --jar->cookie_count;
+  DEBUGP (("Discarded old cookie.\n"));
 }
-
+
 /* Functions for parsing the `Set-Cookie' header, and creating new
    cookies from the wire.  */
 
@@ -337,10 +451,10 @@ discard_matching_cookie (struct cookie_jar *jar, struct cookie *cookie)
    attribute name and value.  Subsequent parameters will be checked
    against field names such as `domain', `path', etc.  Recognized
    fields will be parsed and the corresponding members of COOKIE
-   filled.  */
+   filled.  Expiry times are computed relative to NOW.  */
 
 static struct cookie *
-parse_set_cookie (const char *set_cookie, bool silent)
+parse_set_cookie (const char *set_cookie, time_t now, bool silent)
 {
   const char *ptr = set_cookie;
   struct cookie *cookie = cookie_new ();
@@ -402,7 +516,7 @@ parse_set_cookie (const char *set_cookie, bool silent)
               /* According to netscape's specification, expiry time in
                  the past means that discarding of a matching cookie
                  is requested.  */
-              if (cookie->expiry_time < cookies_now)
+              if (cookie->expiry_time < now)
                 cookie->discard_requested = 1;
             }
         }
@@ -420,7 +534,7 @@ parse_set_cookie (const char *set_cookie, bool silent)
             /* something went wrong. */
             goto error;
           cookie->permanent = 1;
-          cookie->expiry_time = cookies_now + maxage;
+          cookie->expiry_time = now + maxage;
 
           /* According to rfc2109, a cookie with max-age of 0 means that
              discarding of a matching cookie is requested.  */
@@ -658,14 +772,13 @@ cookie_handle_set_cookie (struct cookie_jar *jar,
                           const char *path, const char *set_cookie)
 {
   struct cookie *cookie;
-  cookies_now = time (NULL);
 
   /* Wget's paths don't begin with '/' (blame rfc1808), but cookie
      usage assumes /-prefixed paths.  Until the rest of Wget is fixed,
      simply prepend slash to PATH.  */
   PREPEND_SLASH (path);
 
-  cookie = parse_set_cookie (set_cookie, false);
+  cookie = parse_set_cookie (set_cookie, time (NULL), false);
   if (!cookie)
     goto out;
 
@@ -720,11 +833,15 @@ cookie_handle_set_cookie (struct cookie_jar *jar,
 
   if (cookie->discard_requested)
     {
+      JAR_WRITE_LOCK (jar);
       discard_matching_cookie (jar, cookie);
+      JAR_UNLOCK (jar);
       goto out;
     }
 
+  JAR_WRITE_LOCK (jar);
   store_cookie (jar, cookie);
+  JAR_UNLOCK (jar);
   return;
 
  out:
@@ -733,8 +850,7 @@ cookie_handle_set_cookie (struct cookie_jar *jar,
 }
 
 /* Support for sending out cookies in HTTP requests, based on
-   previously stored cookies.  Entry point is
-   `build_cookies_request'.  */
+   previously stored cookies.  Entry point is `cookie_header'.  */
 
 /* Return a count of how many times CHR occurs in STRING. */
 
@@ -749,54 +865,52 @@ count_char (const char *string, char chr)
   return count;
 }
 
-/* Find the cookie chains whose domains match HOST and store them to
-   DEST.
+/* Find the nodes whose domains match HOST and have cookies, and store
+   them to DEST, from the most specific one.  Add the generations of
+   the nodes of HOST and its parent domains to *GENERATION.
 
-   A cookie chain is the head of a list of cookies that belong to a
-   host/domain.  Given HOST "img.search.xemacs.org", this function
-   will return the chains for "img.search.xemacs.org",
-   "search.xemacs.org", and "xemacs.org" -- those of them that exist
-   (if any), that is.
+   Given HOST "img.search.xemacs.org", this function will return the
+   nodes for "img.search.xemacs.org", "search.xemacs.org", and
+   "xemacs.org" -- those of them that have cookies, that is.
 
    DEST should be large enough to accept (in the worst case) as many
    elements as there are domain components of HOST.  */
 
 static int
-find_chains_of_host (struct cookie_jar *jar, const char *host,
-                     struct cookie *dest[])
+find_nodes_of_host (struct cookie_jar *jar, const char *host,
+                    struct cookie_node *dest[], unsigned long *generation)
 {
-  int dest_count = 0;
-  int passes, passcnt;
-
-  /* Bail out quickly if there are no cookies in the jar.  */
-  if (!hash_table_count (jar->chains))
-    return 0;
+  char *buf = alloca (strlen (host) + 1);
+  char **labels = alloca_array (char *, 1 + count_char (host, '.'));
+  int count = split_domain (host, buf, labels);
+  int min_depth, depth, dest_count = 0, i, j;
+  struct cookie_node *node = &jar->root;
 
   if (numeric_address_p (host))
     /* If host is an IP address, only check for the exact match. */
-    passes = 1;
+    min_depth = count;
   else
     /* Otherwise, check all the subdomains except the top-level (last)
-       one.  As a domain with N components has N-1 dots, the number of
-       passes equals the number of dots.  */
-    passes = count_char (host, '.');
-
-  passcnt = 0;
+       one.  */
+    min_depth = count > 1 ? 2 : 1;
 
-  /* Find chains that match HOST, starting with exact match and
-     progressing to less specific domains.  For instance, given HOST
-     fly.srk.fer.hr, first look for fly.srk.fer.hr's chain, then
-     srk.fer.hr's, then fer.hr's.  */
-  while (1)
+  for (depth = 1; depth <= count; depth++)
     {
-      struct cookie *chain = hash_table_get (jar->chains, host);
-      if (chain)
-        dest[dest_count++] = chain;
-      if (++passcnt >= passes)
+      node = node_child (node, labels[count - depth], false);
+      if (!node)
         break;
-      host = strchr (host, '.') + 1;
+      *generation += node->generation;
+      if (depth >= min_depth && node->count)
+        dest[dest_count++] = node;
     }
 
+  /* The nodes were found from the least specific one.  */
+  for (i = 0, j = dest_count - 1; i < j; i++, j--)
+    {
+      struct cookie_node *tmp = dest[i];
+      dest[i] = dest[j];
+      dest[j] = tmp;
+    }
   return dest_count;
 }
 
@@ -817,21 +931,15 @@ path_matches (const char *full_path, const char *prefix)
 }
 
 /* Return true iff COOKIE matches the provided parameters of the URL
-   being downloaded: HOST, PORT, PATH, and SECFLAG.
-
-   If PATH_GOODNESS is non-NULL, store the "path goodness" value
-   there.  That value is a measure of how closely COOKIE matches PATH,
-   used for ordering cookies.  */
+   being downloaded: HOST, PORT, PATH, and SECFLAG, at time NOW.  */
 
 static bool
 cookie_matches_url (const struct cookie *cookie,
                     const char *host, int port, const char *path,
-                    bool secflag, int *path_goodness)
+                    bool secflag, time_t now)
 {
-  int pg;
-
-  if (cookie_expired_p (cookie))
-    /* Ignore stale cookies.  Don't bother unchaining the cookie at
+  if (cookie_expired_p (cookie, now))
+    /* Ignore stale cookies.  Don't bother removing the cookie at
        this point -- Wget is a relatively short-lived application, and
        stale cookies will not be saved by `save_cookies'.  On the
        other hand, this function should be as efficient as
@@ -846,204 +954,119 @@ cookie_matches_url (const struct cookie *cookie,
 
   /* If exact domain match is required, verify that cookie's domain is
      equal to HOST.  If not, assume success on the grounds of the
-     cookie's chain having been found by find_chains_of_host.  */
+     cookie's node having been found by find_nodes_of_host.  */
   if (cookie->domain_exact
       && 0 != strcasecmp (host, cookie->domain))
     return false;
 
-  pg = path_matches (path, cookie->path);
-  if (pg == 0)
-    return false;
-
-  if (path_goodness)
-    /* If the caller requested path_goodness, we return it.  This is
-       an optimization, so that the caller doesn't need to call
-       path_matches() again.  */
-    *path_goodness = pg;
-  return true;
+  return path_matches (path, cookie->path) != 0;
 }
 
-/* A structure that points to a cookie, along with the additional
-   information about the cookie's "goodness".  This allows us to sort
-   the cookies when returning them to the server, as required by the
-   spec.  */
+/* Hash and test functions for finding duplicate cookies, i.e. those
+   with the same attr name and value.  */
 
-struct weighed_cookie {
-  struct cookie *cookie;
-  int domain_goodness;
-  int path_goodness;
-};
-
-/* Comparator used for uniquifying the list. */
-
-static int
-equality_comparator (const void *p1, const void *p2)
+static unsigned long
+cookie_pair_hash (const void *key)
 {
-  struct weighed_cookie *wc1 = (struct weighed_cookie *)p1;
-  struct weighed_cookie *wc2 = (struct weighed_cookie *)p2;
-
-  int namecmp  = strcmp (wc1->cookie->attr, wc2->cookie->attr);
-  int valuecmp = strcmp (wc1->cookie->value, wc2->cookie->value);
-
-  /* We only really care whether both name and value are equal.  We
-     return them in this order only for consistency...  */
-  return namecmp ? namecmp : valuecmp;
+  const struct cookie *c = key;
+  return hash_string (c->attr) * 31 + hash_string (c->value);
 }
 
-/* Eliminate duplicate cookies.  "Duplicate cookies" are any two
-   cookies with the same attr name and value.  Whenever a duplicate
-   pair is found, one of the cookies is removed.  */
-
 static int
-eliminate_dups (struct weighed_cookie *outgoing, int count)
+cookie_pair_equal (const void *key1, const void *key2)
 {
-  struct weighed_cookie *h;     /* hare */
-  struct weighed_cookie *t;     /* tortoise */
-  struct weighed_cookie *end = outgoing + count;
-
-  /* We deploy a simple uniquify algorithm: first sort the array
-     according to our sort criteria, then copy it to itself, comparing
-     each cookie to its neighbor and ignoring the duplicates.  */
-
-  qsort (outgoing, count, sizeof (struct weighed_cookie), equality_comparator);
-
-  /* "Hare" runs through all the entries in the array, followed by
-     "tortoise".  If a duplicate is found, the hare skips it.
-     Non-duplicate entries are copied to the tortoise ptr.  */
-
-  for (h = t = outgoing; h < end; h++)
-    {
-      if (h != end - 1)
-        {
-          struct cookie *c0 = h[0].cookie;
-          struct cookie *c1 = h[1].cookie;
-          if (!strcmp (c0->attr, c1->attr) && !strcmp (c0->value, c1->value))
-            continue;           /* ignore the duplicate */
-        }
-
-      /* If the hare has advanced past the tortoise (because of
-         previous dups), make sure the values get copied.  Otherwise,
-         no copying is necessary.  */
-      if (h != t)
-        *t++ = *h;
-      else
-        t++;
-    }
-  return t - outgoing;
+  const struct cookie *c1 = key1, *c2 = key2;
+  return !strcmp (c1->attr, c2->attr) && !strcmp (c1->value, c2->value);
 }
 
-/* Comparator used for sorting by quality. */
+/* Build the `Cookie' header from the cookies of the COUNT nodes in
+   NODES that match HOST, PORT, PATH and SECFLAG at time NOW.  Return
+   NULL if there are none.
 
-static int
-goodness_comparator (const void *p1, const void *p2)
-{
-  struct weighed_cookie *wc1 = (struct weighed_cookie *)p1;
-  struct weighed_cookie *wc2 = (struct weighed_cookie *)p2;
-
-  /* Subtractions take `wc2' as the first argument becauase we want a
-     sort in *decreasing* order of goodness.  */
-  int dgdiff = wc2->domain_goodness - wc1->domain_goodness;
-  int pgdiff = wc2->path_goodness - wc1->path_goodness;
-
-  /* Sort by domain goodness; if these are the same, sort by path
-     goodness.  (The sorting order isn't really specified; maybe it
-     should be the other way around.)  */
-  return dgdiff ? dgdiff : pgdiff;
-}
+   Set *CACHEABLE to whether the header is the same for all the paths
+   in the directory of PATH, of length DIRLEN, and *VALID_UNTIL to the
+   earliest expiry time of the cookies in the header, or 0.  */
 
-/* Generate a `Cookie' header for a request that goes to HOST:PORT and
-   requests PATH from the server.  The resulting string is allocated
-   with `malloc', and the caller is responsible for freeing it.  If no
-   cookies pertain to this request, i.e. no cookie header should be
-   generated, NULL is returned.  */
-
-char *
-cookie_header (struct cookie_jar *jar, const char *host,
-               int port, const char *path, bool secflag)
+static char *
+build_cookie_header (struct cookie_node **nodes, int count,
+                     const char *host, int port, const char *path,
+                     int dirlen, bool secflag, time_t now,
+                     bool *cacheable, time_t *valid_until)
 {
-  struct cookie **chains;
-  int chain_count;
-
-  struct cookie *cookie;
-  struct weighed_cookie *outgoing;
-  int count, i, ocnt;
+  struct cookie **outgoing;
+  struct hash_table *seen = NULL;
+  int total, ocnt, i, j;
   char *result;
   int result_size, pos;
-  PREPEND_SLASH (path);         /* see cookie_handle_set_cookie */
-
-  /* First, find the cookie chains whose domains match HOST. */
-
-  /* Allocate room for find_chains_of_host to write to.  The number of
-     chains can at most equal the number of subdomains, hence
-     1+<number of dots>.  */
-  chains = alloca_array (struct cookie *, 1 + count_char (host, '.'));
-  chain_count = find_chains_of_host (jar, host, chains);
-
-  /* No cookies for this host. */
-  if (!chain_count)
-    return NULL;
 
-  cookies_now = time (NULL);
+  *cacheable = true;
+  *valid_until = 0;
 
-  /* Now extract from the chains those cookies that match our host
-     (for domain_exact cookies), port (for cookies with port other
-     than PORT_ANY), etc.  See matching_cookie for details.  */
-
-  /* Count the number of matching cookies. */
-  count = 0;
-  for (i = 0; i < chain_count; i++)
-    for (cookie = chains[i]; cookie; cookie = cookie->next)
-      if (cookie_matches_url (cookie, host, port, path, secflag, NULL))
-        ++count;
-  if (!count)
-    return NULL;                /* no cookies matched */
-
-  /* Allocate the array. */
-  outgoing = alloca_array (struct weighed_cookie, count);
-
-  /* Fill the array with all the matching cookies from the chains that
-     match HOST. */
+  total = 0;
+  for (i = 0; i < count; i++)
+    total += nodes[i]->count;
+  outgoing = xnew_array (struct cookie *, total);
+  if (total > 1)
+    seen = hash_table_new (total, cookie_pair_hash, cookie_pair_equal);
+
+  /* The nodes come from the best-matching domain, and within one
+     node, the cookies from the best-matching path, which is the order
+     the spec requires them to be sent in.  Of the cookies with the
+     same name and value, only the first one is sent.  */
   ocnt = 0;
-  for (i = 0; i < chain_count; i++)
-    for (cookie = chains[i]; cookie; cookie = cookie->next)
+  for (i = 0; i < count; i++)
+    for (j = 0; j < nodes[i]->count; j++)
       {
-        int pg;
-        if (!cookie_matches_url (cookie, host, port, path, secflag, &pg))
+        struct cookie *cookie = nodes[i]->cookies[j];
+
+        /* A cookie whose path goes beyond the directory matches some
+           of the files in it, but not others.  */
+        if ((int) strlen (cookie->path) > dirlen
+            && 0 == strncmp (cookie->path, path, dirlen))
+          *cacheable = false;
+
+        if (!cookie_matches_url (cookie, host, port, path, secflag, now))
           continue;
-        outgoing[ocnt].cookie = cookie;
-        outgoing[ocnt].domain_goodness = strlen (cookie->domain);
-        outgoing[ocnt].path_goodness   = pg;
-        ++ocnt;
+        if (seen)
+          {
+            if (hash_table_contains (seen, cookie))
+              continue;
+            hash_table_put (seen, cookie, cookie);
+          }
+        if (cookie->expiry_time != 0
+            && (*valid_until == 0 || cookie->expiry_time < *valid_until))
+          *valid_until = cookie->expiry_time;
+        outgoing[ocnt++] = cookie;
       }
-  assert (ocnt == count);
+  if (seen)
+    hash_table_destroy (seen);
 
-  /* Eliminate duplicate cookies; that is, those whose name and value
-     are the same.  */
-  count = eliminate_dups (outgoing, count);
-
-  /* Sort the array so that best-matching domains come first, and
-     that, within one domain, best-matching paths come first. */
-  qsort (outgoing, count, sizeof (struct weighed_cookie), goodness_comparator);
+  if (!ocnt)
+    {
+      /* no cookies matched */
+      xfree (outgoing);
+      return NULL;
+    }
 
   /* Count the space the name=value pairs will take. */
   result_size = 0;
-  for (i = 0; i < count; i++)
+  for (i = 0; i < ocnt; i++)
     {
-      struct cookie *c = outgoing[i].cookie;
+      struct cookie *c = outgoing[i];
       /* name=value */
       result_size += strlen (c->attr) + 1 + strlen (c->value);
     }
 
   /* Allocate output buffer:
      name=value pairs -- result_size
-     "; " separators  -- (count - 1) * 2
+     "; " separators  -- (ocnt - 1) * 2
      \0 terminator    -- 1 */
-  result_size = result_size + (count - 1) * 2 + 1;
+  result_size = result_size + (ocnt - 1) * 2 + 1;
   result = xmalloc (result_size);
   pos = 0;
-  for (i = 0; i < count; i++)
+  for (i = 0; i < ocnt; i++)
     {
-      struct cookie *c = outgoing[i].cookie;
+      struct cookie *c = outgoing[i];
       int namlen = strlen (c->attr);
       int vallen = strlen (c->value);
 
@@ -1052,7 +1075,7 @@ cookie_header (struct cookie_jar *jar, const char *host,
       result[pos++] = '=';
       memcpy (result + pos, c->value, vallen);
       pos += vallen;
-      if (i < count - 1)
+      if (i < ocnt - 1)
         {
           result[pos++] = ';';
           result[pos++] = ' ';
@@ -1060,9 +1083,127 @@ cookie_header (struct cookie_jar *jar, const char *host,
     }
   result[pos++] = '\0';
   assert (pos == result_size);
+  xfree (outgoing);
   return result;
 }
-
+
+/* Return the key of the cached header for HOST, PORT, SECFLAG and
+   the directory of PATH of length DIRLEN, allocated with malloc.  */
+
+static char *
+header_cache_key (const char *host, int port, bool secflag,
+                  const char *path, int dirlen)
+{
+  char *key = aprintf ("%d %d %s %.*s", port, secflag, host, dirlen, path);
+  char *p;
+
+  /* Host names are case-insensitive. */
+  for (p = strchr (strchr (key, ' ') + 1, ' ') + 1; *p != ' '; p++)
+    *p = c_tolower (*p);
+  return key;
+}
+
+/* Free the cached headers.  */
+
+static void
+header_cache_clear (struct cookie_jar *jar)
+{
+  hash_table_iterator iter;
+
+  for (hash_table_iterate (jar->headers, &iter); hash_table_iter_next (&iter); )
+    {
+      struct header_cache *hc = iter.value;
+      xfree (iter.key);
+      xfree_null (hc->header);
+      xfree (hc);
+    }
+  hash_table_clear (jar->headers);
+}
+
+/* Generate a `Cookie' header for a request that goes to HOST:PORT and
+   requests PATH from the server.  The resulting string is allocated
+   with `malloc', and the caller is responsible for freeing it.  If no
+   cookies pertain to this request, i.e. no cookie header should be
+   generated, NULL is returned.  */
+
+char *
+cookie_header (struct cookie_jar *jar, const char *host,
+               int port, const char *path, bool secflag)
+{
+  struct cookie_node **nodes;
+  int node_count;
+  unsigned long generation = 0;
+  struct header_cache *hc;
+  char *key = NULL;
+  int dirlen;
+  bool cacheable;
+  time_t now, valid_until;
+  char *result = NULL;
+  PREPEND_SLASH (path);         /* see cookie_handle_set_cookie */
+
+  JAR_READ_LOCK (jar);
+
+  /* Bail out quickly if there are no cookies in the jar.  */
+  if (!jar->cookie_count)
+    goto out;
+
+  /* First, find the nodes whose domains match HOST.  Their number
+     can at most equal the number of subdomains, hence 1+<number of
+     dots>.  */
+  nodes = alloca_array (struct cookie_node *, 1 + count_char (host, '.'));
+  node_count = find_nodes_of_host (jar, host, nodes, &generation);
+
+  /* No cookies for this host. */
+  if (!node_count)
+    goto out;
+
+  now = time (NULL);
+
+  /* Use the cached header if the nodes haven't changed since, and
+     none of its cookies has expired.  */
+  dirlen = strrchr (path, '/') + 1 - path;
+  key = header_cache_key (host, port, secflag, path, dirlen);
+  HEADERS_LOCK (jar);
+  hc = hash_table_get (jar->headers, key);
+  if (hc && hc->generation == generation
+      && (hc->valid_until == 0 || now <= hc->valid_until))
+    {
+      result = hc->header ? xstrdup (hc->header) : NULL;
+      HEADERS_UNLOCK (jar);
+      goto out;
+    }
+  HEADERS_UNLOCK (jar);
+
+  result = build_cookie_header (nodes, node_count, host, port, path,
+                                dirlen, secflag, now,
+                                &cacheable, &valid_until);
+  if (cacheable)
+    {
+      /* Other threads may have built the same header meanwhile, but
+         while we hold the trie lock, not from other cookies.  */
+      HEADERS_LOCK (jar);
+      hc = hash_table_get (jar->headers, key);
+      if (!hc)
+        {
+          if (hash_table_count (jar->headers) >= HEADER_CACHE_MAX)
+            header_cache_clear (jar);
+          hc = xnew0 (struct header_cache);
+          hash_table_put (jar->headers, key, hc);
+          key = NULL;
+        }
+      xfree_null (hc->header);
+      hc->header = result ? xstrdup (result) : NULL;
+      hc->generation = generation;
+      hc->valid_until = valid_until;
+      HEADERS_UNLOCK (jar);
+    }
+
+ out:
+  JAR_UNLOCK (jar);
+  xfree_null (key);
+  return result;
+}
+
 /* Support for loading and saving cookies.  The format used for
    loading and saving should be the format of the `cookies.txt' file
    used by Netscape and Mozilla, at least the Unix versions.
@@ -1131,6 +1272,7 @@ cookie_jar_load (struct cookie_jar *jar, const char *file)
 {
   char *line = NULL;
   size_t bufsize = 0;
+  time_t now;
 
   FILE *fp = fopen (file, "r");
   if (!fp)
@@ -1140,7 +1282,7 @@ cookie_jar_load (struct cookie_jar *jar, const char *file)
       return;
     }
 
-  cookies_now = time (NULL);
+  now = time (NULL);
 
   while (getline (&line, &bufsize, fp) > 0)
     {
@@ -1206,7 +1348,7 @@ cookie_jar_load (struct cookie_jar *jar, const char *file)
       cookie->domain  = strdupdelim (domain_b, domain_e);
 
       /* safe default in case EXPIRES field is garbled. */
-      expiry = (double)cookies_now - 1;
+      expiry = (double)now - 1;
 
       /* I don't like changing the line, but it's safe here.  (line is
          malloced.)  */
@@ -1222,13 +1364,15 @@ cookie_jar_load (struct cookie_jar *jar, const char *file)
         }
       else
         {
-          if (expiry < cookies_now)
+          if (expiry < now)
             goto abort_cookie;  /* ignore stale cookie. */
           cookie->expiry_time = expiry;
           cookie->permanent = 1;
         }
 
+      JAR_WRITE_LOCK (jar);
       store_cookie (jar, cookie);
+      JAR_UNLOCK (jar);
 
     next:
       continue;
@@ -1241,17 +1385,71 @@ cookie_jar_load (struct cookie_jar *jar, const char *file)
   fclose (fp);
 }
 
-/* Save cookies, in format described above, to FILE. */
+/* Lines of the cookies file, built by snapshot_node.  */
+
+struct cookie_lines {
+  char **lines;
+  int count, size;
+};
+
+/* Add the lines of the cookies of NODE and its subdomains that are to
+   be saved at time NOW to LINES.  */
+
+static void
+snapshot_node (struct cookie_lines *lines, struct cookie_node *node,
+               time_t now)
+{
+  int i;
+
+  for (i = 0; i < node->count; i++)
+    {
+      struct cookie *cookie = node->cookies[i];
+      char port[1 + MAX_INT_TO_STRING_LEN (int)];
+
+      if (!cookie->permanent && !opt.keep_session_cookies)
+        continue;
+      if (cookie_expired_p (cookie, now))
+        continue;
+      port[0] = '\0';
+      if (cookie->port != PORT_ANY)
+        sprintf (port, ":%d", cookie->port);
+      DO_REALLOC (lines->lines, lines->size, lines->count + 1, char *);
+      lines->lines[lines->count++] =
+        aprintf ("%s%s%s\t%s\t%s\t%s\t%.0f\t%s\t%s\n",
+                 cookie->domain_exact ? "" : ".", node->domain, port,
+                 cookie->domain_exact ? "FALSE" : "TRUE",
+                 cookie->path, cookie->secure ? "TRUE" : "FALSE",
+                 (double)cookie->expiry_time,
+                 cookie->attr, cookie->value);
+    }
+
+  if (node->children)
+    {
+      hash_table_iterator iter;
+      for (hash_table_iterate (node->children, &iter);
+           hash_table_iter_next (&iter);
+           )
+        snapshot_node (lines, iter.value, now);
+    }
+}
+
+/* Save cookies, in format described above, to FILE.
+
+   The lines are built while holding the jar for reading, so that the
+   file is a consistent snapshot, and written after releasing it, so
+   that the other threads don't wait for the disk.  */
 
 void
 cookie_jar_save (struct cookie_jar *jar, const char *file)
 {
   FILE *fp;
-  hash_table_iterator iter;
+  struct cookie_lines lines;
+  time_t now;
+  int i;
 
   DEBUGP (("Saving cookies to %s.\n", file));
 
-  cookies_now = time (NULL);
+  now = time (NULL);
 
   fp = fopen (file, "w");
   if (!fp)
@@ -1261,37 +1459,23 @@ cookie_jar_save (struct cookie_jar *jar, const char *file)
       return;
     }
 
+  xzero (lines);
+  JAR_READ_LOCK (jar);
+  snapshot_node (&lines, &jar->root, now);
+  JAR_UNLOCK (jar);
+
   fputs ("# HTTP cookie file.\n", fp);
-  fprintf (fp, "# Generated by Wget on %s.\n", datetime_str (cookies_now));
+  fprintf (fp, "# Generated by Wget on %s.\n", datetime_str (now));
   fputs ("# Edit at your own risk.\n\n", fp);
 
-  for (hash_table_iterate (jar->chains, &iter);
-       hash_table_iter_next (&iter);
-       )
+  for (i = 0; i < lines.count; i++)
     {
-      const char *domain = iter.key;
-      struct cookie *cookie = iter.value;
-      for (; cookie; cookie = cookie->next)
-        {
-          if (!cookie->permanent && !opt.keep_session_cookies)
-            continue;
-          if (cookie_expired_p (cookie))
-            continue;
-          if (!cookie->domain_exact)
-            fputc ('.', fp);
-          fputs (domain, fp);
-          if (cookie->port != PORT_ANY)
-            fprintf (fp, ":%d", cookie->port);
-          fprintf (fp, "\t%s\t%s\t%s\t%.0f\t%s\t%s\n",
-                   cookie->domain_exact ? "FALSE" : "TRUE",
-                   cookie->path, cookie->secure ? "TRUE" : "FALSE",
-                   (double)cookie->expiry_time,
-                   cookie->attr, cookie->value);
-          if (ferror (fp))
-            goto out;
-        }
+      if (!ferror (fp))
+        fputs (lines.lines[i], fp);
+      xfree (lines.lines[i]);
     }
- out:
+  xfree_null (lines.lines);
+
   if (ferror (fp))
     logprintf (LOG_NOTQUIET, _("Error writing to %s: %s\n"),
                quote (file), strerror (errno));
@@ -1301,30 +1485,110 @@ cookie_jar_save (struct cookie_jar *jar, const char *file)
 
   DEBUGP (("Done saving cookies.\n"));
 }
-
-/* Clean up cookie-related data. */
 
-void
-cookie_jar_delete (struct cookie_jar *jar)
+/* Free the cookies of NODE and its subdomains, and the nodes of the
+   subdomains.  */
+
+static void
+delete_node (struct cookie_node *node)
 {
-  /* Iterate over chains (indexed by domain) and free them. */
-  hash_table_iterator iter;
-  for (hash_table_iterate (jar->chains, &iter); hash_table_iter_next (&iter); )
+  int i;
+
+  for (i = 0; i < node->count; i++)
+    delete_cookie (node->cookies[i]);
+  xfree_null (node->cookies);
+  xfree_null (node->domain);
+  if (node->children)
     {
-      struct cookie *chain = iter.value;
-      xfree (iter.key);
-      /* Then all cookies in this chain. */
-      while (chain)
+      hash_table_iterator iter;
+      for (hash_table_iterate (node->children, &iter);
+           hash_table_iter_next (&iter);
+           )
         {
-          struct cookie *next = chain->next;
-          delete_cookie (chain);
-          chain = next;
+          struct cookie_node *child = iter.value;
+          delete_node (child);
+          xfree (child->label);
+          xfree (child);
         }
+      hash_table_destroy (node->children);
     }
-  hash_table_destroy (jar->chains);
+}
+
+/* Clean up cookie-related data. */
+
+void
+cookie_jar_delete (struct cookie_jar *jar)
+{
+  delete_node (&jar->root);
+  header_cache_clear (jar);
+  hash_table_destroy (jar->headers);
+#ifdef ENABLE_THREADS
+  pthread_rwlock_destroy (&jar->lock);
+  pthread_mutex_destroy (&jar->headers_mutex);
+#endif
   xfree (jar);
 }
-
+
+#ifdef TESTING
+
+/* Check that the headers, cached or not, follow the changes of the
+   jar.  */
+
+const char *
+test_cookie_header (void)
+{
+  static const struct {
+    const char *path;
+    const char *set_cookie;     /* Set-Cookie received, or NULL */
+    const char *get_path;
+    const char *expected;       /* Cookie header expected, or NULL */
+  } tests[] = {
+    { "a/b/index.html", "x=1; path=/", "a/b/c.html", "x=1" },
+    { "a/b/index.html", "y=2; domain=example.com; path=/a/", "a/b/c.html",
+      "x=1; y=2" },
+    { "a/b/index.html", "z=3", "a/b/c.html", "z=3; x=1; y=2" },
+    { NULL, NULL, "a/b/c.html", "z=3; x=1; y=2" },
+    { NULL, NULL, "a/d.html", "x=1; y=2" },
+    { NULL, NULL, "d.html", "x=1" },
+    { "a/b/index.html", "x=9; path=/", "a/b/c.html", "z=3; x=9; y=2" },
+    { "a/b/index.html", "x=9; domain=example.com; path=/", "a/b/c.html",
+      "z=3; x=9; y=2" },
+    { "a/b/index.html", "z=; max-age=0", "a/b/c.html", "x=9; y=2" },
+    { "a/b/c.html", "p=4; path=/a/b/c", "a/b/c.html", "p=4; x=9; y=2" },
+    { NULL, NULL, "a/b/d.html", "x=9; y=2" },
+    { NULL, NULL, "a/b/c.html", "p=4; x=9; y=2" },
+    { "index.html", "x=; max-age=0; path=/", "x.html", "x=9" },
+  };
+  struct cookie_jar *jar = cookie_jar_new ();
+  int i;
+
+  for (i = 0; i < countof (tests); i++)
+    {
+      char *header;
+      bool ok;
+
+      if (tests[i].set_cookie)
+        cookie_handle_set_cookie (jar, "www.example.com", 80, tests[i].path,
+                                  tests[i].set_cookie);
+      header = cookie_header (jar, "www.example.com", 80, tests[i].get_path,
+                              false);
+      ok = tests[i].expected
+        ? header && 0 == strcmp (header, tests[i].expected)
+        : header == NULL;
+      xfree_null (header);
+      mu_assert ("test_cookie_header: wrong Cookie header", ok);
+    }
+
+  mu_assert ("test_cookie_header: no cookies for other hosts",
+             cookie_header (jar, "www.example.org", 80, "a/b/c.html",
+                            false) == NULL);
+
+  cookie_jar_delete (jar);
+  return NULL;
+}
+
+#endif /* TESTING */
+
 /* Test cases.  Currently this is only tests parse_set_cookies.  To
    use, recompile Wget with -DTEST_COOKIES and call test_cookies()
    from main.  */
@@ -1365,7 +1629,7 @@ test_cookies (void)
       const char **expected = tests_succ[i].results;
       struct cookie *c;
 
-      c = parse_set_cookie (data, true);
+      c = parse_set_cookie (data, time (NULL), true);
       if (!c)
         {
           printf ("NULL cookie returned for valid data: %s\n", data);
@@ -1405,7 +1669,7 @@ test_cookies (void)
     {
       struct cookie *c;
       char *data = tests_fail[i];
-      c = parse_set_cookie (data, true);
+      c = parse_set_cookie (data, time (NULL), true);
       if (c)
         printf ("Failed to report error on invalid data: %s\n", data);
     }
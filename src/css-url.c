@@ -54,6 +54,7 @@ as that of the covered work.  */
 #include "utils.h"
 #include "convert.h"
 #include "html-url.h"
+#include "arena.h"
 #include "css-tokens.h"
 #include "css-url.h"
 
@@ -249,7 +250,8 @@ get_urls_css (struct map_context *ctx, int offset, int buf_length)
 }
 
 struct urlpos *
-get_urls_css_file (const char *file, const char *url)
+get_urls_css_file (const char *file, const char *url,
+                   const struct link_filter *filter)
 {
   struct file_memory *fm;
   struct map_context ctx;
@@ -269,8 +271,14 @@ get_urls_css_file (const char *file, const char *url)
   ctx.parent_base = url ? url : opt.base_href;
   ctx.document_file = file;
   ctx.nofollow = 0;
+  ctx.arena = arena_new (0);
+  ctx.filter = filter;
 
   get_urls_css (&ctx, 0, fm->length);
+  arena_report (ctx.arena, file);
+  /* The arena is released by free_urlpos along with the list.  */
+  if (!ctx.head)
+    arena_free (ctx.arena);
   wget_read_file_free (fm);
   return ctx.head;
 }
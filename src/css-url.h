@@ -32,6 +32,7 @@ as that of the covered work.  */
 
 void get_urls_css (struct map_context *, int, int);
 void get_urls_css (struct map_context *, int, int);
-struct urlpos *get_urls_css_file (const char *, const char *);
+struct urlpos *get_urls_css_file (const char *, const char *,
+                                  const struct link_filter *);
 
 #endif /* CSS_URL_H */
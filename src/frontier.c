@@ -0,0 +1,1506 @@
+/* Crawl frontier for recursive retrieval.
+   Copyright (C) 2014 Free Software Foundation, Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+
+/* The frontier holds the URLs that recursive retrieval has yet to
+   download, in the order they were found, along with the set of URLs
+   that have already been queued and must not be queued again.
+
+   By default both live in memory, as they always have.  When a
+   frontier directory is given, memory use is bounded instead:
+
+   - The queue keeps at most MEMORY_LIMIT entries in memory.  Once
+     that many are waiting, new entries are appended to segment files
+     ("queue-NNNNNNNN") on disk, and the in-memory queue is refilled
+     from the oldest segment as it drains.  Entries are only ever
+     appended to the newest segment and read from the oldest one, so
+     the breadth-first order is preserved.
+
+   - The seen-set keeps the most recent MEMORY_LIMIT URLs in a hash
+     table.  When the table fills up, its contents are sorted and
+     written to a run file ("seen-NNNNNNNN"), which is then searched
+     with a binary search through a read-only mapping.  Runs of
+     similar size are merged, so that each URL is rewritten once per
+     size tier rather than every time the table is flushed.  A Bloom
+     filter in front of it all answers most lookups for URLs not yet
+     seen without touching the runs.
+
+   - Links are remembered as they appear in documents, resolved
+     against the document's base but not yet parsed, once their URL
+     is known to have been seen.  Recursive retrieval asks about each
+     link before parsing it, so links repeated across pages, such as
+     navigation bars, cost a Bloom filter probe instead of a parse and
+     several lookups.  This cache is kept in both modes and holds at
+     most MEMORY_LIMIT links.
+
+   - The state is periodically checkpointed: entries being downloaded
+     and entries in memory are written to a "head" file, and a
+     "checkpoint" file records the head file, the unread parts of the
+     segments, and the runs.  If Wget is interrupted, running it again
+     with the same start URL and frontier directory resumes from the
+     last checkpoint.  Files superseded by a checkpoint are deleted
+     only after the next one has been written, so the last checkpoint
+     always refers to files that exist.
+
+   The entry points are:
+
+     frontier_new        -- create a frontier.
+     frontier_resume     -- load the state saved by a previous run.
+     frontier_enqueue    -- add a URL to the end of the queue.
+     frontier_dequeue    -- take the URL from the front of the queue.
+     frontier_done       -- declare a dequeued URL fully processed.
+     frontier_seen_p     -- return whether a URL has been seen.
+     frontier_mark_seen  -- add a URL to the seen-set.
+     frontier_link_seen_p -- return whether an unparsed link is known
+                            to have been seen.
+     frontier_note_link  -- remember an unparsed link whose URL has
+                            been seen.
+     frontier_checkpoint -- save the state to the frontier directory.
+     frontier_delete     -- checkpoint if there is work left, and
+                            release the frontier.  */
+
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "hash.h"
+#include "bloom.h"
+#include "iri.h"
+#include "frontier.h"
+#include "metrics.h"
+
+/* Number of queued URLs kept in memory when the caller doesn't say.  */
+#define FRONTIER_DEFAULT_MEMORY 100000
+
+/* Number of entries after which a new queue segment is started, so
+   that consumed parts of the queue can be deleted.  */
+#define FRONTIER_SEGMENT_ENTRIES 65536
+
+/* Number of seen runs in one size tier that triggers a merge of
+   these runs.  A run's tier is the base FRONTIER_TIER_RUNS logarithm
+   of its size in bytes.  */
+#define FRONTIER_TIER_RUNS 4
+
+/* Largest number of seen runs: fewer than FRONTIER_TIER_RUNS in each
+   tier, of which there are at most 32 for sizes below 2^64.  */
+#define FRONTIER_MAX_RUNS ((FRONTIER_TIER_RUNS - 1) * 32)
+
+/* The Bloom filter is sized for this many times MEMORY_LIMIT URLs,
+   at 10 bits per URL.  */
+#define FRONTIER_BLOOM_RATIO 64
+
+/* Bits per link in the Bloom filter of the link cache.  */
+#define FRONTIER_LINK_BLOOM_BITS 10
+
+/* Seconds between checkpoints.  */
+#define FRONTIER_CHECKPOINT_INTERVAL 300
+
+/* First line of the checkpoint file.  */
+#define FRONTIER_MAGIC "wget-frontier 1"
+
+#ifndef MIN
+# define MIN(x, y) ((x) > (y) ? (y) : (x))
+#endif
+
+struct frontier_entry {
+  char *url;                    /* the URL to download */
+  char *referer;                /* the referring document */
+  struct iri *iri;              /* handed to the caller on dequeue */
+  char *encoding;               /* URI encoding of a leased entry */
+  int depth;                    /* the depth */
+  bool html_allowed;            /* whether the document is allowed to
+                                   be treated as HTML. */
+  bool css_allowed;             /* whether the document is allowed to
+                                   be treated as CSS. */
+  struct frontier_entry *next;  /* next element in queue */
+};
+
+struct seen_run {
+  unsigned long id;             /* number in the file name */
+  struct file_memory *fm;       /* sorted URLs, one per line */
+};
+
+struct frontier {
+  char *dir;                    /* frontier directory, or NULL if
+                                   everything is kept in memory */
+  int memory_limit;             /* queued or seen URLs kept in memory */
+
+  /* The in-memory part of the queue, which comes before the entries
+     on disk.  */
+  struct frontier_entry *head, *tail;
+  int count;                    /* entries in memory */
+  wgint maxcount;               /* largest queue size seen */
+
+  /* Entries that were dequeued but not yet declared done.  They are
+     saved by checkpoints along with the queue.  */
+  struct frontier_entry *leased;
+
+  /* The on-disk part of the queue, in segments FIRST_SEGMENT to
+     LAST_SEGMENT.  WRITER appends to LAST_SEGMENT, and READER reads
+     FIRST_SEGMENT.  If WRITER is NULL, LAST_SEGMENT hasn't been
+     created yet.  */
+  wgint disk_count;
+  unsigned long first_segment, last_segment;
+  FILE *reader, *writer;
+  wgint reader_offset;          /* where READER starts when opened */
+  int writer_entries;
+  wgint spilled;                /* total entries ever spilled */
+
+  /* The seen-set.  In memory mode, SEEN holds a copy of every URL.
+     Otherwise it holds copies of the URLs not yet written to a
+     run.  */
+  struct hash_table *seen;
+  struct bloom *bloom;
+  struct seen_run *runs;
+  int run_count;
+  unsigned long next_run;
+  wgint seen_lookups;           /* lookups, counted if BLOOM is used */
+  wgint seen_hits;
+  wgint seen_false_positives;   /* BLOOM said yes, the set said no */
+
+  /* The link cache.  LINKS holds copies of the links, and LINK_BLOOM
+     is checked before it.  Both are created on first use.  */
+  struct hash_table *links;
+  struct bloom *link_bloom;
+  wgint link_lookups;
+  wgint link_hits;
+  wgint link_false_positives;   /* LINK_BLOOM said yes, LINKS said no */
+
+  /* Checkpointing.  */
+  char *start_url;
+  unsigned long checkpoint_number;
+  time_t last_checkpoint;
+  char **obsolete;              /* files to delete after the next
+                                   checkpoint */
+
+  char *line;                   /* buffer for getline */
+  size_t line_size;
+};
+
+/* Return the name of the file NAME-NUMBER in the frontier directory,
+   or of NAME if NUMBER is negative.  The name is freshly allocated.  */
+
+static char *
+frontier_file (const struct frontier *f, const char *name, long number)
+{
+  if (number < 0)
+    return aprintf ("%s/%s", f->dir, name);
+  return aprintf ("%s/%s-%08lu", f->dir, name, (unsigned long) number);
+}
+
+/* Arrange for FILE to be deleted after the next checkpoint.  FILE is
+   taken over by the frontier.  */
+
+static void
+make_obsolete (struct frontier *f, char *file)
+{
+  f->obsolete = vec_append (f->obsolete, file);
+  xfree (file);
+}
+
+static void
+delete_obsolete (struct frontier *f)
+{
+  char **p;
+
+  if (!f->obsolete)
+    return;
+  for (p = f->obsolete; *p; p++)
+    unlink (*p);
+  free_vec (f->obsolete);
+  f->obsolete = NULL;
+}
+
+/* Create a frontier.  If DIR is non-NULL, keep at most MEMORY_LIMIT
+   queued URLs and MEMORY_LIMIT seen URLs in memory and spill the rest
+   to files in DIR, which is created if necessary.  */
+
+struct frontier *
+frontier_new (const char *dir, int memory_limit)
+{
+  struct frontier *f = xnew0 (struct frontier);
+
+  if (dir && !file_exists_p (dir) && make_directory (dir) < 0)
+    {
+      logprintf (LOG_NOTQUIET, _("Cannot create frontier directory %s: %s\n"),
+                 quote (dir), strerror (errno));
+      dir = NULL;
+    }
+
+  f->memory_limit = memory_limit > 0 ? memory_limit : FRONTIER_DEFAULT_MEMORY;
+  f->seen = make_string_hash_table (0);
+  if (dir)
+    {
+      f->dir = xstrdup (dir);
+      f->bloom = bloom_new ((unsigned long) f->memory_limit
+                            * FRONTIER_BLOOM_RATIO, 10);
+      f->last_checkpoint = time (NULL);
+    }
+  return f;
+}
+
+/* Queue entries on disk.  Each entry is a line of five fields
+   separated by spaces: depth, flags (1 for HTML, 2 for CSS), URI
+   encoding, URL and referer, with "-" standing for a missing encoding
+   or referer.  URLs never contain spaces or newlines once parsed.  */
+
+static bool
+write_entry (FILE *fp, const char *url, const char *referer,
+             const char *encoding, int depth, bool html_allowed,
+             bool css_allowed)
+{
+  return fprintf (fp, "%d %d %s %s %s\n", depth,
+                  (html_allowed ? 1 : 0) | (css_allowed ? 2 : 0),
+                  encoding ? encoding : "-", url,
+                  referer ? referer : "-") > 0;
+}
+
+/* Parse a line written by write_entry into a new in-memory entry.
+   LINE is modified.  Return NULL if the line is malformed.  */
+
+static struct frontier_entry *
+parse_entry (char *line)
+{
+  char *fields[5];
+  char *p = line;
+  int i, flags;
+  struct frontier_entry *e;
+
+  for (i = 0; i < 5; i++)
+    {
+      fields[i] = p;
+      p += strcspn (p, " \n");
+      if (!*p && i < 4)
+        return NULL;
+      *p++ = '\0';
+    }
+
+  e = xnew0 (struct frontier_entry);
+  e->depth = atoi (fields[0]);
+  flags = atoi (fields[1]);
+  e->html_allowed = (flags & 1) != 0;
+  e->css_allowed = (flags & 2) != 0;
+  e->url = xstrdup (fields[3]);
+  e->referer = strcmp (fields[4], "-") ? xstrdup (fields[4]) : NULL;
+  e->iri = iri_new ();
+  if (strcmp (fields[2], "-"))
+    set_uri_encoding (e->iri, fields[2], false);
+  return e;
+}
+
+static void
+append_entry (struct frontier *f, struct frontier_entry *e)
+{
+  e->next = NULL;
+  if (!f->tail)
+    f->head = f->tail = e;
+  else
+    {
+      f->tail->next = e;
+      f->tail = e;
+    }
+  ++f->count;
+}
+
+static void
+free_entry (struct frontier_entry *e)
+{
+  if (e->iri)
+    iri_free (e->iri);
+  xfree (e->url);
+  xfree_null (e->referer);
+  xfree_null (e->encoding);
+  xfree (e);
+}
+
+/* Append an entry to the newest queue segment.  */
+
+static bool
+spill_entry (struct frontier *f, struct iri *i, const char *url,
+             const char *referer, int depth, bool html_allowed,
+             bool css_allowed)
+{
+  if (!f->writer)
+    {
+      char *name = frontier_file (f, "queue", f->last_segment);
+      f->writer = fopen (name, "wb");
+      if (!f->writer)
+        {
+          logprintf (LOG_NOTQUIET, "%s: %s\n", name, strerror (errno));
+          xfree (name);
+          return false;
+        }
+      xfree (name);
+      f->writer_entries = 0;
+    }
+
+  if (!write_entry (f->writer, url, referer, i->uri_encoding, depth,
+                    html_allowed, css_allowed))
+    {
+      logprintf (LOG_NOTQUIET, _("Cannot write to frontier: %s\n"),
+                 strerror (errno));
+      return false;
+    }
+  ++f->disk_count;
+  ++f->spilled;
+
+  if (++f->writer_entries >= FRONTIER_SEGMENT_ENTRIES)
+    {
+      /* Start a new segment so that this one can be deleted once it
+         has been read.  */
+      if (fclose (f->writer) != 0)
+        return false;
+      f->writer = NULL;
+      ++f->last_segment;
+    }
+  return true;
+}
+
+/* Move entries from the oldest queue segments into memory, until
+   MEMORY_LIMIT entries are in memory or the disk is exhausted.  */
+
+static bool
+refill (struct frontier *f)
+{
+  while (f->count < f->memory_limit && f->disk_count > 0)
+    {
+      struct frontier_entry *e;
+
+      if (f->writer && f->first_segment == f->last_segment)
+        /* We're reading the segment being written.  */
+        fflush (f->writer);
+
+      if (!f->reader)
+        {
+          char *name = frontier_file (f, "queue", f->first_segment);
+          f->reader = fopen (name, "rb");
+          if (!f->reader
+              || (f->reader_offset
+                  && fseeko (f->reader, f->reader_offset, SEEK_SET) < 0))
+            {
+              logprintf (LOG_NOTQUIET, "%s: %s\n", name, strerror (errno));
+              xfree (name);
+              return false;
+            }
+          xfree (name);
+          f->reader_offset = 0;
+        }
+
+      clearerr (f->reader);
+      if (getline (&f->line, &f->line_size, f->reader) <= 0)
+        {
+          if (f->first_segment == f->last_segment)
+            {
+              /* DISK_COUNT says there are more entries, but the
+                 segment being written has none.  */
+              logprintf (LOG_NOTQUIET,
+                         _("Frontier segment %lu is truncated.\n"),
+                         f->first_segment);
+              f->disk_count = 0;
+              return false;
+            }
+          /* Done with this segment.  */
+          fclose (f->reader);
+          f->reader = NULL;
+          make_obsolete (f, frontier_file (f, "queue", f->first_segment));
+          ++f->first_segment;
+          continue;
+        }
+
+      --f->disk_count;
+      e = parse_entry (f->line);
+      if (!e)
+        {
+          logprintf (LOG_NOTQUIET, _("Malformed frontier entry: %s\n"),
+                     quote (f->line));
+          continue;
+        }
+      append_entry (f, e);
+    }
+  return true;
+}
+
+/* Enqueue a URL in the frontier.  The queue is FIFO: the items will be
+   retrieved ("dequeued") from the queue in the order they were placed
+   into it.  I is taken over by the frontier.  Return false if the
+   entry could not be written to disk.  */
+
+bool
+frontier_enqueue (struct frontier *f, struct iri *i,
+                  const char *url, const char *referer, int depth,
+                  bool html_allowed, bool css_allowed)
+{
+  struct frontier_entry *e;
+  bool ok = true;
+
+  DEBUGP (("Enqueuing %s at depth %d\n",
+           quotearg_n_style (0, escape_quoting_style, url), depth));
+  if (i)
+    DEBUGP (("[IRI Enqueuing %s with %s\n", quote_n (0, url),
+             i->uri_encoding ? quote_n (1, i->uri_encoding) : "None"));
+
+  if (f->dir && (f->disk_count > 0 || f->count >= f->memory_limit))
+    {
+      /* Entries on disk come before this one, or memory is full.
+         Either way, this entry goes after them.  */
+      ok = spill_entry (f, i, url, referer, depth, html_allowed,
+                        css_allowed);
+      iri_free (i);
+    }
+  else
+    {
+      e = xnew0 (struct frontier_entry);
+      e->iri = i;
+      e->url = xstrdup (url);
+      e->referer = referer ? xstrdup (referer) : NULL;
+      e->depth = depth;
+      e->html_allowed = html_allowed;
+      e->css_allowed = css_allowed;
+      append_entry (f, e);
+    }
+
+  if (f->count + f->disk_count > f->maxcount)
+    f->maxcount = f->count + f->disk_count;
+  metrics_set (METRIC_QUEUE, f->count + f->disk_count);
+  metrics_set (METRIC_QUEUE_MAX, f->maxcount);
+  DEBUGP (("Queue count %s, maxcount %s.\n",
+           number_to_static_string (f->count + f->disk_count),
+           number_to_static_string (f->maxcount)));
+  return ok;
+}
+
+/* Take a URL out of the frontier.  Return true if this operation
+   succeeded, or false if the queue is empty.  The URL and the referer
+   belong to the caller, which must free them.  In disk mode, the
+   entry keeps its own copies and stays "leased" until frontier_done is
+   called for its URL, so that a checkpoint taken in the meantime
+   doesn't lose it.  */
+
+bool
+frontier_dequeue (struct frontier *f, struct iri **i,
+                  char **url, char **referer, int *depth,
+                  bool *html_allowed, bool *css_allowed)
+{
+  struct frontier_entry *e;
+
+  if (!f->head && f->disk_count > 0)
+    refill (f);
+
+  e = f->head;
+  if (!e)
+    return false;
+
+  f->head = e->next;
+  if (!f->head)
+    f->tail = NULL;
+  --f->count;
+  metrics_set (METRIC_QUEUE, f->count + f->disk_count);
+
+  *i = e->iri;
+  *depth = e->depth;
+  *html_allowed = e->html_allowed;
+  *css_allowed = e->css_allowed;
+
+  DEBUGP (("Dequeuing %s at depth %d\n",
+           quotearg_n_style (0, escape_quoting_style, e->url), e->depth));
+  DEBUGP (("Queue count %s, maxcount %s.\n",
+           number_to_static_string (f->count + f->disk_count),
+           number_to_static_string (f->maxcount)));
+
+  if (!f->dir)
+    {
+      *url = e->url;
+      *referer = e->referer;
+      xfree (e);
+      return true;
+    }
+
+  *url = xstrdup (e->url);
+  *referer = e->referer ? xstrdup (e->referer) : NULL;
+
+  /* The caller owns the iri now; remember the encoding in case the
+     entry has to be checkpointed.  */
+  e->encoding = e->iri->uri_encoding ? xstrdup (e->iri->uri_encoding) : NULL;
+  e->iri = NULL;
+  e->next = f->leased;
+  f->leased = e;
+
+  if (time (NULL) - f->last_checkpoint >= FRONTIER_CHECKPOINT_INTERVAL)
+    frontier_checkpoint (f);
+  return true;
+}
+
+/* Declare that URL, previously returned by frontier_dequeue, has been
+   downloaded and its links enqueued.  */
+
+void
+frontier_done (struct frontier *f, const char *url)
+{
+  struct frontier_entry **prev, *e;
+
+  for (prev = &f->leased; (e = *prev) != NULL; prev = &e->next)
+    if (!strcmp (e->url, url))
+      {
+        *prev = e->next;
+        free_entry (e);
+        return;
+      }
+}
+
+/* Seen runs.  */
+
+/* Compare KEY with the LEN bytes at LINE, like strcmp.  */
+
+static int
+compare_line (const char *key, const char *line, size_t len)
+{
+  size_t keylen = strlen (key);
+  int cmp = memcmp (key, line, MIN (keylen, len));
+  if (cmp)
+    return cmp;
+  return keylen < len ? -1 : keylen > len;
+}
+
+/* Return whether KEY is one of the lines of the sorted run R.  */
+
+static bool
+run_contains (const struct seen_run *r, const char *key)
+{
+  const char *lo = r->fm->content;
+  const char *hi = lo + r->fm->length;
+
+  /* LO and HI always point to the beginning of a line.  */
+  while (lo < hi)
+    {
+      const char *mid = lo + (hi - lo) / 2;
+      const char *end;
+      int cmp;
+
+      while (mid > lo && mid[-1] != '\n')
+        --mid;
+      end = memchr (mid, '\n', hi - mid);
+      if (!end)
+        end = hi;
+      cmp = compare_line (key, mid, end - mid);
+      if (cmp == 0)
+        return true;
+      if (cmp < 0)
+        hi = mid;
+      else
+        lo = end + 1;
+    }
+  return false;
+}
+
+static bool
+open_run (struct frontier *f, unsigned long id)
+{
+  char *name = frontier_file (f, "seen", id);
+  struct file_memory *fm = wget_read_file (name);
+
+  if (!fm)
+    {
+      logprintf (LOG_NOTQUIET, "%s: %s\n", name, strerror (errno));
+      xfree (name);
+      return false;
+    }
+  xfree (name);
+  f->runs = xrealloc (f->runs, (f->run_count + 1) * sizeof *f->runs);
+  f->runs[f->run_count].id = id;
+  f->runs[f->run_count].fm = fm;
+  ++f->run_count;
+  return true;
+}
+
+static int
+compare_strings (const void *a, const void *b)
+{
+  return strcmp (*(const char **) a, *(const char **) b);
+}
+
+/* Merge the runs from FIRST on into a single one, dropping
+   duplicates.  */
+
+static bool
+merge_runs (struct frontier *f, int first)
+{
+  unsigned long id = f->next_run++;
+  char *name = frontier_file (f, "seen", id);
+  FILE *fp = fopen (name, "wb");
+  const char **pos, **end;
+  const char *last = NULL;
+  size_t last_len = 0;
+  int i, n = f->run_count - first;
+  bool ok = true;
+
+  if (!fp)
+    {
+      logprintf (LOG_NOTQUIET, "%s: %s\n", name, strerror (errno));
+      xfree (name);
+      return false;
+    }
+
+  pos = xnew_array (const char *, n);
+  end = xnew_array (const char *, n);
+  for (i = 0; i < n; i++)
+    {
+      pos[i] = f->runs[first + i].fm->content;
+      end[i] = pos[i] + f->runs[first + i].fm->length;
+    }
+
+  while (1)
+    {
+      int best = -1;
+      size_t best_len = 0;
+
+      for (i = 0; i < n; i++)
+        if (pos[i] < end[i])
+          {
+            const char *nl = memchr (pos[i], '\n', end[i] - pos[i]);
+            size_t len = (nl ? nl : end[i]) - pos[i];
+            if (best < 0)
+              best = i, best_len = len;
+            else
+              {
+                int cmp = memcmp (pos[i], pos[best], MIN (len, best_len));
+                if (cmp < 0 || (cmp == 0 && len < best_len))
+                  best = i, best_len = len;
+              }
+          }
+      if (best < 0)
+        break;
+
+      if (!last || last_len != best_len
+          || memcmp (last, pos[best], best_len) != 0)
+        {
+          fwrite (pos[best], 1, best_len, fp);
+          putc ('\n', fp);
+          last = pos[best];
+          last_len = best_len;
+        }
+      pos[best] += best_len + 1;
+    }
+
+  xfree (pos);
+  xfree (end);
+  if (ferror (fp))
+    ok = false;
+  if (fclose (fp) != 0)
+    ok = false;
+  if (!ok)
+    {
+      logprintf (LOG_NOTQUIET, "%s: %s\n", name, strerror (errno));
+      unlink (name);
+      xfree (name);
+      return false;
+    }
+  xfree (name);
+
+  DEBUGP (("Merged %d seen runs into run %lu.\n", n, id));
+  for (i = first; i < f->run_count; i++)
+    {
+      wget_read_file_free (f->runs[i].fm);
+      make_obsolete (f, frontier_file (f, "seen", f->runs[i].id));
+    }
+  f->run_count = first;
+  return open_run (f, id);
+}
+
+static int
+run_tier (const struct seen_run *r)
+{
+  wgint len = r->fm->length;
+  int tier = 0;
+
+  while (len >= FRONTIER_TIER_RUNS)
+    {
+      len /= FRONTIER_TIER_RUNS;
+      ++tier;
+    }
+  return tier;
+}
+
+/* Merge the runs of any tier that has FRONTIER_TIER_RUNS of them, until
+   no tier has.  Merging only runs of similar size keeps the number of
+   runs logarithmic in the size of the seen-set, without rewriting the
+   big runs for every small one added by a checkpoint.  */
+
+static bool
+merge_tiers (struct frontier *f)
+{
+  int i, j;
+
+  for (i = 0; i < f->run_count; i++)
+    {
+      int tier = run_tier (&f->runs[i]);
+      int n = 0, first;
+      struct seen_run *runs;
+
+      for (j = i; j < f->run_count; j++)
+        if (run_tier (&f->runs[j]) == tier)
+          ++n;
+      if (n < FRONTIER_TIER_RUNS)
+        continue;
+
+      /* Move the runs of this tier to the end, and merge them.  The
+         order of the runs doesn't matter otherwise.  */
+      runs = xnew_array (struct seen_run, f->run_count);
+      first = 0;
+      for (j = 0; j < f->run_count; j++)
+        if (run_tier (&f->runs[j]) != tier)
+          runs[first++] = f->runs[j];
+      n = first;
+      for (j = 0; j < f->run_count; j++)
+        if (run_tier (&f->runs[j]) == tier)
+          runs[n++] = f->runs[j];
+      memcpy (f->runs, runs, f->run_count * sizeof *runs);
+      xfree (runs);
+      if (!merge_runs (f, first))
+        return false;
+
+      /* The merged run may complete a higher tier.  */
+      i = -1;
+    }
+  return true;
+}
+
+/* Write the URLs in the seen hash table to a new run, and empty the
+   table.  */
+
+static bool
+flush_seen (struct frontier *f)
+{
+  int count = hash_table_count (f->seen);
+  const char **keys;
+  hash_table_iterator iter;
+  unsigned long id;
+  char *name;
+  FILE *fp;
+  int i;
+  bool ok = true;
+
+  if (count == 0)
+    return true;
+
+  keys = xnew_array (const char *, count);
+  for (i = 0, hash_table_iterate (f->seen, &iter);
+       hash_table_iter_next (&iter); i++)
+    keys[i] = iter.key;
+  qsort (keys, count, sizeof *keys, compare_strings);
+
+  id = f->next_run++;
+  name = frontier_file (f, "seen", id);
+  fp = fopen (name, "wb");
+  if (!fp)
+    ok = false;
+  else
+    {
+      for (i = 0; i < count; i++)
+        {
+          fputs (keys[i], fp);
+          putc ('\n', fp);
+        }
+      if (ferror (fp))
+        ok = false;
+      if (fclose (fp) != 0)
+        ok = false;
+    }
+  if (!ok)
+    {
+      logprintf (LOG_NOTQUIET, "%s: %s\n", name, strerror (errno));
+      xfree (keys);
+      xfree (name);
+      return false;
+    }
+  xfree (name);
+
+  for (i = 0; i < count; i++)
+    xfree ((char *) keys[i]);
+  xfree (keys);
+  hash_table_clear (f->seen);
+
+  if (!open_run (f, id))
+    return false;
+  return merge_tiers (f);
+}
+
+/* Return whether URL has been added to the seen-set.  */
+
+bool
+frontier_seen_p (struct frontier *f, const char *url)
+{
+  int i;
+
+  if (!f->bloom)
+    return hash_table_contains (f->seen, url);
+
+  ++f->seen_lookups;
+  if (!bloom_maybe_contains (f->bloom, url))
+    return false;
+  if (hash_table_contains (f->seen, url))
+    goto hit;
+  for (i = 0; i < f->run_count; i++)
+    if (run_contains (&f->runs[i], url))
+      goto hit;
+  ++f->seen_false_positives;
+  return false;
+
+ hit:
+  ++f->seen_hits;
+  return true;
+}
+
+/* Add URL to the seen-set.  Return false if the set could not be
+   written to disk.  */
+
+bool
+frontier_mark_seen (struct frontier *f, const char *url)
+{
+  if (hash_table_contains (f->seen, url))
+    return true;
+  hash_table_put (f->seen, xstrdup (url), "1");
+  if (!f->dir)
+    return true;
+
+  bloom_add (f->bloom, url);
+  if (hash_table_count (f->seen) >= f->memory_limit)
+    return flush_seen (f);
+  return true;
+}
+
+/* The link cache.  */
+
+static void
+free_links (struct frontier *f)
+{
+  hash_table_iterator iter;
+
+  if (!f->links)
+    return;
+  for (hash_table_iterate (f->links, &iter); hash_table_iter_next (&iter); )
+    xfree (iter.key);
+  hash_table_destroy (f->links);
+  bloom_free (f->link_bloom);
+  f->links = NULL;
+  f->link_bloom = NULL;
+}
+
+/* Return whether LINK, an absolute link that has not been parsed, is
+   known to refer to a URL in the seen-set.  A false return means only
+   that the link must be parsed to find out.  */
+
+bool
+frontier_link_seen_p (struct frontier *f, const char *link)
+{
+  ++f->link_lookups;
+  if (!f->link_bloom || !bloom_maybe_contains (f->link_bloom, link))
+    return false;
+  if (!hash_table_contains (f->links, link))
+    {
+      ++f->link_false_positives;
+      return false;
+    }
+  ++f->link_hits;
+  return true;
+}
+
+/* Remember LINK, whose URL the caller has found in the seen-set, so
+   that frontier_link_seen_p will know LINK without parsing it again.
+   When the cache is full, it is started afresh.  */
+
+void
+frontier_note_link (struct frontier *f, const char *link)
+{
+  if (f->links && hash_table_count (f->links) >= f->memory_limit)
+    free_links (f);
+  if (!f->links)
+    {
+      f->links = make_string_hash_table (0);
+      f->link_bloom = bloom_new (f->memory_limit, FRONTIER_LINK_BLOOM_BITS);
+    }
+  if (hash_table_contains (f->links, link))
+    return;
+  bloom_add (f->link_bloom, link);
+  hash_table_put (f->links, xstrdup (link), "1");
+}
+
+/* Return the false positive rate of a Bloom filter that has answered
+   LOOKUPS lookups, HITS of them for strings in the set, as a
+   percentage.  */
+
+static double
+false_positive_rate (wgint lookups, wgint hits, wgint false_positives)
+{
+  wgint misses = lookups - hits;
+  return misses ? 100.0 * false_positives / misses : 0;
+}
+
+/* Checkpoints.  */
+
+/* Write STRING to the file NAME in the frontier directory, atomically
+   replacing the old contents.  */
+
+static bool
+replace_file (struct frontier *f, const char *name, const char *string)
+{
+  char *file = frontier_file (f, name, -1);
+  char *tmp = concat_strings (file, ".tmp", (char *) 0);
+  FILE *fp = fopen (tmp, "wb");
+  bool ok = fp != NULL;
+
+  if (fp)
+    {
+      fputs (string, fp);
+      if (ferror (fp))
+        ok = false;
+      if (fclose (fp) != 0)
+        ok = false;
+    }
+  if (ok && rename (tmp, file) < 0)
+    ok = false;
+  if (!ok)
+    {
+      logprintf (LOG_NOTQUIET, "%s: %s\n", file, strerror (errno));
+      unlink (tmp);
+    }
+  xfree (tmp);
+  xfree (file);
+  return ok;
+}
+
+static bool
+write_bloom (struct frontier *f)
+{
+  char *file = frontier_file (f, "bloom", -1);
+  char *tmp = concat_strings (file, ".tmp", (char *) 0);
+  FILE *fp = fopen (tmp, "wb");
+  bool ok = fp != NULL;
+
+  if (fp)
+    {
+      ok = bloom_write (f->bloom, fp);
+      if (fclose (fp) != 0)
+        ok = false;
+    }
+  if (ok && rename (tmp, file) < 0)
+    ok = false;
+  if (!ok)
+    {
+      logprintf (LOG_NOTQUIET, "%s: %s\n", file, strerror (errno));
+      unlink (tmp);
+    }
+  xfree (tmp);
+  xfree (file);
+  return ok;
+}
+
+/* Save the state of the frontier to its directory.  Return false on
+   error, in which case the previous checkpoint is left intact.  */
+
+bool
+frontier_checkpoint (struct frontier *f)
+{
+  unsigned long number = f->checkpoint_number + 1;
+  char *name, *manifest, *runs;
+  char head_buf[24], offset_buf[24], length_buf[24], disk_buf[24];
+  struct frontier_entry *e;
+  wgint reader_offset, writer_length, head_count = 0;
+  FILE *fp;
+  int i;
+  bool ok = true;
+
+  if (!f->dir)
+    return false;
+  f->last_checkpoint = time (NULL);
+
+  if (!flush_seen (f) || !write_bloom (f))
+    return false;
+
+  /* Entries being downloaded come first, then the in-memory queue.  */
+  name = frontier_file (f, "head", number);
+  fp = fopen (name, "wb");
+  if (!fp)
+    ok = false;
+  else
+    {
+      for (e = f->leased; e && ok; e = e->next, head_count++)
+        ok = write_entry (fp, e->url, e->referer, e->encoding, e->depth,
+                          e->html_allowed, e->css_allowed);
+      for (e = f->head; e && ok; e = e->next, head_count++)
+        ok = write_entry (fp, e->url, e->referer, e->iri->uri_encoding,
+                          e->depth, e->html_allowed, e->css_allowed);
+      if (fclose (fp) != 0)
+        ok = false;
+    }
+  if (!ok)
+    {
+      logprintf (LOG_NOTQUIET, "%s: %s\n", name, strerror (errno));
+      unlink (name);
+      xfree (name);
+      return false;
+    }
+  xfree (name);
+
+  reader_offset = f->reader ? ftello (f->reader) : f->reader_offset;
+  writer_length = 0;
+  if (f->writer)
+    {
+      fflush (f->writer);
+      writer_length = ftello (f->writer);
+    }
+
+  number_to_string (head_buf, head_count);
+  number_to_string (offset_buf, reader_offset);
+  number_to_string (length_buf, writer_length);
+  number_to_string (disk_buf, f->disk_count);
+  runs = xstrdup ("");
+  for (i = 0; i < f->run_count; i++)
+    {
+      char *tmp = aprintf ("%s %lu", runs, f->runs[i].id);
+      xfree (runs);
+      runs = tmp;
+    }
+
+  manifest = aprintf ("%s\nstart %s\nhead %lu %s\nqueue %lu %s %lu %s %s\n"
+                      "runs %lu%s\n",
+                      FRONTIER_MAGIC, f->start_url ? f->start_url : "-",
+                      number, head_buf, f->first_segment, offset_buf,
+                      f->last_segment, length_buf, disk_buf,
+                      f->next_run, runs);
+  xfree (runs);
+  ok = replace_file (f, "checkpoint", manifest);
+  xfree (manifest);
+  if (!ok)
+    {
+      name = frontier_file (f, "head", number);
+      unlink (name);
+      xfree (name);
+      return false;
+    }
+
+  /* The new checkpoint is in place; what the old one needed can go.  */
+  if (f->checkpoint_number)
+    make_obsolete (f, frontier_file (f, "head", f->checkpoint_number));
+  delete_obsolete (f);
+  f->checkpoint_number = number;
+
+  DEBUGP (("Checkpointed frontier: %s entries in memory, %s on disk, "
+           "%d seen runs.\n",
+           number_to_static_string (head_count),
+           number_to_static_string (f->disk_count), f->run_count));
+  return true;
+}
+
+/* Parse up to MAX space-separated numbers from S into VALUES.  Return
+   the number of values parsed.  */
+
+static int
+parse_numbers (const char *s, wgint *values, int max)
+{
+  int n = 0;
+
+  while (n < max)
+    {
+      char *end;
+      wgint v;
+
+      while (*s == ' ')
+        ++s;
+      if (!c_isdigit (*s))
+        break;
+      v = str_to_wgint (s, &end, 10);
+      values[n++] = v;
+      s = end;
+    }
+  return n;
+}
+
+/* Read the next line of FP into F's line buffer and check that it
+   begins with KEYWORD followed by a space.  Return the rest of the
+   line without the newline, or NULL.  */
+
+static char *
+read_field (struct frontier *f, FILE *fp, const char *keyword)
+{
+  size_t len = strlen (keyword);
+  ssize_t n = getline (&f->line, &f->line_size, fp);
+
+  if (n <= 0)
+    return NULL;
+  if (f->line[n - 1] == '\n')
+    f->line[n - 1] = '\0';
+  if (strncmp (f->line, keyword, len) != 0 || f->line[len] != ' ')
+    return NULL;
+  return f->line + len + 1;
+}
+
+/* Load the entries of the head file NUMBER into memory.  */
+
+static bool
+load_head (struct frontier *f, unsigned long number)
+{
+  char *name = frontier_file (f, "head", number);
+  FILE *fp = fopen (name, "rb");
+
+  if (!fp)
+    {
+      logprintf (LOG_NOTQUIET, "%s: %s\n", name, strerror (errno));
+      xfree (name);
+      return false;
+    }
+  xfree (name);
+
+  while (getline (&f->line, &f->line_size, fp) > 0)
+    {
+      struct frontier_entry *e = parse_entry (f->line);
+      if (e)
+        append_entry (f, e);
+    }
+  fclose (fp);
+  return true;
+}
+
+/* Load the state saved by the last checkpoint, if the checkpoint was
+   taken by a retrieval starting at START_URL.  Return true if the
+   frontier was resumed; otherwise, the caller should enqueue the
+   start URL.  */
+
+bool
+frontier_resume (struct frontier *f, const char *start_url)
+{
+  char *name, *field;
+  FILE *fp;
+  wgint head[2], queue[5], runs[FRONTIER_MAX_RUNS + 3];
+  int run_count, i;
+  bool same_url;
+  struct bloom *bloom;
+
+  xfree_null (f->start_url);
+  f->start_url = xstrdup (start_url);
+  if (!f->dir)
+    return false;
+
+  name = frontier_file (f, "checkpoint", -1);
+  fp = fopen (name, "rb");
+  xfree (name);
+  if (!fp)
+    return false;
+
+  if (getline (&f->line, &f->line_size, fp) <= 0
+      || strncmp (f->line, FRONTIER_MAGIC "\n", strlen (FRONTIER_MAGIC) + 1))
+    goto invalid;
+  field = read_field (f, fp, "start");
+  if (!field)
+    goto invalid;
+  same_url = !strcmp (field, start_url);
+  if (!(field = read_field (f, fp, "head"))
+      || parse_numbers (field, head, 2) != 2)
+    goto invalid;
+  /* Whatever happens, the old head file is not needed after the next
+     checkpoint.  */
+  make_obsolete (f, frontier_file (f, "head", head[0]));
+  if (!same_url)
+    {
+      logprintf (LOG_NOTQUIET, _("Ignoring the checkpoint in %s, "
+                                 "which is for another URL.\n"),
+                 quote (f->dir));
+      fclose (fp);
+      return false;
+    }
+  if (!(field = read_field (f, fp, "queue"))
+      || parse_numbers (field, queue, 5) != 5
+      || !(field = read_field (f, fp, "runs"))
+      || (run_count = parse_numbers (field, runs, countof (runs)) - 1) < 0
+      || run_count > FRONTIER_MAX_RUNS + 1)
+    goto invalid;
+  fclose (fp);
+
+  name = frontier_file (f, "bloom", -1);
+  fp = fopen (name, "rb");
+  xfree (name);
+  bloom = fp ? bloom_read (fp) : NULL;
+  if (fp)
+    fclose (fp);
+  if (!bloom)
+    goto invalid_closed;
+  bloom_free (f->bloom);
+  f->bloom = bloom;
+
+  f->next_run = runs[0];
+  for (i = 0; i < run_count; i++)
+    if (!open_run (f, runs[i + 1]))
+      goto invalid_closed;
+
+  if (!load_head (f, head[0]))
+    goto invalid_closed;
+  f->checkpoint_number = head[0];
+
+  f->first_segment = queue[0];
+  f->reader_offset = queue[1];
+  f->last_segment = queue[2];
+  f->disk_count = queue[4];
+  if (queue[3] > 0)
+    {
+      /* Drop whatever was appended to the last segment after the
+         checkpoint, and append to a new segment from now on.  */
+      name = frontier_file (f, "queue", f->last_segment);
+      if (truncate (name, queue[3]) < 0)
+        {
+          logprintf (LOG_NOTQUIET, "%s: %s\n", name, strerror (errno));
+          xfree (name);
+          goto invalid_closed;
+        }
+      xfree (name);
+      ++f->last_segment;
+    }
+
+  logprintf (LOG_VERBOSE,
+             _("Resuming from the checkpoint in %s: %s URLs queued.\n"),
+             quote (f->dir),
+             number_to_static_string (f->count + f->disk_count));
+  return true;
+
+ invalid:
+  fclose (fp);
+ invalid_closed:
+  logprintf (LOG_NOTQUIET,
+             _("The checkpoint in %s is invalid; starting over.\n"),
+             quote (f->dir));
+  /* Forget anything loaded so far.  */
+  for (i = 0; i < f->run_count; i++)
+    wget_read_file_free (f->runs[i].fm);
+  f->run_count = 0;
+  f->next_run = 0;
+  while (f->head)
+    {
+      struct frontier_entry *e = f->head;
+      f->head = e->next;
+      free_entry (e);
+    }
+  f->tail = NULL;
+  f->count = 0;
+  f->checkpoint_number = 0;
+  f->first_segment = f->last_segment = 0;
+  f->reader_offset = f->disk_count = 0;
+  bloom_free (f->bloom);
+  f->bloom = bloom_new ((unsigned long) f->memory_limit
+                        * FRONTIER_BLOOM_RATIO, 10);
+  return false;
+}
+
+/* Delete the files of a finished retrieval.  */
+
+static void
+remove_files (struct frontier *f)
+{
+  unsigned long n;
+  char *name;
+  int i;
+
+  for (n = f->first_segment; n <= f->last_segment; n++)
+    {
+      name = frontier_file (f, "queue", n);
+      unlink (name);
+      xfree (name);
+    }
+  for (i = 0; i < f->run_count; i++)
+    make_obsolete (f, frontier_file (f, "seen", f->runs[i].id));
+  if (f->checkpoint_number)
+    make_obsolete (f, frontier_file (f, "head", f->checkpoint_number));
+  make_obsolete (f, frontier_file (f, "bloom", -1));
+  make_obsolete (f, frontier_file (f, "checkpoint", -1));
+  delete_obsolete (f);
+}
+
+/* Release the frontier.  If a frontier directory is used and URLs
+   remain to be downloaded, checkpoint them first so that the
+   retrieval can be resumed; otherwise, delete the directory's
+   files.  */
+
+void
+frontier_delete (struct frontier *f)
+{
+  hash_table_iterator iter;
+  int i;
+
+  if (f->dir)
+    {
+      if (f->head || f->leased || f->disk_count)
+        {
+          if (frontier_checkpoint (f))
+            logprintf (LOG_NOTQUIET,
+                       _("Saved the state of the retrieval in %s.\n"),
+                       quote (f->dir));
+        }
+      if (f->reader)
+        fclose (f->reader);
+      if (f->writer)
+        fclose (f->writer);
+      if (!f->head && !f->leased && !f->disk_count)
+        remove_files (f);
+
+      DEBUGP (("Frontier: %s URLs spilled to disk, %d seen runs.\n",
+               number_to_static_string (f->spilled), f->run_count));
+      if (f->seen_lookups)
+        logprintf (LOG_VERBOSE, _("Seen URLs: %s lookups, "
+                                  "%.2f%% Bloom filter false positives.\n"),
+                   number_to_static_string (f->seen_lookups),
+                   false_positive_rate (f->seen_lookups, f->seen_hits,
+                                        f->seen_false_positives));
+    }
+  for (hash_table_iterate (f->seen, &iter); hash_table_iter_next (&iter); )
+    xfree (iter.key);
+
+  while (f->head)
+    {
+      struct frontier_entry *e = f->head;
+      f->head = e->next;
+      free_entry (e);
+    }
+  while (f->leased)
+    {
+      struct frontier_entry *e = f->leased;
+      f->leased = e->next;
+      free_entry (e);
+    }
+  if (f->link_lookups)
+    logprintf (LOG_VERBOSE, _("Links: %s lookups, %s skipped without parsing, "
+                              "%.2f%% Bloom filter false positives.\n"),
+               number_to_static_string (f->link_lookups),
+               number_to_static_string (f->link_hits),
+               false_positive_rate (f->link_lookups, f->link_hits,
+                                    f->link_false_positives));
+  free_links (f);
+
+  for (i = 0; i < f->run_count; i++)
+    wget_read_file_free (f->runs[i].fm);
+  xfree_null (f->runs);
+  hash_table_destroy (f->seen);
+  bloom_free (f->bloom);
+  if (f->obsolete)
+    free_vec (f->obsolete);
+  xfree_null (f->line);
+  xfree_null (f->start_url);
+  xfree_null (f->dir);
+  xfree (f);
+}
+
+#ifdef TESTING
+
+#include "test.h"
+
+const char *
+test_frontier_spill (void)
+{
+  char dir[] = "/tmp/wget-frontier-XXXXXX";
+  char url[64];
+  struct frontier *f;
+  struct iri *iri;
+  char *u, *ref;
+  int i, depth;
+  bool html, css;
+
+  mu_assert ("test_frontier_spill: mkdtemp failed", mkdtemp (dir) != NULL);
+
+  /* Two entries in memory, so that most of the queue and the seen-set
+     go to disk.  */
+  f = frontier_new (dir, 2);
+  for (i = 0; i < 50; i++)
+    {
+      sprintf (url, "http://example.com/%d", i);
+      mu_assert ("test_frontier_spill: enqueue failed",
+                 frontier_enqueue (f, iri_new (), url, NULL, i, true, false));
+      mu_assert ("test_frontier_spill: mark_seen failed",
+                 frontier_mark_seen (f, url));
+    }
+
+  for (i = 0; i < 50; i++)
+    {
+      sprintf (url, "http://example.com/%d", i);
+      mu_assert ("test_frontier_spill: URL not seen",
+                 frontier_seen_p (f, url));
+    }
+  mu_assert ("test_frontier_spill: unknown URL seen",
+             !frontier_seen_p (f, "http://example.com/x"));
+
+  for (i = 0; i < 50; i++)
+    {
+      mu_assert ("test_frontier_spill: queue ended early",
+                 frontier_dequeue (f, &iri, &u, &ref, &depth, &html, &css));
+      sprintf (url, "http://example.com/%d", i);
+      mu_assert ("test_frontier_spill: wrong order",
+                 !strcmp (u, url) && depth == i && html && !css && !ref);
+      frontier_done (f, u);
+      xfree (u);
+      iri_free (iri);
+    }
+  mu_assert ("test_frontier_spill: queue not empty",
+             !frontier_dequeue (f, &iri, &u, &ref, &depth, &html, &css));
+
+  /* Nothing is left to resume, so this removes the files.  */
+  frontier_delete (f);
+  mu_assert ("test_frontier_spill: files left behind", rmdir (dir) == 0);
+
+  return NULL;
+}
+
+const char *
+test_frontier_links (void)
+{
+  char link[64];
+  struct frontier *f;
+  int i;
+
+  /* Room for four links, so that the cache is restarted.  */
+  f = frontier_new (NULL, 4);
+  mu_assert ("test_frontier_links: unknown link seen",
+             !frontier_link_seen_p (f, "http://example.com/x"));
+
+  for (i = 0; i < 6; i++)
+    {
+      sprintf (link, "http://example.com/./%d/..", i);
+      frontier_note_link (f, link);
+      mu_assert ("test_frontier_links: seen link forgotten",
+                 frontier_link_seen_p (f, link));
+    }
+  mu_assert ("test_frontier_links: cache not restarted",
+             !frontier_link_seen_p (f, "http://example.com/./0/.."));
+
+  frontier_delete (f);
+  return NULL;
+}
+
+#endif /* TESTING */
@@ -44,7 +44,7 @@ as that of the covered work.  */
 #include "ftp.h"
 #include "retr.h"
 
-char ftp_last_respline[128];
+FTP_THREAD_LOCAL char ftp_last_respline[128];
 
 
 /* Get the response of FTP server and allocate enough room to handle
@@ -54,10 +54,15 @@ char ftp_last_respline[128];
 
    If the line is successfully read, FTPOK is returned, and *ret_line
    is assigned a freshly allocated line.  Otherwise, FTPRERR is
-   returned, and the value of *ret_line should be ignored.  */
+   returned, and the value of *ret_line should be ignored.
 
-uerr_t
-ftp_response (int fd, char **ret_line)
+   If FEATURES is non-NULL, the lines of a multi-line response that
+   start with a space, such as the features FEAT lists, are handed to
+   it along with ARG.  */
+
+static uerr_t
+ftp_response_1 (int fd, char **ret_line,
+                void (*features) (const char *, void *), void *arg)
 {
   while (1)
     {
@@ -89,10 +94,18 @@ ftp_response (int fd, char **ret_line)
           *ret_line = line;
           return FTPOK;
         }
+      if (features && *line == ' ')
+        features (line + 1, arg);
       xfree (line);
     }
 }
 
+uerr_t
+ftp_response (int fd, char **ret_line)
+{
+  return ftp_response_1 (fd, ret_line, NULL, NULL);
+}
+
 /* Returns the malloc-ed FTP request, ending with <CR><LF>, printing
    it if printing is required.  If VALUE is NULL, just use
    command<CR><LF>.  */
@@ -1030,11 +1043,81 @@ ftp_list (int csock, const char *file, bool avoid_list_a, bool avoid_list,
   return err;
 }
 
+/* Sends the MLSD command to the server, to list the current
+   directory in the machine-readable format of RFC 3659.  */
+uerr_t
+ftp_mlsd (int csock)
+{
+  char *request, *respline;
+  int nwritten;
+  uerr_t err;
+
+  request = ftp_request ("MLSD", NULL);
+  nwritten = fd_write (csock, request, strlen (request), -1);
+  if (nwritten < 0)
+    {
+      xfree (request);
+      return WRITEFAILED;
+    }
+  xfree (request);
+  /* Get appropriate response.  */
+  err = ftp_response (csock, &respline);
+  if (err != FTPOK)
+    return err;
+  if (*respline == '5')
+    err = FTPNSFOD;
+  else if (*respline != '1')
+    err = FTPRERR;
+  xfree (respline);
+  return err;
+}
+
+static void
+feat_mlsd (const char *feature, void *arg)
+{
+  /* MLSD comes with MLST, which servers advertise along with the
+     facts they support, as in "MLST type*;size*;modify*;".  */
+  if (!strncasecmp (feature, "MLST", 4)
+      && (!feature[4] || feature[4] == ' '))
+    *(bool *) arg = true;
+}
+
+/* Sends the FEAT command to the server, and sets *MLSD if the server
+   supports the MLSD command.  */
+uerr_t
+ftp_feat (int csock, bool *mlsd)
+{
+  char *request, *respline;
+  int nwritten;
+  uerr_t err;
+
+  *mlsd = false;
+  request = ftp_request ("FEAT", NULL);
+  nwritten = fd_write (csock, request, strlen (request), -1);
+  if (nwritten < 0)
+    {
+      xfree (request);
+      return WRITEFAILED;
+    }
+  xfree (request);
+  err = ftp_response_1 (csock, &respline, feat_mlsd, mlsd);
+  if (err != FTPOK)
+    return err;
+  if (*respline != '2')
+    {
+      /* Servers that predate FEAT support none of the extensions.  */
+      *mlsd = false;
+      err = FTPSRVERR;
+    }
+  xfree (respline);
+  return err;
+}
+
 /* Sends the SYST command to the server. */
 uerr_t
 ftp_syst (int csock, enum stype *server_type, enum ustype *unix_type)
 {
-  char *request, *respline;
+  char *request, *respline, *saveptr;
   int nwritten;
   uerr_t err;
 
@@ -1059,11 +1142,11 @@ ftp_syst (int csock, enum stype *server_type, enum ustype *unix_type)
     }
 
   /* Skip the number (215, but 200 (!!!) in case of VMS) */
-  strtok (respline, " ");
+  strtok_r (respline, " ", &saveptr);
 
   /* Which system type has been reported (we are interested just in the
      first word of the server response)?  */
-  request = strtok (NULL, " ");
+  request = strtok_r (NULL, " ", &saveptr);
 
   *unix_type = UST_OTHER;
 
@@ -1101,7 +1184,7 @@ ftp_syst (int csock, enum stype *server_type, enum ustype *unix_type)
 uerr_t
 ftp_pwd (int csock, char **pwd)
 {
-  char *request, *respline;
+  char *request, *respline, *saveptr;
   int nwritten;
   uerr_t err;
 
@@ -1127,8 +1210,8 @@ ftp_pwd (int csock, char **pwd)
 
   /* Skip the number (257), leading citation mark, trailing citation mark
      and everything following it. */
-  strtok (respline, "\"");
-  request = strtok (NULL, "\"");
+  strtok_r (respline, "\"", &saveptr);
+  request = strtok_r (NULL, "\"", &saveptr);
   if (!request)
     /* Treat the malformed response as an error, which the caller has
        to handle gracefully anyway.  */
@@ -43,6 +43,10 @@ as that of the covered work.  */
 #include "convert.h"            /* for html_quote_string prototype */
 #include "retr.h"               /* for output_stream */
 
+#ifdef TESTING
+#include "test.h"
+#endif
+
 /* Converts symbolic permissions to number-style ones, e.g. string
    rwxr-xr-x to 755.  For now, it knows nothing of
    setuid/setgid/sticky.  ACLs are ignored.  */
@@ -82,18 +86,44 @@ clean_line (char *line, int len)
   return len;
 }
 
-/* Convert the Un*x-ish style directory listing stored in FILE to a
-   linked list of fileinfo (system-independent) entries.  The contents
-   of FILE are considered to be produced by the standard Unix `ls -la'
+/* Copy the next line of the listing between *POS and END, with its
+   terminating newline, to *LINE, growing it as getline does, and
+   advance *POS past it.  Return the length of the line, or -1 at the
+   end of the listing.  */
+static int
+read_line (const char **pos, const char *end, char **line, size_t *bufsize)
+{
+  const char *p = *pos;
+  const char *nl;
+  int len;
+
+  if (p >= end)
+    return -1;
+  nl = memchr (p, '\n', end - p);
+  len = nl ? nl + 1 - p : end - p;
+  if (!*line || *bufsize < (size_t) len + 1)
+    {
+      *bufsize = len + 1;
+      *line = xrealloc (*line, *bufsize);
+    }
+  memcpy (*line, p, len);
+  (*line)[len] = '\0';
+  *pos = p + len;
+  return len;
+}
+
+/* Convert the Un*x-ish style directory listing of SIZE bytes at
+   LISTING to a linked list of fileinfo (system-independent) entries.
+   The contents of LISTING are considered to be produced by the standard Unix `ls -la'
    output (whatever that might be).  BSD (no group) and SYSV (with
    group) listings are handled.
 
    The time stamps are stored in a separate variable, time_t
    compatible (I hope).  The timezones are ignored.  */
 static struct fileinfo *
-ftp_parse_unix_ls (const char *file, int ignore_perms)
+ftp_parse_unix_ls (const char *listing, size_t size, int ignore_perms)
 {
-  FILE *fp;
+  const char *pos = listing, *end = listing + size;
   static const char *months[] = {
     "Jan", "Feb", "Mar", "Apr", "May", "Jun",
     "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
@@ -106,25 +136,20 @@ ftp_parse_unix_ls (const char *file, int ignore_perms)
   size_t bufsize = 0;
 
   char *line = NULL, *tok, *ptok;      /* tokenizer */
+  char *saveptr;
   struct fileinfo *dir, *l, cur; /* list creation */
 
-  fp = fopen (file, "rb");
-  if (!fp)
-    {
-      logprintf (LOG_NOTQUIET, "%s: %s\n", file, strerror (errno));
-      return NULL;
-    }
   dir = l = NULL;
 
   /* Line loop to end of file: */
-  while ((len = getline (&line, &bufsize, fp)) > 0)
+  while ((len = read_line (&pos, end, &line, &bufsize)) > 0)
     {
       len = clean_line (line, len);
       /* Skip if total...  */
       if (!strncasecmp (line, "total", 5))
         continue;
       /* Get the first token (permissions).  */
-      tok = strtok (line, " ");
+      tok = strtok_r (line, " ", &saveptr);
       if (!tok)
         continue;
 
@@ -193,7 +218,7 @@ ftp_parse_unix_ls (const char *file, int ignore_perms)
          works for now.  */
       tok = line;
       while (ptok = tok,
-             (tok = strtok (NULL, " ")) != NULL)
+             (tok = strtok_r (NULL, " ", &saveptr)) != NULL)
         {
           --next;
           if (next < 0)         /* a month name was not encountered */
@@ -414,14 +439,13 @@ ftp_parse_unix_ls (const char *file, int ignore_perms)
     }
 
   xfree (line);
-  fclose (fp);
   return dir;
 }
 
 static struct fileinfo *
-ftp_parse_winnt_ls (const char *file)
+ftp_parse_winnt_ls (const char *listing, size_t size)
 {
-  FILE *fp;
+  const char *pos = listing, *end = listing + size;
   int len;
   int year, month, day;         /* for time analysis */
   int hour, min;
@@ -429,19 +453,14 @@ ftp_parse_winnt_ls (const char *file)
   struct tm timestruct;
 
   char *line = NULL, *tok;             /* tokenizer */
+  char *saveptr;
   char *filename;
   struct fileinfo *dir, *l, cur; /* list creation */
 
-  fp = fopen (file, "rb");
-  if (!fp)
-    {
-      logprintf (LOG_NOTQUIET, "%s: %s\n", file, strerror (errno));
-      return NULL;
-    }
   dir = l = NULL;
 
   /* Line loop to end of file: */
-  while ((len = getline (&line, &bufsize, fp)) > 0)
+  while ((len = read_line (&pos, end, &line, &bufsize)) > 0)
     {
       len = clean_line (line, len);
 
@@ -455,14 +474,14 @@ ftp_parse_winnt_ls (const char *file)
 
       /* First column: mm-dd-yy or mm-dd-yyyy. Should atoi() on the month fail,
          january will be assumed.  */
-      tok = strtok(line, "-");
+      tok = strtok_r (line, "-", &saveptr);
       if (tok == NULL) continue;
       month = atoi(tok) - 1;
       if (month < 0) month = 0;
-      tok = strtok(NULL, "-");
+      tok = strtok_r (NULL, "-", &saveptr);
       if (tok == NULL) continue;
       day = atoi(tok);
-      tok = strtok(NULL, " ");
+      tok = strtok_r (NULL, " ", &saveptr);
       if (tok == NULL) continue;
       year = atoi(tok);
       /* Assuming the epoch starting at 1.1.1970 */
@@ -483,10 +502,10 @@ ftp_parse_winnt_ls (const char *file)
 
       /* Second column: hh:mm[AP]M, listing does not contain value for
          seconds */
-      tok = strtok(NULL,  ":");
+      tok = strtok_r (NULL, ":", &saveptr);
       if (tok == NULL) continue;
       hour = atoi(tok);
-      tok = strtok(NULL,  "M");
+      tok = strtok_r (NULL, "M", &saveptr);
       if (tok == NULL) continue;
       min = atoi(tok);
       /* Adjust hour from AM/PM. Just for the record, the sequence goes
@@ -517,9 +536,9 @@ ftp_parse_winnt_ls (const char *file)
          permissions (guessed as 0644 for plain files and 0755 for
          directories as the listing does not give us a clue) and filetype
          here. */
-      tok = strtok(NULL, " ");
+      tok = strtok_r (NULL, " ", &saveptr);
       if (tok == NULL) continue;
-      while ((tok != NULL) && (*tok == '\0'))  tok = strtok(NULL, " ");
+      while ((tok != NULL) && (*tok == '\0'))  tok = strtok_r (NULL, " ", &saveptr);
       if (tok == NULL) continue;
       if (*tok == '<')
         {
@@ -562,15 +581,14 @@ ftp_parse_winnt_ls (const char *file)
     }
 
   xfree (line);
-  fclose(fp);
   return dir;
 }
 
 
 
-/* Convert the VMS-style directory listing stored in "file" to a
-   linked list of fileinfo (system-independent) entries.  The contents
-   of FILE are considered to be produced by the standard VMS
+/* Convert the VMS-style directory listing of SIZE bytes at LISTING to
+   a linked list of fileinfo (system-independent) entries.  The contents
+   of LISTING are considered to be produced by the standard VMS
    "DIRECTORY [/SIZE [= ALL]] /DATE [/OWNER] [/PROTECTION]" command,
    more or less.  (Different VMS FTP servers may have different headers,
    and may not supply the same data, but all should be subsets of this.)
@@ -677,9 +695,9 @@ static void eat_carets( char *str)
 
 
 static struct fileinfo *
-ftp_parse_vms_ls (const char *file)
+ftp_parse_vms_ls (const char *listing, size_t size)
 {
-  FILE *fp;
+  const char *pos = listing, *end = listing + size;
   int dt, i, j, len;
   int perms;
   size_t bufsize = 0;
@@ -688,19 +706,14 @@ ftp_parse_vms_ls (const char *file)
   char date_str[ 32];
 
   char *line = NULL, *tok; /* tokenizer */
+  char *saveptr;
   struct fileinfo *dir, *l, cur; /* list creation */
 
-  fp = fopen (file, "r");
-  if (!fp)
-    {
-      logprintf (LOG_NOTQUIET, "%s: %s\n", file, strerror (errno));
-      return NULL;
-    }
   dir = l = NULL;
 
   /* Skip blank lines, Directory heading, and more blank lines. */
 
-  for (j = 0; (i = getline (&line, &bufsize, fp)) > 0; )
+  for (j = 0; (i = read_line (&pos, end, &line, &bufsize)) > 0; )
     {
       i = clean_line (line, i);
       if (i <= 0)
@@ -737,7 +750,7 @@ ftp_parse_vms_ls (const char *file)
          the version number (";1").
       */
 
-      tok = strtok(line, " ");
+      tok = strtok_r (line, " ", &saveptr);
       if (tok == NULL) tok = line;
       DEBUGP (("file name:   '%s'\n", tok));
 
@@ -814,11 +827,11 @@ ftp_parse_vms_ls (const char *file)
          a second line.  If needed, read the second line.
       */
 
-      tok = strtok (NULL, " ");
+      tok = strtok_r (NULL, " ", &saveptr);
       if (tok == NULL)
         {
           DEBUGP (("Getting additional line.\n"));
-          i = getline (&line, &bufsize, fp);
+          i = read_line (&pos, end, &line, &bufsize);
           if (i <= 0)
             {
               DEBUGP (("EOF.  Leaving listing parser.\n"));
@@ -842,7 +855,7 @@ ftp_parse_vms_ls (const char *file)
             }
           else
             {
-              tok = strtok (line, " ");
+              tok = strtok_r (line, " ", &saveptr);
               if (tok == NULL)
                 {
                   /* Unexpected non-empty but apparently blank line. */
@@ -939,7 +952,7 @@ ftp_parse_vms_ls (const char *file)
               DEBUGP (("Ignored (size?).\n"));
             }
 
-          tok = strtok (NULL, " ");
+          tok = strtok_r (NULL, " ", &saveptr);
         }
 
       /* Tokens exhausted.  Interpret the data, and fill in the
@@ -989,7 +1002,7 @@ ftp_parse_vms_ls (const char *file)
           l->next = NULL;
         }
 
-      i = getline (&line, &bufsize, fp);
+      i = read_line (&pos, end, &line, &bufsize);
       if (i > 0)
         {
           i = clean_line (line, i);
@@ -1002,7 +1015,6 @@ ftp_parse_vms_ls (const char *file)
     }
 
   xfree (line);
-  fclose (fp);
   return dir;
 }
 
@@ -1011,46 +1023,163 @@ ftp_parse_vms_ls (const char *file)
    the SYSTEM_TYPE. The system type should be based on the result of the
    "SYST" response of the FTP server. According to this repsonse we will
    use on of the three different listing parsers that cover the most of FTP
-   servers used nowadays.  */
+   servers used nowadays.  The listing is the SIZE bytes at LISTING.  */
 
 struct fileinfo *
-ftp_parse_ls (const char *file, const enum stype system_type)
+ftp_parse_ls (const char *listing, size_t size, const enum stype system_type)
 {
   switch (system_type)
     {
     case ST_UNIX:
-      return ftp_parse_unix_ls (file, 0);
+      return ftp_parse_unix_ls (listing, size, 0);
     case ST_WINNT:
       {
-        /* Detect whether the listing is simulating the UNIX format */
-        FILE *fp;
-        int   c;
-        fp = fopen (file, "rb");
-        if (!fp)
-        {
-          logprintf (LOG_NOTQUIET, "%s: %s\n", file, strerror (errno));
-          return NULL;
-        }
-        c = fgetc(fp);
-        fclose(fp);
-        /* If the first character of the file is '0'-'9', it's WINNT
-           format. */
-        if (c >= '0' && c <='9')
-          return ftp_parse_winnt_ls (file);
+        /* Detect whether the listing is simulating the UNIX format.
+           If the first character of the listing is '0'-'9', it's
+           WINNT format. */
+        if (size > 0 && listing[0] >= '0' && listing[0] <= '9')
+          return ftp_parse_winnt_ls (listing, size);
         else
-          return ftp_parse_unix_ls (file, 1);
+          return ftp_parse_unix_ls (listing, size, 1);
       }
     case ST_VMS:
-      return ftp_parse_vms_ls (file);
+      return ftp_parse_vms_ls (listing, size);
     case ST_MACOS:
-      return ftp_parse_unix_ls (file, 1);
+      return ftp_parse_unix_ls (listing, size, 1);
     default:
       logprintf (LOG_NOTQUIET, _("\
 Unsupported listing type, trying Unix listing parser.\n"));
-      return ftp_parse_unix_ls (file, 0);
+      return ftp_parse_unix_ls (listing, size, 0);
     }
 }
-
+
+/* Convert the MLSD listing of SIZE bytes at LISTING to a linked list
+   of fileinfo entries.  Unlike the output of LIST, MLSD output is
+   meant for machines (RFC 3659): each line holds a list of
+   "fact=value;" pairs, a space and the file name, and the time-stamps
+   are in UTC.  */
+
+struct fileinfo *
+ftp_parse_mlsd (const char *listing, size_t size)
+{
+  const char *pos = listing, *end = listing + size;
+  size_t bufsize = 0;
+  int len;
+  char *line = NULL, *saveptr;
+  struct fileinfo *dir = NULL, *l = NULL, cur;
+
+  while ((len = read_line (&pos, end, &line, &bufsize)) > 0)
+    {
+      char *facts, *name, *fact;
+      bool skip = false;
+
+      while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        line[--len] = '\0';
+
+      /* The facts end with the first "; ", or there are none and the
+         line starts with the space.  */
+      if (*line == ' ')
+        {
+          *line = '\0';
+          facts = line;
+          name = line + 1;
+        }
+      else
+        {
+          name = strstr (line, "; ");
+          if (!name)
+            continue;
+          *name = '\0';
+          name += 2;
+          facts = line;
+        }
+      if (!*name || !strcmp (name, ".") || !strcmp (name, ".."))
+        continue;
+
+      xzero (cur);
+      cur.type = FT_UNKNOWN;
+      cur.tstamp = -1;
+      cur.ptype = TT_HOUR_MIN;
+      cur.perms = -1;
+
+      for (fact = strtok_r (facts, ";", &saveptr); fact;
+           fact = strtok_r (NULL, ";", &saveptr))
+        {
+          char *value = strchr (fact, '=');
+          if (!value)
+            continue;
+          *value++ = '\0';
+          if (!strcasecmp (fact, "type"))
+            {
+              if (!strcasecmp (value, "file"))
+                cur.type = FT_PLAINFILE;
+              else if (!strcasecmp (value, "dir"))
+                cur.type = FT_DIRECTORY;
+              else if (!strcasecmp (value, "cdir")
+                       || !strcasecmp (value, "pdir"))
+                skip = true;
+              else if (!strncasecmp (value, "OS.unix=slink", 13)
+                       || !strncasecmp (value, "OS.unix=symlink", 15))
+                {
+                  /* "OS.unix=slink:TARGET", as written by some
+                     servers, names the target of the link.  */
+                  char *target = strchr (value, ':');
+                  cur.type = FT_SYMLINK;
+                  if (target && target[1])
+                    cur.linkto = xstrdup (target + 1);
+                }
+            }
+          else if (!strcasecmp (fact, "size"))
+            cur.size = str_to_wgint (value, NULL, 10);
+          else if (!strcasecmp (fact, "modify"))
+            {
+              struct tm tm;
+              xzero (tm);
+              /* YYYYMMDDHHMMSS, possibly followed by fractions.  */
+              if (sscanf (value, "%4d%2d%2d%2d%2d%2d", &tm.tm_year,
+                          &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min,
+                          &tm.tm_sec) == 6)
+                {
+                  tm.tm_year -= 1900;
+                  tm.tm_mon -= 1;
+                  cur.tstamp = timegm (&tm);
+                }
+            }
+          else if (!strcasecmp (fact, "UNIX.mode"))
+            cur.perms = strtol (value, NULL, 8);
+        }
+
+      if (skip || cur.type == FT_UNKNOWN)
+        {
+          xfree_null (cur.linkto);
+          continue;
+        }
+      if (cur.perms == -1)
+        cur.perms = cur.type == FT_DIRECTORY ? 0755 : 0644;
+      cur.name = xstrdup (name);
+      DEBUGP (("MLSD: %s, type %d, size %s, perms %0o\n", cur.name,
+               cur.type, number_to_static_string (cur.size), cur.perms));
+
+      if (!dir)
+        {
+          l = dir = xnew (struct fileinfo);
+          memcpy (l, &cur, sizeof (cur));
+          l->prev = l->next = NULL;
+        }
+      else
+        {
+          cur.prev = l;
+          l->next = xnew (struct fileinfo);
+          l = l->next;
+          memcpy (l, &cur, sizeof (cur));
+          l->next = NULL;
+        }
+    }
+
+  xfree (line);
+  return dir;
+}
+
 /* Stuff for creating FTP index. */
 
 /* The function creates an HTML index containing references to given
@@ -1067,6 +1196,8 @@ ftp_index (const char *file, struct url *u, struct fileinfo *f)
 
   if (!output_stream)
     {
+      /* The directory is no longer made for the .listing file.  */
+      mkalldirs (file);
       fp = fopen (file, "wb");
       if (!fp)
         {
@@ -1176,3 +1307,48 @@ ftp_index (const char *file, struct url *u, struct fileinfo *f)
     fflush (fp);
   return FTPOK;
 }
+
+#ifdef TESTING
+
+const char *
+test_ftp_parse_mlsd()
+{
+  static const char listing[] =
+    "type=cdir;modify=20130101000000; /pub\r\n"
+    "type=pdir;modify=20130101000000; /\r\n"
+    "type=dir;modify=20131017120000;UNIX.mode=0700; private\r\n"
+    "type=file;size=1234;modify=20131017123456.789; a file; with semi\r\n"
+    "type=OS.unix=slink:latest;modify=20131017120000; current\r\n"
+    "type=OS.foo;size=1; unknown\r\n"
+    " nofacts\r\n"
+    "type=file;size=7\r\n";
+  struct fileinfo *f, *next;
+
+  f = ftp_parse_mlsd (listing, sizeof (listing) - 1);
+
+  mu_assert ("test_ftp_parse_mlsd: missing directory",
+             f && !strcmp (f->name, "private") && f->type == FT_DIRECTORY
+             && f->perms == 0700 && f->tstamp == 1382011200);
+  f = f->next;
+  mu_assert ("test_ftp_parse_mlsd: missing file",
+             f && !strcmp (f->name, "a file; with semi")
+             && f->type == FT_PLAINFILE && f->size == 1234
+             && f->perms == 0644 && f->tstamp == 1382013296);
+  f = f->next;
+  mu_assert ("test_ftp_parse_mlsd: missing symlink",
+             f && !strcmp (f->name, "current") && f->type == FT_SYMLINK
+             && f->linkto && !strcmp (f->linkto, "latest"));
+  mu_assert ("test_ftp_parse_mlsd: unexpected entries", !f->next);
+
+  for (; f; f = next)
+    {
+      next = f->prev;
+      xfree (f->name);
+      xfree_null (f->linkto);
+      xfree (f);
+    }
+
+  return NULL;
+}
+
+#endif /* TESTING */
@@ -39,6 +39,9 @@ as that of the covered work.  */
 #include <assert.h>
 #include <errno.h>
 #include <time.h>
+#ifdef ENABLE_THREADS
+# include <pthread.h>
+#endif
 
 #include "utils.h"
 #include "url.h"
@@ -50,6 +53,8 @@ as that of the covered work.  */
 #include "convert.h"            /* for downloaded_file */
 #include "recur.h"              /* for INFINITE_RECURSION */
 #include "warc.h"
+#include "ptimer.h"
+#include "metrics.h"
 
 #ifdef __VMS
 # include "vms.h"
@@ -72,12 +77,183 @@ typedef struct
   enum stype rs;                /* remote system reported by ftp server */
   enum ustype rsu;              /* when rs is ST_UNIX, here there are more details */
   char *id;                     /* initial directory */
+  char *cwd;                    /* current directory, as in u->dir, or
+                                   NULL if unknown */
+  bool reused;                  /* the connection came from the pool */
   char *target;                 /* target file name */
   struct url *proxy;            /* FTWK-style proxy */
+  struct ftp_crawl *crawl;      /* parallel recursive retrieval, or NULL */
+  char *listing;                /* the last directory listing received */
+  size_t listing_size;          /* its size in bytes */
+  bool listing_mlsd;            /* whether it came from MLSD */
 } ccon;
 
 extern int numurls;
 
+/* Idle control connections, kept logged in for the FTP URLs that
+   follow.  Many files retrieved from one server, be they listed in an
+   input file or the ranges of a metalink download, then cost a single
+   login rather than one each.  */
+struct ftp_session {
+  char *host;                   /* the server, */
+  int port;
+  char *user;                   /* the user logged in, */
+  char *passwd;                 /* the password given, */
+  char type;                    /* and the transfer type, as set by TYPE */
+  int csock;
+  int st;                       /* the SESSION_FLAGS of ccon */
+  enum stype rs;
+  enum ustype rsu;
+  char *id;
+  char *cwd;
+  struct ftp_session *next;
+};
+
+/* The flags of ccon that describe the server rather than a transfer.  */
+#define SESSION_FLAGS (AVOID_LIST_A | AVOID_LIST                        \
+                       | LIST_AFTER_LIST_A_CHECK_DONE | FEAT_DONE | USE_MLSD)
+
+static struct ftp_session *sessions;
+static int session_count;
+
+#ifdef ENABLE_THREADS
+static pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+# define SESSIONS_LOCK pthread_mutex_lock (&sessions_mutex)
+# define SESSIONS_UNLOCK pthread_mutex_unlock (&sessions_mutex)
+#else
+# define SESSIONS_LOCK
+# define SESSIONS_UNLOCK
+#endif
+
+/* Find the user name to log in to U's server with, and the password
+   to go with it.  */
+static void
+ftp_credentials (struct url *u, const char **user, const char **passwd)
+{
+  *user = u->user;
+  *passwd = u->passwd;
+  search_netrc (u->host, user, passwd, 1);
+  *user = *user ? *user : (opt.ftp_user ? opt.ftp_user : opt.user);
+  if (!*user) *user = "anonymous";
+  *passwd = *passwd ? *passwd : (opt.ftp_passwd ? opt.ftp_passwd : opt.passwd);
+  if (!*passwd) *passwd = "-wget@";
+}
+
+static void
+ftp_session_free (struct ftp_session *s)
+{
+  fd_close (s->csock);
+  xfree (s->host);
+  xfree (s->user);
+  xfree (s->passwd);
+  xfree_null (s->id);
+  xfree_null (s->cwd);
+  xfree (s);
+}
+
+/* Hand an idle control connection to U's server over to CON, if the
+   pool has one that was logged in with the same credentials.
+   Connections the server has closed meanwhile are dropped.  */
+static void
+ftp_session_get (struct url *u, ccon *con)
+{
+  const char *user, *passwd;
+  char type = ftp_process_type (u->params);
+  struct ftp_session *s, **prev;
+
+  ftp_credentials (u, &user, &passwd);
+  while (1)
+    {
+      SESSIONS_LOCK;
+      for (prev = &sessions; (s = *prev) != NULL; prev = &s->next)
+        if (s->port == u->port && s->type == type
+            && !strcasecmp (s->host, u->host) && !strcmp (s->user, user)
+            && !strcmp (s->passwd, passwd))
+          {
+            *prev = s->next;
+            --session_count;
+            break;
+          }
+      SESSIONS_UNLOCK;
+      if (!s)
+        return;
+      if (test_socket_open (s->csock))
+        break;
+      DEBUGP (("Dropping closed FTP control connection %d.\n", s->csock));
+      ftp_session_free (s);
+    }
+
+  DEBUGP (("Reusing FTP control connection %d.\n", s->csock));
+  con->csock = s->csock;
+  con->st |= s->st;
+  con->rs = s->rs;
+  con->rsu = s->rsu;
+  con->id = s->id;
+  con->cwd = s->cwd;
+  con->reused = true;
+  xfree (s->host);
+  xfree (s->user);
+  xfree (s->passwd);
+  xfree (s);
+}
+
+/* Keep CON's control connection to U's server for later URLs, rather
+   than closing it.  The pool holds a connection per job; when it is
+   full, the connection idle for the longest is closed.  */
+static void
+ftp_session_put (struct url *u, ccon *con)
+{
+  const char *user, *passwd;
+  struct ftp_session *s = xnew0 (struct ftp_session), *old = NULL;
+
+  ftp_credentials (u, &user, &passwd);
+  s->host = xstrdup (u->host);
+  s->port = u->port;
+  s->user = xstrdup (user);
+  s->passwd = xstrdup (passwd);
+  s->type = ftp_process_type (u->params);
+  s->csock = con->csock;
+  s->st = con->st & SESSION_FLAGS;
+  s->rs = con->rs;
+  s->rsu = con->rsu;
+  s->id = con->id;
+  s->cwd = con->cwd;
+  con->csock = -1;
+  con->id = con->cwd = NULL;
+
+  SESSIONS_LOCK;
+  s->next = sessions;
+  sessions = s;
+  if (++session_count > (opt.jobs > 1 ? opt.jobs : 1))
+    {
+      struct ftp_session **prev = &sessions;
+      while ((*prev)->next)
+        prev = &(*prev)->next;
+      old = *prev;
+      *prev = NULL;
+      --session_count;
+    }
+  SESSIONS_UNLOCK;
+
+  if (old)
+    ftp_session_free (old);
+}
+
+/* Close the pooled control connections.  */
+void
+ftp_cleanup (void)
+{
+  SESSIONS_LOCK;
+  while (sessions)
+    {
+      struct ftp_session *next = sessions->next;
+      ftp_session_free (sessions);
+      sessions = next;
+    }
+  session_count = 0;
+  SESSIONS_UNLOCK;
+}
+
 /* Look for regexp "( *[0-9]+ *byte" (literal parenthesis) anywhere in
    the string S, and return the number converted to wgint, if found, 0
    otherwise.  */
@@ -237,6 +413,59 @@ print_length (wgint size, wgint start, bool authoritative)
 
 static uerr_t ftp_get_listing (struct url *, ccon *, struct fileinfo **);
 
+#ifndef MIN
+# define MIN(i, j) ((i) <= (j) ? (i) : (j))
+#endif
+
+/* Read a directory listing from the data connection FD into
+   CON->listing, replacing whatever listing was there.  The listing is
+   kept in memory for ftp_get_listing to parse; it is written to disk
+   only when the user asked to keep it.  The number of bytes read is
+   added to QTYREAD and QTYWRITTEN.  Returns 0, or -1 on read error,
+   like fd_read_body.  */
+static int
+read_listing (int fd, ccon *con, wgint *qtyread, wgint *qtywritten)
+{
+  struct ptimer *timer = ptimer_new ();
+  size_t size = 0, bufsize = 16 * 1024;
+  char *buf = xmalloc (bufsize);
+  int ret;
+
+  while (1)
+    {
+      size_t room;
+
+      if (size == bufsize)
+        {
+          if (bufsize > (size_t) -1 / 2)
+            {
+              errno = ENOMEM;
+              ret = -1;
+              break;
+            }
+          bufsize <<= 1;
+          buf = xrealloc (buf, bufsize);
+        }
+      /* fd_read takes the amount as an int.  */
+      room = MIN (bufsize - size, 1024 * 1024);
+      ret = fd_read (fd, buf + size, room, -1);
+      if (ret <= 0)
+        break;
+      size += ret;
+    }
+  con->dltime = ptimer_measure (timer);
+  ptimer_destroy (timer);
+
+  xfree_null (con->listing);
+  con->listing = buf;
+  con->listing_size = size;
+  if (qtyread)
+    *qtyread += size;
+  if (qtywritten)
+    *qtywritten += size;
+  return ret < 0 ? -1 : 0;
+}
+
 /* Retrieves a file with denoted parameters through opening an FTP
    connection to the server.  It always closes the data connection,
    and closes the control connection in case of error.  If warc_tmp
@@ -273,20 +502,22 @@ getftp (struct url *u, wgint passed_expected_bytes, wgint *qtyread,
 
   *qtyread = restval;
 
-  user = u->user;
-  passwd = u->passwd;
-  search_netrc (u->host, (const char **)&user, (const char **)&passwd, 1);
-  user = user ? user : (opt.ftp_user ? opt.ftp_user : opt.user);
-  if (!user) user = "anonymous";
-  passwd = passwd ? passwd : (opt.ftp_passwd ? opt.ftp_passwd : opt.passwd);
-  if (!passwd) passwd = "-wget@";
+  ftp_credentials (u, &user, &passwd);
 
   dtsock = -1;
   local_sock = -1;
   con->dltime = 0;
 
   if (!(cmd & DO_LOGIN))
-    csock = con->csock;
+    {
+      csock = con->csock;
+      if (con->reused)
+        {
+          logprintf (LOG_VERBOSE, _("Reusing existing connection to %s:%d.\n"),
+                     quotearg_style (escape_quoting_style, u->host), u->port);
+          con->reused = false;
+        }
+    }
   else                          /* cmd & DO_LOGIN */
     {
       char    *host = con->proxy ? con->proxy->host : u->host;
@@ -534,11 +765,15 @@ Error in server response, closing control connection.\n"));
         }
       if (!opt.server_response)
         logputs (LOG_VERBOSE, _("done.  "));
+
+      /* A new session starts out in the initial directory.  */
+      xfree_null (con->cwd);
+      con->cwd = xstrdup ("");
     } /* do login */
 
   if (cmd & DO_CWD)
     {
-      if (!*u->dir)
+      if (!*u->dir && con->cwd && !*con->cwd)
         logputs (LOG_VERBOSE, _("==> CWD not needed.\n"));
       else
         {
@@ -547,7 +782,9 @@ Error in server response, closing control connection.\n"));
           int cwd_end;
           int cwd_start;
 
-          char *target = u->dir;
+          /* An empty u->dir is the initial directory, which a reused
+             session may have left.  */
+          char *target = *u->dir ? u->dir : con->id;
 
           DEBUGP (("changing working directory\n"));
 
@@ -765,6 +1002,9 @@ Error in server response, closing control connection.\n"));
 
         } /* for */
 
+          xfree_null (con->cwd);
+          con->cwd = xstrdup (u->dir);
+
           /* 2004-09-20 SMS. */
           /* End of deviant indenting. */
 
@@ -820,6 +1060,46 @@ Error in server response, closing control connection.\n"));
       return RETRFINISHED;
     }
 
+  /* Ask the server once per session whether it speaks MLSD, whose
+     listings need no guessing at their format.  */
+  if ((cmd & DO_LIST) && !(con->st & FEAT_DONE))
+    {
+      bool mlsd;
+
+      if (!opt.server_response)
+        logputs (LOG_VERBOSE, "==> FEAT ... ");
+      err = ftp_feat (csock, &mlsd);
+      /* FTPRERR, WRITEFAILED, FTPSRVERR */
+      switch (err)
+        {
+        case FTPRERR:
+          logputs (LOG_VERBOSE, "\n");
+          logputs (LOG_NOTQUIET, _("\
+Error in server response, closing control connection.\n"));
+          fd_close (csock);
+          con->csock = -1;
+          return err;
+        case WRITEFAILED:
+          logputs (LOG_VERBOSE, "\n");
+          logputs (LOG_NOTQUIET,
+                   _("Write failed, closing control connection.\n"));
+          fd_close (csock);
+          con->csock = -1;
+          return err;
+        case FTPSRVERR:
+          /* No FEAT, no MLSD.  */
+        case FTPOK:
+          break;
+        default:
+          abort ();
+        }
+      if (!opt.server_response)
+        logputs (LOG_VERBOSE, _("done.\n"));
+      con->st |= FEAT_DONE;
+      if (mlsd)
+        con->st |= USE_MLSD;
+    }
+
   do
   {
   try_again = false;
@@ -1084,12 +1364,29 @@ Error in server response, closing control connection.\n"));
 
   if (cmd & DO_LIST)
     {
-      if (!opt.server_response)
-        logputs (LOG_VERBOSE, "==> LIST ... ");
-      /* As Maciej W. Rozycki (macro@ds2.pg.gda.pl) says, `LIST'
-         without arguments is better than `LIST .'; confirmed by
-         RFC959.  */
-      err = ftp_list (csock, NULL, con->st&AVOID_LIST_A, con->st&AVOID_LIST, &list_a_used);
+      con->listing_mlsd = false;
+      err = FTPNSFOD;
+      if (con->st & USE_MLSD)
+        {
+          if (!opt.server_response)
+            logputs (LOG_VERBOSE, "==> MLSD ... ");
+          err = ftp_mlsd (csock);
+          if (err == FTPOK)
+            con->listing_mlsd = true;
+          else if (err == FTPNSFOD && !opt.server_response)
+            logputs (LOG_VERBOSE, _("failed.\n"));
+        }
+      /* If MLSD is refused, see whether LIST fares better.  */
+      if (err == FTPNSFOD)
+        {
+          if (!opt.server_response)
+            logputs (LOG_VERBOSE, "==> LIST ... ");
+          /* As Maciej W. Rozycki (macro@ds2.pg.gda.pl) says, `LIST'
+             without arguments is better than `LIST .'; confirmed by
+             RFC959.  */
+          err = ftp_list (csock, NULL, con->st&AVOID_LIST_A,
+                          con->st&AVOID_LIST, &list_a_used);
+        }
 
       /* FTPRERR, WRITEFAILED */
       switch (err)
@@ -1166,7 +1463,10 @@ Error in server response, closing control connection.\n"));
      there allows a open failure to be detected immediately, without first
      connecting to the server.)
   */
-  if (!output_stream || con->cmd & DO_LIST)
+  if (con->cmd & DO_LIST)
+    /* Listings are read into memory, see read_listing.  */
+    fp = NULL;
+  else if (!output_stream)
     {
 /* On VMS, alter the name as required. */
 #ifdef __VMS
@@ -1315,17 +1615,21 @@ Error in server response, closing control connection.\n"));
   if (restval && rest_failed)
     flags |= rb_skip_startpos;
   rd_size = 0;
-  res = fd_read_body (u->url, dtsock, fp,
-                      expected_bytes ? expected_bytes - restval : 0,
-                      restval, &rd_size, qtyread, &con->dltime, flags, warc_tmp);
+  if (con->cmd & DO_LIST)
+    res = read_listing (dtsock, con, &rd_size, qtyread);
+  else
+    res = fd_read_body (u->url, dtsock, fp,
+                        expected_bytes ? expected_bytes - restval : 0,
+                        restval, &rd_size, qtyread, &con->dltime, flags,
+                        warc_tmp, NULL);
 
   tms = datetime_str (time (NULL));
   tmrate = retr_rate (rd_size, con->dltime);
-  total_download_time += con->dltime;
+  count_download_time (con->dltime);
 
   fd_close (local_sock);
   /* Close the local file.  */
-  if (!output_stream || con->cmd & DO_LIST)
+  if (!output_stream && !(con->cmd & DO_LIST))
     fclose (fp);
 
   /* If fd_read_body couldn't write to fp or warc_tmp, bail out.  */
@@ -1404,46 +1708,27 @@ Error in server response, closing control connection.\n"));
      print it out.  */
   if (con->cmd & DO_LIST)
     {
-      if (opt.server_response)
-        {
-/* 2005-02-25 SMS.
-   Much of this work may already have been done, but repeating it should
-   do no damage beyond wasting time.
-*/
-/* On VMS, alter the name as required. */
-#ifdef __VMS
-      char *targ;
-
-      targ = ods_conform( con->target);
-      if (targ != con->target)
+      if (opt.server_response && con->listing)
         {
-          xfree( con->target);
-          con->target = targ;
-        }
-#endif /* def __VMS */
+          const char *pos = con->listing;
+          const char *end = con->listing + con->listing_size;
 
-      mkalldirs (con->target);
-      fp = fopen (con->target, "r");
-      if (!fp)
-        logprintf (LOG_ALWAYS, "%s: %s\n", con->target, strerror (errno));
-      else
-        {
-          char *line = NULL;
-          size_t bufsize = 0;
-          ssize_t len;
-
-          /* The lines are being read with getline because of
-             no-buffering on opt.lfile.  */
-          while ((len = getline (&line, &bufsize, fp)) > 0)
+          while (pos < end)
             {
-              while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
-                line[--len] = '\0';
+              const char *eol = memchr (pos, '\n', end - pos);
+              const char *next = eol ? eol + 1 : end;
+              char *line;
+
+              if (!eol)
+                eol = end;
+              while (eol > pos && (eol[-1] == '\n' || eol[-1] == '\r'))
+                --eol;
+              line = strdupdelim (pos, eol);
               logprintf (LOG_ALWAYS, "%s\n",
                          quotearg_style (escape_quoting_style, line));
+              xfree (line);
+              pos = next;
             }
-          xfree (line);
-          fclose (fp);
-        }
         } /* server_response */
 
       /* 2013-10-17 Andrea Urbani (matfanjol)
@@ -1460,7 +1745,7 @@ Error in server response, closing control connection.\n"));
           ("LIST -a" is used to get also the hidden files)
 
           */
-      if (!(con->st & LIST_AFTER_LIST_A_CHECK_DONE))
+      if (!con->listing_mlsd && !(con->st & LIST_AFTER_LIST_A_CHECK_DONE))
         {
           /* We still have to check "LIST" after the first "LIST -a" to see
              if with "LIST" we get more data than "LIST -a", that means
@@ -1540,6 +1825,30 @@ Error in server response, closing control connection.\n"));
   return RETRFINISHED;
 }
 
+/* Write the listing last received on CON to FILE, for
+   --no-remove-listing.  */
+static uerr_t
+save_listing (ccon *con, const char *file)
+{
+  FILE *fp;
+  size_t written;
+
+  mkalldirs (file);
+  fp = fopen (file, "wb");
+  if (!fp)
+    {
+      logprintf (LOG_NOTQUIET, "%s: %s\n", file, strerror (errno));
+      return FOPENERR;
+    }
+  written = fwrite (con->listing, 1, con->listing_size, fp);
+  if (fclose (fp) != 0 || written != con->listing_size)
+    {
+      logprintf (LOG_NOTQUIET, "%s: %s\n", file, strerror (errno));
+      return FWRITEERR;
+    }
+  return RETROK;
+}
+
 /* A one-file FTP loop.  This is the part where FTP retrieval is
    retried, and retried, and retried, and...
 
@@ -1554,6 +1863,7 @@ ftp_loop_internal (struct url *u, struct fileinfo *f, ccon *con, char **local_fi
   const char *tmrate = NULL;
   uerr_t err;
   struct_stat st;
+  bool in_memory;
 
   /* Declare WARC variables. */
   bool warc_enabled = (opt.warc_filename != NULL);
@@ -1591,8 +1901,10 @@ ftp_loop_internal (struct url *u, struct fileinfo *f, ccon *con, char **local_fi
       return RETROK;
     }
 
-  /* Remove it if it's a link.  */
-  remove_link (con->target);
+  /* Remove it if it's a link.  Listings stay in memory unless they
+     are to be kept.  */
+  if (!(con->cmd & DO_LIST) || !opt.remove_listing)
+    remove_link (con->target);
 
   count = 0;
 
@@ -1606,15 +1918,18 @@ ftp_loop_internal (struct url *u, struct fileinfo *f, ccon *con, char **local_fi
     {
       /* Increment the pass counter.  */
       ++count;
+      if (count > 1)
+        metrics_add (METRIC_RETRIES, 1);
       sleep_between_retrievals (count);
       if (con->st & ON_YOUR_OWN)
         {
           con->cmd = 0;
           con->cmd |= (DO_RETR | LEAVE_PENDING);
-          if (con->csock != -1)
-            con->cmd &= ~ (DO_LOGIN | DO_CWD);
-          else
+          if (con->csock == -1)
             con->cmd |= (DO_LOGIN | DO_CWD);
+          else if (!con->cwd || strcmp (con->cwd, u->dir))
+            /* A session from the pool may be elsewhere.  */
+            con->cmd |= DO_CWD;
         }
       else /* not on your own */
         {
@@ -1749,16 +2064,27 @@ ftp_loop_internal (struct url *u, struct fileinfo *f, ccon *con, char **local_fi
       if (!opt.spider)
         tmrate = retr_rate (qtyread - restval, con->dltime);
 
-      /* If we get out of the switch above without continue'ing, we've
-         successfully downloaded a file.  Remember this fact. */
-      downloaded_file (FILE_DOWNLOADED_NORMALLY, locf);
-
-      if (con->st & ON_YOUR_OWN)
+      /* A listing is only written out when it is to be kept.  */
+      in_memory = (con->cmd & DO_LIST) && opt.remove_listing;
+      if (in_memory)
+        logprintf (LOG_VERBOSE, _("%s (%s) - listing of %s received [%s]\n\n"),
+                   tms, tmrate, quote (*u->dir ? u->dir : "/"),
+                   number_to_static_string (qtyread));
+      else
         {
-          fd_close (con->csock);
-          con->csock = -1;
+          if (con->cmd & DO_LIST)
+            {
+              err = save_listing (con, locf);
+              if (err != RETROK)
+                return err;
+            }
+          /* If we get out of the switch above without continue'ing,
+             we've successfully downloaded a file.  Remember this
+             fact. */
+          downloaded_file (FILE_DOWNLOADED_NORMALLY, locf);
         }
-      if (!opt.spider)
+
+      if (!opt.spider && !in_memory)
         {
           bool write_to_stdout = (opt.output_document && HYPHENP (opt.output_document));
 
@@ -1770,7 +2096,7 @@ ftp_loop_internal (struct url *u, struct fileinfo *f, ccon *con, char **local_fi
                      write_to_stdout ? "" : quote (locf),
                      number_to_static_string (qtyread));
         }
-      if (!opt.verbose && !opt.quiet)
+      if (!opt.verbose && !opt.quiet && !in_memory)
         {
           /* Need to hide the password from the URL.  The `if' is here
              so that we don't do the needless allocation every
@@ -1801,8 +2127,8 @@ ftp_loop_internal (struct url *u, struct fileinfo *f, ccon *con, char **local_fi
             /* --dont-remove-listing was specified, so do count this towards the
                number of bytes and files downloaded. */
             {
-              total_downloaded_bytes += qtyread;
-              numurls++;
+              count_downloads (1, qtyread);
+              metrics_add_file (u->host, qtyread);
             }
 
           /* Deletion of listing files is not controlled by --delete-after, but
@@ -1816,8 +2142,8 @@ ftp_loop_internal (struct url *u, struct fileinfo *f, ccon *con, char **local_fi
              downloaded if they're going to be deleted.  People seeding proxies,
              for instance, may want to know how many bytes and files they've
              downloaded through it. */
-          total_downloaded_bytes += qtyread;
-          numurls++;
+          count_downloads (1, qtyread);
+          metrics_add_file (u->host, qtyread);
 
           if (opt.delete_after && !input_file_url (opt.input_filename))
             {
@@ -1880,58 +2206,95 @@ ftp_get_listing (struct url *u, ccon *con, struct fileinfo **f)
 
   if (err == RETROK)
     {
-      *f = ftp_parse_ls (lf, con->rs);
-      if (opt.remove_listing)
-        {
-          if (unlink (lf))
-            logprintf (LOG_NOTQUIET, "unlink: %s\n", strerror (errno));
-          else
-            logprintf (LOG_VERBOSE, _("Removed %s.\n"), quote (lf));
-        }
+      if (con->listing_mlsd)
+        *f = ftp_parse_mlsd (con->listing, con->listing_size);
+      else
+        *f = ftp_parse_ls (con->listing, con->listing_size, con->rs);
     }
   else
     *f = NULL;
   xfree (lf);
+  xfree_null (con->listing);
+  con->listing = NULL;
+  con->listing_size = 0;
   con->cmd &= ~DO_LIST;
   return err;
 }
 
-static uerr_t ftp_retrieve_dirs (struct url *, struct fileinfo *, ccon *);
-static uerr_t ftp_retrieve_glob (struct url *, ccon *, int);
+static uerr_t ftp_retrieve_dirs (struct url *, struct fileinfo *, ccon *, int);
+static uerr_t ftp_retrieve_glob (struct url *, ccon *, int, int);
 static struct fileinfo *delelement (struct fileinfo *, struct fileinfo **);
 static void freefileinfo (struct fileinfo *f);
 
-/* Retrieve a list of files given in struct fileinfo linked list.  If
-   a file is a symbolic link, do not retrieve it, but rather try to
-   set up a similar link on the local disk, if the symlinks are
-   supported.
+#ifdef ENABLE_THREADS
+/* Parallel recursive retrieval.
+
+   With --jobs, a recursive retrieval does not walk the directory tree
+   on a single control connection.  The directories found in listings
+   and the files that need transferring are queued as jobs instead,
+   and served by several workers, each logged in on a control
+   connection of its own.  The connections are capped by
+   --ftp-connections, as FTP servers commonly limit the number of
+   sessions a client may open.  */
+
+struct ftp_job {
+  char *dir;                    /* the directory, as in u->dir */
+  struct fileinfo *f;           /* file to retrieve, or NULL to retrieve
+                                   the directory listing */
+  int depth;                    /* recursion depth of the directory */
+  struct ftp_job *next;
+};
+
+struct ftp_crawl {
+  char *url;                    /* URL the retrieval started from */
+  struct url *proxy;            /* FTWK-style proxy */
+  enum stype rs;                /* remote system, as found at login */
+  enum ustype rsu;
 
-   If opt.recursive is set, after all files have been retrieved,
-   ftp_retrieve_dirs will be called to retrieve the directories.  */
-static uerr_t
-ftp_retrieve_list (struct url *u, struct fileinfo *f, ccon *con)
+  struct ftp_job *head, *tail;  /* queued jobs */
+  int busy;                     /* number of workers running a job */
+  bool stop;                    /* a fatal error or the quota stopped us */
+  uerr_t err;                   /* the error that did */
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;          /* signals new jobs and the end */
+};
+
+/* Queue the retrieval of F from the directory DIR, or of the
+   directory DIR itself if F is NULL.  */
+static void
+ftp_crawl_push (struct ftp_crawl *crawl, const char *dir,
+                const struct fileinfo *f, int depth)
 {
-  static int depth = 0;
-  uerr_t err;
-  struct fileinfo *orig;
-  wgint local_size;
-  time_t tml;
-  bool dlthis; /* Download this (file). */
-  const char *actual_target = NULL;
+  struct ftp_job *job = xnew0 (struct ftp_job);
 
-  /* Increase the depth.  */
-  ++depth;
-  if (opt.reclevel != INFINITE_RECURSION && depth > opt.reclevel)
+  job->dir = xstrdup (dir);
+  job->depth = depth;
+  if (f)
     {
-      DEBUGP ((_("Recursion depth %d exceeded max. depth %d.\n"),
-               depth, opt.reclevel));
-      --depth;
-      return RECLEVELEXC;
+      job->f = xnew (struct fileinfo);
+      *job->f = *f;
+      job->f->name = xstrdup (f->name);
+      job->f->linkto = f->linkto ? xstrdup (f->linkto) : NULL;
+      job->f->prev = job->f->next = NULL;
     }
 
-  assert (f != NULL);
-  orig = f;
+  pthread_mutex_lock (&crawl->mutex);
+  if (crawl->tail)
+    crawl->tail->next = job;
+  else
+    crawl->head = job;
+  crawl->tail = job;
+  pthread_cond_signal (&crawl->cond);
+  pthread_mutex_unlock (&crawl->mutex);
+}
+#endif /* ENABLE_THREADS */
 
+/* Set up CON to retrieve files from the directory u->dir, logging in
+   and changing the directory first if need be.  */
+static void
+prepare_retr (ccon *con)
+{
   con->st &= ~ON_YOUR_OWN;
   if (!(con->st & DONE_CWD))
     con->cmd |= DO_CWD;
@@ -1943,199 +2306,256 @@ ftp_retrieve_list (struct url *u, struct fileinfo *f, ccon *con)
     con->cmd |= DO_LOGIN;
   else
     con->cmd &= ~DO_LOGIN;
+}
 
-  err = RETROK;                 /* in case it's not used */
+/* Return true if ERR should stop the retrieval of a file list.  */
+static bool
+ftp_fatal_p (uerr_t err)
+{
+  return (err == QUOTEXC || err == HOSTERR || err == FWRITEERR
+          || err == WARC_ERR || err == WARC_TMP_FOPENERR
+          || err == WARC_TMP_FWRITEERR);
+}
 
-  while (f)
-    {
-      char *old_target, *ofile;
+/* Retrieve the file F from the directory u->dir.  If F is a symbolic
+   link, do not retrieve it, but rather try to set up a similar link
+   on the local disk, if the symlinks are supported.  */
+static uerr_t
+ftp_retrieve_file (struct url *u, struct fileinfo *f, ccon *con)
+{
+  uerr_t err;
+  wgint local_size;
+  time_t tml;
+  bool dlthis; /* Download this (file). */
+  const char *actual_target = NULL;
+  char *old_target, *ofile;
 
-      if (opt.quota && total_downloaded_bytes > opt.quota)
-        {
-          --depth;
-          return QUOTEXC;
-        }
-      old_target = con->target;
+  old_target = con->target;
 
-      ofile = xstrdup (u->file);
-      url_set_file (u, f->name);
+  ofile = xstrdup (u->file);
+  url_set_file (u, f->name);
 
-      con->target = url_file_name (u, NULL);
-      err = RETROK;
+  con->target = url_file_name (u, NULL);
+  err = RETROK;
 
-      dlthis = true;
-      if (opt.timestamping && f->type == FT_PLAINFILE)
+  dlthis = true;
+  if (opt.timestamping && f->type == FT_PLAINFILE)
+    {
+      struct_stat st;
+      /* If conversion of HTML files retrieved via FTP is ever implemented,
+         we'll need to stat() <file>.orig here when -K has been specified.
+         I'm not implementing it now since files on an FTP server are much
+         more likely than files on an HTTP server to legitimately have a
+         .orig suffix. */
+      if (!stat (con->target, &st))
         {
-          struct_stat st;
-          /* If conversion of HTML files retrieved via FTP is ever implemented,
-             we'll need to stat() <file>.orig here when -K has been specified.
-             I'm not implementing it now since files on an FTP server are much
-             more likely than files on an HTTP server to legitimately have a
-             .orig suffix. */
-          if (!stat (con->target, &st))
-            {
-              bool eq_size;
-              bool cor_val;
-              /* Else, get it from the file.  */
-              local_size = st.st_size;
-              tml = st.st_mtime;
+          bool eq_size;
+          bool cor_val;
+          /* Else, get it from the file.  */
+          local_size = st.st_size;
+          tml = st.st_mtime;
 #ifdef WINDOWS
-              /* Modification time granularity is 2 seconds for Windows, so
-                 increase local time by 1 second for later comparison. */
-              tml++;
+          /* Modification time granularity is 2 seconds for Windows, so
+             increase local time by 1 second for later comparison. */
+          tml++;
 #endif
-              /* Compare file sizes only for servers that tell us correct
-                 values. Assume sizes being equal for servers that lie
-                 about file size.  */
-              cor_val = (con->rs == ST_UNIX || con->rs == ST_WINNT);
-              eq_size = cor_val ? (local_size == f->size) : true;
-              if (f->tstamp <= tml && eq_size)
-                {
-                  /* Remote file is older, file sizes can be compared and
-                     are both equal. */
-                  logprintf (LOG_VERBOSE, _("\
+          /* Compare file sizes only for servers that tell us correct
+             values. Assume sizes being equal for servers that lie
+             about file size.  */
+          cor_val = (con->rs == ST_UNIX || con->rs == ST_WINNT);
+          eq_size = cor_val ? (local_size == f->size) : true;
+          if (f->tstamp <= tml && eq_size)
+            {
+              /* Remote file is older, file sizes can be compared and
+                 are both equal. */
+              logprintf (LOG_VERBOSE, _("\
 Remote file no newer than local file %s -- not retrieving.\n"), quote (con->target));
-                  dlthis = false;
-                }
-              else if (eq_size)
-                {
-                  /* Remote file is newer or sizes cannot be matched */
-                  logprintf (LOG_VERBOSE, _("\
+              dlthis = false;
+            }
+          else if (eq_size)
+            {
+              /* Remote file is newer or sizes cannot be matched */
+              logprintf (LOG_VERBOSE, _("\
 Remote file is newer than local file %s -- retrieving.\n\n"),
-                             quote (con->target));
-                }
-              else
-                {
-                  /* Sizes do not match */
-                  logprintf (LOG_VERBOSE, _("\
+                         quote (con->target));
+            }
+          else
+            {
+              /* Sizes do not match */
+              logprintf (LOG_VERBOSE, _("\
 The sizes do not match (local %s) -- retrieving.\n\n"),
-                             number_to_static_string (local_size));
-                }
+                         number_to_static_string (local_size));
             }
-        }       /* opt.timestamping && f->type == FT_PLAINFILE */
-      switch (f->type)
+        }
+    }       /* opt.timestamping && f->type == FT_PLAINFILE */
+  switch (f->type)
+    {
+    case FT_SYMLINK:
+      /* If opt.retr_symlinks is defined, we treat symlinks as
+         if they were normal files.  There is currently no way
+         to distinguish whether they might be directories, and
+         follow them.  */
+      if (!opt.retr_symlinks)
         {
-        case FT_SYMLINK:
-          /* If opt.retr_symlinks is defined, we treat symlinks as
-             if they were normal files.  There is currently no way
-             to distinguish whether they might be directories, and
-             follow them.  */
-          if (!opt.retr_symlinks)
-            {
 #ifdef HAVE_SYMLINK
-              if (!f->linkto)
-                logputs (LOG_NOTQUIET,
-                         _("Invalid name of the symlink, skipping.\n"));
-              else
+          if (!f->linkto)
+            logputs (LOG_NOTQUIET,
+                     _("Invalid name of the symlink, skipping.\n"));
+          else
+            {
+              struct_stat st;
+              /* Check whether we already have the correct
+                 symbolic link.  */
+              int rc = lstat (con->target, &st);
+              if (rc == 0)
                 {
-                  struct_stat st;
-                  /* Check whether we already have the correct
-                     symbolic link.  */
-                  int rc = lstat (con->target, &st);
-                  if (rc == 0)
+                  size_t len = strlen (f->linkto) + 1;
+                  if (S_ISLNK (st.st_mode))
                     {
-                      size_t len = strlen (f->linkto) + 1;
-                      if (S_ISLNK (st.st_mode))
+                      char *link_target = (char *)alloca (len);
+                      size_t n = readlink (con->target, link_target, len);
+                      if ((n == len - 1)
+                          && (memcmp (link_target, f->linkto, n) == 0))
                         {
-                          char *link_target = (char *)alloca (len);
-                          size_t n = readlink (con->target, link_target, len);
-                          if ((n == len - 1)
-                              && (memcmp (link_target, f->linkto, n) == 0))
-                            {
-                              logprintf (LOG_VERBOSE, _("\
+                          logprintf (LOG_VERBOSE, _("\
 Already have correct symlink %s -> %s\n\n"),
-                                         quote (con->target),
-                                         quote (f->linkto));
-                              dlthis = false;
-                              break;
-                            }
+                                     quote (con->target),
+                                     quote (f->linkto));
+                          dlthis = false;
+                          break;
                         }
                     }
-                  logprintf (LOG_VERBOSE, _("Creating symlink %s -> %s\n"),
-                             quote (con->target), quote (f->linkto));
-                  /* Unlink before creating symlink!  */
-                  unlink (con->target);
-                  if (symlink (f->linkto, con->target) == -1)
-                    logprintf (LOG_NOTQUIET, "symlink: %s\n", strerror (errno));
-                  logputs (LOG_VERBOSE, "\n");
-                } /* have f->linkto */
+                }
+              logprintf (LOG_VERBOSE, _("Creating symlink %s -> %s\n"),
+                         quote (con->target), quote (f->linkto));
+              /* Unlink before creating symlink!  */
+              unlink (con->target);
+              if (symlink (f->linkto, con->target) == -1)
+                logprintf (LOG_NOTQUIET, "symlink: %s\n", strerror (errno));
+              logputs (LOG_VERBOSE, "\n");
+            } /* have f->linkto */
 #else  /* not HAVE_SYMLINK */
-              logprintf (LOG_NOTQUIET,
-                         _("Symlinks not supported, skipping symlink %s.\n"),
-                         quote (con->target));
+          logprintf (LOG_NOTQUIET,
+                     _("Symlinks not supported, skipping symlink %s.\n"),
+                     quote (con->target));
 #endif /* not HAVE_SYMLINK */
-            }
-          else                /* opt.retr_symlinks */
-            {
-              if (dlthis)
-                err = ftp_loop_internal (u, f, con, NULL, NULL);
-            } /* opt.retr_symlinks */
-          break;
-        case FT_DIRECTORY:
-          if (!opt.recursive)
-            logprintf (LOG_NOTQUIET, _("Skipping directory %s.\n"),
-                       quote (f->name));
-          break;
-        case FT_PLAINFILE:
-          /* Call the retrieve loop.  */
+        }
+      else                /* opt.retr_symlinks */
+        {
           if (dlthis)
             err = ftp_loop_internal (u, f, con, NULL, NULL);
-          break;
-        case FT_UNKNOWN:
-          logprintf (LOG_NOTQUIET, _("%s: unknown/unsupported file type.\n"),
-                     quote (f->name));
-          break;
-        }       /* switch */
+        } /* opt.retr_symlinks */
+      break;
+    case FT_DIRECTORY:
+      if (!opt.recursive)
+        logprintf (LOG_NOTQUIET, _("Skipping directory %s.\n"),
+                   quote (f->name));
+      break;
+    case FT_PLAINFILE:
+      /* Call the retrieve loop.  */
+      if (dlthis)
+        err = ftp_loop_internal (u, f, con, NULL, NULL);
+      break;
+    case FT_UNKNOWN:
+      logprintf (LOG_NOTQUIET, _("%s: unknown/unsupported file type.\n"),
+                 quote (f->name));
+      break;
+    }       /* switch */
+
 
+  /* 2004-12-15 SMS.
+   * Set permissions _before_ setting the times, as setting the
+   * permissions changes the modified-time, at least on VMS.
+   * Also, use the opt.output_document name here, too, as
+   * appropriate.  (Do the test once, and save the result.)
+   */
 
-      /* 2004-12-15 SMS.
-       * Set permissions _before_ setting the times, as setting the
-       * permissions changes the modified-time, at least on VMS.
-       * Also, use the opt.output_document name here, too, as
-       * appropriate.  (Do the test once, and save the result.)
-       */
+  set_local_file (&actual_target, con->target);
 
-      set_local_file (&actual_target, con->target);
+  /* If downloading a plain file, and the user requested it, then
+     set valid (non-zero) permissions. */
+  if (dlthis && (actual_target != NULL) &&
+   (f->type == FT_PLAINFILE) && opt.preserve_perm)
+    {
+      if (f->perms)
+        chmod (actual_target, f->perms);
+      else
+        DEBUGP (("Unrecognized permissions for %s.\n", actual_target));
+    }
 
-      /* If downloading a plain file, and the user requested it, then
-         set valid (non-zero) permissions. */
-      if (dlthis && (actual_target != NULL) &&
-       (f->type == FT_PLAINFILE) && opt.preserve_perm)
+  /* Set the time-stamp information to the local file.  Symlinks
+     are not to be stamped because it sets the stamp on the
+     original.  :( */
+  if (actual_target != NULL)
+    {
+      if (opt.useservertimestamps
+          && !(f->type == FT_SYMLINK && !opt.retr_symlinks)
+          && f->tstamp != -1
+          && dlthis
+          && file_exists_p (con->target))
         {
-          if (f->perms)
-            chmod (actual_target, f->perms);
-          else
-            DEBUGP (("Unrecognized permissions for %s.\n", actual_target));
+          touch (actual_target, f->tstamp);
         }
+      else if (f->tstamp == -1)
+        logprintf (LOG_NOTQUIET, _("%s: corrupt time-stamp.\n"),
+                   actual_target);
+    }
+
+  xfree (con->target);
+  con->target = old_target;
+
+  url_set_file (u, ofile);
+  xfree (ofile);
+
+  return err;
+}
+
+/* Retrieve a list of files given in struct fileinfo linked list,
+   DEPTH levels below the starting directory.
+
+   If opt.recursive is set, after all files have been retrieved,
+   ftp_retrieve_dirs will be called to retrieve the directories.  */
+static uerr_t
+ftp_retrieve_list (struct url *u, struct fileinfo *f, ccon *con, int depth)
+{
+  uerr_t err;
+  struct fileinfo *orig;
+
+  if (opt.reclevel != INFINITE_RECURSION && depth > opt.reclevel)
+    {
+      DEBUGP ((_("Recursion depth %d exceeded max. depth %d.\n"),
+               depth, opt.reclevel));
+      return RECLEVELEXC;
+    }
+
+  assert (f != NULL);
+  orig = f;
+
+  prepare_retr (con);
+
+  err = RETROK;                 /* in case it's not used */
+
+  while (f)
+    {
+      if (opt.quota && total_downloaded_bytes > opt.quota)
+        return QUOTEXC;
 
-      /* Set the time-stamp information to the local file.  Symlinks
-         are not to be stamped because it sets the stamp on the
-         original.  :( */
-      if (actual_target != NULL)
+#ifdef ENABLE_THREADS
+      /* In a parallel retrieval, leave the transfers to the workers.  */
+      if (con->crawl
+          && (f->type == FT_PLAINFILE
+              || (f->type == FT_SYMLINK && opt.retr_symlinks)))
         {
-          if (opt.useservertimestamps
-              && !(f->type == FT_SYMLINK && !opt.retr_symlinks)
-              && f->tstamp != -1
-              && dlthis
-              && file_exists_p (con->target))
-            {
-              touch (actual_target, f->tstamp);
-            }
-          else if (f->tstamp == -1)
-            logprintf (LOG_NOTQUIET, _("%s: corrupt time-stamp.\n"),
-                       actual_target);
+          ftp_crawl_push (con->crawl, u->dir, f, depth);
+          f = f->next;
+          continue;
         }
+#endif
 
-      xfree (con->target);
-      con->target = old_target;
-
-      url_set_file (u, ofile);
-      xfree (ofile);
+      err = ftp_retrieve_file (u, f, con);
 
       /* Break on fatals.  */
-      if (err == QUOTEXC || err == HOSTERR || err == FWRITEERR
-          || err == WARC_ERR || err == WARC_TMP_FOPENERR
-          || err == WARC_TMP_FWRITEERR)
+      if (ftp_fatal_p (err))
         break;
       con->cmd &= ~ (DO_CWD | DO_LOGIN);
       f = f->next;
@@ -2144,11 +2564,10 @@ Already have correct symlink %s -> %s\n\n"),
   /* We do not want to call ftp_retrieve_dirs here */
   if (opt.recursive &&
       !(opt.reclevel != INFINITE_RECURSION && depth >= opt.reclevel))
-    err = ftp_retrieve_dirs (u, orig, con);
+    err = ftp_retrieve_dirs (u, orig, con, depth);
   else if (opt.recursive)
     DEBUGP ((_("Will not retrieve dirs since depth is %d (max %d).\n"),
              depth, opt.reclevel));
-  --depth;
   return err;
 }
 
@@ -2157,7 +2576,7 @@ Already have correct symlink %s -> %s\n\n"),
    ftp_retrieve_glob on each directory entry.  The function knows
    about excluded directories.  */
 static uerr_t
-ftp_retrieve_dirs (struct url *u, struct fileinfo *f, ccon *con)
+ftp_retrieve_dirs (struct url *u, struct fileinfo *f, ccon *con, int depth)
 {
   char *container = NULL;
   int container_size = 0;
@@ -2202,12 +2621,20 @@ Not descending to %s as it is excluded/not-included.\n"),
           continue;
         }
 
+#ifdef ENABLE_THREADS
+      if (con->crawl)
+        {
+          ftp_crawl_push (con->crawl, newdir, NULL, depth + 1);
+          continue;
+        }
+#endif
+
       con->st &= ~DONE_CWD;
 
       odir = xstrdup (u->dir);  /* because url_set_dir will free
                                    u->dir. */
       url_set_dir (u, newdir);
-      ftp_retrieve_glob (u, con, GLOB_GETALL);
+      ftp_retrieve_glob (u, con, GLOB_GETALL, depth + 1);
       url_set_dir (u, odir);
       xfree (odir);
 
@@ -2241,9 +2668,9 @@ has_insecure_name_p (const char *s)
    If the argument ACTION is GLOB_GETONE, just download the file (but
    first get the listing, so that the time-stamp is heeded); if it's
    GLOB_GLOBALL, use globbing; if it's GLOB_GETALL, download the whole
-   directory.  */
+   directory.  DEPTH is the recursion depth of the directory.  */
 static uerr_t
-ftp_retrieve_glob (struct url *u, ccon *con, int action)
+ftp_retrieve_glob (struct url *u, ccon *con, int action, int depth)
 {
   struct fileinfo *f, *start;
   uerr_t res;
@@ -2346,7 +2773,7 @@ ftp_retrieve_glob (struct url *u, ccon *con, int action)
   if (start)
     {
       /* Just get everything.  */
-      res = ftp_retrieve_list (u, start, con);
+      res = ftp_retrieve_list (u, start, con, depth);
     }
   else
     {
@@ -2378,6 +2805,166 @@ ftp_retrieve_glob (struct url *u, ccon *con, int action)
     return res;
 }
 
+#ifdef ENABLE_THREADS
+/* Return the number of connections a parallel retrieval may use.  */
+static int
+ftp_crawl_connections (void)
+{
+  int n = opt.jobs;
+  if (opt.ftp_connections > 0 && n > opt.ftp_connections)
+    n = opt.ftp_connections;
+  return n;
+}
+
+static void
+ftp_job_free (struct ftp_job *job)
+{
+  xfree (job->dir);
+  freefileinfo (job->f);
+  xfree (job);
+}
+
+/* Run the jobs queued in CRAWL on the connection CON, until the queue
+   drains or the retrieval stops.  U is the worker's own URL.  */
+static void
+ftp_crawl_work (struct ftp_crawl *crawl, ccon *con, struct url *u)
+{
+  pthread_mutex_lock (&crawl->mutex);
+  while (1)
+    {
+      struct ftp_job *job;
+      uerr_t err;
+
+      while (!crawl->head && crawl->busy && !crawl->stop)
+        pthread_cond_wait (&crawl->cond, &crawl->mutex);
+      if (crawl->stop || !crawl->head)
+        break;
+      job = crawl->head;
+      crawl->head = job->next;
+      if (!crawl->head)
+        crawl->tail = NULL;
+      crawl->busy++;
+      pthread_mutex_unlock (&crawl->mutex);
+
+      if (opt.quota && total_downloaded_bytes > opt.quota)
+        err = QUOTEXC;
+      else
+        {
+          if (!con->cwd || strcmp (con->cwd, job->dir))
+            con->st &= ~DONE_CWD;
+          url_set_dir (u, job->dir);
+          if (job->f)
+            {
+              prepare_retr (con);
+              err = ftp_retrieve_file (u, job->f, con);
+            }
+          else
+            err = ftp_retrieve_glob (u, con, GLOB_GETALL, job->depth);
+        }
+      ftp_job_free (job);
+
+      pthread_mutex_lock (&crawl->mutex);
+      crawl->busy--;
+      if (ftp_fatal_p (err) && !crawl->stop)
+        {
+          crawl->stop = true;
+          crawl->err = err;
+        }
+      if (crawl->stop || (!crawl->head && !crawl->busy))
+        pthread_cond_broadcast (&crawl->cond);
+    }
+  pthread_mutex_unlock (&crawl->mutex);
+}
+
+/* The start routine of the worker threads, which log in on their own
+   connections.  */
+static void *
+ftp_crawl_thread (void *arg)
+{
+  struct ftp_crawl *crawl = (struct ftp_crawl *) arg;
+  struct url *u = url_parse (crawl->url, NULL, NULL, false);
+  ccon con;
+
+  if (!u)
+    return NULL;
+
+  xzero (con);
+  con.csock = -1;
+  con.rs = crawl->rs;
+  con.rsu = crawl->rsu;
+  con.proxy = crawl->proxy;
+  con.crawl = crawl;
+
+  ftp_crawl_work (crawl, &con, u);
+
+  if (con.csock != -1 && !con.proxy)
+    ftp_session_put (u, &con);
+  else if (con.csock != -1)
+    fd_close (con.csock);
+  xfree_null (con.id);
+  xfree_null (con.cwd);
+  url_free (u);
+  return NULL;
+}
+
+/* Retrieve the jobs ftp_retrieve_glob queued in CRAWL for the URL U,
+   which was listed on the connection CON.  CON serves jobs as well,
+   alongside the worker threads.  */
+static uerr_t
+ftp_crawl_run (struct ftp_crawl *crawl, ccon *con, struct url *u)
+{
+  int n_threads = ftp_crawl_connections () - 1;
+  pthread_t *threads;
+  char *odir, *ofile;
+  int i, started = 0;
+
+  if (!crawl->head)
+    return RETROK;
+
+  crawl->url = xstrdup (u->url);
+  crawl->rs = con->rs;
+  crawl->rsu = con->rsu;
+
+  threads = xnew_array (pthread_t, n_threads);
+  for (i = 0; i < n_threads; i++)
+    {
+      int err = pthread_create (&threads[started], NULL, ftp_crawl_thread,
+                                crawl);
+      if (err)
+        {
+          logprintf (LOG_NOTQUIET, "pthread_create: %s\n", strerror (err));
+          break;
+        }
+      started++;
+    }
+  DEBUGP (("Retrieving %s on %d connections.\n", u->url, started + 1));
+
+  odir = xstrdup (u->dir);
+  ofile = xstrdup (u->file);
+  ftp_crawl_work (crawl, con, u);
+  url_set_dir (u, odir);
+  url_set_file (u, ofile);
+  xfree (odir);
+  xfree (ofile);
+
+  for (i = 0; i < started; i++)
+    pthread_join (threads[i], NULL);
+  xfree (threads);
+
+  /* A stopped retrieval leaves jobs behind.  */
+  while (crawl->head)
+    {
+      struct ftp_job *next = crawl->head->next;
+      ftp_job_free (crawl->head);
+      crawl->head = next;
+    }
+  crawl->tail = NULL;
+  xfree_null (crawl->url);
+
+  return crawl->stop ? crawl->err : RETROK;
+}
+#endif /* ENABLE_THREADS */
+
 /* The wrapper that calls an appropriate routine according to contents
    of URL.  Inherently, its capabilities are limited on what can be
    encoded into a URL.  */
@@ -2387,6 +2974,9 @@ ftp_loop (struct url *u, char **local_file, int *dt, struct url *proxy,
 {
   ccon con;                     /* FTP connection */
   uerr_t res;
+#ifdef ENABLE_THREADS
+  struct ftp_crawl crawl;
+#endif
 
   *dt = 0;
 
@@ -2397,6 +2987,10 @@ ftp_loop (struct url *u, char **local_file, int *dt, struct url *proxy,
   con.rs = ST_UNIX;
   con.id = NULL;
   con.proxy = proxy;
+  /* Sessions through a proxy are logged in to the proxy, and are not
+     pooled.  */
+  if (!proxy)
+    ftp_session_get (u, &con);
   /* To let ftp_loop_internal AND getftp know of the desired file name. Added
      while implementing metalink support to wget. */
   if(local_file && *local_file)
@@ -2462,8 +3056,33 @@ ftp_loop (struct url *u, char **local_file, int *dt, struct url *proxy,
           /* ftp_retrieve_glob is a catch-all function that gets called
              if we need globbing, time-stamping, recursion or preserve
              permissions.  Its third argument is just what we really need.  */
+#ifdef ENABLE_THREADS
+          /* Spread a recursive retrieval over several connections if
+             --jobs allows it.  With -O, everything goes to a single
+             stream, so keep to one.  */
+          if (recursive && ftp_crawl_connections () > 1
+              && !opt.output_document)
+            {
+              xzero (crawl);
+              crawl.proxy = proxy;
+              pthread_mutex_init (&crawl.mutex, NULL);
+              pthread_cond_init (&crawl.cond, NULL);
+              con.crawl = &crawl;
+            }
+#endif
           res = ftp_retrieve_glob (u, &con,
-                                   ispattern ? GLOB_GLOBALL : GLOB_GETONE);
+                                   ispattern ? GLOB_GLOBALL : GLOB_GETONE, 1);
+#ifdef ENABLE_THREADS
+          if (con.crawl)
+            {
+              uerr_t crawl_res = ftp_crawl_run (&crawl, &con, u);
+              if (crawl_res != RETROK)
+                res = crawl_res;
+              con.crawl = NULL;
+              pthread_cond_destroy (&crawl.cond);
+              pthread_mutex_destroy (&crawl.mutex);
+            }
+#endif
         }
       else
         res = ftp_loop_internal (u, NULL, &con, local_file, range);
@@ -2472,11 +3091,16 @@ ftp_loop (struct url *u, char **local_file, int *dt, struct url *proxy,
     res = RETROK;
   if (res == RETROK)
     *dt |= RETROKF;
-  /* If a connection was left, quench it.  */
-  if (con.csock != -1)
+  /* If a connection was left, keep it for the next URL, unless
+     something went wrong.  */
+  if (con.csock != -1 && res == RETROK && !proxy)
+    ftp_session_put (u, &con);
+  else if (con.csock != -1)
     fd_close (con.csock);
   xfree_null (con.id);
   con.id = NULL;
+  xfree_null (con.cwd);
+  con.cwd = NULL;
   xfree_null (con.target);
   con.target = NULL;
   return res;
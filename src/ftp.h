@@ -55,7 +55,14 @@ enum ustype
   UST_OTHER
 };
 
-extern char ftp_last_respline[];
+/* The last response line read on the thread's control connection.
+   Parallel retrievals keep a connection per thread.  */
+#ifdef ENABLE_THREADS
+# define FTP_THREAD_LOCAL __thread
+#else
+# define FTP_THREAD_LOCAL
+#endif
+extern FTP_THREAD_LOCAL char ftp_last_respline[];
 
 uerr_t ftp_response (int, char **);
 uerr_t ftp_login (int, const char *, const char *);
@@ -72,6 +79,8 @@ uerr_t ftp_cwd (int, const char *);
 uerr_t ftp_retr (int, const char *);
 uerr_t ftp_rest (int, wgint);
 uerr_t ftp_list (int, const char *, bool, bool, bool *);
+uerr_t ftp_mlsd (int);
+uerr_t ftp_feat (int, bool *);
 uerr_t ftp_syst (int, enum stype *, enum ustype *);
 uerr_t ftp_pwd (int, char **);
 uerr_t ftp_size (int, const char *, wgint *);
@@ -146,17 +155,23 @@ enum wget_ftp_fstatus
   AVOID_LIST    = 0x0008,	/* It tells us if during this
 				 session we have to avoid to use
 				 "LIST". */
-  LIST_AFTER_LIST_A_CHECK_DONE  = 0x0010
+  LIST_AFTER_LIST_A_CHECK_DONE  = 0x0010,
 				/* It tells us if we have already
 				 checked "LIST" after the first
 				 "LIST -a" to handle the case of
 				 file/folders named "-a". */
+  FEAT_DONE     = 0x0020,	/* FEAT has been sent during this
+				 session.  */
+  USE_MLSD      = 0x0040	/* The server advertises MLST, so
+				 directories are listed with MLSD. */
 };
 
-struct fileinfo *ftp_parse_ls (const char *, const enum stype);
+struct fileinfo *ftp_parse_ls (const char *, size_t, const enum stype);
+struct fileinfo *ftp_parse_mlsd (const char *, size_t);
 uerr_t ftp_loop (struct url *, char **, int *, struct url *, bool, bool, struct range *);
 
 uerr_t ftp_index (const char *, struct url *, struct fileinfo *);
+void ftp_cleanup (void);
 
 char ftp_process_type (const char *);
 
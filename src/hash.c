@@ -48,6 +48,7 @@ as that of the covered work.  */
 /* Make do without them. */
 # define xnew(x) xmalloc (sizeof (x))
 # define xnew_array(type, x) xmalloc (sizeof (type) * (x))
+# define xnew0_array(type, x) calloc ((x), sizeof (type))
 # define xmalloc malloc
 # define xfree free
 # ifndef countof
@@ -111,45 +112,71 @@ as that of the covered work.  */
 /* IMPLEMENTATION:
 
    The hash table is implemented as an open-addressed table with
-   linear probing collision resolution.
+   linear probing and "Robin Hood" collision resolution.
 
    The above means that all the cells (each cell containing a key and
    a value pointer) are stored in a contiguous array.  Array position
-   of each cell is determined by the hash value of its key and the
-   size of the table: location := hash(key) % size.  If two different
-   keys end up on the same position (collide), the one that came
-   second is stored in the first unoccupied cell that follows it.
-   This collision resolution technique is called "linear probing".
-
-   There are more advanced collision resolution methods (quadratic
-   probing, double hashing), but we don't use them because they incur
-   more non-sequential access to the array, which results in worse CPU
-   cache behavior.  Linear probing works well as long as the
-   count/size ratio (fullness) is kept below 75%.  We make sure to
-   grow and rehash the table whenever this threshold is exceeded.
-
-   Collisions complicate deletion because simply clearing a cell
-   followed by previously collided entries would cause those neighbors
-   to not be picked up by find_cell later.  One solution is to leave a
-   "tombstone" marker instead of clearing the cell, and another is to
-   recalculate the positions of adjacent cells.  We take the latter
-   approach because it results in less bookkeeping garbage and faster
-   retrieval at the (slight) expense of deletion.  */
+   of each cell is determined by the hash value of its key.  If two
+   different keys end up on the same position (collide), one of them
+   is stored in a following unoccupied cell.  This is called "linear
+   probing".  We prefer it to quadratic probing or double hashing
+   because it accesses the array sequentially, which is friendly to
+   the CPU cache.
+
+   With Robin Hood hashing, an insertion that passes a key closer to
+   its home position than the new key is to its own takes that key's
+   cell, and continues with the displaced key instead.  This keeps the
+   distances of all keys from their home position short and similar,
+   and allows a lookup to stop as soon as it meets a key closer to
+   home than the one it looks for, without reaching an empty cell.
+   Deletion shifts the following keys back by one cell, up to the
+   first empty cell or key at home, so no "tombstones" are needed.
+
+   The table size is always a power of two.  The hash value of a key
+   is scrambled by a multiplication ("Fibonacci hashing"), whose upper
+   bits give the home position, so that weak hash functions don't
+   cluster and no division is needed.  The upper 32 bits of the
+   scrambled hash are stored in an array of tags, parallel to the
+   cells, in which 0 marks an empty cell.  Probing scans the compact
+   tag array, and the test function is only called when the tags
+   match.  The stored tags are also used to move the keys to a larger
+   table without calling the hash function again.
+
+   Resizing is incremental: when the table grows, the old cells are
+   kept and moved to the new, twice larger, array a few at a time by
+   each insertion that follows, so that no single insertion pays for
+   rehashing the entire table.  Until the move is complete, lookups
+   consult both arrays.  Keys are moved a whole run of adjacent
+   occupied cells at a time, so that the keys left behind can still
+   be found by probing the old array.  */
 
 /* Maximum allowed fullness: when hash table's fullness exceeds this
    value, the table is resized.  */
 #define HASH_MAX_FULLNESS 0.75
 
-/* The hash table size is multiplied by this factor (and then rounded
-   to the next prime) with each resize.  This guarantees infrequent
-   resizes.  */
-#define HASH_RESIZE_FACTOR 2
+/* The smallest size of a hash table.  Must be a power of two. */
+#define HASH_MIN_SIZE 16
+
+/* The minimum number of old cells moved to the new array by each
+   insertion during a resize.  The table doubles with each resize, so
+   anything above 4/3 guarantees that the move is complete before the
+   next resize.  */
+#define HASH_MIGRATE_STEP 8
 
 struct cell {
   void *key;
   void *value;
 };
 
+/* An array of cells and their tags.  */
+struct cell_array {
+  uint32_t *tags;               /* tags of the cells, HASH_EMPTY if the
+                                   cell is empty. */
+  struct cell *cells;           /* contiguous array of cells. */
+  unsigned int mask;            /* size of the array minus one. */
+  int shift;                    /* 32 minus log2 of the size. */
+};
+
 typedef unsigned long (*hashfun_t) (const void *);
 typedef int (*testfun_t) (const void *, const void *);
 
@@ -157,90 +184,75 @@ struct hash_table {
   hashfun_t hash_function;
   testfun_t test_function;
 
-  struct cell *cells;           /* contiguous array of cells. */
-  int size;                     /* size of the array. */
+  struct cell_array cur;        /* the cells. */
+  struct cell_array old;        /* the cells being moved to CUR after a
+                                   resize, or NULL tags. */
+  unsigned int migrate_start;   /* an empty cell of OLD where the move
+                                   started. */
+  unsigned int migrate_done;    /* number of cells of OLD moved so
+                                   far. */
 
   int count;                    /* number of occupied entries. */
   int resize_threshold;         /* after size exceeds this number of
                                    entries, resize the table.  */
-  int prime_offset;             /* the offset of the current prime in
-                                   the prime table. */
 };
 
-/* We use the all-bits-set constant (INVALID_PTR) marker to mean that
-   a cell is empty.  It is unaligned and therefore illegal as a
-   pointer.  INVALID_PTR_CHAR (0xff) is the single-character constant
-   used to initialize the entire cells array as empty.
+/* The tag of an empty cell.  Keys whose tag would be HASH_EMPTY get
+   another one.  */
+#define HASH_EMPTY 0
 
-   The all-bits-set value is a better choice than NULL because it
-   allows the use of NULL/0 keys.  Since the keys are either integers
-   or pointers, the only key that cannot be used is the integer value
-   -1.  This is acceptable because it still allows the use of
-   nonnegative integer keys.  */
+#define ARRAY_SIZE(a) ((a)->mask + 1)
 
-#define INVALID_PTR ((void *) ~(uintptr_t) 0)
-#ifndef UCHAR_MAX
-# define UCHAR_MAX 0xff
-#endif
-#define INVALID_PTR_CHAR UCHAR_MAX
+/* The home position of a key with tag TAG in array A. */
+#define HOME(a, tag) ((tag) >> (a)->shift)
 
-/* Whether the cell C is occupied (non-empty). */
-#define CELL_OCCUPIED(c) ((c)->key != INVALID_PTR)
+/* The distance of the key with tag TAG in cell I of array A from its
+   home position.  */
+#define DISTANCE(a, i, tag) (((i) - HOME (a, tag)) & (a)->mask)
 
-/* Clear the cell C, i.e. mark it as empty (unoccupied). */
-#define CLEAR_CELL(c) ((c)->key = INVALID_PTR)
+#define NEXT_INDEX(a, i) (((i) + 1) & (a)->mask)
 
-/* "Next" cell is the cell following C, but wrapping back to CELLS
-   when C would reach CELLS+SIZE.  */
-#define NEXT_CELL(c, cells, size) (c != cells + (size - 1) ? c + 1 : cells)
+/* Return the tag of KEY in hash table HT.  */
 
-/* Loop over occupied cells starting at C, terminating the loop when
-   an empty cell is encountered.  */
-#define FOREACH_OCCUPIED_ADJACENT(c, cells, size)                               \
-  for (; CELL_OCCUPIED (c); c = NEXT_CELL (c, cells, size))
+static inline uint32_t
+hash_tag (const struct hash_table *ht, const void *key)
+{
+  uint64_t h = (uint64_t) ht->hash_function (key) * 0x9e3779b97f4a7c15ULL;
+  uint32_t tag = h >> 32;
+  return tag != HASH_EMPTY ? tag : 1;
+}
 
-/* Return the position of KEY in hash table SIZE large, hash function
-   being HASHFUN.  */
-#define HASH_POSITION(key, hashfun, size) ((hashfun) (key) % size)
+/* Allocate the cells of A, to hold SIZE entries.  SIZE must be a
+   power of two.  */
 
-/* Find a prime near, but greather than or equal to SIZE.  The primes
-   are looked up from a table with a selection of primes convenient
-   for this purpose.
+static void
+cell_array_init (struct cell_array *a, unsigned int size)
+{
+  int bits = 0;
+  while ((1U << bits) < size)
+    ++bits;
+
+  a->tags = xnew0_array (uint32_t, size);
+  a->cells = xnew_array (struct cell, size);
+  a->mask = size - 1;
+  a->shift = 32 - bits;
+}
 
-   PRIME_OFFSET is a minor optimization: it specifies start position
-   for the search for the large enough prime.  The final offset is
-   stored in the same variable.  That way the list of primes does not
-   have to be scanned from the beginning each time around.  */
+static void
+cell_array_free (struct cell_array *a)
+{
+  xfree (a->tags);
+  xfree (a->cells);
+  a->tags = NULL;
+  a->cells = NULL;
+}
 
-static int
-prime_size (int size, int *prime_offset)
-{
-  static const int primes[] = {
-    13, 19, 29, 41, 59, 79, 107, 149, 197, 263, 347, 457, 599, 787, 1031,
-    1361, 1777, 2333, 3037, 3967, 5167, 6719, 8737, 11369, 14783,
-    19219, 24989, 32491, 42257, 54941, 71429, 92861, 120721, 156941,
-    204047, 265271, 344857, 448321, 582821, 757693, 985003, 1280519,
-    1664681, 2164111, 2813353, 3657361, 4754591, 6180989, 8035301,
-    10445899, 13579681, 17653589, 22949669, 29834603, 38784989,
-    50420551, 65546729, 85210757, 110774011, 144006217, 187208107,
-    243370577, 316381771, 411296309, 534685237, 695090819, 903618083,
-    1174703521, 1527114613, 1837299131, 2147483647
-  };
-  size_t i;
-
-  for (i = *prime_offset; i < countof (primes); i++)
-    if (primes[i] >= size)
-      {
-        /* Set the offset to the next prime.  That is safe because,
-           next time we are called, it will be with a larger SIZE,
-           which means we could never return the same prime anyway.
-           (If that is not the case, the caller can simply reset
-           *prime_offset.)  */
-        *prime_offset = i + 1;
-        return primes[i];
-      }
+/* Set the resize threshold of HT for its current size.  */
 
-  abort ();
+static void
+set_resize_threshold (struct hash_table *ht)
+{
+  ht->resize_threshold = ARRAY_SIZE (&ht->cur) * HASH_MAX_FULLNESS;
 }
 
 static int cmp_pointer (const void *, const void *);
@@ -257,8 +269,7 @@ static int cmp_pointer (const void *, const void *);
 
    Note that hash tables grow dynamically regardless of ITEMS.  The
    only use of ITEMS is to preallocate the table and avoid unnecessary
-   dynamic regrows.  Don't bother making ITEMS prime because it's not
-   used as size unchanged.  To start with a small table that grows as
+   dynamic regrows.  To start with a small table that grows as
    needed, simply specify zero ITEMS.
 
    If hash and test callbacks are not specified, identity mapping is
@@ -274,30 +285,22 @@ hash_table_new (int items,
                 unsigned long (*hash_function) (const void *),
                 int (*test_function) (const void *, const void *))
 {
-  int size;
+  unsigned int size;
   struct hash_table *ht = xnew (struct hash_table);
 
   ht->hash_function = hash_function ? hash_function : hash_pointer;
   ht->test_function = test_function ? test_function : cmp_pointer;
 
-  /* If the size of struct hash_table ever becomes a concern, this
-     field can go.  (Wget doesn't create many hashes.)  */
-  ht->prime_offset = 0;
-
   /* Calculate the size that ensures that the table will store at
      least ITEMS keys without the need to resize.  */
-  size = 1 + items / HASH_MAX_FULLNESS;
-  size = prime_size (size, &ht->prime_offset);
-  ht->size = size;
-  ht->resize_threshold = size * HASH_MAX_FULLNESS;
-  /*assert (ht->resize_threshold >= items);*/
-
-  ht->cells = xnew_array (struct cell, ht->size);
-
-  /* Mark cells as empty.  We use 0xff rather than 0 to mark empty
-     keys because it allows us to use NULL/0 as keys.  */
-  memset (ht->cells, INVALID_PTR_CHAR, size * sizeof (struct cell));
-
+  size = HASH_MIN_SIZE;
+  while (size * HASH_MAX_FULLNESS <= items)
+    size <<= 1;
+
+  cell_array_init (&ht->cur, size);
+  ht->old.tags = NULL;
+  ht->old.cells = NULL;
+  set_resize_threshold (ht);
   ht->count = 0;
 
   return ht;
@@ -308,26 +311,61 @@ hash_table_new (int items,
 void
 hash_table_destroy (struct hash_table *ht)
 {
-  xfree (ht->cells);
+  cell_array_free (&ht->cur);
+  if (ht->old.tags)
+    cell_array_free (&ht->old);
   xfree (ht);
 }
 
+/* Find the key KEY, whose tag is TAG, in array A.  Returns the index
+   of its cell, or -1 if it is not there.  */
+
+static inline long
+find_in_array (const struct hash_table *ht, const struct cell_array *a,
+               const void *key, uint32_t tag)
+{
+  testfun_t equals = ht->test_function;
+  unsigned int i = HOME (a, tag);
+  unsigned int dist;
+
+  for (dist = 0; ; dist++, i = NEXT_INDEX (a, i))
+    {
+      uint32_t t = a->tags[i];
+      /* An empty cell, or a key closer to its home than KEY would be
+         here, means KEY is not in the array.  */
+      if (t == HASH_EMPTY || DISTANCE (a, i, t) < dist)
+        return -1;
+      if (t == tag && equals (key, a->cells[i].key))
+        return i;
+    }
+}
+
 /* The heart of most functions in this file -- find the cell whose
-   KEY is equal to key, using linear probing.  Returns the cell
-   that matches KEY, or the first empty cell if none matches.  */
+   KEY is equal to key.  Returns the cell that matches KEY, or NULL if
+   none matches.  If ARRAY and INDEX are non-NULL, the array and the
+   index of the cell are stored there.  */
 
 static inline struct cell *
-find_cell (const struct hash_table *ht, const void *key)
+find_cell (const struct hash_table *ht, const void *key,
+           struct cell_array **array, unsigned int *index)
 {
-  struct cell *cells = ht->cells;
-  int size = ht->size;
-  struct cell *c = cells + HASH_POSITION (key, ht->hash_function, size);
-  testfun_t equals = ht->test_function;
+  uint32_t tag = hash_tag (ht, key);
+  const struct cell_array *a = &ht->cur;
+  long i = find_in_array (ht, a, key, tag);
 
-  FOREACH_OCCUPIED_ADJACENT (c, cells, size)
-    if (equals (key, c->key))
-      break;
-  return c;
+  if (i < 0 && ht->old.tags)
+    {
+      a = &ht->old;
+      i = find_in_array (ht, a, key, tag);
+    }
+  if (i < 0)
+    return NULL;
+
+  if (array)
+    *array = (struct cell_array *) a;
+  if (index)
+    *index = i;
+  return &a->cells[i];
 }
 
 /* Get the value that corresponds to the key KEY in the hash table HT.
@@ -340,8 +378,8 @@ find_cell (const struct hash_table *ht, const void *key)
 void *
 hash_table_get (const struct hash_table *ht, const void *key)
 {
-  struct cell *c = find_cell (ht, key);
-  if (CELL_OCCUPIED (c))
+  struct cell *c = find_cell (ht, key, NULL, NULL);
+  if (c)
     return c->value;
   else
     return NULL;
@@ -354,8 +392,8 @@ int
 hash_table_get_pair (const struct hash_table *ht, const void *lookup_key,
                      void *orig_key, void *value)
 {
-  struct cell *c = find_cell (ht, lookup_key);
-  if (CELL_OCCUPIED (c))
+  struct cell *c = find_cell (ht, lookup_key, NULL, NULL);
+  if (c)
     {
       if (orig_key)
         *(void **)orig_key = c->key;
@@ -372,51 +410,126 @@ hash_table_get_pair (const struct hash_table *ht, const void *lookup_key,
 int
 hash_table_contains (const struct hash_table *ht, const void *key)
 {
-  struct cell *c = find_cell (ht, key);
-  return CELL_OCCUPIED (c);
+  return find_cell (ht, key, NULL, NULL) != NULL;
 }
 
-/* Grow hash table HT as necessary, and rehash all the key-value
-   mappings.  */
+/* Store KEY, whose tag is TAG, and VALUE in array A, which must not
+   contain KEY.  */
 
 static void
-grow_hash_table (struct hash_table *ht)
+insert_into_array (struct cell_array *a, uint32_t tag, void *key, void *value)
 {
-  hashfun_t hasher = ht->hash_function;
-  struct cell *old_cells = ht->cells;
-  struct cell *old_end   = ht->cells + ht->size;
-  struct cell *c, *cells;
-  int newsize;
+  unsigned int i = HOME (a, tag);
+  unsigned int dist = 0;
+  struct cell c;
 
-  newsize = prime_size (ht->size * HASH_RESIZE_FACTOR, &ht->prime_offset);
-#if 0
-  printf ("growing from %d to %d; fullness %.2f%% to %.2f%%\n",
-          ht->size, newsize,
-          100.0 * ht->count / ht->size,
-          100.0 * ht->count / newsize);
-#endif
+  c.key = key;
+  c.value = value;
+  for (;; i = NEXT_INDEX (a, i), dist++)
+    {
+      uint32_t t = a->tags[i];
+      unsigned int d;
 
-  ht->size = newsize;
-  ht->resize_threshold = newsize * HASH_MAX_FULLNESS;
+      if (t == HASH_EMPTY)
+        {
+          a->tags[i] = tag;
+          a->cells[i] = c;
+          return;
+        }
 
-  cells = xnew_array (struct cell, newsize);
-  memset (cells, INVALID_PTR_CHAR, newsize * sizeof (struct cell));
-  ht->cells = cells;
+      /* Take the cell of a key closer to its home, and find another
+         cell for that key.  */
+      d = DISTANCE (a, i, t);
+      if (d < dist)
+        {
+          struct cell tmp = a->cells[i];
+          a->tags[i] = tag;
+          a->cells[i] = c;
+          tag = t;
+          c = tmp;
+          dist = d;
+        }
+    }
+}
 
-  for (c = old_cells; c < old_end; c++)
-    if (CELL_OCCUPIED (c))
-      {
-        struct cell *new_c;
-        /* We don't need to test for uniqueness of keys because they
-           come from the hash table and are therefore known to be
-           unique.  */
-        new_c = cells + HASH_POSITION (c->key, hasher, newsize);
-        FOREACH_OCCUPIED_ADJACENT (new_c, cells, newsize)
-          ;
-        *new_c = *c;
-      }
+/* Remove the entry in cell I of array A, shifting the entries that
+   follow it back towards their home.  */
 
-  xfree (old_cells);
+static void
+remove_from_array (struct cell_array *a, unsigned int i)
+{
+  for (;;)
+    {
+      unsigned int next = NEXT_INDEX (a, i);
+      uint32_t t = a->tags[next];
+      if (t == HASH_EMPTY || DISTANCE (a, next, t) == 0)
+        break;
+      a->tags[i] = t;
+      a->cells[i] = a->cells[next];
+      i = next;
+    }
+  a->tags[i] = HASH_EMPTY;
+}
+
+/* Move at least COUNT cells of the old array of HT to the current
+   one, and then up to the end of the run of occupied cells, so that
+   the entries left behind can still be found.  Frees the old array
+   when all of it has been moved.  */
+
+static void
+migrate_cells (struct hash_table *ht, unsigned int count)
+{
+  struct cell_array *old = &ht->old;
+  unsigned int size = ARRAY_SIZE (old);
+  unsigned int moved = 0;
+
+  while (ht->migrate_done < size)
+    {
+      unsigned int i = (ht->migrate_start + ht->migrate_done) & old->mask;
+      uint32_t t = old->tags[i];
+
+      if (t == HASH_EMPTY)
+        {
+          if (moved >= count)
+            return;
+        }
+      else
+        {
+          insert_into_array (&ht->cur, t, old->cells[i].key,
+                             old->cells[i].value);
+          old->tags[i] = HASH_EMPTY;
+        }
+      ++ht->migrate_done;
+      ++moved;
+    }
+
+  cell_array_free (old);
+}
+
+/* Grow hash table HT.  The entries are moved to the new cells by
+   the insertions that follow, see migrate_cells.  */
+
+static void
+grow_hash_table (struct hash_table *ht)
+{
+  unsigned int i;
+
+  /* Finish the previous resize.  This is normally a no-op, see
+     HASH_MIGRATE_STEP.  */
+  if (ht->old.tags)
+    migrate_cells (ht, UINT_MAX);
+
+  ht->old = ht->cur;
+  cell_array_init (&ht->cur, ARRAY_SIZE (&ht->old) * 2);
+  set_resize_threshold (ht);
+
+  /* Start moving the cells at an empty one, which is a boundary
+     between runs of occupied cells.  The fullness guarantees that
+     there is one.  */
+  for (i = 0; ht->old.tags[i] != HASH_EMPTY; i++)
+    ;
+  ht->migrate_start = i;
+  ht->migrate_done = 0;
 }
 
 /* Put VALUE in the hash table HT under the key KEY.  This regrows the
@@ -425,8 +538,8 @@ grow_hash_table (struct hash_table *ht)
 void
 hash_table_put (struct hash_table *ht, const void *key, const void *value)
 {
-  struct cell *c = find_cell (ht, key);
-  if (CELL_OCCUPIED (c))
+  struct cell *c = find_cell (ht, key, NULL, NULL);
+  if (c)
     {
       /* update existing item */
       c->key   = (void *)key; /* const? */
@@ -437,15 +550,14 @@ hash_table_put (struct hash_table *ht, const void *key, const void *value)
   /* If adding the item would make the table exceed max. fullness,
      grow the table first.  */
   if (ht->count >= ht->resize_threshold)
-    {
-      grow_hash_table (ht);
-      c = find_cell (ht, key);
-    }
+    grow_hash_table (ht);
+  if (ht->old.tags)
+    migrate_cells (ht, HASH_MIGRATE_STEP);
 
   /* add new item */
   ++ht->count;
-  c->key   = (void *)key;       /* const? */
-  c->value = (void *)value;
+  insert_into_array (&ht->cur, hash_tag (ht, key), (void *)key,
+                     (void *)value);
 }
 
 /* Remove KEY->value mapping from HT.  Return 0 if there was no such
@@ -454,45 +566,15 @@ hash_table_put (struct hash_table *ht, const void *key, const void *value)
 int
 hash_table_remove (struct hash_table *ht, const void *key)
 {
-  struct cell *c = find_cell (ht, key);
-  if (!CELL_OCCUPIED (c))
-    return 0;
-  else
-    {
-      int size = ht->size;
-      struct cell *cells = ht->cells;
-      hashfun_t hasher = ht->hash_function;
+  struct cell_array *a;
+  unsigned int i;
 
-      CLEAR_CELL (c);
-      --ht->count;
-
-      /* Rehash all the entries following C.  The alternative
-         approach is to mark the entry as deleted, i.e. create a
-         "tombstone".  That speeds up removal, but leaves a lot of
-         garbage and slows down hash_table_get and hash_table_put.  */
+  if (!find_cell (ht, key, &a, &i))
+    return 0;
 
-      c = NEXT_CELL (c, cells, size);
-      FOREACH_OCCUPIED_ADJACENT (c, cells, size)
-        {
-          const void *key2 = c->key;
-          struct cell *c_new;
-
-          /* Find the new location for the key. */
-          c_new = cells + HASH_POSITION (key2, hasher, size);
-          FOREACH_OCCUPIED_ADJACENT (c_new, cells, size)
-            if (key2 == c_new->key)
-              /* The cell C (key2) is already where we want it (in
-                 C_NEW's "chain" of keys.)  */
-              goto next_rehash;
-
-          *c_new = *c;
-          CLEAR_CELL (c);
-
-        next_rehash:
-          ;
-        }
-      return 1;
-    }
+  remove_from_array (a, i);
+  --ht->count;
+  return 1;
 }
 
 /* Clear HT of all entries.  After calling this function, the count
@@ -502,7 +584,9 @@ hash_table_remove (struct hash_table *ht, const void *key)
 void
 hash_table_clear (struct hash_table *ht)
 {
-  memset (ht->cells, INVALID_PTR_CHAR, ht->size * sizeof (struct cell));
+  if (ht->old.tags)
+    cell_array_free (&ht->old);
+  memset (ht->cur.tags, 0, ARRAY_SIZE (&ht->cur) * sizeof (uint32_t));
   ht->count = 0;
 }
 
@@ -521,19 +605,23 @@ void
 hash_table_for_each (struct hash_table *ht,
                      int (*fn) (void *, void *, void *), void *arg)
 {
-  struct cell *c = ht->cells;
-  struct cell *end = ht->cells + ht->size;
+  struct cell_array *a = &ht->cur;
+  unsigned int i;
+
+  /* Finish any resize, so that all the entries are in one array. */
+  if (ht->old.tags)
+    migrate_cells (ht, UINT_MAX);
 
-  for (; c < end; c++)
-    if (CELL_OCCUPIED (c))
+  for (i = 0; i < ARRAY_SIZE (a); i++)
+    if (a->tags[i] != HASH_EMPTY)
       {
         void *key;
       repeat:
-        key = c->key;
-        if (fn (key, c->value, arg))
+        key = a->cells[i].key;
+        if (fn (key, a->cells[i].value, arg))
           return;
         /* hash_table_remove might have moved the adjacent cells. */
-        if (c->key != key && CELL_OCCUPIED (c))
+        if (a->tags[i] != HASH_EMPTY && a->cells[i].key != key)
           goto repeat;
       }
 }
@@ -551,8 +639,8 @@ hash_table_for_each (struct hash_table *ht,
 void
 hash_table_iterate (struct hash_table *ht, hash_table_iterator *iter)
 {
-  iter->pos = ht->cells;
-  iter->end = ht->cells + ht->size;
+  iter->table = ht;
+  iter->pos = 0;
 }
 
 /* Get the next hash table entry.  ITER is an iterator object
@@ -567,16 +655,24 @@ hash_table_iterate (struct hash_table *ht, hash_table_iterator *iter)
 int
 hash_table_iter_next (hash_table_iterator *iter)
 {
-  struct cell *c = iter->pos;
-  struct cell *end = iter->end;
-  for (; c < end; c++)
-    if (CELL_OCCUPIED (c))
-      {
-        iter->key = c->key;
-        iter->value = c->value;
-        iter->pos = c + 1;
-        return 1;
-      }
+  struct hash_table *ht = iter->table;
+  unsigned long cur_size = ARRAY_SIZE (&ht->cur);
+  unsigned long end = cur_size + (ht->old.tags ? ARRAY_SIZE (&ht->old) : 0);
+
+  /* Positions past the current cells are those of the old cells of a
+     resize in progress.  */
+  for (; iter->pos < end; iter->pos++)
+    {
+      struct cell_array *a = iter->pos < cur_size ? &ht->cur : &ht->old;
+      unsigned long i = iter->pos < cur_size ? iter->pos : iter->pos - cur_size;
+      if (a->tags[i] != HASH_EMPTY)
+        {
+          iter->key = a->cells[i].key;
+          iter->value = a->cells[i].value;
+          ++iter->pos;
+          return 1;
+        }
+    }
   return 0;
 }
 
@@ -589,7 +685,7 @@ hash_table_count (const struct hash_table *ht)
 {
   return ht->count;
 }
-
+
 /* Functions from this point onward are meant for convenience and
    don't strictly belong to this file.  However, this is as good a
    place for them as any.  */
@@ -638,7 +734,7 @@ hash_table_count (const struct hash_table *ht)
    this one seems to perform much better, both by being faster and by
    generating less collisions.  */
 
-static unsigned long
+unsigned long
 hash_string (const void *key)
 {
   const char *p = key;
@@ -653,7 +749,7 @@ hash_string (const void *key)
 
 /* Frontend for strcmp usable for hash tables. */
 
-static int
+int
 cmp_string (const void *s1, const void *s2)
 {
   return !strcmp ((const char *)s1, (const char *)s2);
@@ -676,7 +772,7 @@ make_string_hash_table (int items)
 
 /* Like hash_string, but produce the same hash regardless of the case. */
 
-static unsigned long
+unsigned long
 hash_string_nocase (const void *key)
 {
   const char *p = key;
@@ -691,7 +787,7 @@ hash_string_nocase (const void *key)
 
 /* Like string_cmp, but doing case-insensitive compareison. */
 
-static int
+int
 string_cmp_nocase (const void *s1, const void *s2)
 {
   return !strcasecmp ((const char *)s1, (const char *)s2);
@@ -739,6 +835,30 @@ hash_pointer (const void *ptr)
   return (unsigned long) key;
 }
 
+/* Return a 64-bit hash of the LEN bytes at S.  This is FNV-1a
+   followed by a final mix, so that the low bits depend on the whole
+   string.  Unlike hash_string, it is meant for fingerprints and Bloom
+   filters, where 32 bits are too few to tell millions of URLs
+   apart.  */
+
+uint64_t
+hash_string_64 (const char *s, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  const unsigned char *p = (const unsigned char *) s;
+  const unsigned char *end = p + len;
+
+  for (; p < end; p++)
+    {
+      h ^= *p;
+      h *= 0x100000001b3ULL;
+    }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
 static int
 cmp_pointer (const void *ptr1, const void *ptr2)
 {
@@ -791,8 +911,146 @@ main (void)
   print_hash (ht);
 #endif
 #if 1
-  printf ("%d %d\n", ht->count, ht->size);
+  printf ("%d %u\n", ht->count, ARRAY_SIZE (&ht->cur));
 #endif
   return 0;
 }
 #endif /* TEST */
+
+#ifdef BENCHMARK
+
+/* Time the basic operations on string and pointer keys.  Compile
+   with
+
+     gcc -O2 -DSTANDALONE -DHAVE_STDINT_H -DBENCHMARK hash.c
+
+   and run with the number of keys as the optional argument.  */
+
+#include <time.h>
+
+static double
+bench_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_report (const char *what, int count, double start)
+{
+  printf ("%-28s %8.1f ns/op\n", what, (bench_now () - start) * 1e9 / count);
+}
+
+static void
+bench_table (const char *name, struct hash_table *ht, char **keys,
+             char **misses, int count)
+{
+  char what[64];
+  double start;
+  long found = 0;
+  int i;
+
+  start = bench_now ();
+  for (i = 0; i < count; i++)
+    hash_table_put (ht, keys[i], keys[i]);
+  sprintf (what, "%s: put", name);
+  bench_report (what, count, start);
+
+  start = bench_now ();
+  for (i = 0; i < count; i++)
+    found += hash_table_get (ht, keys[(i * 7919L) % count]) != NULL;
+  sprintf (what, "%s: get (hit)", name);
+  bench_report (what, count, start);
+
+  start = bench_now ();
+  for (i = 0; i < count; i++)
+    found += hash_table_contains (ht, misses[i]);
+  sprintf (what, "%s: get (miss)", name);
+  bench_report (what, count, start);
+
+  start = bench_now ();
+  for (i = 0; i < count; i++)
+    hash_table_remove (ht, keys[i]);
+  sprintf (what, "%s: remove", name);
+  bench_report (what, count, start);
+
+  assert (found == count && hash_table_count (ht) == 0);
+  hash_table_destroy (ht);
+}
+
+int
+main (int argc, char **argv)
+{
+  int count = argc > 1 ? atoi (argv[1]) : 1000000;
+  char **keys = xnew_array (char *, count);
+  char **misses = xnew_array (char *, count);
+  int i;
+
+  for (i = 0; i < count; i++)
+    {
+      keys[i] = xmalloc (64);
+      sprintf (keys[i], "http://www.example.com/dir/%d/index.html", i);
+      misses[i] = xmalloc (64);
+      sprintf (misses[i], "http://www.example.com/dir/%d/other.html", i);
+    }
+
+  bench_table ("string keys", make_string_hash_table (0), keys, misses, count);
+  bench_table ("pointer keys", hash_table_new (0, NULL, NULL), keys, misses,
+               count);
+  return 0;
+}
+#endif /* BENCHMARK */
+
+#ifdef TESTING
+
+#include "test.h"
+
+const char *
+test_hash_table (void)
+{
+  struct hash_table *ht = hash_table_new (0, NULL, NULL);
+  hash_table_iterator iter;
+  long i, k, n;
+
+  /* Keys are small integers, so that all of them but the first are
+     moved around by several incremental resizes.  */
+  for (i = 1; i <= 10000; i++)
+    {
+      hash_table_put (ht, (void *) i, (void *) (i * 2));
+      k = i / 2 + 1;
+      mu_assert ("test_hash_table: missing key after put",
+                 k % 3 == 2 || hash_table_get (ht, (void *) k)
+                               == (void *) (k * 2));
+      if (i % 3 == 0)
+        mu_assert ("test_hash_table: remove failed",
+                   hash_table_remove (ht, (void *) (i - 1)));
+    }
+  mu_assert ("test_hash_table: wrong count",
+             hash_table_count (ht) == 10000 - 10000 / 3);
+
+  for (i = 1; i <= 10000; i++)
+    {
+      bool removed = i % 3 == 2;
+      mu_assert ("test_hash_table: wrong contents",
+                 hash_table_contains (ht, (void *) i) == !removed
+                 && hash_table_get (ht, (void *) i)
+                    == (removed ? NULL : (void *) (i * 2)));
+    }
+
+  for (n = 0, hash_table_iterate (ht, &iter); hash_table_iter_next (&iter);
+       n++)
+    mu_assert ("test_hash_table: wrong value while iterating",
+               iter.value == (void *) ((long) iter.key * 2));
+  mu_assert ("test_hash_table: wrong iteration count",
+             n == hash_table_count (ht));
+
+  hash_table_clear (ht);
+  mu_assert ("test_hash_table: clear failed",
+             hash_table_count (ht) == 0 && !hash_table_contains (ht, (void *) 1));
+  hash_table_destroy (ht);
+
+  return NULL;
+}
+
+#endif /* TESTING */
@@ -51,7 +51,8 @@ void hash_table_for_each (struct hash_table *,
 
 typedef struct {
   void *key, *value;		/* public members */
-  void *pos, *end;		/* private members */
+  void *table;			/* private members */
+  unsigned long pos;
 } hash_table_iterator;
 void hash_table_iterate (struct hash_table *, hash_table_iterator *);
 int hash_table_iter_next (hash_table_iterator *);
@@ -61,6 +62,12 @@ int hash_table_count (const struct hash_table *);
 struct hash_table *make_string_hash_table (int);
 struct hash_table *make_nocase_string_hash_table (int);
 
+unsigned long hash_string (const void *);
+int cmp_string (const void *, const void *);
+unsigned long hash_string_nocase (const void *);
+int string_cmp_nocase (const void *, const void *);
+
 unsigned long hash_pointer (const void *);
+uint64_t hash_string_64 (const char *, size_t);
 
 #endif /* HASH_H */
@@ -56,11 +56,16 @@ as that of the covered work.  */
 #endif /* WINDOWS */
 
 #include <errno.h>
+#ifdef ENABLE_THREADS
+# include <pthread.h>
+#endif
 
 #include "utils.h"
 #include "host.h"
 #include "url.h"
 #include "hash.h"
+#include "chash.h"
+#include "metrics.h"
 
 #ifndef NO_ADDRESS
 # define NO_ADDRESS NO_DATA
@@ -87,6 +92,17 @@ struct address_list {
                                    0, the entry is freed. */
 };
 
+/* Address lists are shared by the host cache and the --jobs threads
+   that connect to the host, which release them concurrently.  */
+#ifdef ENABLE_THREADS
+static pthread_mutex_t refcount_mutex = PTHREAD_MUTEX_INITIALIZER;
+# define REFCOUNT_LOCK pthread_mutex_lock (&refcount_mutex)
+# define REFCOUNT_UNLOCK pthread_mutex_unlock (&refcount_mutex)
+#else
+# define REFCOUNT_LOCK
+# define REFCOUNT_UNLOCK
+#endif
+
 /* Get the bounds of the address list.  */
 
 void
@@ -300,10 +316,14 @@ address_list_delete (struct address_list *al)
 void
 address_list_release (struct address_list *al)
 {
-  --al->refcount;
+  int refcount;
+
+  REFCOUNT_LOCK;
+  refcount = --al->refcount;
+  REFCOUNT_UNLOCK;
   DEBUGP (("Releasing 0x%0*lx (new refcount %d).\n", PTR_FORMAT (al),
-           al->refcount));
-  if (al->refcount <= 0)
+           refcount));
+  if (refcount <= 0)
     {
       DEBUGP (("Deleting unused 0x%0*lx.\n", PTR_FORMAT (al)));
       address_list_delete (al);
@@ -576,9 +596,35 @@ is_valid_ipv6_address (const char *str, const char *end)
    application.  Refreshing is attempted when connect fails, though --
    see connect_to_host.  */
 
-/* Mapping between known hosts and to lists of their addresses. */
-static struct hash_table *host_name_addresses_map;
+/* Mapping between known hosts and to lists of their addresses.  The
+   cache is shared by all the --jobs threads.  */
+static struct chash_table *host_name_addresses_map;
 
+static void
+cache_create (void)
+{
+  host_name_addresses_map = make_nocase_string_chash_table (0);
+}
+
+#ifdef ENABLE_THREADS
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+# define ENSURE_CACHE_EXISTS pthread_once (&cache_once, cache_create)
+#else
+# define ENSURE_CACHE_EXISTS do {               \
+  if (!host_name_addresses_map)                 \
+    cache_create ();                            \
+} while (0)
+#endif
+
+/* Add a reference to AL.  */
+
+static void
+address_list_ref (struct address_list *al)
+{
+  REFCOUNT_LOCK;
+  ++al->refcount;
+  REFCOUNT_UNLOCK;
+}
 
 /* Return the host's resolved addresses from the cache, if
    available.  */
@@ -587,16 +633,21 @@ static struct address_list *
 cache_query (const char *host)
 {
   struct address_list *al;
-  if (!host_name_addresses_map)
-    return NULL;
-  al = hash_table_get (host_name_addresses_map, host);
+  struct hash_table *ht;
+
+  ENSURE_CACHE_EXISTS;
+
+  /* Take the reference under the lock, so that cache_remove in
+     another thread can't free AL before we do.  */
+  ht = chash_table_lock (host_name_addresses_map, host);
+  al = hash_table_get (ht, host);
   if (al)
-    {
-      DEBUGP (("Found %s in host_name_addresses_map (%p)\n", host, al));
-      ++al->refcount;
-      return al;
-    }
-  return NULL;
+    address_list_ref (al);
+  chash_table_unlock (host_name_addresses_map, host);
+
+  if (al)
+    DEBUGP (("Found %s in host_name_addresses_map (%p)\n", host, al));
+  return al;
 }
 
 /* Cache the DNS lookup of HOST.  Subsequent invocations of
@@ -605,11 +656,24 @@ cache_query (const char *host)
 static void
 cache_store (const char *host, struct address_list *al)
 {
-  if (!host_name_addresses_map)
-    host_name_addresses_map = make_nocase_string_hash_table (0);
+  struct hash_table *ht;
+  char *old_host;
+  struct address_list *old_al;
 
-  ++al->refcount;
-  hash_table_put (host_name_addresses_map, xstrdup_lower (host), al);
+  ENSURE_CACHE_EXISTS;
+  address_list_ref (al);
+
+  /* Another thread may have resolved and cached HOST meanwhile; keep
+     its key and replace its addresses with ours.  */
+  ht = chash_table_lock (host_name_addresses_map, host);
+  if (hash_table_get_pair (ht, host, &old_host, &old_al))
+    {
+      hash_table_put (ht, old_host, al);
+      address_list_release (old_al);
+    }
+  else
+    hash_table_put (ht, xstrdup_lower (host), al);
+  chash_table_unlock (host_name_addresses_map, host);
 
   IF_DEBUG
     {
@@ -627,15 +691,19 @@ cache_store (const char *host, struct address_list *al)
 static void
 cache_remove (const char *host)
 {
+  struct hash_table *ht;
+  char *old_host;
   struct address_list *al;
-  if (!host_name_addresses_map)
-    return;
-  al = hash_table_get (host_name_addresses_map, host);
-  if (al)
+
+  ENSURE_CACHE_EXISTS;
+  ht = chash_table_lock (host_name_addresses_map, host);
+  if (hash_table_get_pair (ht, host, &old_host, &al))
     {
+      hash_table_remove (ht, host);
       address_list_release (al);
-      hash_table_remove (host_name_addresses_map, host);
+      xfree (old_host);
     }
+  chash_table_unlock (host_name_addresses_map, host);
 }
 
 /* Look up HOST in DNS and return a list of IP addresses.
@@ -748,6 +816,7 @@ lookup_host (const char *host, int flags)
   {
     int err;
     struct addrinfo hints, *res;
+    struct ptimer *timer;
 
     xzero (hints);
     hints.ai_socktype = SOCK_STREAM;
@@ -776,7 +845,10 @@ lookup_host (const char *host, int flags)
       }
 #endif
 
+    /* Numeric addresses are not looked up, so they aren't timed.  */
+    timer = numeric_address ? NULL : metrics_start_timer ();
     err = getaddrinfo_with_timeout (host, NULL, &hints, &res, timeout);
+    metrics_observe (LATENCY_DNS, timer);
     if (err != 0 || res == NULL)
       {
         if (!silent)
@@ -803,7 +875,9 @@ lookup_host (const char *host, int flags)
   }
 #else  /* not ENABLE_IPV6 */
   {
+    struct ptimer *timer = metrics_start_timer ();
     struct hostent *hptr = gethostbyname_with_timeout (host, timeout);
+    metrics_observe (LATENCY_DNS, timer);
     if (!hptr)
       {
         if (!silent)
@@ -894,23 +968,25 @@ sufmatch (const char **list, const char *what)
   return false;
 }
 
+static int
+host_cleanup_mapper (void *key, void *value, void *arg)
+{
+  char *host = key;
+  struct address_list *al = value;
+  xfree (host);
+  assert (al->refcount == 1);
+  address_list_delete (al);
+  return 0;
+}
+
 void
 host_cleanup (void)
 {
   if (host_name_addresses_map)
     {
-      hash_table_iterator iter;
-      for (hash_table_iterate (host_name_addresses_map, &iter);
-           hash_table_iter_next (&iter);
-           )
-        {
-          char *host = iter.key;
-          struct address_list *al = iter.value;
-          xfree (host);
-          assert (al->refcount == 1);
-          address_list_delete (al);
-        }
-      hash_table_destroy (host_name_addresses_map);
+      chash_table_for_each (host_name_addresses_map, host_cleanup_mapper,
+                            NULL);
+      chash_table_destroy (host_name_addresses_map);
       host_name_addresses_map = NULL;
     }
 }
@@ -135,14 +135,25 @@ hash_table_get (const struct hash_table *ht, void *ptr)
 {
   return ptr;
 }
+
+struct arena {
+  int dummy;
+};
+static void *
+arena_realloc (struct arena *a, void *ptr, size_t old_size, size_t new_size)
+{
+  return realloc (ptr, new_size);
+}
 #else  /* not STANDALONE */
 # include "hash.h"
+# include "arena.h"
 #endif
 
 /* Pool support.  A pool is a resizable chunk of memory.  It is first
-   allocated on the stack, and moved to the heap if it needs to be
-   larger than originally expected.  map_html_tags() uses it to store
-   the zero-terminated names and values of tags and attributes.
+   allocated on the stack, and moved to the heap (or to the caller's
+   arena, if one was given) if it needs to be larger than originally
+   expected.  map_html_tags() uses it to store the zero-terminated
+   names and values of tags and attributes.
 
    Thus taginfo->name, and attr->name and attr->value for each
    attribute, do not point into separately allocated areas, but into
@@ -162,18 +173,23 @@ struct pool {
                                    to restore the pool to the initial
                                    state. */
   int orig_size;
-};
 
-/* Initialize the pool to hold INITIAL_SIZE bytes of storage. */
+  struct arena *arena;          /* arena to grow into, or NULL to use
+                                   malloc. */
+};
 
-#define POOL_INIT(p, initial_storage, initial_size) do {        \
-  struct pool *P = (p);                                         \
-  P->contents = (initial_storage);                              \
-  P->size = (initial_size);                                     \
-  P->tail = 0;                                                  \
-  P->resized = false;                                           \
-  P->orig_contents = P->contents;                               \
-  P->orig_size = P->size;                                       \
+/* Initialize the pool to hold INITIAL_SIZE bytes of storage.  If
+   ARENA is non-NULL, the pool grows into it instead of the heap.  */
+
+#define POOL_INIT(p, initial_storage, initial_size, pool_arena) do {    \
+  struct pool *P = (p);                                                 \
+  P->contents = (initial_storage);                                      \
+  P->size = (initial_size);                                             \
+  P->tail = 0;                                                          \
+  P->resized = false;                                                   \
+  P->orig_contents = P->contents;                                       \
+  P->orig_size = P->size;                                               \
+  P->arena = (pool_arena);                                              \
 } while (0)
 
 /* Grow the pool to accomodate at least SIZE new bytes.  If the pool
@@ -181,7 +197,7 @@ struct pool {
 
 #define POOL_GROW(p, increase)                                  \
   GROW_ARRAY ((p)->contents, (p)->size, (p)->tail + (increase), \
-              (p)->resized, char)
+              (p)->resized, char, (p)->arena)
 
 /* Append text in the range [beg, end) to POOL.  No zero-termination
    is done.  */
@@ -207,14 +223,15 @@ struct pool {
 #define POOL_REWIND(p) (p)->tail = 0
 
 /* Free heap-allocated memory for contents of POOL.  This calls
-   xfree() if the memory was allocated through malloc.  It also
+   xfree() if the memory was allocated through malloc; memory taken
+   from an arena is left for the arena's owner to release.  It also
    restores `contents' and `size' to their original, pre-malloc
    values.  That way after POOL_FREE, the pool is fully usable, just
    as if it were freshly initialized with POOL_INIT.  */
 
 #define POOL_FREE(p) do {                       \
   struct pool *P = p;                           \
-  if (P->resized)                               \
+  if (P->resized && !P->arena)                  \
     xfree (P->contents);                        \
   P->contents = P->orig_contents;               \
   P->size = P->orig_size;                       \
@@ -232,16 +249,29 @@ struct pool {
    stumble upon large data.
 
    After the first resize, subsequent ones are performed with realloc,
-   just like DO_REALLOC.  */
+   just like DO_REALLOC.
+
+   If ARENA is non-NULL, the memory is taken from it rather than from
+   the heap, and must not be freed by the caller.  */
 
-#define GROW_ARRAY(basevar, sizevar, needed_size, resized, type) do {           \
+#define GROW_ARRAY(basevar, sizevar, needed_size, resized, type, arena) do {    \
   long ga_needed_size = (needed_size);                                          \
   long ga_newsize = (sizevar);                                                  \
   while (ga_newsize < ga_needed_size)                                           \
     ga_newsize <<= 1;                                                           \
   if (ga_newsize != (sizevar))                                                  \
     {                                                                           \
-      if (resized)                                                              \
+      if (arena)                                                                \
+        {                                                                       \
+          void *ga_new = arena_realloc (arena, resized ? basevar : NULL,        \
+                                        (sizevar) * sizeof (type),              \
+                                        ga_newsize * sizeof (type));            \
+          if (!resized)                                                         \
+            memcpy (ga_new, basevar, (sizevar) * sizeof (type));                \
+          (basevar) = ga_new;                                                   \
+          resized = true;                                                       \
+        }                                                                       \
+      else if (resized)                                                         \
         basevar = xrealloc (basevar, ga_newsize * sizeof (type));               \
       else                                                                      \
         {                                                                       \
@@ -825,17 +855,22 @@ static int tag_backout_count;
    (Obviously, the caller can filter out unwanted tags and attributes
    just as well, but this is just an optimization designed to avoid
    unnecessary copying of tags/attributes which the caller doesn't
-   care about.)  */
+   care about.)
+
+   If ARENA is non-NULL, temporary storage that doesn't fit on the
+   stack is allocated from it instead of the heap.  */
 
 void
 map_html_tags (const char *text, int size,
                void (*mapfun) (struct taginfo *, void *), void *maparg,
                int flags,
                const struct hash_table *allowed_tags,
-               const struct hash_table *allowed_attributes)
+               const struct hash_table *allowed_attributes,
+               struct arena *arena)
 {
   /* storage for strings passed to MAPFUN callback; if 256 bytes is
-     too little, POOL_APPEND allocates more with malloc. */
+     too little, POOL_APPEND allocates more with malloc (or from
+     ARENA). */
   char pool_initial_storage[256];
   struct pool pool;
 
@@ -853,7 +888,8 @@ map_html_tags (const char *text, int size,
   if (!size)
     return;
 
-  POOL_INIT (&pool, pool_initial_storage, countof (pool_initial_storage));
+  POOL_INIT (&pool, pool_initial_storage, countof (pool_initial_storage),
+             arena);
 
   {
     int nattrs, end_tag;
@@ -1077,7 +1113,7 @@ map_html_tags (const char *text, int size,
           continue;
 
         GROW_ARRAY (pairs, attr_pair_size, nattrs + 1, attr_pair_resized,
-                    struct attr_pair);
+                    struct attr_pair, arena);
 
         pairs[nattrs].name_pool_index = pool.tail;
         convert_and_copy (&pool, attr_name_begin, attr_name_end, AP_DOWNCASE);
@@ -1158,7 +1194,7 @@ map_html_tags (const char *text, int size,
 
  finish:
   POOL_FREE (&pool);
-  if (attr_pair_resized)
+  if (attr_pair_resized && !arena)
     xfree (pairs);
   /* pop any tag stack that's left */
   tagstack_pop (&head, &tail, head);
@@ -1196,7 +1232,7 @@ int main ()
       x = xrealloc (x, size);
     }
 
-  map_html_tags (x, length, test_mapper, &tag_counter, 0, NULL, NULL);
+  map_html_tags (x, length, test_mapper, &tag_counter, 0, NULL, NULL, NULL);
   printf ("TAGS: %d\n", tag_counter);
   printf ("Tag backouts:     %d\n", tag_backout_count);
   printf ("Comment backouts: %d\n", comment_backout_count);
@@ -58,6 +58,7 @@ struct taginfo {
 };
 
 struct hash_table;		/* forward declaration */
+struct arena;			/* forward declaration */
 
 /* Flags for map_html_tags: */
 #define MHT_STRICT_COMMENTS  1  /* use strict comment interpretation */
@@ -66,6 +67,7 @@ struct hash_table;		/* forward declaration */
 
 void map_html_tags (const char *, int,
 		    void (*) (struct taginfo *, void *), void *, int,
-		    const struct hash_table *, const struct hash_table *);
+		    const struct hash_table *, const struct hash_table *,
+		    struct arena *);
 
 #endif /* HTML_PARSE_H */
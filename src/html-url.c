@@ -35,17 +35,25 @@ as that of the covered work.  */
 #include <stdlib.h>
 #include <errno.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "exits.h"
+#include "connect.h"
 #include "html-parse.h"
 #include "url.h"
 #include "utils.h"
 #include "hash.h"
+#include "arena.h"
 #include "convert.h"
 #include "recur.h"
 #include "html-url.h"
 #include "css-url.h"
 
+#ifdef TESTING
+#include "test.h"
+#endif
+
 typedef void (*tag_handler_t) (int, struct taginfo *, struct map_context *);
 
 #define DECLARE_TAG_HANDLER(fun)                                \
@@ -272,7 +280,10 @@ find_attr (struct taginfo *tag, const char *name, int *attrind)
 
 /* Append LINK_URI to the urlpos structure that is being built.
 
-   LINK_URI will be merged with the current document base.
+   LINK_URI will be merged with the current document base.  If the
+   context has a link filter that drops the merged link, nothing is
+   appended and NULL is returned.  Otherwise, with a link filter, the
+   merged link is kept in the LINK member of the new element.
 */
 
 struct urlpos *
@@ -282,6 +293,8 @@ append_url (const char *link_uri, int position, int size,
   int link_has_scheme = url_has_scheme (link_uri);
   struct urlpos *newel;
   const char *base = ctx->base ? ctx->base : ctx->parent_base;
+  char *complete_uri = NULL;
+  const char *absolute_uri;
   struct url *url;
 
   struct iri *iri = iri_new ();
@@ -305,13 +318,20 @@ append_url (const char *link_uri, int position, int size,
           return NULL;
         }
 
-      url = url_parse (link_uri, NULL, iri, false);
+      if (ctx->filter && ctx->filter->skip_p (link_uri, ctx->filter->arg))
+        {
+          iri_free (iri);
+          return NULL;
+        }
+
+      url = url_parse_arena (link_uri, NULL, iri, false, ctx->arena);
       if (!url)
         {
           DEBUGP (("%s: link \"%s\" doesn't parse.\n",
                    ctx->document_file, link_uri));
           return NULL;
         }
+      absolute_uri = link_uri;
     }
   else
     {
@@ -319,7 +339,7 @@ append_url (const char *link_uri, int position, int size,
          canonicalized, i.e. that "../" have been resolved.
          (parse_url will do that for us.) */
 
-      char *complete_uri = uri_merge (base, link_uri);
+      complete_uri = uri_merge (base, link_uri);
 
       DEBUGP (("%s: merge(%s, %s) -> %s\n",
                quotearg_n_style (0, escape_quoting_style, ctx->document_file),
@@ -327,7 +347,16 @@ append_url (const char *link_uri, int position, int size,
                quote_n (2, link_uri),
                quotearg_n_style (3, escape_quoting_style, complete_uri)));
 
-      url = url_parse (complete_uri, NULL, iri, false);
+      if (ctx->filter && ctx->filter->skip_p (complete_uri, ctx->filter->arg))
+        {
+          DEBUGP (("%s: link \"%s\" already seen.\n",
+                   ctx->document_file, complete_uri));
+          xfree (complete_uri);
+          iri_free (iri);
+          return NULL;
+        }
+
+      url = url_parse_arena (complete_uri, NULL, iri, false, ctx->arena);
       if (!url)
         {
           DEBUGP (("%s: merged link \"%s\" doesn't parse.\n",
@@ -335,17 +364,25 @@ append_url (const char *link_uri, int position, int size,
           xfree (complete_uri);
           return NULL;
         }
-      xfree (complete_uri);
+      absolute_uri = complete_uri;
     }
 
   iri_free (iri);
 
   DEBUGP (("appending %s to urlpos.\n", quote (url->url)));
 
-  newel = xnew0 (struct urlpos);
+  if (ctx->arena)
+    newel = arena_new_obj (ctx->arena, struct urlpos);
+  else
+    newel = xnew0 (struct urlpos);
+  newel->arena = ctx->arena;
   newel->url = url;
   newel->pos = position;
   newel->size = size;
+  if (ctx->filter)
+    newel->link = (ctx->arena ? arena_strdup (ctx->arena, absolute_uri)
+                   : xstrdup (absolute_uri));
+  xfree_null (complete_uri);
 
   /* A URL is relative if the host is not named, and the name does not
      start with `/'.  */
@@ -475,13 +512,18 @@ static void
 tag_handle_base (int tagid, struct taginfo *tag, struct map_context *ctx)
 {
   struct urlpos *base_urlpos;
+  const struct link_filter *filter;
   int attrind;
   char *newbase = find_attr (tag, "href", &attrind);
   if (!newbase)
     return;
 
+  /* The base is needed even if the link itself would be dropped.  */
+  filter = ctx->filter;
+  ctx->filter = NULL;
   base_urlpos = append_url (newbase, ATTR_POS(tag,attrind,ctx),
                             ATTR_SIZE(tag,attrind), ctx);
+  ctx->filter = filter;
   if (!base_urlpos)
     return;
   base_urlpos->ignore_when_downloading = 1;
@@ -704,11 +746,12 @@ collect_tags_mapper (struct taginfo *tag, void *arg)
 
 /* Analyze HTML tags FILE and construct a list of URLs referenced from
    it.  It merges relative links in FILE with URL.  It is aware of
-   <base href=...> and does the right thing.  */
+   <base href=...> and does the right thing.  Links dropped by FILTER,
+   if non-NULL, are left out of the list.  */
 
 struct urlpos *
 get_urls_html (const char *file, const char *url, bool *meta_disallow_follow,
-               struct iri *iri)
+               struct iri *iri, const struct link_filter *filter)
 {
   struct file_memory *fm;
   struct map_context ctx;
@@ -729,6 +772,8 @@ get_urls_html (const char *file, const char *url, bool *meta_disallow_follow,
   ctx.parent_base = url ? url : opt.base_href;
   ctx.document_file = file;
   ctx.nofollow = false;
+  ctx.arena = arena_new (0);
+  ctx.filter = filter;
 
   if (!interesting_tags)
     init_interesting ();
@@ -746,7 +791,7 @@ get_urls_html (const char *file, const char *url, bool *meta_disallow_follow,
 
   /* the NULL here used to be interesting_tags */
   map_html_tags (fm->content, fm->length, collect_tags_mapper, &ctx, flags,
-                 NULL, interesting_attributes);
+                 NULL, interesting_attributes, ctx.arena);
 
   /* If meta charset isn't null, override content encoding */
   if (iri && meta_charset)
@@ -756,11 +801,78 @@ get_urls_html (const char *file, const char *url, bool *meta_disallow_follow,
   if (meta_disallow_follow)
     *meta_disallow_follow = ctx.nofollow;
 
+  arena_report (ctx.arena, file);
+  /* The arena is released by free_urlpos along with the list.  */
+  if (!ctx.head)
+    arena_free (ctx.arena);
+
   xfree_null (ctx.base);
   wget_read_file_free (fm);
   return ctx.head;
 }
 
+/* Parse the URL on the line [LINE_BEG, LINE_END) of the input file
+   FILE into an entry allocated from ARENA.  Returns NULL for blank
+   lines and invalid URLs, which are reported.  */
+
+static struct urlpos *
+parse_url_line (const char *file, const char *line_beg, const char *line_end,
+                struct arena *arena)
+{
+  int up_error_code;
+  char *url_text;
+  struct urlpos *entry;
+  struct url *url;
+
+  /* Strip whitespace from the beginning and end of line. */
+  while (line_beg < line_end && c_isspace (*line_beg))
+    ++line_beg;
+  while (line_end > line_beg && c_isspace (*(line_end - 1)))
+    --line_end;
+
+  if (line_beg == line_end)
+    return NULL;
+
+  /* The URL is in the [line_beg, line_end) region. */
+
+  /* We must copy the URL to a zero-terminated string, and we
+     can't use alloca because we're in a loop.  *sigh*.  */
+  url_text = strdupdelim (line_beg, line_end);
+
+  if (opt.base_href)
+    {
+      /* Merge opt.base_href with URL. */
+      char *merged = uri_merge (opt.base_href, url_text);
+      xfree (url_text);
+      url_text = merged;
+    }
+
+  char *new_url = rewrite_shorthand_url (url_text);
+  if (new_url)
+    {
+      xfree (url_text);
+      url_text = new_url;
+    }
+
+  url = url_parse_arena (url_text, &up_error_code, NULL, false, arena);
+  if (!url)
+    {
+      char *error = url_error (url_text, up_error_code);
+      logprintf (LOG_NOTQUIET, _("%s: Invalid URL %s: %s\n"),
+                 file, url_text, error);
+      xfree (url_text);
+      xfree (error);
+      inform_exit_status (URLERROR);
+      return NULL;
+    }
+  xfree (url_text);
+
+  entry = arena_new_obj (arena, struct urlpos);
+  entry->arena = arena;
+  entry->url = url;
+  return entry;
+}
+
 /* This doesn't really have anything to do with HTML, but it's similar
    to get_urls_html, so we put it here.  */
 
@@ -770,6 +882,7 @@ get_urls_file (const char *file)
   struct file_memory *fm;
   struct urlpos *head, *tail;
   const char *text, *text_end;
+  struct arena *arena;
 
   /* Load the file.  */
   fm = wget_read_file (file);
@@ -781,14 +894,12 @@ get_urls_file (const char *file)
   DEBUGP (("Loaded %s (size %s).\n", file, number_to_static_string (fm->length)));
 
   head = tail = NULL;
+  arena = arena_new (0);
   text = fm->content;
   text_end = fm->content + fm->length;
   while (text < text_end)
     {
-      int up_error_code;
-      char *url_text;
       struct urlpos *entry;
-      struct url *url;
 
       const char *line_beg = text;
       const char *line_end = memchr (text, '\n', text_end - text);
@@ -798,62 +909,222 @@ get_urls_file (const char *file)
         ++line_end;
       text = line_end;
 
-      /* Strip whitespace from the beginning and end of line. */
-      while (line_beg < line_end && c_isspace (*line_beg))
-        ++line_beg;
-      while (line_end > line_beg && c_isspace (*(line_end - 1)))
-        --line_end;
-
-      if (line_beg == line_end)
+      entry = parse_url_line (file, line_beg, line_end, arena);
+      if (!entry)
         continue;
 
-      /* The URL is in the [line_beg, line_end) region. */
+      if (!head)
+        head = entry;
+      else
+        tail->next = entry;
+      tail = entry;
+    }
+  arena_report (arena, file);
+  if (!head)
+    arena_free (arena);
+  wget_read_file_free (fm);
+  return head;
+}
+
+/* A reader of the URLs of an input file that parses them in batches,
+   as they are read, instead of loading the whole file first.  Memory
+   stays bounded however long the file is, and the URLs a pipe brings
+   are retrieved while the program feeding it is still running.  */
+
+struct url_file {
+  char *name;                   /* file name, for messages */
+  int fd;
+  char *buf;                    /* text read but not yet parsed is */
+  int start, end;               /* buf[start, end) */
+  int size;
+  bool eof;                     /* whether read found the end */
+};
 
-      /* We must copy the URL to a zero-terminated string, and we
-         can't use alloca because we're in a loop.  *sigh*.  */
-      url_text = strdupdelim (line_beg, line_end);
+/* Open FILE, or the standard input if FILE is "-", for
+   read_urls_file.  Returns NULL if it cannot be opened.  */
 
-      if (opt.base_href)
-        {
-          /* Merge opt.base_href with URL. */
-          char *merged = uri_merge (opt.base_href, url_text);
-          xfree (url_text);
-          url_text = merged;
-        }
+struct url_file *
+open_urls_file (const char *file)
+{
+  struct url_file *uf;
+  int fd = HYPHENP (file) ? fileno (stdin) : open (file, O_RDONLY);
+
+  if (fd < 0)
+    {
+      logprintf (LOG_NOTQUIET, "%s: %s\n", file, strerror (errno));
+      return NULL;
+    }
+  uf = xnew0 (struct url_file);
+  uf->name = xstrdup (file);
+  uf->fd = fd;
+  uf->size = 64 * 1024;
+  uf->buf = xmalloc (uf->size);
+  return uf;
+}
+
+/* Read more of UF into its buffer, after the line it holds a part
+   of.  */
+
+static void
+fill_urls_file (struct url_file *uf)
+{
+  int res;
 
-      char *new_url = rewrite_shorthand_url (url_text);
-      if (new_url)
+  if (uf->start > 0)
+    {
+      memmove (uf->buf, uf->buf + uf->start, uf->end - uf->start);
+      uf->end -= uf->start;
+      uf->start = 0;
+    }
+  if (uf->end == uf->size)
+    {
+      uf->size <<= 1;
+      uf->buf = xrealloc (uf->buf, uf->size);
+    }
+  do
+    res = read (uf->fd, uf->buf + uf->end, uf->size - uf->end);
+  while (res < 0 && errno == EINTR);
+  if (res > 0)
+    uf->end += res;
+  else
+    {
+      if (res < 0)
+        logprintf (LOG_NOTQUIET, "%s: %s\n", uf->name, strerror (errno));
+      uf->eof = true;
+    }
+}
+
+/* Return the list of the next URLs of UF, at most MAX of them.  The
+   URLs already read are returned rather than waiting for more, so a
+   pipe delivers its URLs as they come.  If no URL has been read and
+   BLOCK is false, NULL is returned when reading would block; a NULL
+   return means the end of the file only if urls_file_eof says so.
+   Free the list with free_urlpos.  */
+
+struct urlpos *
+read_urls_file (struct url_file *uf, int max, bool block)
+{
+  struct urlpos *head = NULL, *tail = NULL;
+  struct arena *arena = arena_new (0);
+  int count = 0;
+
+  while (count < max)
+    {
+      struct urlpos *entry;
+      char *line_beg = uf->buf + uf->start;
+      char *line_end = memchr (line_beg, '\n', uf->end - uf->start);
+
+      if (line_end)
+        uf->start = line_end + 1 - uf->buf;
+      else if (uf->eof)
         {
-          xfree (url_text);
-          url_text = new_url;
+          /* The last line may lack a newline.  */
+          if (uf->start == uf->end)
+            break;
+          line_end = uf->buf + uf->end;
+          uf->start = uf->end;
         }
-
-      url = url_parse (url_text, &up_error_code, NULL, false);
-      if (!url)
+      else
         {
-          char *error = url_error (url_text, up_error_code);
-          logprintf (LOG_NOTQUIET, _("%s: Invalid URL %s: %s\n"),
-                     file, url_text, error);
-          xfree (url_text);
-          xfree (error);
-          inform_exit_status (URLERROR);
+          if (head || (!block && select_fd (uf->fd, 0, WAIT_FOR_READ) == 0))
+            break;
+          fill_urls_file (uf);
           continue;
         }
-      xfree (url_text);
-
-      entry = xnew0 (struct urlpos);
-      entry->url = url;
 
+      entry = parse_url_line (uf->name, line_beg, line_end, arena);
+      if (!entry)
+        continue;
       if (!head)
         head = entry;
       else
         tail->next = entry;
       tail = entry;
+      ++count;
     }
-  wget_read_file_free (fm);
+  if (!head)
+    arena_free (arena);
   return head;
 }
 
+/* Whether all the URLs of UF have been read.  */
+
+bool
+urls_file_eof (const struct url_file *uf)
+{
+  return uf->eof && uf->start == uf->end;
+}
+
+void
+close_urls_file (struct url_file *uf)
+{
+  if (uf->fd != fileno (stdin))
+    close (uf->fd);
+  xfree (uf->name);
+  xfree (uf->buf);
+  xfree (uf);
+}
+
+#ifdef TESTING
+
+const char *
+test_read_urls_file()
+{
+  char name[] = "/tmp/wget-urls-XXXXXX";
+  struct url_file *uf;
+  struct urlpos *list, *u;
+  char *long_path;
+  FILE *fp;
+  int fd, i, n;
+
+  fd = mkstemp (name);
+  mu_assert ("test_read_urls_file: mkstemp failed", fd >= 0);
+  fp = fdopen (fd, "w");
+  for (i = 0; i < 2500; i++)
+    fprintf (fp, "  http://example.com/%d\n\n", i);
+  /* A line longer than the buffer, and a last line without newline.  */
+  long_path = xmalloc (100000);
+  memset (long_path, 'a', 99999);
+  long_path[99999] = '\0';
+  fprintf (fp, "http://example.com/%s\nhttp://example.com/last", long_path);
+  fclose (fp);
+
+  uf = open_urls_file (name);
+  mu_assert ("test_read_urls_file: open failed", uf != NULL);
+  n = 0;
+  while ((list = read_urls_file (uf, 1000, true)) != NULL)
+    {
+      for (i = 0, u = list; u; u = u->next, i++, n++)
+        {
+          char expected[64];
+
+          if (n < 2500)
+            sprintf (expected, "http://example.com/%d", n);
+          else if (n == 2500)
+            {
+              mu_assert ("test_read_urls_file: wrong long URL",
+                         strlen (u->url->url) == 19 + 99999);
+              continue;
+            }
+          else
+            strcpy (expected, "http://example.com/last");
+          mu_assert ("test_read_urls_file: wrong URL",
+                     !strcmp (u->url->url, expected));
+        }
+      mu_assert ("test_read_urls_file: batch too long", i <= 1000);
+      free_urlpos (list);
+    }
+  mu_assert ("test_read_urls_file: wrong count", n == 2502);
+  mu_assert ("test_read_urls_file: not at end", urls_file_eof (uf));
+  close_urls_file (uf);
+  unlink (name);
+  xfree (long_path);
+
+  return NULL;
+}
+
+#endif /* TESTING */
+
 void
 cleanup_html_url (void)
 {
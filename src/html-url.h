@@ -31,6 +31,18 @@ as that of the covered work.  */
 #ifndef HTML_URL_H
 #define HTML_URL_H
 
+struct url;
+
+/* Lets the caller drop links before they are parsed.  SKIP_P is
+   called with the absolute form of each link, i.e. the link merged
+   with the document's base, and returns true if the link is to be
+   dropped.  The absolute form of each link that is kept is stored in
+   the LINK member of its urlpos.  */
+struct link_filter {
+  bool (*skip_p) (const char *, void *);
+  void *arg;
+};
+
 struct map_context {
   char *text;			/* HTML text. */
   char *base;			/* Base URI of the document, possibly
@@ -41,10 +53,19 @@ struct map_context {
                                    <meta name=robots> tag. */
 
   struct urlpos *head;	/* List of URLs that is being built. */
+  struct arena *arena;		/* Arena the list is allocated from. */
+  const struct link_filter *filter; /* Links to drop, or NULL. */
 };
 
 struct urlpos *get_urls_file (const char *);
-struct urlpos *get_urls_html (const char *, const char *, bool *, struct iri *);
+
+struct url_file;
+struct url_file *open_urls_file (const char *);
+struct urlpos *read_urls_file (struct url_file *, int, bool);
+bool urls_file_eof (const struct url_file *);
+void close_urls_file (struct url_file *);
+struct urlpos *get_urls_html (const char *, const char *, bool *, struct iri *,
+                              const struct link_filter *);
 struct urlpos *append_url (const char *, int, int, struct map_context *);
 void free_urlpos (struct urlpos *);
 
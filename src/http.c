@@ -63,6 +63,7 @@ as that of the covered work.  */
 #include "convert.h"
 #include "spider.h"
 #include "warc.h"
+#include "metrics.h"
 
 #ifdef TESTING
 #include "test.h"
@@ -89,7 +90,6 @@ static void load_cookies (void);
 #endif
 
 
-static bool cookies_loaded_p;
 static struct cookie_jar *wget_cookie_jar;
 
 #define TEXTHTML_S "text/html"
@@ -1245,21 +1245,23 @@ static bool pconn_active;
 static struct {
 #else
 static pthread_mutex_t pconn_mutex;
+static pthread_once_t pconn_mutex_once = PTHREAD_ONCE_INIT;
 
 static void
-pconn_lock()
+pconn_mutex_init (void)
   {
-    static int pconn_mutex_init_p = 0;
-    if (! pconn_mutex_init_p)
-      {
-        pthread_mutexattr_t mta;
-        pthread_mutexattr_init (&mta);
-        pthread_mutexattr_settype (&mta, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutexattr_t mta;
+    pthread_mutexattr_init (&mta);
+    pthread_mutexattr_settype (&mta, PTHREAD_MUTEX_RECURSIVE);
 
-        pthread_mutex_init (&pconn_mutex, &mta);
-        pconn_mutex_init_p = 1;
-      }
+    pthread_mutex_init (&pconn_mutex, &mta);
+  }
 
+static void
+pconn_lock()
+  {
+    /* Several threads may take the lock for the first time at once.  */
+    pthread_once (&pconn_mutex_once, pconn_mutex_init);
     pthread_mutex_lock (&pconn_mutex);
   }
 
@@ -1696,6 +1698,8 @@ struct http_stat
   wgint orig_file_size;         /* size of file to compare for time-stamping */
   time_t orig_file_tstamp;      /* time-stamp of file to compare for
                                  * time-stamping */
+  bool accept_ranges;           /* true if the server said it serves
+                                   byte ranges */
 };
 
 static void
@@ -1757,6 +1761,7 @@ read_response_body (struct http_stat *hs, int sock, FILE *fp, wgint contlen,
 {
   int warc_payload_offset = 0;
   FILE *warc_tmp = NULL;
+  struct warc_digests warc_digests;
   int warcerr = 0;
 
   if (opt.warc_filename != NULL)
@@ -1775,6 +1780,11 @@ read_response_body (struct http_stat *hs, int sock, FILE *fp, wgint contlen,
           if (warc_tmp_written != head_len)
             warcerr = WARC_TMP_FWRITEERR;
           warc_payload_offset = head_len;
+
+          /* Digest the record as it is written, so that the WARC code
+             does not have to read it back.  */
+          warc_digests_init (&warc_digests, warc_payload_offset);
+          warc_digests_update (&warc_digests, head, head_len);
         }
 
       if (warcerr != 0)
@@ -1814,7 +1824,9 @@ read_response_body (struct http_stat *hs, int sock, FILE *fp, wgint contlen,
      response body to warc_tmp.  */
   hs->res = fd_read_body (url, sock, fp, contlen != -1 ? contlen : 0,
                           hs->restval, &hs->rd_size, &hs->len, &hs->dltime,
-                          flags, warc_tmp);
+                          flags, warc_tmp,
+                          warc_tmp != NULL && opt.warc_digests_enabled
+                          ? &warc_digests : NULL);
   if (hs->res >= 0)
     {
       if (warc_tmp != NULL)
@@ -1826,6 +1838,8 @@ read_response_body (struct http_stat *hs, int sock, FILE *fp, wgint contlen,
           bool r = warc_write_response_record (url, warc_timestamp_str,
                                                warc_request_uuid, warc_ip,
                                                warc_tmp, warc_payload_offset,
+                                               opt.warc_digests_enabled
+                                               ? &warc_digests : NULL,
                                                type, statcode, hs->newloc);
 
           /* warc_write_response_record has closed warc_tmp. */
@@ -1937,6 +1951,7 @@ gethttp (struct url *u, struct http_stat *hs, int *dt, struct url *proxy,
   bool head_only = !!(*dt & HEAD_ONLY);
 
   char *head;
+  struct ptimer *first_byte_timer;
   struct response *resp;
   char hdrval[512];
   char *message;
@@ -2029,11 +2044,13 @@ gethttp (struct url *u, struct http_stat *hs, int *dt, struct url *proxy,
 
   if(hs->restval_last)
     {
+      /* Not number_to_static_string, whose buffers the other segments
+         of the download share.  */
+      char first[24], last[24];
+      number_to_string (first, hs->restval);
+      number_to_string (last, hs->restval_last);
       request_set_header (req, "Range",
-                          aprintf ("bytes=%s-%s",
-                                   number_to_static_string (hs->restval),
-                                   number_to_static_string (hs->restval_last)),
-                          rel_value);
+                          aprintf ("bytes=%s-%s", first, last), rel_value);
     }
   else if (hs->restval)
     request_set_header (req, "Range",
@@ -2266,6 +2283,7 @@ gethttp (struct url *u, struct http_stat *hs, int *dt, struct url *proxy,
         {
           sock = -1;
         }
+      metrics_add (sock >= 0 ? METRIC_PCONN_HITS : METRIC_PCONN_MISSES, 1);
     }
 
   if (sock < 0)
@@ -2367,7 +2385,10 @@ gethttp (struct url *u, struct http_stat *hs, int *dt, struct url *proxy,
 
       if (conn->scheme == SCHEME_HTTPS)
         {
-          if (!ssl_connect_wget (sock, u->host))
+          struct ptimer *timer = metrics_start_timer ();
+          bool connected = ssl_connect_wget (sock, u->host);
+          metrics_observe (LATENCY_TLS, timer);
+          if (!connected)
             {
               fd_close (sock);
               request_free (req);
@@ -2475,7 +2496,9 @@ gethttp (struct url *u, struct http_stat *hs, int *dt, struct url *proxy,
 
 
 read_header:
+  first_byte_timer = metrics_start_timer ();
   head = read_http_response_head (sock);
+  metrics_observe (LATENCY_FIRST_BYTE, first_byte_timer);
   if (!head)
     {
       if (errno == 0)
@@ -2890,6 +2913,8 @@ read_header:
     }
   hs->newloc = resp_header_strdup (resp, "Location");
   hs->remote_time = resp_header_strdup (resp, "Last-Modified");
+  if (resp_header_copy (resp, "Accept-Ranges", hdrval, sizeof (hdrval)))
+    hs->accept_ranges = 0 == strcasecmp (hdrval, "bytes");
 
   if (resp_header_copy (resp, "Content-Range", hdrval, sizeof (hdrval)))
     {
@@ -3062,6 +3087,17 @@ read_header:
       xfree (head);
       return RANGEERR;
     }
+  if (hs->restval_last && statcode == HTTP_STATUS_OK)
+    {
+      /* The server sent the whole document in reply to a request for
+         a segment of it.  Let the caller fetch it in one piece.  */
+      logputs (LOG_VERBOSE, _("\
+\n    The server does not support ranges.\n\n"));
+      xfree_null (type);
+      CLOSE_INVALIDATE (sock);
+      xfree (head);
+      return RANGEERR;
+    }
   if (contlen == -1)
     hs->contlen = -1;
   else
@@ -3166,8 +3202,9 @@ read_header:
 # define FOPEN_BIN_FLAG true
 #endif /* def __VMS [else] */
 
-  /* Open the local file.  */
-  if (!output_stream)
+  /* Open the local file.  A segment goes to a file of its own even
+     with -O.  */
+  if (!output_stream || hs->restval_last)
     {
       mkalldirs (hs->local_file);
       if (opt.backups)
@@ -3297,11 +3334,12 @@ http_loop (struct url *u, struct url *original_url, char **newloc,
 
 
 #ifndef ENABLE_METALINK
-  /* Assert that no value for *LOCAL_FILE was passed. */
-  assert (local_file == NULL || *local_file == NULL);
+  /* Assert that no value for *LOCAL_FILE was passed, except for the
+     file of a segment. */
+  assert (range || local_file == NULL || *local_file == NULL);
 
   /* Set LOCAL_FILE parameter. */
-  if (local_file && opt.output_document)
+  if (local_file && opt.output_document && !range)
     *local_file = HYPHENP (opt.output_document) ? NULL : xstrdup (opt.output_document);
 #endif
 
@@ -3322,7 +3360,7 @@ http_loop (struct url *u, struct url *original_url, char **newloc,
   xzero (hstat);
   hstat.referer = referer;
 
-  if (opt.output_document)
+  if (opt.output_document && !range)
     {
       hstat.local_file = xstrdup (opt.output_document);
       got_name = true;
@@ -3337,7 +3375,8 @@ http_loop (struct url *u, struct url *original_url, char **newloc,
       got_name = true;
     }
 
-  if (got_name && file_exists_p (hstat.local_file) && opt.noclobber && !opt.output_document)
+  if (got_name && opt.noclobber && !opt.output_document
+      && file_exists_p (hstat.local_file))
     {
       /* If opt.noclobber is turned on and file already exists, do not
          retrieve the file. But if the output_document was given, then this
@@ -3364,20 +3403,25 @@ http_loop (struct url *u, struct url *original_url, char **newloc,
 
   /* Send preliminary HEAD request if -N is given and we have an existing
    * destination file. */
-  if (!opt.output_document)
-      file_name = url_file_name (opt.trustservernames ? u : original_url, NULL);
-  else
-    file_name = xstrdup (opt.output_document);
-  if (opt.timestamping && (file_exists_p (file_name)
-                           || opt.content_disposition))
-    send_head_first = true;
-  xfree (file_name);
+  if (opt.timestamping)
+    {
+      if (!opt.output_document)
+        file_name = url_file_name (opt.trustservernames ? u : original_url,
+                                   NULL);
+      else
+        file_name = xstrdup (opt.output_document);
+      if (file_exists_p (file_name) || opt.content_disposition)
+        send_head_first = true;
+      xfree (file_name);
+    }
 
   /* THE loop */
   do
     {
       /* Increment the pass counter.  */
       ++count;
+      if (count > 1)
+        metrics_add (METRIC_RETRIES, 1);
       sleep_between_retrievals (count);
 
       /* Get the current time string.  */
@@ -3443,7 +3487,9 @@ Spider mode enabled. Check if remote file exists.\n"));
 
       if (range)
         {
-          hstat.restval = range->first_byte;
+          /* Resume a segment where the previous try left off.  */
+          hstat.restval = (count > 1 && hstat.len > range->first_byte
+                           ? hstat.len : range->first_byte);
           hstat.restval_last = range -> last_byte;
         }
       else
@@ -3479,6 +3525,13 @@ Spider mode enabled. Check if remote file exists.\n"));
         case HERR: case HEOF: case CONSOCKERR: case CONCLOSED:
         case CONERROR: case READERR: case WRITEFAILED:
         case RANGEERR: case FOPEN_EXCL_ERR:
+          /* A server that ignores the range of a segment will not
+             honor it on the next try either.  */
+          if (err == RANGEERR && range)
+            {
+              ret = err;
+              goto exit;
+            }
           /* Non-fatal errors continue executing the loop, which will
              bring them to "while" statement at the end, to judge
              whether the number of tries was exceeded.  */
@@ -3747,7 +3800,7 @@ Remote file exists.\n\n"));
       /* End of time-stamping section. */
 
       tmrate = retr_rate (hstat.rd_size, hstat.dltime);
-      total_download_time += hstat.dltime;
+      count_download_time (hstat.dltime);
 
       if (hstat.len == hstat.contlen)
         {
@@ -3770,8 +3823,11 @@ Remote file exists.\n\n"));
                          number_to_static_string (hstat.contlen),
                          hstat.local_file, count);
             }
-          ++numurls;
-          total_downloaded_bytes += hstat.rd_size;
+          count_downloads (1, hstat.rd_size);
+          /* retrieve_segmented counts the whole of a segmented
+             download.  */
+          if (!range)
+            metrics_add_file (u->host, hstat.rd_size);
 
           /* Remember that we downloaded the file for later ".orig" code. */
           if (*dt & ADDED_HTML_EXTENSION)
@@ -3803,8 +3859,9 @@ Remote file exists.\n\n"));
                              tms, u->url, number_to_static_string (hstat.len),
                              hstat.local_file, count);
                 }
-              ++numurls;
-              total_downloaded_bytes += hstat.rd_size;
+              count_downloads (1, hstat.rd_size);
+              if (!range)
+                metrics_add_file (u->host, hstat.rd_size);
 
               /* Remember that we downloaded the file for later ".orig" code. */
               if (*dt & ADDED_HTML_EXTENSION)
@@ -3872,6 +3929,37 @@ exit:
   return ret;
 }
 
+/* Find out with a HEAD request whether the document at U can be
+   retrieved in segments, that is whether the server serves byte
+   ranges of it.  Returns its length if so, and -1 if it cannot, if it
+   is HTML or CSS, or if the request fails or is redirected.  */
+
+wgint
+http_range_length (struct url *u, struct url *proxy, struct iri *iri)
+{
+  struct http_stat hstat;
+  int dt = HEAD_ONLY;
+  wgint length = -1;
+  uerr_t err;
+
+  if (opt.cookies)
+    load_cookies ();
+
+  xzero (hstat);
+  hstat.referer = opt.referer;
+  hstat.local_file = url_file_name (u, NULL);
+  hstat.existence_checked = hstat.timestamp_checked = true;
+
+  err = gethttp (u, &hstat, &dt, proxy, iri, 1);
+  if (err == RETRFINISHED && (dt & RETROKF)
+      && !(dt & (TEXTHTML | TEXTCSS))
+      && hstat.accept_ranges && hstat.contlen > 0)
+    length = hstat.contlen;
+  free_hstat (&hstat);
+
+  return length;
+}
+
 /* Check whether the result of strptime() indicates success.
    strptime() returns the pointer to how far it got to in the string.
    The processing has been successful if the string is at `GMT' or
@@ -4313,16 +4401,27 @@ create_authorization_line (const char *au, const char *user,
     }
 }
 
+static void
+load_cookies_1 (void)
+{
+  wget_cookie_jar = cookie_jar_new ();
+  if (opt.cookies_input)
+    cookie_jar_load (wget_cookie_jar, opt.cookies_input);
+}
+
+/* Create the cookie jar and load the cookies into it, once for all
+   the threads.  */
+
 static void
 load_cookies (void)
 {
+#ifdef ENABLE_THREADS
+  static pthread_once_t load_cookies_once = PTHREAD_ONCE_INIT;
+  pthread_once (&load_cookies_once, load_cookies_1);
+#else
   if (!wget_cookie_jar)
-    wget_cookie_jar = cookie_jar_new ();
-  if (opt.cookies_input && !cookies_loaded_p)
-    {
-      cookie_jar_load (wget_cookie_jar, opt.cookies_input);
-      cookies_loaded_p = true;
-    }
+    load_cookies_1 ();
+#endif
 }
 
 void
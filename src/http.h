@@ -37,6 +37,7 @@ struct url;
 
 uerr_t http_loop (struct url *, struct url *, char **, char **, const char *,
                   int *, struct url *, struct iri *, struct range *);
+wgint http_range_length (struct url *, struct url *, struct iri *);
 void save_cookies (void);
 void http_cleanup (void);
 time_t http_atotm (const char *);
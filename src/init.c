@@ -64,8 +64,10 @@ as that of the covered work.  */
 #include "progress.h"
 #include "recur.h"              /* for INFINITE_RECURSION */
 #include "convert.h"            /* for convert_cleanup */
+#include "intern.h"             /* for intern_cleanup */
 #include "res.h"                /* for res_cleanup */
 #include "http.h"               /* for http_cleanup */
+#include "ftp.h"                /* for ftp_cleanup */
 #include "retr.h"               /* for output_stream */
 #include "warc.h"               /* for warc_close */
 
@@ -95,8 +97,12 @@ CMD_DECLARE (cmd_vector);
 
 CMD_DECLARE (cmd_spec_dirstruct);
 CMD_DECLARE (cmd_spec_header);
+#ifdef HAVE_LIBZ
+CMD_DECLARE (cmd_spec_warc_compression_level);
+#endif
 CMD_DECLARE (cmd_spec_warc_header);
 CMD_DECLARE (cmd_spec_htmlify);
+CMD_DECLARE (cmd_spec_log_format);
 CMD_DECLARE (cmd_spec_mirror);
 CMD_DECLARE (cmd_spec_prefer_family);
 CMD_DECLARE (cmd_spec_progress);
@@ -177,6 +183,11 @@ static const struct {
   { "followftp",        &opt.follow_ftp,        cmd_boolean },
   { "followtags",       &opt.follow_tags,       cmd_vector },
   { "forcehtml",        &opt.force_html,        cmd_boolean },
+  { "frontierdir",      &opt.frontier_dir,      cmd_directory },
+  { "frontiermemory",   &opt.frontier_memory,   cmd_number },
+#ifdef ENABLE_THREADS
+  { "ftpconnections",   &opt.ftp_connections,   cmd_number },
+#endif
   { "ftppasswd",        &opt.ftp_passwd,        cmd_string }, /* deprecated */
   { "ftppassword",      &opt.ftp_passwd,        cmd_string },
   { "ftpproxy",         &opt.ftp_proxy,         cmd_string },
@@ -186,6 +197,9 @@ static const struct {
   { "ftpuser",          &opt.ftp_user,          cmd_string },
   { "glob",             &opt.ftp_glob,          cmd_boolean },
   { "header",           NULL,                   cmd_spec_header },
+#ifdef ENABLE_THREADS
+  { "hostconnections",  &opt.host_connections,  cmd_number },
+#endif
   { "htmlextension",    &opt.adjust_extension,  cmd_boolean }, /* deprecated */
   { "htmlify",          NULL,                   cmd_spec_htmlify },
   { "httpkeepalive",    &opt.http_keep_alive,   cmd_boolean },
@@ -215,12 +229,14 @@ static const struct {
   { "loadcookies",      &opt.cookies_input,     cmd_file },
   { "localencoding",    &opt.locale,            cmd_string },
   { "logfile",          &opt.lfilename,         cmd_file },
+  { "logformat",        NULL,                   cmd_spec_log_format },
   { "login",            &opt.ftp_user,          cmd_string },/* deprecated*/
   { "maxredirect",      &opt.max_redirect,      cmd_number },
 #ifdef ENABLE_METALINK
   { "metalink",         &opt.metalink_file,     cmd_file },
 #endif
   { "method",           &opt.method,            cmd_string_uppercase },
+  { "metricsfile",      &opt.metrics_file,      cmd_file },
   { "mirror",           NULL,                   cmd_spec_mirror },
   { "netrc",            &opt.netrc,             cmd_boolean },
   { "noclobber",        &opt.noclobber,         cmd_boolean },
@@ -297,6 +313,7 @@ static const struct {
   { "warccdxdedup",     &opt.warc_cdx_dedup_filename,  cmd_file },
 #ifdef HAVE_LIBZ
   { "warccompression",  &opt.warc_compression_enabled, cmd_boolean },
+  { "warccompressionlevel", &opt.warc_compression_level, cmd_spec_warc_compression_level },
 #endif
   { "warcdigests",      &opt.warc_digests_enabled, cmd_boolean },
   { "warcfile",         &opt.warc_filename,     cmd_file },
@@ -351,6 +368,9 @@ defaults (void)
   opt.ntry = 20;
 #ifdef ENABLE_THREADS
   opt.jobs = 1;
+  opt.ftp_connections = 4;
+  opt.host_connections = 4;
+  opt.frontier_memory = 100000;
 #endif
 #ifdef ENABLE_METALINK
   opt.n_retries = 1;
@@ -414,6 +434,7 @@ defaults (void)
   opt.warc_maxsize = 0; /* 1024 * 1024 * 1024; */
 #ifdef HAVE_LIBZ
   opt.warc_compression_enabled = true;
+  opt.warc_compression_level = 9;
 #else
   opt.warc_compression_enabled = false;
 #endif
@@ -1315,6 +1336,27 @@ cmd_spec_header (const char *com, const char *val, void *place_ignored)
   return true;
 }
 
+#ifdef HAVE_LIBZ
+/* Set the GZIP compression level of WARC records, from 0 to 9.  */
+static bool
+cmd_spec_warc_compression_level (const char *com, const char *val,
+                                 void *place)
+{
+  int level;
+
+  if (!cmd_number (com, val, &level))
+    return false;
+  if (level > 9)
+    {
+      fprintf (stderr, _("%s: %s: Invalid number %s.\n"),
+               exec_name, com, quote (val));
+      return false;
+    }
+  *(int *) place = level;
+  return true;
+}
+#endif
+
 static bool
 cmd_spec_warc_header (const char *com, const char *val, void *place_ignored)
 {
@@ -1367,6 +1409,24 @@ cmd_spec_mirror (const char *com, const char *val, void *place_ignored)
   return true;
 }
 
+/* Validate --log-format and set the choice.  Allowed values are
+   "plain" and "json".  */
+
+static bool
+cmd_spec_log_format (const char *com, const char *val, void *place_ignored)
+{
+  static const struct decode_item choices[] = {
+    { "plain", log_format_plain },
+    { "json", log_format_json },
+  };
+  int log_format = log_format_plain;
+  int ok = decode_string (val, choices, countof (choices), &log_format);
+  if (!ok)
+    fprintf (stderr, _("%s: %s: Invalid value %s.\n"), exec_name, com, quote (val));
+  opt.log_format = log_format;
+  return ok;
+}
+
 /* Validate --prefer-family and set the choice.  Allowed values are
    "IPv4", "IPv6", and "none".  */
 
@@ -1744,9 +1804,12 @@ cleanup (void)
 
 #ifdef DEBUG_MALLOC
   convert_cleanup ();
+  intern_cleanup ();
   res_cleanup ();
   http_cleanup ();
+  ftp_cleanup ();
   cleanup_html_url ();
+  url_cleanup ();
   spider_cleanup ();
   host_cleanup ();
   log_cleanup ();
@@ -1762,6 +1825,8 @@ cleanup (void)
   xfree_null (opt.lfilename);
   xfree_null (opt.dir_prefix);
   xfree_null (opt.input_filename);
+  xfree_null (opt.frontier_dir);
+  xfree_null (opt.metrics_file);
   xfree_null (opt.output_document);
   free_vec (opt.accepts);
   free_vec (opt.rejects);
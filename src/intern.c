@@ -0,0 +1,236 @@
+/* String interning.
+   Copyright (C) 2014 Free Software Foundation, Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+
+/* This module keeps a single copy of each string handed to it and
+   returns the same pointer for equal strings.  The link conversion
+   tables use it for the URLs and file names they keep for the whole
+   run, which they would otherwise hold in several copies.
+
+   The strings are packed into an arena and indexed by an
+   open-addressed table of 64-bit fingerprints, so that each distinct
+   string costs its own length plus about twenty bytes.  Interned
+   strings are never freed individually; they live until
+   intern_cleanup is called at exit.
+
+   The entry points are:
+
+     intern_string  -- return the interned copy of a string, adding it
+                       if necessary.
+     intern_lookup  -- return the interned copy of a string, or NULL.
+     intern_cleanup -- release all interned strings.  */
+
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#ifdef ENABLE_THREADS
+# include <pthread.h>
+#endif
+
+#include "utils.h"
+#include "hash.h"
+#include "arena.h"
+#include "intern.h"
+
+/* Size of the arena blocks holding the strings.  */
+#define INTERN_BLOCK_SIZE 65536
+
+/* Initial size of the table; must be a power of two.  */
+#define INTERN_INITIAL_SIZE 1024
+
+struct intern_cell {
+  uint64_t fingerprint;         /* hash of STRING */
+  const char *string;           /* the interned string, or NULL if the
+                                   cell is empty */
+};
+
+static struct intern_cell *cells;
+static unsigned long size;      /* number of cells, a power of two */
+static unsigned long count;     /* number of occupied cells */
+static struct arena *strings;
+
+#ifdef ENABLE_THREADS
+static pthread_mutex_t intern_mutex = PTHREAD_MUTEX_INITIALIZER;
+# define INTERN_LOCK pthread_mutex_lock (&intern_mutex)
+# define INTERN_UNLOCK pthread_mutex_unlock (&intern_mutex)
+#else
+# define INTERN_LOCK
+# define INTERN_UNLOCK
+#endif
+
+/* Return the cell holding S (with fingerprint FP), or the empty cell
+   where it would be stored.  */
+
+static struct intern_cell *
+find_cell (const char *s, uint64_t fp)
+{
+  unsigned long mask = size - 1;
+  unsigned long i = (unsigned long) fp & mask;
+
+  while (cells[i].string)
+    {
+      if (cells[i].fingerprint == fp && !strcmp (cells[i].string, s))
+        break;
+      i = (i + 1) & mask;
+    }
+  return &cells[i];
+}
+
+/* Double the size of the table.  */
+
+static void
+grow_table (void)
+{
+  struct intern_cell *old_cells = cells;
+  unsigned long old_size = size, i;
+
+  size = old_size ? old_size * 2 : INTERN_INITIAL_SIZE;
+  cells = xnew0_array (struct intern_cell, size);
+  for (i = 0; i < old_size; i++)
+    if (old_cells[i].string)
+      {
+        unsigned long mask = size - 1;
+        unsigned long j = (unsigned long) old_cells[i].fingerprint & mask;
+        while (cells[j].string)
+          j = (j + 1) & mask;
+        cells[j] = old_cells[i];
+      }
+  xfree_null (old_cells);
+}
+
+/* Return the interned copy of S, creating it if S has not been seen
+   before.  The returned string must not be modified or freed.  */
+
+const char *
+intern_string (const char *s)
+{
+  size_t len = strlen (s);
+  uint64_t fp = hash_string_64 (s, len);
+  struct intern_cell *cell;
+  const char *result;
+
+  INTERN_LOCK;
+  /* Keep the table at most 3/4 full.  */
+  if ((count + 1) * 4 > size * 3)
+    grow_table ();
+  if (!strings)
+    strings = arena_new (INTERN_BLOCK_SIZE);
+
+  cell = find_cell (s, fp);
+  if (!cell->string)
+    {
+      char *copy = arena_alloc (strings, len + 1);
+      memcpy (copy, s, len + 1);
+      cell->fingerprint = fp;
+      cell->string = copy;
+      ++count;
+    }
+  result = cell->string;
+  INTERN_UNLOCK;
+
+  return result;
+}
+
+/* Return the interned copy of S, or NULL if S has not been
+   interned.  */
+
+const char *
+intern_lookup (const char *s)
+{
+  const char *result = NULL;
+
+  INTERN_LOCK;
+  if (count)
+    result = find_cell (s, hash_string_64 (s, strlen (s)))->string;
+  INTERN_UNLOCK;
+
+  return result;
+}
+
+/* Release all interned strings.  Pointers previously returned by
+   intern_string become invalid.  */
+
+void
+intern_cleanup (void)
+{
+  INTERN_LOCK;
+  if (strings)
+    {
+      DEBUGP (("Interned %lu strings in a table of %lu cells.\n",
+               count, size));
+      arena_report (strings, "interned strings");
+      arena_free (strings);
+      strings = NULL;
+    }
+  xfree_null (cells);
+  cells = NULL;
+  size = count = 0;
+  INTERN_UNLOCK;
+}
+
+#ifdef TESTING
+
+#include "test.h"
+
+const char *
+test_intern_string (void)
+{
+  char buf[32];
+  const char *a, *b;
+  int i;
+
+  a = intern_string ("http://www.example.com/");
+  mu_assert ("test_intern_string: copy returned",
+             a != NULL && !strcmp (a, "http://www.example.com/"));
+  strcpy (buf, "http://www.example.com/");
+  b = intern_string (buf);
+  mu_assert ("test_intern_string: equal strings not shared", a == b);
+  mu_assert ("test_intern_string: lookup failed", intern_lookup (buf) == a);
+  mu_assert ("test_intern_string: unknown string found",
+             intern_lookup ("http://www.example.com/x") == NULL);
+
+  /* Force the table to grow and check that old strings survive.  */
+  for (i = 0; i < 5000; i++)
+    {
+      sprintf (buf, "http://h/%d", i);
+      intern_string (buf);
+    }
+  mu_assert ("test_intern_string: string lost after growth",
+             intern_lookup ("http://www.example.com/") == a);
+  mu_assert ("test_intern_string: grown entry missing",
+             intern_lookup ("http://h/4321") != NULL);
+
+  intern_cleanup ();
+  return NULL;
+}
+
+#endif /* TESTING */
@@ -37,6 +37,12 @@ as that of the covered work.  */
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h>
+#include <sys/time.h>
+#ifdef ENABLE_THREADS
+# include <pthread.h>
+# include <semaphore.h>
+#endif
 
 #include "utils.h"
 #include "log.h"
@@ -326,11 +332,438 @@ get_warc_log_fp (void)
   return NULL;
 }
 
+/* Buffered logging.
+
+   With --jobs, several threads log at the same time, and a message
+   printed in pieces, such as "Connecting to host... " followed later
+   by "connected.", would be torn apart by the messages of the other
+   threads.  Instead, each thread assembles its output in a log buffer
+   of its own, and hands whole lines over as log records.  The records
+   are pushed to a lock-free queue, and a writer thread writes them to
+   the log in batches, flushing the log once per batch rather than
+   after every message.  While the writer runs, it is the only thread
+   that touches the log files and the saved context lines.
+
+   Each record carries the number of the thread that logged it (0 for
+   the main thread; with --jobs, every download runs in a thread of
+   its own) and the time at which its first character was logged.
+   These are shown with --log-format=json, which writes each line of
+   output as a JSON object.  That format needs whole lines as well, so
+   it buffers the output in the same way even without --jobs; the
+   records are then written by the thread that completes them.  */
+
+/* Whether log output goes through log buffers.  Set by log_init.  */
+static bool buffered_log_p;
+
+/* The level of the messages logged by debug_logprintf, used only for
+   tagging records.  */
+#define LOG_DEBUG_LEVEL (LOG_ALWAYS + 1)
+
+enum log_record_type {
+  LR_TEXT,                      /* output to be logged */
+  LR_SYNC,                      /* wake up the thread in log_sync */
+  LR_STOP                       /* make the writer thread exit */
+};
+
+struct log_record {
+  struct log_record *next;
+  enum log_record_type type;
+  int thread_id;
+  int level;                    /* level of the first message */
+  bool save;                    /* whether to save TEXT as context */
+  bool done;                    /* LR_SYNC has been reached */
+  struct timeval time;
+  char text[1];                 /* the output, possibly several lines */
+};
+
+struct log_buffer {
+  char *text;                   /* output not yet handed over */
+  int length;
+  int size;
+  int level;
+  struct timeval time;
+  bool save_context;            /* see log_set_save_context */
+  int thread_id;
+};
+
+#ifdef ENABLE_THREADS
+static pthread_key_t log_buffer_key;
+static pthread_once_t log_buffer_key_once = PTHREAD_ONCE_INIT;
+
+/* The number of threads that have logged so far.  */
+static int log_thread_count;
+
+/* Whether records are handed over to log_writer_thread rather than
+   written by the threads that log them.  */
+static bool log_writer_running;
+static pthread_t log_writer;
+
+/* Records pushed by the logging threads, most recent first.
+   Producers push with a compare-and-swap, and the writer takes the
+   whole list at once, so the queue needs no lock.  LOG_QUEUE_SEM is
+   posted whenever a record is pushed to an empty queue.  */
+static struct log_record *log_queue;
+static sem_t log_queue_sem;
+
+/* Protect the DONE flag of LR_SYNC records.  */
+static pthread_mutex_t log_sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_synced = PTHREAD_COND_INITIALIZER;
+#else
+static struct log_buffer *the_log_buffer;
+#endif
+
+static void log_flush_files (void);
+static void log_buffer_push (struct log_buffer *);
+
+/* Write LINE_END - LINE, a single line of REC without the newline, as
+   a JSON object.  */
+
+static void
+log_write_json_line (FILE *fp, const struct log_record *rec,
+                     const char *line, const char *line_end)
+{
+  static const char *level_names[] = {
+    "verbose", "notquiet", "nonverbose", "always", "debug"
+  };
+  const char *p;
+
+  fprintf (fp, "{\"time\":%ld.%03ld,\"thread\":%d,\"level\":\"%s\","
+           "\"message\":\"", (long) rec->time.tv_sec,
+           (long) rec->time.tv_usec / 1000, rec->thread_id,
+           level_names[rec->level]);
+  for (p = line; p < line_end; p++)
+    {
+      unsigned char c = *p;
+      if (c == '"' || c == '\\')
+        {
+          putc ('\\', fp);
+          putc (c, fp);
+        }
+      else if (c < 0x20 || c == 0x7f)
+        fprintf (fp, "\\u%04x", c);
+      else
+        putc (c, fp);
+    }
+  FPUTS ("\"}\n", fp);
+}
+
+/* The thread whose output last left a line unfinished, such as a
+   progress bar, or -1.  */
+static int unfinished_thread_id = -1;
+
+/* Write the text of REC to the log files, and save it as context if
+   needed.  */
+
+static void
+log_write_record (const struct log_record *rec)
+{
+  FILE *fp = get_log_fp ();
+  FILE *warcfp = get_warc_log_fp ();
+  size_t len = strlen (rec->text);
+  if (!fp || !len)
+    return;
+
+  if (opt.log_format == log_format_json)
+    {
+      /* Blank lines only separate plain text output, so they are
+         left out.  */
+      const char *p = rec->text;
+      while (*p)
+        {
+          const char *end = strchr (p, '\n');
+          if (!end)
+            end = p + strlen (p);
+          if (end > p)
+            log_write_json_line (fp, rec, p, end);
+          p = *end ? end + 1 : end;
+        }
+    }
+  else
+    {
+      /* Don't append the output of one thread to a line left
+         unfinished by another.  */
+      if (unfinished_thread_id >= 0 && unfinished_thread_id != rec->thread_id)
+        FPUTS ("\n", fp);
+      FPUTS (rec->text, fp);
+    }
+  unfinished_thread_id = rec->text[len - 1] == '\n' ? -1 : rec->thread_id;
+  if (warcfp != NULL)
+    FPUTS (rec->text, warcfp);
+  if (save_context_p && rec->save)
+    saved_append (rec->text);
+}
+
+#ifdef ENABLE_THREADS
+static void
+log_queue_push (struct log_record *rec)
+{
+  struct log_record *head = __atomic_load_n (&log_queue, __ATOMIC_RELAXED);
+  do
+    rec->next = head;
+  while (!__atomic_compare_exchange_n (&log_queue, &head, rec, true,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  if (!head)
+    sem_post (&log_queue_sem);
+}
+
+/* The writer thread.  Write the queued records in the order they
+   were pushed, until an LR_STOP record is found.  */
+
+static void *
+log_writer_thread (void *arg)
+{
+  bool stop = false;
+  while (!stop)
+    {
+      struct log_record *rec, *next, *list = NULL;
+
+      while (sem_wait (&log_queue_sem) < 0 && errno == EINTR)
+        ;
+      rec = __atomic_exchange_n (&log_queue, NULL, __ATOMIC_ACQUIRE);
+      for (; rec; rec = next)
+        {
+          next = rec->next;
+          rec->next = list;
+          list = rec;
+        }
+
+      check_redirect_output ();
+      for (rec = list; rec; rec = next)
+        {
+          next = rec->next;
+          switch (rec->type)
+            {
+            case LR_TEXT:
+              log_write_record (rec);
+              free (rec);
+              break;
+            case LR_SYNC:
+              /* The waiting thread frees REC.  */
+              log_flush_files ();
+              pthread_mutex_lock (&log_sync_mutex);
+              rec->done = true;
+              pthread_cond_broadcast (&log_synced);
+              pthread_mutex_unlock (&log_sync_mutex);
+              break;
+            case LR_STOP:
+              stop = true;
+              free (rec);
+              break;
+            }
+        }
+      log_flush_files ();
+    }
+  return NULL;
+}
+
+/* Wait until the writer thread has written and flushed everything
+   that has been pushed so far.  */
+
+static void
+log_sync (void)
+{
+  struct log_record *rec = xnew0 (struct log_record);
+  rec->type = LR_SYNC;
+  log_queue_push (rec);
+  pthread_mutex_lock (&log_sync_mutex);
+  while (!rec->done)
+    pthread_cond_wait (&log_synced, &log_sync_mutex);
+  pthread_mutex_unlock (&log_sync_mutex);
+  xfree (rec);
+}
+
+/* Write out the queued records and stop the writer thread.  Later
+   records are written by the threads that log them.  */
+
+static void
+log_stop_writer (void)
+{
+  struct log_record *rec;
+  if (!log_writer_running || pthread_equal (pthread_self (), log_writer))
+    return;
+  rec = xnew0 (struct log_record);
+  rec->type = LR_STOP;
+  log_queue_push (rec);
+  pthread_join (log_writer, NULL);
+  sem_destroy (&log_queue_sem);
+  log_writer_running = false;
+}
+
+static void
+log_start_writer (void)
+{
+  if (sem_init (&log_queue_sem, 0, 0) < 0)
+    return;
+  if (pthread_create (&log_writer, NULL, log_writer_thread, NULL) != 0)
+    {
+      sem_destroy (&log_queue_sem);
+      return;
+    }
+  log_writer_running = true;
+  /* Don't lose the queued output when some other code calls exit.  */
+  atexit (log_stop_writer);
+}
+
+static void
+free_log_buffer (void *arg)
+{
+  struct log_buffer *buf = arg;
+  /* Hand over what is left of the thread's output.  */
+  if (buf->length)
+    log_buffer_push (buf);
+  free (buf->text);
+  free (buf);
+}
+
+static void
+create_log_buffer_key (void)
+{
+  pthread_key_create (&log_buffer_key, free_log_buffer);
+}
+#endif /* ENABLE_THREADS */
+
+/* Hand REC over to be written.  */
+
+static void
+log_push (struct log_record *rec)
+{
+#ifdef ENABLE_THREADS
+  if (log_writer_running)
+    {
+      log_queue_push (rec);
+      return;
+    }
+#endif
+  check_redirect_output ();
+  log_write_record (rec);
+  free (rec);
+  if (flush_log_p)
+    log_flush_files ();
+  else
+    needs_flushing = true;
+}
+
+/* Return the log buffer of the calling thread, creating it if
+   necessary.  Return NULL if it cannot be allocated.
+
+   The log buffers and records are allocated with malloc rather than
+   xmalloc, because memfatal logs its message before exiting.  */
+
+static struct log_buffer *
+get_log_buffer (void)
+{
+  struct log_buffer *buf;
+#ifdef ENABLE_THREADS
+  pthread_once (&log_buffer_key_once, create_log_buffer_key);
+  buf = pthread_getspecific (log_buffer_key);
+#else
+  buf = the_log_buffer;
+#endif
+  if (buf)
+    return buf;
+
+  buf = calloc (1, sizeof *buf);
+  if (!buf)
+    return NULL;
+  buf->save_context = true;
+#ifdef ENABLE_THREADS
+  buf->thread_id = __atomic_fetch_add (&log_thread_count, 1,
+                                       __ATOMIC_RELAXED);
+  pthread_setspecific (log_buffer_key, buf);
+#else
+  the_log_buffer = buf;
+#endif
+  return buf;
+}
+
+/* Hand the contents of BUF over as a record, and empty BUF.  */
+
+static void
+log_buffer_push (struct log_buffer *buf)
+{
+  struct log_record *rec = malloc (offsetof (struct log_record, text)
+                                   + buf->length + 1);
+  if (!rec)
+    {
+      FILE *fp = get_log_fp ();
+      if (fp)
+        FPUTS (buf->text, fp);
+      buf->length = 0;
+      return;
+    }
+
+  rec->type = LR_TEXT;
+  rec->thread_id = buf->thread_id;
+  rec->level = buf->level;
+  rec->save = buf->save_context;
+  rec->done = false;
+  rec->time = buf->time;
+  memcpy (rec->text, buf->text, buf->length + 1);
+  buf->length = 0;
+  log_push (rec);
+}
+
+/* Append S, logged at LEVEL, to the log buffer of the calling thread.
+   Hand the buffer over once it ends with a whole line.  */
+
+static void
+log_buffer_append (int level, const char *s)
+{
+  struct log_buffer *buf;
+  int len = strlen (s);
+
+  if (!len)
+    return;
+  buf = get_log_buffer ();
+  if (buf && buf->length + len + 1 > buf->size)
+    {
+      int size = buf->size ? buf->size : 256;
+      char *text;
+      while (size < buf->length + len + 1)
+        size <<= 1;
+      text = realloc (buf->text, size);
+      if (text)
+        {
+          buf->text = text;
+          buf->size = size;
+        }
+      else
+        {
+          /* Out of memory: log the pieces directly.  */
+          if (buf->length)
+            log_buffer_push (buf);
+          buf = NULL;
+        }
+    }
+  if (!buf)
+    {
+      FILE *fp = get_log_fp ();
+      if (fp)
+        FPUTS (s, fp);
+      return;
+    }
+
+  if (!buf->length)
+    {
+      buf->level = level;
+      gettimeofday (&buf->time, NULL);
+    }
+  memcpy (buf->text + buf->length, s, len + 1);
+  buf->length += len;
+  if (buf->text[buf->length - 1] == '\n')
+    log_buffer_push (buf);
+}
+
 /* Sets the file descriptor for the secondary log file.  */
 
 void
 log_set_warc_log_fp (FILE * fp)
 {
+#ifdef ENABLE_THREADS
+  /* Let the writer thread finish with the old file first.  */
+  if (log_writer_running)
+    log_sync ();
+#endif
   warclogfp = fp;
 }
 
@@ -343,6 +776,13 @@ logputs (enum log_options o, const char *s)
   FILE *fp;
   FILE *warcfp;
 
+  if (buffered_log_p)
+    {
+      CHECK_VERBOSE (o);
+      log_buffer_append (o, s);
+      return;
+    }
+
   check_redirect_output ();
   if ((fp = get_log_fp ()) == NULL)
     return;
@@ -381,17 +821,23 @@ struct logvprintf_state {
    portable.)  */
 
 static bool
-log_vprintf_internal (struct logvprintf_state *state, const char *fmt,
-                      va_list args)
+log_vprintf_internal (struct logvprintf_state *state, int level,
+                      const char *fmt, va_list args)
 {
   char smallmsg[128];
   char *write_ptr = smallmsg;
   int available_size = sizeof (smallmsg);
   int numwritten;
-  FILE *fp = get_log_fp ();
-  FILE *warcfp = get_warc_log_fp ();
+  FILE *fp = NULL;
+  FILE *warcfp = NULL;
+
+  if (!buffered_log_p)
+    {
+      fp = get_log_fp ();
+      warcfp = get_warc_log_fp ();
+    }
 
-  if (!save_context_p && warcfp == NULL)
+  if (!buffered_log_p && !save_context_p && warcfp == NULL)
     {
       /* In the simple case just call vfprintf(), to avoid needless
          allocation and games with vsnprintf(). */
@@ -441,6 +887,13 @@ log_vprintf_internal (struct logvprintf_state *state, const char *fmt,
     }
 
   /* Writing succeeded. */
+  if (buffered_log_p)
+    {
+      log_buffer_append (level, write_ptr);
+      if (state->bigmsg)
+        xfree (state->bigmsg);
+      return true;
+    }
   if (save_context_p)
     saved_append (write_ptr);
   FPUTS (write_ptr, fp);
@@ -458,9 +911,51 @@ log_vprintf_internal (struct logvprintf_state *state, const char *fmt,
   return true;
 }
 
-/* Flush LOGFP.  Useful while flushing is disabled.  */
+/* Flush LOGFP.  Useful while flushing is disabled.  With buffered
+   logging, also hand over the pending output of the calling thread,
+   even if it doesn't end with a whole line, and wait until it has been
+   written.  */
 void
 logflush (void)
+{
+  if (buffered_log_p)
+    {
+      struct log_buffer *buf = get_log_buffer ();
+      if (buf && buf->length)
+        log_buffer_push (buf);
+#ifdef ENABLE_THREADS
+      if (log_writer_running)
+        {
+          log_sync ();
+          return;
+        }
+#endif
+    }
+  log_flush_files ();
+}
+
+/* Like logflush, but don't wait for the writer thread to write the
+   output of the calling thread; it flushes the log after each batch
+   of records anyway.  Used for output that is redrawn often, such as
+   the progress bar.  */
+void
+logflush_nowait (void)
+{
+  if (buffered_log_p)
+    {
+      struct log_buffer *buf = get_log_buffer ();
+      if (buf && buf->length)
+        log_buffer_push (buf);
+#ifdef ENABLE_THREADS
+      if (log_writer_running)
+        return;
+#endif
+    }
+  log_flush_files ();
+}
+
+static void
+log_flush_files (void)
 {
   FILE *fp = get_log_fp ();
   FILE *warcfp = get_warc_log_fp ();
@@ -489,6 +984,11 @@ logflush (void)
 void
 log_set_flush (bool flush)
 {
+#ifdef ENABLE_THREADS
+  /* The writer thread flushes the log after each batch anyway.  */
+  if (log_writer_running)
+    return;
+#endif
   if (flush == flush_log_p)
     return;
 
@@ -509,12 +1009,24 @@ log_set_flush (bool flush)
 
 /* (Temporarily) disable storing log to memory.  Returns the old
    status of storing, with which this function can be called again to
-   reestablish storing. */
+   reestablish storing.  With buffered logging, this only applies to
+   the output of the calling thread.  */
 
 bool
 log_set_save_context (bool savep)
 {
-  bool old = save_context_p;
+  bool old;
+  if (buffered_log_p)
+    {
+      struct log_buffer *buf = get_log_buffer ();
+      if (buf)
+        {
+          old = buf->save_context;
+          buf->save_context = savep;
+          return old;
+        }
+    }
+  old = save_context_p;
   save_context_p = savep;
   return old;
 }
@@ -530,16 +1042,19 @@ logprintf (enum log_options o, const char *fmt, ...)
   struct logvprintf_state lpstate;
   bool done;
 
-  check_redirect_output ();
-  if (inhibit_logging)
-    return;
+  if (!buffered_log_p)
+    {
+      check_redirect_output ();
+      if (inhibit_logging)
+        return;
+    }
   CHECK_VERBOSE (o);
 
   xzero (lpstate);
   do
     {
       va_start (args, fmt);
-      done = log_vprintf_internal (&lpstate, fmt, args);
+      done = log_vprintf_internal (&lpstate, o, fmt, args);
       va_end (args);
 
       if (done && errno == EPIPE)
@@ -560,15 +1075,18 @@ debug_logprintf (const char *fmt, ...)
       struct logvprintf_state lpstate;
       bool done;
 
-      check_redirect_output ();
-      if (inhibit_logging)
-        return;
+      if (!buffered_log_p)
+        {
+          check_redirect_output ();
+          if (inhibit_logging)
+            return;
+        }
 
       xzero (lpstate);
       do
         {
           va_start (args, fmt);
-          done = log_vprintf_internal (&lpstate, fmt, args);
+          done = log_vprintf_internal (&lpstate, LOG_DEBUG_LEVEL, fmt, args);
           va_end (args);
         }
       while (!done);
@@ -613,6 +1131,17 @@ log_init (const char *file, bool appendp)
           save_context_p = true;
         }
     }
+
+  if (opt.jobs > 1 || opt.log_format == log_format_json)
+    {
+      buffered_log_p = true;
+      /* Make the main thread number 0.  */
+      get_log_buffer ();
+#ifdef ENABLE_THREADS
+      if (opt.jobs > 1)
+        log_start_writer ();
+#endif
+    }
 }
 
 /* Close LOGFP (only if we opened it, not if it's stderr), inhibit
@@ -622,6 +1151,16 @@ log_close (void)
 {
   int i;
 
+  if (buffered_log_p)
+    {
+      struct log_buffer *buf = get_log_buffer ();
+      if (buf && buf->length)
+        log_buffer_push (buf);
+#ifdef ENABLE_THREADS
+      log_stop_writer ();
+#endif
+    }
+
   if (logfp && (logfp != stderr))
     fclose (logfp);
   logfp = NULL;
@@ -56,6 +56,7 @@ as that of the covered work.  */
 #include "http.h"               /* for save_cookies */
 #include "ptimer.h"
 #include "warc.h"
+#include "metrics.h"
 #include <getopt.h>
 #include <getpass.h>
 #include <quote.h>
@@ -196,6 +197,11 @@ static struct cmdline_option option_data[] =
     { "follow-tags", 0, OPT_VALUE, "followtags", -1 },
     { "force-directories", 'x', OPT_BOOLEAN, "dirstruct", -1 },
     { "force-html", 'F', OPT_BOOLEAN, "forcehtml", -1 },
+    { "frontier-dir", 0, OPT_VALUE, "frontierdir", -1 },
+    { "frontier-memory", 0, OPT_VALUE, "frontiermemory", -1 },
+#ifdef ENABLE_THREADS
+    { "ftp-connections", 0, OPT_VALUE, "ftpconnections", -1 },
+#endif
     { "ftp-password", 0, OPT_VALUE, "ftppassword", -1 },
 #ifdef __VMS
     { "ftp-stmlf", 0, OPT_BOOLEAN, "ftpstmlf", -1 },
@@ -204,6 +210,9 @@ static struct cmdline_option option_data[] =
     { "glob", 0, OPT_BOOLEAN, "glob", -1 },
     { "header", 0, OPT_VALUE, "header", -1 },
     { "help", 'h', OPT_FUNCALL, (void *)print_help, no_argument },
+#ifdef ENABLE_THREADS
+    { "host-connections", 0, OPT_VALUE, "hostconnections", -1 },
+#endif
     { "host-directories", 0, OPT_BOOLEAN, "addhostdir", -1 },
     { "html-extension", 'E', OPT_BOOLEAN, "adjustextension", -1 }, /* deprecated */
     { "htmlify", 0, OPT_BOOLEAN, "htmlify", -1 },
@@ -230,11 +239,13 @@ static struct cmdline_option option_data[] =
     { "limit-rate", 0, OPT_VALUE, "limitrate", -1 },
     { "load-cookies", 0, OPT_VALUE, "loadcookies", -1 },
     { "local-encoding", 0, OPT_VALUE, "localencoding", -1 },
+    { "log-format", 0, OPT_VALUE, "logformat", -1 },
     { "max-redirect", 0, OPT_VALUE, "maxredirect", -1 },
 #ifdef ENABLE_METALINK
     { "metalink-file", 0, OPT_VALUE, "metalink", -1 },
 #endif
     { "method", 0, OPT_VALUE, "method", -1 },
+    { "metrics-file", 0, OPT_VALUE, "metricsfile", -1 },
     { "mirror", 'm', OPT_BOOLEAN, "mirror", -1 },
     { "no", 'n', OPT__NO, NULL, required_argument },
     { "no-clobber", 0, OPT_BOOLEAN, "noclobber", -1 },
@@ -303,6 +314,7 @@ static struct cmdline_option option_data[] =
     { "warc-cdx", 0, OPT_BOOLEAN, "warccdx", -1 },
 #ifdef HAVE_LIBZ
     { "warc-compression", 0, OPT_BOOLEAN, "warccompression", -1 },
+    { "warc-compression-level", 0, OPT_VALUE, "warccompressionlevel", -1 },
 #endif
     { "warc-dedup", 0, OPT_VALUE, "warccdxdedup", -1 },
     { "warc-digests", 0, OPT_BOOLEAN, "warcdigests", -1 },
@@ -453,6 +465,12 @@ Logging and input file:\n"),
   -o,  --output-file=FILE    log messages to FILE.\n"),
     N_("\
   -a,  --append-output=FILE  append messages to FILE.\n"),
+    N_("\
+       --log-format=FORMAT   write messages as plain text or as JSON lines\n\
+                             (FORMAT is `plain' or `json').\n"),
+    N_("\
+       --metrics-file=FILE   keep rewriting FILE with live metrics in the\n\
+                             Prometheus text format.\n"),
 #ifdef ENABLE_DEBUG
     N_("\
   -d,  --debug               print lots of debugging information.\n"),
@@ -573,6 +591,9 @@ Download:\n"),
 #ifdef ENABLE_THREADS
     N_("\
        --jobs                    specify how many threads use.\n"),
+    N_("\
+       --host-connections=N      retrieve at most N input file URLs\n\
+                                 from one host at once with --jobs.\n"),
 #endif
     "\n",
     N_("\
@@ -690,6 +711,10 @@ FTP options:\n"),
        --ftp-user=USER         set ftp user to USER.\n"),
     N_("\
        --ftp-password=PASS     set ftp password to PASS.\n"),
+#ifdef ENABLE_THREADS
+    N_("\
+       --ftp-connections=N     use at most N connections with --jobs.\n"),
+#endif
     N_("\
        --no-remove-listing     don't remove `.listing' files.\n"),
     N_("\
@@ -717,6 +742,8 @@ WARC options:\n"),
 #ifdef HAVE_LIBZ
     N_("\
        --no-warc-compression     do not compress WARC files with GZIP.\n"),
+    N_("\
+       --warc-compression-level=N  compress WARC files at GZIP level N.\n"),
 #endif
     N_("\
        --no-warc-digests         do not calculate SHA1 digests.\n"),
@@ -752,6 +779,11 @@ Recursive download:\n"),
   -m,  --mirror             shortcut for -N -r -l inf --no-remove-listing.\n"),
     N_("\
   -p,  --page-requisites    get all images, etc. needed to display HTML page.\n"),
+    N_("\
+       --frontier-dir=DIR   keep the queue on disk in DIR and make the\n\
+                            retrieval resumable.\n"),
+    N_("\
+       --frontier-memory=N  keep at most N queued URLs in memory.\n"),
     N_("\
        --strict-comments    turn on strict (SGML) handling of HTML comments.\n"),
     "\n",
@@ -1555,6 +1587,8 @@ for details.\n\n"));
   if (opt.warc_filename != 0)
     warc_init ();
 
+  metrics_start ();
+
   DEBUGP (("DEBUG output created by Wget %s on %s.\n\n",
            version_string, OS_TYPE));
 
@@ -1730,8 +1764,13 @@ be specified when downloading from a metalink.\n"));
             }
           else
           {
+#ifdef ENABLE_THREADS
+            retrieve_segmented (url_parsed, *t, &filename, &redirected_URL,
+                                &dt, iri);
+#else
             retrieve_url (url_parsed, *t, &filename, &redirected_URL, NULL,
                           &dt, opt.recursive, iri, true, NULL);
+#endif
           }
 
           if (opt.delete_after && filename != NULL && file_exists_p (filename))
@@ -1776,6 +1815,9 @@ be specified when downloading from a metalink.\n"));
     }
 #endif
 
+  progress_stop ();
+  metrics_stop ();
+
   /* Print broken links. */
   if (opt.recursive && opt.spider)
     print_broken_links ();
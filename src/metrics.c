@@ -0,0 +1,506 @@
+/* Live metrics.
+   Copyright (C) 2014 Free Software Foundation, Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+
+
+/* This module keeps counters of the work done by the downloads, and
+   latency histograms of their network operations, for a scheduler or
+   a monitoring system to read while Wget runs.  With --metrics-file,
+   they are written to a file in the Prometheus text format, every
+   METRICS_INTERVAL seconds and once more at the end.  The file is
+   written under a temporary name and renamed, so a reader always sees
+   a whole set.
+
+   The counters are updated with relaxed atomic additions, which is
+   all the downloads do; only the bytes per host, counted once per
+   file, take a lock.  Without --metrics-file, the updates return at
+   once.  */
+
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef ENABLE_THREADS
+# include <pthread.h>
+# include <semaphore.h>
+#endif
+
+#include "utils.h"
+#include "hash.h"
+#include "ptimer.h"
+#include "metrics.h"
+
+/* How often the metrics file is rewritten, in seconds.  */
+#define METRICS_INTERVAL 1
+
+#ifdef ENABLE_THREADS
+# define METRIC_ADD(p, n) __atomic_fetch_add (p, n, __ATOMIC_RELAXED)
+# define METRIC_STORE(p, n) __atomic_store_n (p, n, __ATOMIC_RELAXED)
+# define METRIC_LOAD(p) __atomic_load_n (p, __ATOMIC_RELAXED)
+#else
+# define METRIC_ADD(p, n) (*(p) += (n))
+# define METRIC_STORE(p, n) (*(p) = (n))
+# define METRIC_LOAD(p) (*(p))
+#endif
+
+static const struct {
+  const char *name;
+  const char *type;
+  const char *help;
+} metric_info[METRIC_COUNT] = {
+  { "wget_downloaded_bytes_total", "counter",
+    "Bytes of response bodies read." },
+  { "wget_downloaded_files_total", "counter",
+    "Files downloaded." },
+  { "wget_active_transfers", "gauge",
+    "Response bodies being read." },
+  { "wget_connections_total", "counter",
+    "TCP connections opened." },
+  { "wget_persistent_connection_hits_total", "counter",
+    "HTTP requests sent on a reused connection." },
+  { "wget_persistent_connection_misses_total", "counter",
+    "HTTP requests that needed a new connection." },
+  { "wget_retries_total", "counter",
+    "Retrieval attempts after the first." },
+  { "wget_queue_urls", "gauge",
+    "URLs in the recursive retrieval queue." },
+  { "wget_queue_urls_max", "gauge",
+    "Largest size of the recursive retrieval queue." },
+};
+
+static const struct {
+  const char *name;
+  const char *help;
+} latency_info[LATENCY_COUNT] = {
+  { "wget_dns_lookup_seconds", "Time taken by host name lookups." },
+  { "wget_connect_seconds", "Time taken by TCP connects." },
+  { "wget_tls_handshake_seconds", "Time taken by TLS handshakes." },
+  { "wget_first_byte_seconds",
+    "Time from sending a request to receiving the response head." },
+};
+
+/* The upper bounds of the histogram buckets, in seconds.  */
+static const double latency_bounds[] = {
+  0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+#define LATENCY_BUCKETS countof (latency_bounds)
+
+struct latency {
+  wgint buckets[LATENCY_BUCKETS + 1]; /* the last one is +Inf */
+  wgint sum_us;                 /* sum of the latencies, in
+                                   microseconds */
+};
+
+static bool metrics_on;
+static wgint counters[METRIC_COUNT];
+static struct latency latencies[LATENCY_COUNT];
+
+/* Bytes of the downloaded files by host name.  */
+static struct hash_table *host_bytes;
+
+#ifdef ENABLE_THREADS
+static pthread_mutex_t host_bytes_mutex = PTHREAD_MUTEX_INITIALIZER;
+# define HOST_BYTES_LOCK pthread_mutex_lock (&host_bytes_mutex)
+# define HOST_BYTES_UNLOCK pthread_mutex_unlock (&host_bytes_mutex)
+#else
+# define HOST_BYTES_LOCK
+# define HOST_BYTES_UNLOCK
+#endif
+
+/* Measures the time since metrics_start, for the download rate.  */
+static struct ptimer *metrics_timer;
+static double last_write_time;
+static wgint last_write_bytes;
+
+/* Add N to metric M.  */
+
+void
+metrics_add (enum metric m, wgint n)
+{
+  if (metrics_on)
+    METRIC_ADD (&counters[m], n);
+}
+
+/* Set the gauge M to N.  */
+
+void
+metrics_set (enum metric m, wgint n)
+{
+  if (metrics_on)
+    METRIC_STORE (&counters[m], n);
+}
+
+static void write_metrics_file (void);
+
+/* Count a file of SIZE bytes downloaded from HOST.  */
+
+void
+metrics_add_file (const char *host, wgint size)
+{
+  wgint *bytes;
+
+  if (!metrics_on)
+    return;
+  METRIC_ADD (&counters[METRIC_FILES], 1);
+
+  HOST_BYTES_LOCK;
+  bytes = hash_table_get (host_bytes, host);
+  if (!bytes)
+    {
+      bytes = xnew0 (wgint);
+      hash_table_put (host_bytes, xstrdup (host), bytes);
+    }
+  *bytes += size;
+  HOST_BYTES_UNLOCK;
+
+#ifndef ENABLE_THREADS
+  /* Without a thread of its own, the file is written between
+     downloads, once metrics_start has set it up.  */
+  if (metrics_timer
+      && ptimer_measure (metrics_timer) - last_write_time >= METRICS_INTERVAL)
+    write_metrics_file ();
+#endif
+}
+
+/* Return a timer for metrics_observe, or NULL if metrics are not
+   kept.  */
+
+struct ptimer *
+metrics_start_timer (void)
+{
+  return metrics_on ? ptimer_new () : NULL;
+}
+
+static void
+record_latency (enum metric_latency l, double secs)
+{
+  struct latency *lat = &latencies[l];
+  size_t i;
+
+  for (i = 0; i < LATENCY_BUCKETS; i++)
+    if (secs <= latency_bounds[i])
+      break;
+  METRIC_ADD (&lat->buckets[i], 1);
+  METRIC_ADD (&lat->sum_us, (wgint) (secs * 1000000));
+}
+
+/* Record the time measured by TIMER, which came from
+   metrics_start_timer, as a latency of kind L, and destroy TIMER.  */
+
+void
+metrics_observe (enum metric_latency l, struct ptimer *timer)
+{
+  if (!timer)
+    return;
+  record_latency (l, ptimer_measure (timer));
+  ptimer_destroy (timer);
+}
+
+/* Write N to FP.  number_to_static_string is not used, because the
+   downloads may use it at the same time.  */
+
+static void
+write_number (FILE *fp, wgint n)
+{
+  char buf[24];
+
+  number_to_string (buf, n);
+  fputs (buf, fp);
+}
+
+/* Write STR as a label value to FP.  */
+
+static void
+write_label (FILE *fp, const char *str)
+{
+  for (; *str; str++)
+    {
+      if (*str == '\\' || *str == '"')
+        putc ('\\', fp);
+      if (*str == '\n')
+        fputs ("\\n", fp);
+      else
+        putc (*str, fp);
+    }
+}
+
+/* Write the metrics to FP.  RATE is the download rate since the
+   previous write, in bytes per second.  */
+
+static void
+write_metrics (FILE *fp, double rate)
+{
+  hash_table_iterator iter;
+  int m;
+
+  for (m = 0; m < METRIC_COUNT; m++)
+    {
+      fprintf (fp, "# HELP %s %s\n# TYPE %s %s\n%s ",
+               metric_info[m].name, metric_info[m].help,
+               metric_info[m].name, metric_info[m].type,
+               metric_info[m].name);
+      write_number (fp, METRIC_LOAD (&counters[m]));
+      putc ('\n', fp);
+    }
+
+  fprintf (fp, "# HELP wget_download_rate_bytes_per_second "
+           "Download rate over the last interval.\n"
+           "# TYPE wget_download_rate_bytes_per_second gauge\n"
+           "wget_download_rate_bytes_per_second %.0f\n", rate);
+
+  fputs ("# HELP wget_host_downloaded_bytes_total "
+         "Bytes of the files downloaded from each host.\n"
+         "# TYPE wget_host_downloaded_bytes_total counter\n", fp);
+  HOST_BYTES_LOCK;
+  for (hash_table_iterate (host_bytes, &iter);
+       hash_table_iter_next (&iter); )
+    {
+      fputs ("wget_host_downloaded_bytes_total{host=\"", fp);
+      write_label (fp, iter.key);
+      fputs ("\"} ", fp);
+      write_number (fp, *(wgint *) iter.value);
+      putc ('\n', fp);
+    }
+  HOST_BYTES_UNLOCK;
+
+  for (m = 0; m < LATENCY_COUNT; m++)
+    {
+      const char *name = latency_info[m].name;
+      struct latency *lat = &latencies[m];
+      wgint count = 0;
+      size_t i;
+
+      fprintf (fp, "# HELP %s %s\n# TYPE %s histogram\n",
+               name, latency_info[m].help, name);
+      for (i = 0; i <= LATENCY_BUCKETS; i++)
+        {
+          count += METRIC_LOAD (&lat->buckets[i]);
+          if (i < LATENCY_BUCKETS)
+            fprintf (fp, "%s_bucket{le=\"%g\"} ", name, latency_bounds[i]);
+          else
+            fprintf (fp, "%s_bucket{le=\"+Inf\"} ", name);
+          write_number (fp, count);
+          putc ('\n', fp);
+        }
+      fprintf (fp, "%s_sum %.6f\n%s_count ",
+               name, METRIC_LOAD (&lat->sum_us) / 1000000.0, name);
+      write_number (fp, count);
+      putc ('\n', fp);
+    }
+}
+
+/* Write the metrics to opt.metrics_file, through a temporary file.  */
+
+static void
+write_metrics_file (void)
+{
+  char *tmp = aprintf ("%s.tmp", opt.metrics_file);
+  double now = ptimer_measure (metrics_timer);
+  wgint bytes = METRIC_LOAD (&counters[METRIC_BYTES]);
+  double rate = 0;
+  FILE *fp;
+
+  if (now > last_write_time)
+    rate = (bytes - last_write_bytes) / (now - last_write_time);
+  last_write_time = now;
+  last_write_bytes = bytes;
+
+  fp = fopen (tmp, "w");
+  if (!fp)
+    {
+      logprintf (LOG_NOTQUIET, "%s: %s\n", tmp, strerror (errno));
+      xfree (tmp);
+      return;
+    }
+  write_metrics (fp, rate);
+  if (fclose (fp) == EOF || rename (tmp, opt.metrics_file) != 0)
+    {
+      logprintf (LOG_NOTQUIET, "%s: %s\n", opt.metrics_file,
+                 strerror (errno));
+      unlink (tmp);
+    }
+  xfree (tmp);
+}
+
+#ifdef ENABLE_THREADS
+static pthread_t metrics_writer;
+static sem_t metrics_writer_stop;
+static bool metrics_writer_running;
+
+/* The thread that rewrites the metrics file every METRICS_INTERVAL
+   seconds, until metrics_stop.  */
+
+static void *
+metrics_writer_thread (void *arg)
+{
+  for (;;)
+    {
+      struct timespec ts;
+      int res;
+
+      clock_gettime (CLOCK_REALTIME, &ts);
+      ts.tv_sec += METRICS_INTERVAL;
+      while ((res = sem_timedwait (&metrics_writer_stop, &ts)) < 0
+             && errno == EINTR)
+        ;
+      if (res == 0)
+        break;
+      write_metrics_file ();
+    }
+  return NULL;
+}
+#endif /* ENABLE_THREADS */
+
+static void
+free_host_bytes (void)
+{
+  hash_table_iterator iter;
+
+  for (hash_table_iterate (host_bytes, &iter);
+       hash_table_iter_next (&iter); )
+    {
+      xfree (iter.key);
+      xfree (iter.value);
+    }
+  hash_table_destroy (host_bytes);
+  host_bytes = NULL;
+}
+
+/* Start keeping metrics, if --metrics-file was given.  */
+
+void
+metrics_start (void)
+{
+  if (!opt.metrics_file || metrics_on)
+    return;
+
+  host_bytes = make_nocase_string_hash_table (0);
+  metrics_timer = ptimer_new ();
+  metrics_on = true;
+  write_metrics_file ();
+
+#ifdef ENABLE_THREADS
+  if (sem_init (&metrics_writer_stop, 0, 0) == 0)
+    {
+      if (pthread_create (&metrics_writer, NULL, metrics_writer_thread,
+                          NULL) == 0)
+        metrics_writer_running = true;
+      else
+        sem_destroy (&metrics_writer_stop);
+    }
+#endif
+  atexit (metrics_stop);
+}
+
+/* Write the metrics one last time and stop keeping them.  */
+
+void
+metrics_stop (void)
+{
+  if (!metrics_on)
+    return;
+
+#ifdef ENABLE_THREADS
+  if (metrics_writer_running)
+    {
+      sem_post (&metrics_writer_stop);
+      pthread_join (metrics_writer, NULL);
+      sem_destroy (&metrics_writer_stop);
+      metrics_writer_running = false;
+    }
+#endif
+  write_metrics_file ();
+  metrics_on = false;
+
+  free_host_bytes ();
+  ptimer_destroy (metrics_timer);
+  metrics_timer = NULL;
+}
+
+#ifdef TESTING
+
+#include "test.h"
+
+const char *
+test_metrics_write (void)
+{
+  static const char *expected[] = {
+    "# TYPE wget_downloaded_bytes_total counter\n",
+    "wget_downloaded_bytes_total 1500\n",
+    "wget_downloaded_files_total 2\n",
+    "wget_queue_urls 7\n",
+    "wget_download_rate_bytes_per_second 250\n",
+    "wget_host_downloaded_bytes_total{host=\"example.com\"} 1500\n",
+    "wget_connect_seconds_bucket{le=\"0.001\"} 0\n",
+    "wget_connect_seconds_bucket{le=\"0.025\"} 1\n",
+    "wget_connect_seconds_bucket{le=\"+Inf\"} 2\n",
+    "wget_connect_seconds_sum 20.020000\n",
+    "wget_connect_seconds_count 2\n",
+    "wget_tls_handshake_seconds_count 0\n",
+  };
+  char line[256];
+  FILE *fp = tmpfile ();
+  size_t i, found = 0;
+
+  mu_assert ("test_metrics_write: no temporary file", fp != NULL);
+
+  metrics_on = true;
+  host_bytes = make_nocase_string_hash_table (0);
+  metrics_add (METRIC_BYTES, 1000);
+  metrics_add (METRIC_BYTES, 500);
+  metrics_set (METRIC_QUEUE, 3);
+  metrics_set (METRIC_QUEUE, 7);
+  metrics_add_file ("example.com", 1000);
+  metrics_add_file ("EXAMPLE.com", 500);
+  record_latency (LATENCY_CONNECT, 0.02);
+  record_latency (LATENCY_CONNECT, 20);
+
+  write_metrics (fp, 250);
+  rewind (fp);
+  while (fgets (line, sizeof line, fp))
+    for (i = 0; i < countof (expected); i++)
+      if (!strcmp (line, expected[i]))
+        found |= 1 << i;
+  fclose (fp);
+
+  for (i = 0; i < countof (expected); i++)
+    mu_assert (expected[i], found & (1 << i));
+
+  metrics_on = false;
+  free_host_bytes ();
+  xzero (counters);
+  xzero (latencies);
+  return NULL;
+}
+
+#endif /* TESTING */
@@ -0,0 +1,69 @@
+/* Declarations for intern.c.
+   Copyright (C) 2014 Free Software Foundation, Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+
+
+#ifndef METRICS_H
+#define METRICS_H
+
+struct ptimer;
+
+/* The counters and gauges kept with --metrics-file.  */
+enum metric {
+  METRIC_BYTES,                 /* bytes of bodies read */
+  METRIC_FILES,                 /* files downloaded */
+  METRIC_TRANSFERS,             /* bodies being read */
+  METRIC_CONNECTIONS,           /* TCP connections opened */
+  METRIC_PCONN_HITS,            /* HTTP requests on a reused connection */
+  METRIC_PCONN_MISSES,          /* HTTP requests on a new connection */
+  METRIC_RETRIES,               /* retrieval attempts after the first */
+  METRIC_QUEUE,                 /* URLs in the recursion queue */
+  METRIC_QUEUE_MAX,             /* largest size of the queue */
+  METRIC_COUNT
+};
+
+/* The latencies kept as histograms.  */
+enum metric_latency {
+  LATENCY_DNS,                  /* host name lookups */
+  LATENCY_CONNECT,              /* TCP connects */
+  LATENCY_TLS,                  /* TLS handshakes */
+  LATENCY_FIRST_BYTE,           /* from request to response head */
+  LATENCY_COUNT
+};
+
+void metrics_add (enum metric, wgint);
+void metrics_set (enum metric, wgint);
+void metrics_add_file (const char *, wgint);
+struct ptimer *metrics_start_timer (void);
+void metrics_observe (enum metric_latency, struct ptimer *);
+
+void metrics_start (void);
+void metrics_stop (void);
+
+#endif /* METRICS_H */
@@ -84,24 +84,50 @@ name_temp_files()
 void
 merge_temp_files(char *output)
 {
-  FILE *out, *in;
-  int j, ret;
-  void *buf = malloc (MIN_CHUNK_SIZE);
+  FILE *out;
 
   out = fopen (output, "wb");
-  for(j = 0; j < opt.jobs; ++j)
+  if (!out)
+    return;
+  append_temp_files (out);
+  fclose(out);
+}
+
+/*  Append the temporary files in which the chunks are stored to OUT.
+
+    Returns 0 on success, and -1 if a file could not be read or written. */
+int
+append_temp_files(FILE *out)
+{
+  FILE *in;
+  int j, ret, res = 0;
+  void *buf = malloc (MIN_CHUNK_SIZE);
+
+  for(j = 0; j < opt.jobs && !res; ++j)
     {
       in = fopen(files[j],"rb");
+      if (!in)
+        {
+          res = -1;
+          break;
+        }
       ret = MIN_CHUNK_SIZE;
       while(ret == MIN_CHUNK_SIZE)
         {
           ret = fread(buf, 1, MIN_CHUNK_SIZE, in);
-          fwrite(buf, 1, ret, out);
+          if (fwrite(buf, 1, ret, out) != ret)
+            {
+              res = -1;
+              break;
+            }
         }
+      if (ferror (in))
+        res = -1;
       fclose(in);
     }
-  fclose(out);
   free(buf);
+
+  return res;
 }
 
 /* Delete the temporary files used. */
@@ -238,7 +264,7 @@ segmented_retrieve_url (void *arg)
   ctx->status = retrieve_url (ctx->url_parsed, ctx->url,
                               &ctx->file, &ctx->redirected,
                               ctx->referer, &ctx->dt,
-                              false, ctx->i, true, ctx->range);
+                              false, ctx->i, !ctx->own_status, ctx->range);
   ctx->terminated = 1;
   sem_post (ctx->retr_sem);
 
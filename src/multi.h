@@ -47,12 +47,12 @@ struct s_thread_ctx
   int terminated;
   int dt, url_err;
   char *redirected;
-  char *referer;
+  const char *referer;
   struct url *url_parsed;
   struct iri *i;
   struct range *range;
   char *file;
-  char *url;
+  const char *url;
 #ifdef ENABLE_THREADS
   sem_t *retr_sem;
 #else
@@ -60,6 +60,7 @@ struct s_thread_ctx
   void *retr_sem;
 #endif
   uerr_t status;
+  bool own_status;              /* the caller reports the status */
 };
 
 void init_temp_files();
@@ -68,6 +69,8 @@ void name_temp_files();
 
 void merge_temp_files(char *);
 
+int append_temp_files(FILE *);
+
 void delete_temp_files();
 
 void clean_temp_files();
@@ -37,6 +37,9 @@ as that of the covered work.  */
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#ifdef ENABLE_THREADS
+# include <pthread.h>
+#endif
 
 #include "utils.h"
 #include "netrc.h"
@@ -60,10 +63,17 @@ search_netrc (const char *host, const char **acc, const char **passwd,
 {
   acc_t *l;
   static int processed_netrc;
+#ifdef ENABLE_THREADS
+  /* Threads retrieving URLs at once may all be the first to get here.  */
+  static pthread_mutex_t netrc_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
   if (!opt.netrc)
     return;
   /* Find ~/.netrc.  */
+#ifdef ENABLE_THREADS
+  pthread_mutex_lock (&netrc_mutex);
+#endif
   if (!processed_netrc)
     {
 #ifdef __VMS
@@ -100,6 +110,9 @@ search_netrc (const char *host, const char **acc, const char **passwd,
 
 #endif /* def __VMS [else] */
     }
+#ifdef ENABLE_THREADS
+  pthread_mutex_unlock (&netrc_mutex);
+#endif
   /* If nothing to do...  */
   if (!netrc_list)
     return;
@@ -63,6 +63,12 @@ struct options
   bool unlink;			/* remove file before clobbering */
   char *dir_prefix;		/* The top of directory tree */
   char *lfilename;		/* Log filename */
+  enum {
+    log_format_plain,
+    log_format_json
+  } log_format;			/* Whether the log is plain text or
+				   JSON lines */
+  char *metrics_file;		/* Where live metrics are written */
   char *input_filename;		/* Input filename */
   char *choose_config;		/* Specified config file */
   bool noconfig;
@@ -111,6 +117,7 @@ struct options
   char *warc_cdx_dedup_filename;	/* CDX file to be used for deduplication. */
   wgint warc_maxsize;           /* WARC max archive size */
   bool warc_compression_enabled;  /* For GZIP compression. */
+  int warc_compression_level;   /* GZIP compression level, 0-9. */
   bool warc_digests_enabled;  /* For SHA1 digests. */
   bool warc_cdx_enabled;      /* Create CDX files? */
   bool warc_keep_log;         /* Store the log file in a WARC record. */
@@ -292,6 +299,18 @@ struct options
   bool report_bps;              /*Output bandwidth in bits format*/
 
   int jobs;                 /* How many threads use at the same time.  */
+  int ftp_connections;          /* How many control connections a
+                                   recursive FTP retrieval may open
+                                   with --jobs.  */
+  int host_connections;         /* How many URLs of an input file may
+                                   be retrieved from one host at once
+                                   with --jobs.  */
+
+  char *frontier_dir;           /* Where recursive retrieval keeps the
+                                   parts of its queue and seen-set
+                                   that don't fit in memory. */
+  int frontier_memory;          /* How many queued and seen URLs to
+                                   keep in memory with frontier_dir. */
 };
 
 extern struct options opt;
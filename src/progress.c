@@ -43,6 +43,8 @@ as that of the covered work.  */
 
 #ifdef ENABLE_THREADS
 #include <pthread.h>
+#include <semaphore.h>
+#include <errno.h>
 #endif
 
 #include "progress.h"
@@ -73,10 +75,15 @@ static void bar_update (void *, wgint, double);
 static void bar_draw (void *, bool);
 static void bar_finish (void *, double);
 static void bar_set_params (const char *);
+#ifdef ENABLE_THREADS
+static void bar_count (void *, wgint);
+static void bar_add_done (void *);
+#endif
 
 struct progress_header
 {
   struct progress_header *next;
+  bool rendered;                /* drawn by the renderer thread */
 };
 
 static struct progress_header *progress_list = NULL;
@@ -202,6 +209,53 @@ progress_schedule_redirect (void)
   output_redirected = 1;
 }
 
+#ifdef ENABLE_THREADS
+/* Whether the renderer thread draws the bars; see below.  */
+static bool render_bars;
+
+/* With --jobs, the bars of concurrent downloads are not drawn by the
+   threads that download, which only add to their byte counts.  A
+   renderer thread draws a single bar summing them up, every
+   REFRESH_INTERVAL seconds: the URL when one download runs, the
+   number of files otherwise.  The bytes of the downloads that have
+   finished stay in the sum.  Once started, the renderer runs until
+   progress_stop is called.  */
+
+static pthread_t renderer;
+static sem_t renderer_stop;
+
+/* Sums of the bars that have finished.  */
+static wgint done_count, done_initial, done_total;
+static int done_files;
+static bool done_unknown;       /* a finished bar had no total */
+
+static void *render_thread (void *);
+
+/* Start the renderer, if it does not run yet.  Return whether it
+   runs.  */
+
+static bool
+start_renderer (void)
+{
+  bool res;
+
+  LOCK_PROGRESS ();
+  if (!render_bars && sem_init (&renderer_stop, 0, 0) == 0)
+    {
+      if (pthread_create (&renderer, NULL, render_thread, NULL) == 0)
+        {
+          __atomic_store_n (&render_bars, true, __ATOMIC_RELEASE);
+          atexit (progress_stop);
+        }
+      else
+        sem_destroy (&renderer_stop);
+    }
+  res = render_bars;
+  UNLOCK_PROGRESS ();
+  return res;
+}
+#endif /* ENABLE_THREADS */
+
 /* Create a progress gauge.  INITIAL is the number of bytes the
    download starts from (zero if the download starts from scratch).
    TOTAL is the expected total number of bytes in this download.  If
@@ -213,6 +267,8 @@ progress_create (const char *url, wgint initial, wgint total)
 {
   /* Check if the log status has changed under our feet. */
   struct progress_header *ret;
+  bool render = false;
+
   if (output_redirected)
     {
       if (!current_impl_locked)
@@ -220,9 +276,16 @@ progress_create (const char *url, wgint initial, wgint total)
       output_redirected = 0;
     }
 
+#ifdef ENABLE_THREADS
+  if (current_impl->create == bar_create && opt.jobs > 1)
+    render = start_renderer ();
+#endif
+
   ret = current_impl->create (url, initial, total);
   if (ret)
     {
+      ret->rendered = render && current_impl->create == bar_create;
+
       LOCK_PROGRESS ();
 
       ret->next = progress_list;
@@ -241,6 +304,11 @@ progress_create (const char *url, wgint initial, wgint total)
 bool
 progress_interactive_p (void *progress)
 {
+  struct progress_header *ph = progress;
+
+  /* The renderer thread draws without being called.  */
+  if (ph->rendered)
+    return false;
   return current_impl->interactive;
 }
 
@@ -254,6 +322,14 @@ progress_update (void *progress, wgint howmuch, double dltime)
   static struct ptimer *last_switch = NULL;
   bool force_screen_update = false;
 
+#ifdef ENABLE_THREADS
+  if (((struct progress_header *) progress)->rendered)
+    {
+      bar_count (progress, howmuch);
+      return;
+    }
+#endif
+
   current_impl->update (progress, howmuch, dltime);
   LOCK_PROGRESS ();
 
@@ -302,6 +378,8 @@ progress_update (void *progress, wgint howmuch, double dltime)
 void
 progress_finish (void *progress, double dltime)
 {
+  struct progress_header *ph = progress;
+
     {
       struct progress_header *it, *prev = NULL;
 
@@ -323,9 +401,17 @@ progress_finish (void *progress, double dltime)
           prev = it;
         }
 
+#ifdef ENABLE_THREADS
+      if (ph->rendered)
+        bar_add_done (progress);
+#endif
+
       UNLOCK_PROGRESS ();
     }
-  current_impl->finish (progress, dltime);
+  if (ph->rendered)
+    bar_finish (progress, dltime);
+  else
+    current_impl->finish (progress, dltime);
 }
 
 /* Dot-printing. */
@@ -685,6 +771,13 @@ bar_create (const char *url, wgint initial, wgint total)
   bp->initial_length = initial;
   bp->total_length   = total;
   bp->url            = url;
+
+#ifdef ENABLE_THREADS
+  /* The renderer thread draws the bar and keeps its own width.  */
+  if (__atomic_load_n (&render_bars, __ATOMIC_ACQUIRE))
+    return bp;
+#endif
+
   /* Initialize screen_width if this hasn't been done or if it might
      have changed, as indicated by receiving SIGWINCH.  */
   if (!screen_width || received_sigwinch)
@@ -728,6 +821,20 @@ bar_update (void *progress, wgint howmuch, double dltime)
   update_speed_ring (bp, howmuch, dltime);
 }
 
+#ifdef ENABLE_THREADS
+/* Add HOWMUCH to the byte count of a bar drawn by the renderer
+   thread.  This is all a download does for its progress, and it
+   takes no lock.  */
+
+static void
+bar_count (void *progress, wgint howmuch)
+{
+  struct bar_progress *bp = progress;
+
+  __atomic_fetch_add (&bp->count, howmuch, __ATOMIC_RELAXED);
+}
+#endif
+
 static void
 bar_draw (void *progress, bool force)
 {
@@ -750,6 +857,12 @@ bar_finish (void *progress, double dltime)
 {
   struct bar_progress *bp = progress;
 
+  if (bp->header.rendered)
+    {
+      xfree (bp);
+      return;
+    }
+
   if (bp->total_length > 0
       && bp->count + bp->initial_length > bp->total_length)
     /* See bar_update() for explanation. */
@@ -1203,9 +1316,203 @@ display_image (char *buf)
   bool old = log_set_save_context (false);
   logputs (LOG_VERBOSE, "\r");
   logputs (LOG_VERBOSE, buf);
+  /* The image doesn't end with a newline, so it has to be handed over
+     explicitly when the log is buffered.  Don't wait for it to be
+     written, as the image is redrawn several times a second.  */
+  logflush_nowait ();
   log_set_save_context (old);
 }
 
+#ifdef ENABLE_THREADS
+/* Return the size BP will have when finished, or 0 if unknown.  The
+   count of BP is read once, as COUNT.  */
+
+static wgint
+bar_final_size (struct bar_progress *bp, wgint count)
+{
+  if (bp->total_length <= 0)
+    return 0;
+  return MAX (bp->total_length, bp->initial_length + count);
+}
+
+/* Add the finished bar PROGRESS to the sums of the renderer.  Called
+   with the progress lock held.  */
+
+static void
+bar_add_done (void *progress)
+{
+  struct bar_progress *bp = progress;
+  wgint count = __atomic_load_n (&bp->count, __ATOMIC_RELAXED);
+  wgint size = bar_final_size (bp, count);
+
+  done_count += count;
+  done_initial += bp->initial_length;
+  if (size)
+    done_total += size;
+  else
+    done_unknown = true;
+  done_files++;
+}
+
+/* Sum up the finished and the running bars into AGG, and return the
+   number of running ones.  Replace *LABEL with the URL of the single
+   download, or the count of files, and make it the URL of AGG.
+   Called with the progress lock held.  */
+
+static int
+bar_sum (struct bar_progress *agg, char **label)
+{
+  struct progress_header *it;
+  const char *url = NULL;
+  bool unknown = done_unknown;
+  int n = 0;
+
+  agg->initial_length = done_initial;
+  agg->count = done_count;
+  agg->total_length = done_total;
+  for (it = progress_list; it; it = it->next)
+    {
+      struct bar_progress *bp = (struct bar_progress *) it;
+      wgint count, size;
+
+      if (!it->rendered)
+        continue;
+      count = __atomic_load_n (&bp->count, __ATOMIC_RELAXED);
+      size = bar_final_size (bp, count);
+      agg->initial_length += bp->initial_length;
+      agg->count += count;
+      agg->total_length += size;
+      if (!size)
+        unknown = true;
+      url = bp->url;
+      n++;
+    }
+  if (unknown)
+    agg->total_length = 0;
+
+  if (n || done_files > 1)
+    {
+      xfree (*label);
+      if (n == 1 && !done_files)
+        *label = xstrdup (url);
+      else
+        *label = aprintf (_("%d/%d files"), done_files, done_files + n);
+      agg->url = *label;
+    }
+  return n;
+}
+
+/* Set bp_width from the width of the screen.  */
+
+static void
+set_bar_width (void)
+{
+  screen_width = determine_screen_width ();
+  if (!screen_width)
+    screen_width = DEFAULT_SCREEN_WIDTH;
+  else if (screen_width < MINIMUM_SCREEN_WIDTH)
+    screen_width = MINIMUM_SCREEN_WIDTH;
+  /* - 1 because we don't want to use the last screen column. */
+  bp_width = screen_width - 1;
+}
+
+/* The renderer thread.  It draws the sum of the bars while some are
+   running, and once more when the last of them finishes, so that the
+   bar shows the final sizes.  */
+
+static void *
+render_thread (void *arg)
+{
+  struct bar_progress agg;
+  struct ptimer *timer = ptimer_new ();
+  char *buffer, *label;
+  wgint last_count = 0;
+  bool drawn = false, pending = false, stop = false;
+
+  xzero (agg);
+  agg.url = label = xstrdup ("");
+  set_bar_width ();
+  buffer = xmalloc (bp_width + 100);
+
+  while (!stop)
+    {
+      struct timespec ts;
+      int n, res;
+      bool draw;
+
+      clock_gettime (CLOCK_REALTIME, &ts);
+      ts.tv_nsec += REFRESH_INTERVAL * 1000000000;
+      if (ts.tv_nsec >= 1000000000)
+        {
+          ts.tv_sec++;
+          ts.tv_nsec -= 1000000000;
+        }
+      while ((res = sem_timedwait (&renderer_stop, &ts)) < 0
+             && errno == EINTR)
+        ;
+      stop = res == 0;
+
+      if (received_sigwinch)
+        {
+          received_sigwinch = 0;
+          set_bar_width ();
+          buffer = xrealloc (buffer, bp_width + 100);
+        }
+
+      LOCK_PROGRESS ();
+      n = bar_sum (&agg, &label);
+      agg.dltime = ptimer_measure (timer);
+      update_speed_ring (&agg, MAX (agg.count - last_count, 0), agg.dltime);
+      /* Downloads shorter than REFRESH_INTERVAL show up only in the
+         finished sums.  */
+      draw = n || pending || agg.count != last_count || (stop && drawn);
+      last_count = agg.count;
+      if (draw)
+        create_image (&agg, buffer, agg.dltime, false);
+      UNLOCK_PROGRESS ();
+
+      if (draw)
+        {
+          display_image (buffer);
+          drawn = true;
+        }
+      pending = n > 0;
+    }
+
+  if (drawn)
+    logputs (LOG_VERBOSE, "\n");
+  xfree (buffer);
+  xfree (label);
+  ptimer_destroy (timer);
+  return NULL;
+}
+
+#endif /* ENABLE_THREADS */
+
+/* Stop the renderer thread, if it runs, after it has drawn the final
+   sums.  Called once the downloads are done, so that the sums are
+   shown before the summary.  */
+
+void
+progress_stop (void)
+{
+#ifdef ENABLE_THREADS
+  bool running;
+
+  LOCK_PROGRESS ();
+  running = render_bars;
+  __atomic_store_n (&render_bars, false, __ATOMIC_RELEASE);
+  UNLOCK_PROGRESS ();
+
+  if (running)
+    {
+      sem_post (&renderer_stop);
+      pthread_join (renderer, NULL);
+      sem_destroy (&renderer_stop);
+    }
+#endif
+}
+
 static void
 bar_set_params (const char *params)
 {
@@ -39,6 +39,7 @@ void *progress_create (const char *, wgint, wgint);
 bool progress_interactive_p (void *);
 void progress_update (void *, wgint, double);
 void progress_finish (void *, double);
+void progress_stop (void);
 
 void progress_handle_sigwinch (int);
 
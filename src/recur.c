@@ -56,120 +56,12 @@ as that of the covered work.  */
 #include "html-url.h"
 #include "css-url.h"
 #include "spider.h"
-
-/* Functions for maintaining the URL queue.  */
-
-struct queue_element {
-  const char *url;              /* the URL to download */
-  const char *referer;          /* the referring document */
-  int depth;                    /* the depth */
-  bool html_allowed;            /* whether the document is allowed to
-                                   be treated as HTML. */
-  struct iri *iri;                /* sXXXav */
-  bool css_allowed;             /* whether the document is allowed to
-                                   be treated as CSS. */
-  struct queue_element *next;   /* next element in queue */
-};
-
-struct url_queue {
-  struct queue_element *head;
-  struct queue_element *tail;
-  int count, maxcount;
-};
-
-/* Create a URL queue. */
-
-static struct url_queue *
-url_queue_new (void)
-{
-  struct url_queue *queue = xnew0 (struct url_queue);
-  return queue;
-}
-
-/* Delete a URL queue. */
-
-static void
-url_queue_delete (struct url_queue *queue)
-{
-  xfree (queue);
-}
-
-/* Enqueue a URL in the queue.  The queue is FIFO: the items will be
-   retrieved ("dequeued") from the queue in the order they were placed
-   into it.  */
-
-static void
-url_enqueue (struct url_queue *queue, struct iri *i,
-             const char *url, const char *referer, int depth,
-             bool html_allowed, bool css_allowed)
-{
-  struct queue_element *qel = xnew (struct queue_element);
-  qel->iri = i;
-  qel->url = url;
-  qel->referer = referer;
-  qel->depth = depth;
-  qel->html_allowed = html_allowed;
-  qel->css_allowed = css_allowed;
-  qel->next = NULL;
-
-  ++queue->count;
-  if (queue->count > queue->maxcount)
-    queue->maxcount = queue->count;
-
-  DEBUGP (("Enqueuing %s at depth %d\n",
-           quotearg_n_style (0, escape_quoting_style, url), depth));
-  DEBUGP (("Queue count %d, maxcount %d.\n", queue->count, queue->maxcount));
-
-  if (i)
-    DEBUGP (("[IRI Enqueuing %s with %s\n", quote_n (0, url),
-             i->uri_encoding ? quote_n (1, i->uri_encoding) : "None"));
-
-  if (queue->tail)
-    queue->tail->next = qel;
-  queue->tail = qel;
-
-  if (!queue->head)
-    queue->head = queue->tail;
-}
-
-/* Take a URL out of the queue.  Return true if this operation
-   succeeded, or false if the queue is empty.  */
-
-static bool
-url_dequeue (struct url_queue *queue, struct iri **i,
-             const char **url, const char **referer, int *depth,
-             bool *html_allowed, bool *css_allowed)
-{
-  struct queue_element *qel = queue->head;
-
-  if (!qel)
-    return false;
-
-  queue->head = queue->head->next;
-  if (!queue->head)
-    queue->tail = NULL;
-
-  *i = qel->iri;
-  *url = qel->url;
-  *referer = qel->referer;
-  *depth = qel->depth;
-  *html_allowed = qel->html_allowed;
-  *css_allowed = qel->css_allowed;
-
-  --queue->count;
-
-  DEBUGP (("Dequeuing %s at depth %d\n",
-           quotearg_n_style (0, escape_quoting_style, qel->url), qel->depth));
-  DEBUGP (("Queue count %d, maxcount %d.\n", queue->count, queue->maxcount));
-
-  xfree (qel);
-  return true;
-}
+#include "frontier.h"
 
 static bool download_child_p (const struct urlpos *, struct url *, int,
-                              struct url *, struct hash_table *, struct iri *);
+                              struct url *, struct frontier *, struct iri *);
 static bool descend_redirect_p (const char *, struct url *, int,
-                                struct url *, struct hash_table *, struct iri *);
+                                struct url *, struct frontier *, struct iri *);
 
 #if !ENABLE_THREADS
 # define THREAD_JOIN(...)  (0)
@@ -195,6 +87,17 @@ start_retrieve_url (void *arg)
 }
 #endif
 
+/* Link filter callback for get_urls_html and get_urls_css_file.
+   Links whose URLs are already in the seen-set would only be
+   rejected by download_child_p, so they are dropped before they are
+   parsed.  */
+
+static bool
+link_seen_p (const char *link, void *arg)
+{
+  return frontier_link_seen_p ((struct frontier *) arg, link);
+}
+
 /* Retrieve a part of the web beginning with START_URL.  This used to
    be called "recursive retrieval", because the old function was
    recursive and implemented depth-first search.  retrieve_tree on the
@@ -236,12 +139,11 @@ retrieve_tree (struct url *start_url_parsed, struct iri *pi)
 
   int free_threads = N_THREADS;
 
-  /* The queue of URLs we need to load. */
-  struct url_queue *queue;
-
-  /* The URLs we do not wish to enqueue, because they are already in
-     the queue, but haven't been downloaded yet.  */
-  struct hash_table *blacklist;
+  /* The queue of URLs we need to load, and the URLs we do not wish to
+     enqueue, because they are already in the queue, but haven't been
+     downloaded yet.  */
+  struct frontier *frontier;
+  struct link_filter filter, *link_filter;
 
   struct iri *i = iri_new ();
 
@@ -262,14 +164,25 @@ retrieve_tree (struct url *start_url_parsed, struct iri *pi)
   /* FIXME: CHECK FOR ERRORS.  */
   SEM_INIT (&retr_sem, 0, 0);
 
-  queue = url_queue_new ();
-  blacklist = make_string_hash_table (0);
+  frontier = frontier_new (opt.frontier_dir, opt.frontier_memory);
 
-  /* Enqueue the starting URL.  Use start_url_parsed->url rather than
-     just URL so we enqueue the canonical form of the URL.  */
-  url_enqueue (queue, i, xstrdup (start_url_parsed->url), NULL, 0, true,
-               false);
-  string_set_add (blacklist, start_url_parsed->url);
+  /* With --spider, download_child_p records every link to a seen URL
+     as a referrer, so all links must reach it.  */
+  filter.skip_p = link_seen_p;
+  filter.arg = frontier;
+  link_filter = opt.spider ? NULL : &filter;
+
+  /* Enqueue the starting URL, unless a previous run left a checkpoint
+     to resume from.  Use start_url_parsed->url rather than just URL so
+     we enqueue the canonical form of the URL.  */
+  if (frontier_resume (frontier, start_url_parsed->url))
+    iri_free (i);
+  else
+    {
+      frontier_enqueue (frontier, i, start_url_parsed->url, NULL, 0, true,
+                        false);
+      frontier_mark_seen (frontier, start_url_parsed->url);
+    }
 
   while (1)
     {
@@ -278,6 +191,7 @@ retrieve_tree (struct url *start_url_parsed, struct iri *pi)
       bool is_css = false;
       bool dash_p_leaf_HTML = false;
       char *url = NULL, *referer;
+      const char *done_file;
       int depth;
       bool html_allowed, css_allowed;
       bool dequed = false;
@@ -292,8 +206,8 @@ retrieve_tree (struct url *start_url_parsed, struct iri *pi)
 
       if (next_url == NULL)
         {
-          if (url_dequeue (queue, (struct iri **) &next_i,
-                           (const char **)&next_url, (const char **)&next_referer,
+          if (frontier_dequeue (frontier, (struct iri **) &next_i,
+                           &next_url, &next_referer,
                            &next_depth, &next_html_allowed, &next_css_allowed))
             dequed = true;
         }
@@ -313,21 +227,21 @@ retrieve_tree (struct url *start_url_parsed, struct iri *pi)
          and again under URL2, but at a different (possibly smaller)
          depth, we want the URL's children to be taken into account
          the second time.  */
-      if (dequed && url && dl_url_file_map && hash_table_contains (dl_url_file_map, url))
+      if (dequed && url && (done_file = downloaded_url_file (url)) != NULL)
         {
 	  bool is_css_bool;
 
-          file = xstrdup (hash_table_get (dl_url_file_map, url));
+          file = xstrdup (done_file);
 
           DEBUGP (("Already downloaded \"%s\", reusing it from \"%s\".\n",
                    url, file));
+          frontier_done (frontier, url);
+          next_url = NULL;
 
 	  if ((is_css_bool = (css_allowed
-			      && downloaded_css_set
-			      && string_set_contains (downloaded_css_set, file)))
+			      && downloaded_css_p (file)))
 	      || (html_allowed
-		  && downloaded_html_set
-		  && string_set_contains (downloaded_html_set, file)))
+		  && downloaded_html_p (file)))
 	    {
 	      descend = true;
 	      is_css = is_css_bool;
@@ -433,9 +347,9 @@ retry:
             }
 
           file = thread_ctx[index].file;
-          referer = thread_ctx[index].referer;
+          referer = (char *) thread_ctx[index].referer;
           i = thread_ctx[index].i;
-          url = thread_ctx[index].url;
+          frontier_done (frontier, thread_ctx[index].url);
 
           if (html_allowed && file && status == RETROK
               && (thread_ctx[index].dt & RETROKF) && (thread_ctx[index].dt & TEXTHTML))
@@ -465,20 +379,20 @@ retry:
                 {
                   if (!descend_redirect_p (thread_ctx[index].redirected,
                                            thread_ctx[index].url_parsed, depth,
-                                           start_url_parsed, blacklist, i))
+                                           start_url_parsed, frontier, i))
                     descend = false;
                   else
                     /* Make sure that the old pre-redirect form gets
                        blacklisted. */
-                    string_set_add (blacklist, url);
+                    frontier_mark_seen (frontier, thread_ctx[index].url);
                 }
 
-              xfree (thread_ctx[index].url);
+              xfree ((char *) thread_ctx[index].url);
               url = thread_ctx[index].redirected;
             }
           else
             {
-              xfree (thread_ctx[index].url);
+              xfree ((char *) thread_ctx[index].url);
               url = xstrdup (thread_ctx[index].url_parsed->url);
             }
           url_free(thread_ctx[index].url_parsed);
@@ -522,8 +436,9 @@ retry:
         {
           bool meta_disallow_follow = false;
           struct urlpos *children
-            = is_css ? get_urls_css_file (file, url) :
-                       get_urls_html (file, url, &meta_disallow_follow, i);
+            = is_css ? get_urls_css_file (file, url, link_filter) :
+                       get_urls_html (file, url, &meta_disallow_follow, i,
+                                      link_filter);
 
           if (opt.use_robots && meta_disallow_follow)
             {
@@ -536,14 +451,16 @@ retry:
               struct urlpos *child = children;
               struct url *url_parsed = url_parse (url, NULL, i, true);
               struct iri *ci;
-              char *referer_url = url;
+              const char *referer_url = url;
+              char *stripped_url = NULL;
               bool strip_auth = (url_parsed != NULL
                                  && url_parsed->user != NULL);
               assert (url_parsed != NULL);
 
               /* Strip auth info if present */
               if (strip_auth)
-                referer_url = url_string (url_parsed, URL_AUTH_HIDE);
+                referer_url = stripped_url = url_string (url_parsed,
+                                                         URL_AUTH_HIDE);
 
               for (; child; child = child->next)
                 {
@@ -552,23 +469,23 @@ retry:
                   if (dash_p_leaf_HTML && !child->link_inline_p)
                     continue;
                   if (download_child_p (child, url_parsed, depth, start_url_parsed,
-                                        blacklist, i))
+                                        frontier, i))
                     {
                       ci = iri_new ();
                       set_uri_encoding (ci, i->content_encoding, false);
-                      url_enqueue (queue, ci, xstrdup (child->url->url),
-                                   xstrdup (referer_url), depth + 1,
-                                   child->link_expect_html,
-                                   child->link_expect_css);
+                      if (!frontier_enqueue (frontier, ci, child->url->url,
+                                             referer_url, depth + 1,
+                                             child->link_expect_html,
+                                             child->link_expect_css))
+                        status = FWRITEERR;
                       /* We blacklist the URL we have enqueued, because we
                          don't want to enqueue (and hence download) the
                          same URL twice.  */
-                      string_set_add (blacklist, child->url->url);
+                      frontier_mark_seen (frontier, child->url->url);
                     }
                 }
 
-              if (strip_auth)
-                xfree (referer_url);
+              xfree_null (stripped_url);
               url_free (url_parsed);
               free_urlpos (children);
             }
@@ -597,32 +514,22 @@ retry:
           logputs (LOG_VERBOSE, "\n");
           register_delete_file (file);
         }
-#ifndef ENABLE_THREADS
       xfree (url);
       xfree_null (referer);
+#ifndef ENABLE_THREADS
       xfree_null (file);
       iri_free (i);
 #endif
     }
 
   /* If anything is left of the queue due to a premature exit, free it
-     now.  */
-  {
-    char *d1, *d2;
-    int d3;
-    bool d4, d5;
-    struct iri *d6;
-    while (url_dequeue (queue, (struct iri **)&d6,
-                        (const char **)&d1, (const char **)&d2, &d3, &d4, &d5))
-      {
-        iri_free (d6);
-        xfree (d1);
-        xfree_null (d2);
-      }
-  }
-  url_queue_delete (queue);
-
-  string_set_free (blacklist);
+     now, after saving it if there is a frontier directory.  */
+  if (next_url)
+    {
+      xfree (next_url);
+      xfree_null (next_referer);
+    }
+  frontier_delete (frontier);
 
   if (opt.quota && total_downloaded_bytes > opt.quota)
     return QUOTEXC;
@@ -637,12 +544,12 @@ retry:
    retrieve_tree, but is in a separate function for clarity.
 
    The most expensive checks (such as those for robots) are memoized
-   by storing these URLs to BLACKLIST.  This may or may not help.  It
-   will help if those URLs are encountered many times.  */
+   by adding these URLs to the seen-set of FRONTIER.  This may or may
+   not help.  It will help if those URLs are encountered many times.  */
 
 static bool
 download_child_p (const struct urlpos *upos, struct url *parent, int depth,
-                  struct url *start_url_parsed, struct hash_table *blacklist,
+                  struct url *start_url_parsed, struct frontier *frontier,
                   struct iri *iri)
 {
   struct url *u = upos->url;
@@ -651,8 +558,10 @@ download_child_p (const struct urlpos *upos, struct url *parent, int depth,
 
   DEBUGP (("Deciding whether to enqueue \"%s\".\n", url));
 
-  if (string_set_contains (blacklist, url))
+  if (frontier_seen_p (frontier, url))
     {
+      if (upos->link)
+        frontier_note_link (frontier, upos->link);
       if (opt.spider)
         {
           char *referrer = url_string (parent, URL_AUTH_HIDE_PASSWD);
@@ -822,7 +731,7 @@ download_child_p (const struct urlpos *upos, struct url *parent, int depth,
                  trying to retrieve them.  */
               specs = res_parse ("", 0);
             }
-          res_register_specs (u->host, u->port, specs);
+          specs = res_register_specs (u->host, u->port, specs);
         }
 
       /* Now that we have (or don't have) robots.txt specs, we can
@@ -830,7 +739,7 @@ download_child_p (const struct urlpos *upos, struct url *parent, int depth,
       if (!res_match_path (specs, u->path))
         {
           DEBUGP (("Not following %s because robots.txt forbids it.\n", url));
-          string_set_add (blacklist, url);
+          frontier_mark_seen (frontier, url);
           goto out;
         }
     }
@@ -854,7 +763,7 @@ download_child_p (const struct urlpos *upos, struct url *parent, int depth,
 
 static bool
 descend_redirect_p (const char *redirected, struct url *orig_parsed, int depth,
-                    struct url *start_url_parsed, struct hash_table *blacklist,
+                    struct url *start_url_parsed, struct frontier *frontier,
                     struct iri *iri)
 {
   struct url *new_parsed;
@@ -870,7 +779,7 @@ descend_redirect_p (const char *redirected, struct url *orig_parsed, int depth,
   upos->url = new_parsed;
 
   success = download_child_p (upos, orig_parsed, depth,
-                              start_url_parsed, blacklist, iri);
+                              start_url_parsed, frontier, iri);
 
   url_free (new_parsed);
   xfree (upos);
@@ -64,6 +64,11 @@ as that of the covered work.  */
      whether anyone deploys the recommended expiry scheme for
      robots.txt.
 
+   * Following the common extension to the draft, `*' in a path
+     matches any string, and a `$' ending a path anchors it to the end
+     of the URL path.  The first matching line still decides, as the
+     draft specifies.
+
    Entry points are functions res_parse, res_parse_from_file,
    res_match_path, res_register_specs, res_get_specs, and
    res_retrieve_file.  */
@@ -75,9 +80,13 @@ as that of the covered work.  */
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#ifdef ENABLE_THREADS
+# include <pthread.h>
+#endif
 
 #include "utils.h"
 #include "hash.h"
+#include "chash.h"
 #include "url.h"
 #include "retr.h"
 #include "res.h"
@@ -92,11 +101,39 @@ struct path_info {
   bool user_agent_exact_p;
 };
 
+/* A node in the trie of decoded rule paths built by compile_specs.
+   Children of a node are linked through SIBLING.  */
+struct res_trie_node {
+  char c;                       /* the character leading to the node */
+  int rule;                     /* first prefix rule ending here, or -1 */
+  int exact_rule;               /* first `$' rule ending here, or -1 */
+  int child;
+  int sibling;
+};
+
+/* A rule containing `*', split into its decoded literal segments.  */
+struct res_pattern {
+  int rule;
+  bool anchored;                /* whether the rule ended with `$' */
+  int count;
+  char **segments;
+  int *lengths;
+};
+
 struct robot_specs {
   int count;
   int size;
   struct path_info *paths;
+
+  /* The compiled form of PATHS. */
+  struct res_trie_node *nodes;
+  int node_count;
+  int node_size;
+  struct res_pattern *patterns;
+  int pattern_count;
 };
+
+static void compile_specs (struct robot_specs *);
 
 /* Parsing the robot spec. */
 
@@ -375,6 +412,7 @@ res_parse (const char *source, int length)
       specs->size = specs->count;
     }
 
+  compile_specs (specs);
   return specs;
 }
 
@@ -400,10 +438,21 @@ res_parse_from_file (const char *filename)
 static void
 free_specs (struct robot_specs *specs)
 {
-  int i;
+  int i, j;
+  if (!specs)
+    return;
   for (i = 0; i < specs->count; i++)
     xfree (specs->paths[i].path);
   xfree_null (specs->paths);
+  for (i = 0; i < specs->pattern_count; i++)
+    {
+      for (j = 0; j < specs->patterns[i].count; j++)
+        xfree (specs->patterns[i].segments[j]);
+      xfree (specs->patterns[i].segments);
+      xfree (specs->patterns[i].lengths);
+    }
+  xfree_null (specs->patterns);
+  xfree_null (specs->nodes);
   xfree (specs);
 }
 
@@ -425,56 +474,283 @@ free_specs (struct robot_specs *specs)
     }                                                           \
 } while (0)
 
-/* The inner matching engine: return true if RECORD_PATH matches
-   URL_PATH.  The rules for matching are described at
+/* Decode the LENGTH characters at SRC into DST, which must have room
+   for as many characters, the way DECODE_MAYBE does.  Return the
+   length of the decoded string.  Rules and URL paths are both decoded
+   this way before being compared, which matches them according to
    <http://www.robotstxt.org/wc/norobots-rfc.txt>, section 3.2.2.  */
 
+static int
+decode_path (const char *src, int length, char *dst)
+{
+  const char *p = src, *end = src + length;
+  char *q = dst;
+  for (; p < end; p++)
+    {
+      char c = *p;
+      if (p + 2 < end)
+        DECODE_MAYBE (c, p);
+      *q++ = c;
+    }
+  return q - dst;
+}
+
+/* Return the index of trie node NODE's child for character C, or -1
+   if there is no such child.  */
+
+static int
+trie_child (const struct robot_specs *specs, int node, char c)
+{
+  int child;
+  for (child = specs->nodes[node].child; child >= 0;
+       child = specs->nodes[child].sibling)
+    if (specs->nodes[child].c == c)
+      break;
+  return child;
+}
+
+/* Like trie_child, but add the child if it doesn't exist.  */
+
+static int
+trie_add_child (struct robot_specs *specs, int node, char c)
+{
+  int child = trie_child (specs, node, c);
+  if (child >= 0)
+    return child;
+
+  DO_REALLOC (specs->nodes, specs->node_size, specs->node_count + 1,
+              struct res_trie_node);
+  child = specs->node_count++;
+  specs->nodes[child].c = c;
+  specs->nodes[child].rule = -1;
+  specs->nodes[child].exact_rule = -1;
+  specs->nodes[child].child = -1;
+  specs->nodes[child].sibling = specs->nodes[node].child;
+  specs->nodes[node].child = child;
+  return child;
+}
+
+/* Compile the paths of SPECS for res_match_path.  A rule without
+   wildcards is stored in a trie keyed by its decoded path, so that
+   all the prefix rules a URL matches are found in a single walk down
+   the trie.  A rule that ends with `$' matches only at the node where
+   the URL path ends.  The rare rules that contain `*' are split into
+   their literal segments and kept in a list of their own.
+
+   Since the paths are compiled in order, each node remembers the
+   first rule that ends at it, which is what RES asks for.  */
+
+static void
+compile_specs (struct robot_specs *specs)
+{
+  int i;
+
+  specs->node_count = specs->node_size = 0;
+  specs->nodes = NULL;
+  DO_REALLOC (specs->nodes, specs->node_size, 1, struct res_trie_node);
+  specs->node_count = 1;
+  xzero (specs->nodes[0]);
+  specs->nodes[0].rule = specs->nodes[0].exact_rule = -1;
+  specs->nodes[0].child = specs->nodes[0].sibling = -1;
+
+  specs->patterns = NULL;
+  specs->pattern_count = 0;
+
+  for (i = 0; i < specs->count; i++)
+    {
+      const char *path = specs->paths[i].path;
+      int length = strlen (path);
+      bool anchored = length > 0 && path[length - 1] == '$';
+
+      if (anchored)
+        --length;
+
+      if (memchr (path, '*', length))
+        {
+          struct res_pattern *pat;
+          const char *seg = path, *end = path + length;
+
+          if (!specs->patterns)
+            specs->patterns = xnew_array (struct res_pattern, specs->count);
+          pat = &specs->patterns[specs->pattern_count++];
+          pat->rule = i;
+          pat->anchored = anchored;
+          pat->count = 0;
+          pat->segments = NULL;
+          pat->lengths = NULL;
+          while (1)
+            {
+              const char *star = memchr (seg, '*', end - seg);
+              const char *seg_end = star ? star : end;
+              int n = pat->count++;
+              pat->segments = xrealloc (pat->segments,
+                                        pat->count * sizeof (char *));
+              pat->lengths = xrealloc (pat->lengths,
+                                       pat->count * sizeof (int));
+              pat->segments[n] = xmalloc (seg_end - seg + 1);
+              pat->lengths[n] = decode_path (seg, seg_end - seg,
+                                             pat->segments[n]);
+              if (!star)
+                break;
+              seg = star + 1;
+            }
+        }
+      else
+        {
+          char *decoded = xmalloc (length + 1);
+          int dlen = decode_path (path, length, decoded);
+          int node = 0, j;
+
+          for (j = 0; j < dlen; j++)
+            node = trie_add_child (specs, node, decoded[j]);
+          if (anchored)
+            {
+              if (specs->nodes[node].exact_rule < 0)
+                specs->nodes[node].exact_rule = i;
+            }
+          else if (specs->nodes[node].rule < 0)
+            specs->nodes[node].rule = i;
+          xfree (decoded);
+        }
+    }
+}
+
+/* Return the position of the first occurrence of the LENGTH
+   characters at SEG in TEXT, starting at POS, or -1 if there is
+   none.  */
+
+static int
+find_segment (const char *text, int text_length, int pos,
+              const char *seg, int length)
+{
+  for (; pos + length <= text_length; pos++)
+    if (memcmp (text + pos, seg, length) == 0)
+      return pos;
+  return -1;
+}
+
+/* Return true if the decoded URL path TEXT matches the wildcard rule
+   PAT.  Each segment is matched at its leftmost possible position,
+   which cannot miss a match because `*' matches any string.  */
+
 static bool
-matches (const char *record_path, const char *url_path)
+pattern_matches (const struct res_pattern *pat, const char *text,
+                 int text_length)
 {
-  const char *rp = record_path;
-  const char *up = url_path;
+  int pos, i, last = pat->count - 1;
+
+  if (pat->lengths[0] > text_length
+      || memcmp (text, pat->segments[0], pat->lengths[0]) != 0)
+    return false;
+  pos = pat->lengths[0];
 
-  for (; ; ++rp, ++up)
+  for (i = 1; i < last; i++)
     {
-      char rc = *rp;
-      char uc = *up;
-      if (!rc)
-        return true;
-      if (!uc)
-        return false;
-      DECODE_MAYBE(rc, rp);
-      DECODE_MAYBE(uc, up);
-      if (rc != uc)
+      pos = find_segment (text, text_length, pos,
+                          pat->segments[i], pat->lengths[i]);
+      if (pos < 0)
         return false;
+      pos += pat->lengths[i];
     }
+
+  if (pat->anchored)
+    return (text_length - pat->lengths[last] >= pos
+            && memcmp (text + text_length - pat->lengths[last],
+                       pat->segments[last], pat->lengths[last]) == 0);
+  else
+    return find_segment (text, text_length, pos,
+                         pat->segments[last], pat->lengths[last]) >= 0;
 }
 
-/* Iterate through all paths in SPECS.  For the first one that
-   matches, return its allow/reject status.  If none matches,
+/* Find the first rule in SPECS that matches PATH.  For the first one
+   that matches, return its allow/reject status.  If none matches,
    retrieval is by default allowed.  */
 
 bool
 res_match_path (const struct robot_specs *specs, const char *path)
 {
-  int i;
-  if (!specs)
+  char buf[256], *text;
+  int text_length, length, node, i, rule = -1;
+
+  if (!specs || specs->count == 0)
     return true;
-  for (i = 0; i < specs->count; i++)
-    if (matches (specs->paths[i].path, path))
-      {
-        bool allowedp = specs->paths[i].allowedp;
-        DEBUGP (("%s path %s because of rule %s.\n",
-                 allowedp ? "Allowing" : "Rejecting",
-                 path, quote (specs->paths[i].path)));
-        return allowedp;
-      }
+
+  length = strlen (path);
+  text = length < sizeof (buf) ? buf : xmalloc (length + 1);
+  text_length = decode_path (path, length, text);
+
+  /* Walk down the trie along the path, picking up the earliest prefix
+     rule on the way.  */
+  node = 0;
+  for (i = 0; ; i++)
+    {
+      const struct res_trie_node *n = &specs->nodes[node];
+      if (n->rule >= 0 && (rule < 0 || n->rule < rule))
+        rule = n->rule;
+      if (i == text_length)
+        {
+          if (n->exact_rule >= 0 && (rule < 0 || n->exact_rule < rule))
+            rule = n->exact_rule;
+          break;
+        }
+      node = trie_child (specs, node, text[i]);
+      if (node < 0)
+        break;
+    }
+
+  /* Wildcard rules only matter if they come before the rule found in
+     the trie.  */
+  for (i = 0; i < specs->pattern_count; i++)
+    {
+      const struct res_pattern *pat = &specs->patterns[i];
+      if (rule >= 0 && pat->rule > rule)
+        break;
+      if (pattern_matches (pat, text, text_length))
+        {
+          rule = pat->rule;
+          break;
+        }
+    }
+
+  if (text != buf)
+    xfree (text);
+
+  if (rule >= 0)
+    {
+      bool allowedp = specs->paths[rule].allowedp;
+      DEBUGP (("%s path %s because of rule %s.\n",
+               allowedp ? "Allowing" : "Rejecting",
+               path, quote (specs->paths[rule].path)));
+      return allowedp;
+    }
   return true;
 }
-
+
 /* Registering the specs. */
 
-static struct hash_table *registered_specs;
+/* The specs are shared by the --jobs threads, and are never freed
+   before res_cleanup once registered.  */
+static struct chash_table *registered_specs;
+
+#ifdef ENABLE_THREADS
+static pthread_once_t registered_specs_once = PTHREAD_ONCE_INIT;
+#endif
+
+static void
+create_registered_specs (void)
+{
+  registered_specs = make_nocase_string_chash_table (0);
+}
+
+#ifdef ENABLE_THREADS
+# define ENSURE_SPECS_EXIST \
+  pthread_once (&registered_specs_once, create_registered_specs)
+#else
+# define ENSURE_SPECS_EXIST do {                \
+  if (!registered_specs)                        \
+    create_registered_specs ();                 \
+} while (0)
+#endif
 
 /* Stolen from cookies.c. */
 #define SET_HOSTPORT(host, port, result) do {           \
@@ -485,43 +761,120 @@ static struct hash_table *registered_specs;
   number_to_string (result + HP_len + 1, port);         \
 } while (0)
 
+/* While a thread is retrieving the robots.txt of a server, the
+   server's entry holds FETCHING_SPECS.  Other threads that want the
+   specs wait on SPECS_FETCHED rather than retrieving the file again.
+   SPECS_MUTEX is only taken on that slow path; the lookups of specs
+   that are already registered only take the lock of the table.  */
+static struct robot_specs fetching_specs;
+#define FETCHING_SPECS (&fetching_specs)
+
+#ifdef ENABLE_THREADS
+static pthread_mutex_t specs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t specs_fetched = PTHREAD_COND_INITIALIZER;
+# define SPECS_LOCK pthread_mutex_lock (&specs_mutex)
+# define SPECS_UNLOCK pthread_mutex_unlock (&specs_mutex)
+# define SPECS_WAIT pthread_cond_wait (&specs_fetched, &specs_mutex)
+# define SPECS_BROADCAST pthread_cond_broadcast (&specs_fetched)
+#else
+# define SPECS_LOCK
+# define SPECS_UNLOCK
+# define SPECS_WAIT
+# define SPECS_BROADCAST
+#endif
+
 /* Register RES specs that below to server on HOST:PORT.  They will
-   later be retrievable using res_get_specs.  */
+   later be retrievable using res_get_specs, and threads waiting for
+   them in res_get_specs are woken up.
 
-void
+   If another thread has registered specs for HOST:PORT meanwhile,
+   those are kept, since they may be in use already, and SPECS is
+   freed.  Return the specs that are registered.  */
+
+struct robot_specs *
 res_register_specs (const char *host, int port, struct robot_specs *specs)
 {
   struct robot_specs *old;
   char *hp, *hp_old;
+  struct hash_table *ht;
   SET_HOSTPORT (host, port, hp);
 
-  if (!registered_specs)
-    registered_specs = make_nocase_string_hash_table (0);
+  ENSURE_SPECS_EXIST;
 
-  if (hash_table_get_pair (registered_specs, hp, &hp_old, &old))
+  SPECS_LOCK;
+  ht = chash_table_lock (registered_specs, hp);
+  if (hash_table_get_pair (ht, hp, &hp_old, &old))
     {
-      if (old)
-        free_specs (old);
-      hash_table_put (registered_specs, hp_old, specs);
+      /* Specs registered as NULL, if res_parse_from_file failed, count
+         as absent.  */
+      if (old && old != FETCHING_SPECS)
+        {
+          free_specs (specs);
+          specs = old;
+        }
+      else
+        hash_table_put (ht, hp_old, specs);
     }
   else
     {
-      hash_table_put (registered_specs, xstrdup (hp), specs);
+      hash_table_put (ht, xstrdup (hp), specs);
     }
+  chash_table_unlock (registered_specs, hp);
+  SPECS_BROADCAST;
+  SPECS_UNLOCK;
+  return specs;
 }
 
-/* Get the specs that belong to HOST:PORT. */
+/* Get the specs that belong to HOST:PORT.
+
+   If there are none yet, return NULL.  The caller is then expected
+   to retrieve the robots.txt of the server and to register the specs
+   it finds with res_register_specs (which it must do even if the
+   retrieval fails).  Until it does, other threads asking for the
+   specs of HOST:PORT block here, and get the registered specs when
+   they are woken up, so that every robots.txt is retrieved once.  */
 
 struct robot_specs *
 res_get_specs (const char *host, int port)
 {
-  char *hp;
+  struct robot_specs *specs;
+  struct hash_table *ht;
+  char *hp, *hp_old;
   SET_HOSTPORT (host, port, hp);
-  if (!registered_specs)
-    return NULL;
-  return hash_table_get (registered_specs, hp);
+  ENSURE_SPECS_EXIST;
+
+  specs = chash_table_get (registered_specs, hp);
+  if (specs && specs != FETCHING_SPECS)
+    return specs;
+
+  SPECS_LOCK;
+  while (1)
+    {
+      ht = chash_table_lock (registered_specs, hp);
+      if (!hash_table_get_pair (ht, hp, &hp_old, &specs))
+        {
+          hp_old = xstrdup (hp);
+          specs = NULL;
+        }
+      /* Specs registered as NULL are fetched again, under the key
+         they were registered with.  */
+      if (!specs)
+        hash_table_put (ht, hp_old, FETCHING_SPECS);
+      chash_table_unlock (registered_specs, hp);
+#ifdef ENABLE_THREADS
+      if (specs == FETCHING_SPECS)
+        {
+          SPECS_WAIT;
+          continue;
+        }
+#endif
+      break;
+    }
+  SPECS_UNLOCK;
+
+  return specs == FETCHING_SPECS ? NULL : specs;
 }
-
+
 /* Loading the robots file.  */
 
 #define RES_SPECS_LOCATION "/robots.txt"
@@ -594,20 +947,22 @@ is_robots_txt_url (const char *url)
   return ret;
 }
 
+static int
+res_cleanup_mapper (void *key, void *value, void *arg)
+{
+  xfree (key);
+  if (value != FETCHING_SPECS)
+    free_specs (value);
+  return 0;
+}
+
 void
 res_cleanup (void)
 {
   if (registered_specs)
     {
-      hash_table_iterator iter;
-      for (hash_table_iterate (registered_specs, &iter);
-           hash_table_iter_next (&iter);
-           )
-        {
-          xfree (iter.key);
-          free_specs (iter.value);
-        }
-      hash_table_destroy (registered_specs);
+      chash_table_for_each (registered_specs, res_cleanup_mapper, NULL);
+      chash_table_destroy (registered_specs);
       registered_specs = NULL;
     }
 }
@@ -636,6 +991,50 @@ test_is_robots_txt_url()
   return NULL;
 }
 
+const char *
+test_res_match_path()
+{
+  static const char robots[] =
+    "User-Agent: *\n"
+    "Disallow: /private$\n"
+    "Allow: /private/pub\n"
+    "Disallow: /private\n"
+    "Disallow: /*.cgi$\n"
+    "Disallow: /a%3cb\n"
+    "Allow: /docs/*/index.html\n"
+    "Disallow: /docs/\n";
+  int i;
+  struct {
+    char *path;
+    bool expected_result;
+  } test_array[] = {
+    { "", true },
+    { "private", false },
+    { "private/pub/x", true },
+    { "private/x", false },
+    { "privatex", false },
+    { "foo.cgi", false },
+    { "foo.cgi?x", true },
+    { "bar/foo.cgi", false },
+    { "a<b", false },
+    { "a%3Cbc", false },
+    { "docs/v1/index.html", true },
+    { "docs/v1/other.html", false },
+    { "public", true },
+  };
+  struct robot_specs *specs = res_parse (robots, sizeof (robots) - 1);
+
+  for (i = 0; i < countof (test_array); ++i)
+    {
+      mu_assert ("test_res_match_path: wrong result",
+                 res_match_path (specs, test_array[i].path)
+                 == test_array[i].expected_result);
+    }
+
+  free_specs (specs);
+  return NULL;
+}
+
 #endif /* TESTING */
 
 /*
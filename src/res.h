@@ -38,7 +38,8 @@ struct robot_specs *res_parse_from_file (const char *);
 
 bool res_match_path (const struct robot_specs *, const char *);
 
-void res_register_specs (const char *, int, struct robot_specs *);
+struct robot_specs *res_register_specs (const char *, int,
+                                        struct robot_specs *);
 struct robot_specs *res_get_specs (const char *, int);
 
 bool res_retrieve_file (const char *, char **, struct iri *);
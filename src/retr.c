@@ -67,7 +67,10 @@ as that of the covered work.  */
 #include "convert.h"
 #include "ptimer.h"
 #include "html-url.h"
+#include "arena.h"
 #include "iri.h"
+#include "warc.h"
+#include "metrics.h"
 
 #ifdef ENABLE_METALINK
 static pthread_mutex_t pconn_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -86,6 +89,43 @@ SUM_SIZE_INT total_downloaded_bytes;
 /* Total download time in seconds. */
 double total_download_time;
 
+extern int numurls;
+
+#ifdef ENABLE_THREADS
+/* Guards numurls and the download totals, which the workers of a
+   parallel retrieval and the segments of a download update
+   concurrently.  */
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+# define STATS_LOCK pthread_mutex_lock (&stats_mutex)
+# define STATS_UNLOCK pthread_mutex_unlock (&stats_mutex)
+#else
+# define STATS_LOCK
+# define STATS_UNLOCK
+#endif
+
+/* Add FILES downloaded files of BYTES bytes in total to the
+   statistics.  FILES may be negative, to take back files that were
+   counted more than once.  */
+
+void
+count_downloads (int files, SUM_SIZE_INT bytes)
+{
+  STATS_LOCK;
+  numurls += files;
+  total_downloaded_bytes += bytes;
+  STATS_UNLOCK;
+}
+
+/* Add SECS seconds to the total download time.  */
+
+void
+count_download_time (double secs)
+{
+  STATS_LOCK;
+  total_download_time += secs;
+  STATS_UNLOCK;
+}
+
 /* If non-NULL, the stream to which output should be written.  This
    stream is initialized when `-O' is used.  */
 FILE *output_stream;
@@ -171,8 +211,8 @@ limit_bandwidth (wgint bytes, struct ptimer *timer)
    skipped.  */
 
 static int
-write_data (FILE *out, FILE *out2, const char *buf, int bufsize,
-            wgint *skip, wgint *written)
+write_data (FILE *out, FILE *out2, struct warc_digests *out2_digests,
+            const char *buf, int bufsize, wgint *skip, wgint *written)
 {
   if (out == NULL && out2 == NULL)
     return 1;
@@ -193,7 +233,11 @@ write_data (FILE *out, FILE *out2, const char *buf, int bufsize,
   if (out != NULL)
     fwrite (buf, 1, bufsize, out);
   if (out2 != NULL)
-    fwrite (buf, 1, bufsize, out2);
+    {
+      fwrite (buf, 1, bufsize, out2);
+      if (out2_digests != NULL)
+        warc_digests_update (out2_digests, buf, bufsize);
+    }
   *written += bufsize;
 
   /* Immediately flush the downloaded data.  This should not hinder
@@ -223,6 +267,18 @@ write_data (FILE *out, FILE *out2, const char *buf, int bufsize,
     return 0;
 }
 
+/* Write a chunk header LINE of a chunked response to OUT2, keeping
+   OUT2_DIGESTS up to date.  */
+
+static void
+write_line (FILE *out2, struct warc_digests *out2_digests, const char *line)
+{
+  size_t len = strlen (line);
+  fwrite (line, 1, len, out2);
+  if (out2_digests != NULL)
+    warc_digests_update (out2_digests, line, len);
+}
+
 /* Read the contents of file descriptor FD until it the connection
    terminates or a read error occurs.  The data is read in portions of
    up to 16K and written to OUT as it arrives.  If opt.verbose is set,
@@ -241,7 +297,9 @@ write_data (FILE *out, FILE *out2, const char *buf, int bufsize,
    If OUT2 is non-NULL, the contents is also written to OUT2.
    OUT2 will get an exact copy of the response: if this is a chunked
    response, everything -- including the chunk headers -- is written
-   to OUT2.  (OUT will only get the unchunked response.)
+   to OUT2.  (OUT will only get the unchunked response.)  If
+   OUT2_DIGESTS is non-NULL, it is updated with everything written to
+   OUT2, so that the WARC code need not read OUT2 back to digest it.
 
    The function exits and returns the amount of data read.  In case of
    error while reading data, -1 is returned.  In case of error while
@@ -251,7 +309,7 @@ write_data (FILE *out, FILE *out2, const char *buf, int bufsize,
 int
 fd_read_body (const char *url, int fd, FILE *out, wgint toread, wgint startpos,
               wgint *qtyread, wgint *qtywritten, double *elapsed, int flags,
-              FILE *out2)
+              FILE *out2, struct warc_digests *out2_digests)
 {
   int ret = 0;
 #undef max
@@ -314,6 +372,8 @@ fd_read_body (const char *url, int fd, FILE *out, wgint toread, wgint startpos,
   if (opt.limit_rate && opt.limit_rate < dlbufsize)
     dlbufsize = opt.limit_rate;
 
+  metrics_add (METRIC_TRANSFERS, 1);
+
   /* Read from FD while there is data to read.  Normally toread==0
      means that it is unknown how much data is to arrive.  However, if
      EXACT is set, then toread==0 means what it says: that no data
@@ -335,7 +395,7 @@ fd_read_body (const char *url, int fd, FILE *out, wgint toread, wgint startpos,
                   break;
                 }
               else if (out2 != NULL)
-                fwrite (line, 1, strlen (line), out2);
+                write_line (out2, out2_digests, line);
 
               remaining_chunk_size = strtol (line, &endl, 16);
               xfree (line);
@@ -349,7 +409,7 @@ fd_read_body (const char *url, int fd, FILE *out, wgint toread, wgint startpos,
                   else
                     {
                       if (out2 != NULL)
-                        fwrite (line, 1, strlen (line), out2);
+                        write_line (out2, out2_digests, line);
                       xfree (line);
                     }
                   break;
@@ -401,7 +461,9 @@ fd_read_body (const char *url, int fd, FILE *out, wgint toread, wgint startpos,
       if (ret > 0)
         {
           sum_read += ret;
-          int write_res = write_data (out, out2, dlbuf, ret, &skip, &sum_written);
+          metrics_add (METRIC_BYTES, ret);
+          int write_res = write_data (out, out2, out2_digests, dlbuf, ret,
+                                      &skip, &sum_written);
           if (write_res < 0)
             {
               ret = (write_res == -3) ? -3 : -2;
@@ -421,7 +483,7 @@ fd_read_body (const char *url, int fd, FILE *out, wgint toread, wgint startpos,
                   else
                     {
                       if (out2 != NULL)
-                        fwrite (line, 1, strlen (line), out2);
+                        write_line (out2, out2_digests, line);
                       xfree (line);
                     }
                 }
@@ -443,6 +505,7 @@ fd_read_body (const char *url, int fd, FILE *out, wgint toread, wgint startpos,
     ret = -1;
 
  out:
+  metrics_add (METRIC_TRANSFERS, -1);
   if (progress)
     progress_finish (progress, ptimer_read (timer));
 
@@ -764,8 +827,9 @@ retrieve_url (struct url * orig_parsed, const char *origurl, char **file,
 
 #ifndef ENABLE_METALINK
   /* Note that, each and every call to retrieve_url(), except the ones made by
-     functions relevant to metalink support, the value of *file is NULL. */
-  if (file)
+     functions relevant to metalink support or to segmented downloads, the
+     value of *file is NULL. */
+  if (file && !segment_range)
     *file = NULL;
 #endif
 
@@ -857,7 +921,8 @@ retrieve_url (struct url * orig_parsed, const char *origurl, char **file,
 
       assert (mynewloc != NULL);
 
-      if (local_file)
+      /* The file of a segment belongs to the caller.  */
+      if (local_file && !segment_range)
         xfree (local_file);
 
       /* The HTTP specs only allow absolute URLs to appear in
@@ -960,7 +1025,7 @@ retrieve_url (struct url * orig_parsed, const char *origurl, char **file,
           DEBUGP (("[Couldn't fallback to non-utf8 for %s\n", quote (url)));
     }
 
-  if (local_file && u && *dt & RETROKF)
+  if (local_file && u && *dt & RETROKF && !segment_range)
     {
       register_download (u->url, local_file);
 
@@ -1006,6 +1071,458 @@ bail:
   return result;
 }
 
+#ifdef ENABLE_THREADS
+/* Whether the document at U may be split in segments.  The options
+   checked here need the document to come in one piece.  */
+static bool
+segmentable_p (struct url *u)
+{
+  if (u->scheme != SCHEME_HTTP
+#ifdef HAVE_SSL
+      && u->scheme != SCHEME_HTTPS
+#endif
+      )
+    return false;
+
+  return (opt.jobs > 1 && !opt.recursive && !opt.page_requisites
+          && !opt.spider && !opt.timestamping && !opt.always_rest
+          && opt.start_pos < 0 && !opt.content_disposition
+          && !opt.save_headers && !opt.method && !opt.warc_filename
+          && !opt.backups);
+}
+
+/* Retrieve the document at U like retrieve_url, but over opt.jobs
+   connections at once, each fetching a range of it into a temporary
+   file, as metalink downloads do.  The temporary files are then
+   merged into the file the document is saved to.
+
+   A HEAD request first tells whether the server serves ranges and how
+   long the document is.  If it does not, if the document is too small
+   to split, or if the server ignores the range of a segment, the
+   document is retrieved by retrieve_url in one piece.  */
+
+uerr_t
+retrieve_segmented (struct url *u, const char *origurl, char **file,
+                    char **newloc, int *dt, struct iri *iri)
+{
+  struct s_thread_ctx *thread_ctx;
+  struct url *proxy_url = NULL;
+  char *proxy, *local_file = NULL;
+  sem_t retr_sem;
+  wgint length, chunk_size;
+  int jobs, segments, spawned, r, k;
+  uerr_t status = RETROK;
+
+  if (!segmentable_p (u))
+    goto single;
+
+  if (!opt.output_document)
+    {
+      local_file = url_file_name (u, NULL);
+      if (opt.noclobber && file_exists_p (local_file))
+        goto single;
+    }
+
+  /* Leave bad proxy URLs to retrieve_url to report.  */
+  proxy = getproxy (u);
+  if (proxy)
+    {
+      proxy_url = url_parse (proxy, NULL, NULL, true);
+      if (!proxy_url || proxy_url->scheme != SCHEME_HTTP)
+        {
+          if (proxy_url)
+            url_free (proxy_url);
+          goto single;
+        }
+    }
+  length = http_range_length (u, proxy_url, iri);
+  if (proxy_url)
+    url_free (proxy_url);
+  if (length < 2 * MIN_CHUNK_SIZE)
+    goto single;
+
+  /* As many segments as --jobs asks for, none smaller than
+     MIN_CHUNK_SIZE.  The code in multi.c sizes its arrays by
+     opt.jobs.  */
+  jobs = opt.jobs;
+  segments = length / MIN_CHUNK_SIZE < jobs ? length / MIN_CHUNK_SIZE : jobs;
+  chunk_size = (length + segments - 1) / segments;
+  segments = (length + chunk_size - 1) / chunk_size;
+  opt.jobs = segments;
+
+  init_temp_files ();
+  init_ranges ();
+  fill_ranges_data (1, length, chunk_size);
+  name_temp_files ();
+
+  logprintf (LOG_VERBOSE, _("Retrieving %s in %d segments.\n"),
+             quote (origurl), segments);
+
+  thread_ctx = xcalloc (segments, sizeof *thread_ctx);
+  sem_init (&retr_sem, 0, 0);
+  for (spawned = 0; spawned < segments; ++spawned)
+    {
+      thread_ctx[spawned].url = u->url;
+      thread_ctx[spawned].i = iri_dup (iri);
+      thread_ctx[spawned].retr_sem = &retr_sem;
+      thread_ctx[spawned].own_status = true;
+      if (spawn_thread (thread_ctx, spawned, 0))
+        {
+          logprintf (LOG_NOTQUIET, _("Cannot start a thread: %s\n"),
+                     strerror (errno));
+          if (thread_ctx[spawned].url_parsed)
+            url_free (thread_ctx[spawned].url_parsed);
+          iri_free (thread_ctx[spawned].i);
+          status = RANGEERR;
+          break;
+        }
+    }
+
+  for (k = 0; k < spawned; ++k)
+    {
+      r = collect_thread (&retr_sem, thread_ctx);
+      if (thread_ctx[r].status != RETROK && status != RANGEERR)
+        status = thread_ctx[r].status;
+      xfree_null (thread_ctx[r].redirected);
+      iri_free (thread_ctx[r].i);
+    }
+  sem_destroy (&retr_sem);
+  xfree (thread_ctx);
+
+  if (status == RETROK)
+    {
+      FILE *out = output_stream;
+
+      if (!out)
+        {
+          mkalldirs (local_file);
+          out = fopen (local_file, "wb");
+        }
+      if (!out || append_temp_files (out) < 0
+          || (out != output_stream && fclose (out) == EOF))
+        {
+          logprintf (LOG_NOTQUIET, "%s: %s\n",
+                     local_file ? local_file : opt.output_document,
+                     strerror (errno));
+          status = FWRITEERR;
+        }
+      else if (out == output_stream)
+        fflush (out);
+    }
+
+  delete_temp_files ();
+  clean_range_res_data ();
+  clean_ranges ();
+  clean_temp_files ();
+  opt.jobs = jobs;
+
+  if (status == RANGEERR)
+    goto single;
+
+  if (status == RETROK)
+    {
+      /* Count the document once, not once per segment.  */
+      count_downloads (-(segments - 1), 0);
+      metrics_add_file (u->host, length);
+      if (opt.output_document && !HYPHENP (opt.output_document))
+        local_file = xstrdup (opt.output_document);
+      if (local_file)
+        {
+          logprintf (LOG_VERBOSE, _("%s saved [%s] from %d segments.\n\n"),
+                     quote (local_file), number_to_static_string (length),
+                     segments);
+          register_download (u->url, local_file);
+        }
+      *dt = RETROKF;
+    }
+  else
+    inform_exit_status (status);
+
+  if (file)
+    *file = local_file;
+  else
+    xfree_null (local_file);
+  if (newloc)
+    *newloc = NULL;
+  return status;
+
+ single:
+  xfree_null (local_file);
+  return retrieve_url (u, origurl, file, newloc, NULL, dt, opt.recursive,
+                       iri, true, NULL);
+}
+#endif /* ENABLE_THREADS */
+
+/* How many URLs of an input file are parsed at a time.  */
+#define INPUT_BATCH 1000
+
+/* How long retrieve_urls_parallel waits for a retrieval to end before
+   it looks for more URLs on an input that had none ready, in
+   nanoseconds.  */
+#define INPUT_POLL_NS 200000000
+
+/* Remove FILENAME, retrieved from an input file, if --delete-after
+   asks for it.  */
+static void
+delete_after_input_url (const char *filename, int *dt)
+{
+  if (filename && opt.delete_after && file_exists_p (filename))
+    {
+      DEBUGP (("\
+Removing file due to --delete-after in retrieve_from_file():\n"));
+      logprintf (LOG_VERBOSE, _("Removing %s.\n"), filename);
+      if (unlink (filename))
+        logprintf (LOG_NOTQUIET, "unlink: %s\n", strerror (errno));
+      *dt &= ~RETROKF;
+    }
+}
+
+#ifdef ENABLE_THREADS
+/* Whether the URLs of an input file may be retrieved several at a
+   time.  retrieve_tree is not reentrant, and -O would interleave the
+   documents.  */
+static bool
+parallel_input_p (void)
+{
+  return (opt.jobs > 1 && !opt.recursive && !opt.page_requisites
+          && !opt.output_document);
+}
+
+/* The start routine of the threads of retrieve_urls_parallel.  */
+static void *
+retrieve_input_url (void *arg)
+{
+  struct s_thread_ctx *ctx = (struct s_thread_ctx *) arg;
+
+  ctx->status = retrieve_url (ctx->url_parsed, ctx->url,
+                              &ctx->file, &ctx->redirected,
+                              NULL, &ctx->dt, opt.recursive, ctx->i,
+                              true, NULL);
+  ctx->terminated = 1;
+  sem_post (ctx->retr_sem);
+
+  return NULL;
+}
+
+/* Whether another URL may be retrieved from the host of U while the
+   threads of CTX run, as --host-connections allows.  */
+static bool
+host_connection_free_p (const struct s_thread_ctx *ctx, int n,
+                        const struct url *u)
+{
+  int i, count = 0;
+
+  if (opt.host_connections <= 0)
+    return true;
+  for (i = 0; i < n; i++)
+    if (ctx[i].used && ctx[i].url_parsed
+        && 0 == strcasecmp (ctx[i].url_parsed->host, u->host))
+      count++;
+  return count < opt.host_connections;
+}
+
+/* A URL retrieve_urls_parallel is about to retrieve, parsed with an
+   iri of its own.  */
+struct input_url {
+  struct url *parsed;
+  struct iri *i;
+};
+
+/* Parse the URL of U into IU for retrieve_urls_parallel.  Returns
+   false if it cannot be parsed.  */
+static bool
+parse_input_url (const struct urlpos *u, struct iri *iri,
+                 struct input_url *iu)
+{
+  iu->i = iri_dup (iri);
+  iu->parsed = url_parse (u->url->url, NULL, iu->i, true);
+  if (!iu->parsed)
+    iu->parsed = url_parse (u->url->url, NULL, NULL, false);
+  if (!iu->parsed)
+    {
+      iri_free (iu->i);
+      return false;
+    }
+  return true;
+}
+
+/* Retrieve the URLs of URL_LIST, then those UF reads, opt.jobs at a
+   time, each in a thread of its own, as the loop of retrieve_from_file
+   does one after the other.  A URL whose host already has
+   --host-connections downloads running waits, while those behind it
+   from other hosts go ahead; at most opt.jobs URLs wait that way.
+   While UF has no URL ready, the retrievals that run are collected
+   as they end, so a pipe is read as its URLs come.  Frees URL_LIST.
+
+   COUNT and the returned status are as for retrieve_from_file.  */
+static uerr_t
+retrieve_urls_parallel (struct urlpos *url_list, struct url_file *uf,
+                        struct iri *iri, int *count)
+{
+  const int n = opt.jobs;
+  struct s_thread_ctx *ctx = xcalloc (n, sizeof *ctx);
+  struct input_url *waiting = xnew_array (struct input_url, n);
+  struct urlpos *cur_url = url_list;
+  int n_waiting = 0, busy = 0, i;
+  bool stop = false;
+  uerr_t status = RETROK;
+  sem_t retr_sem;
+
+  sem_init (&retr_sem, 0, 0);
+  while (1)
+    {
+      struct input_url next;
+      bool found = false, input_ready = true;
+
+      /* Pick a URL that waited for its host, or the next one of the
+         input.  */
+      if (!stop && busy < n)
+        {
+          for (i = 0; i < n_waiting && !found; i++)
+            if (host_connection_free_p (ctx, n, waiting[i].parsed))
+              {
+                next = waiting[i];
+                found = true;
+                memmove (waiting + i, waiting + i + 1,
+                         (n_waiting - i - 1) * sizeof *waiting);
+                n_waiting--;
+              }
+          while (!found && n_waiting < n)
+            {
+              struct urlpos *u = cur_url;
+              struct input_url iu;
+
+              if (!u)
+                {
+                  /* Read the next batch, waiting for it only if
+                     nothing runs that could be collected meanwhile.  */
+                  if (!uf || urls_file_eof (uf))
+                    break;
+                  free_urlpos (url_list);
+                  url_list = cur_url = read_urls_file (uf, INPUT_BATCH,
+                                                       busy == 0);
+                  if (!cur_url)
+                    {
+                      input_ready = urls_file_eof (uf);
+                      break;
+                    }
+                  continue;
+                }
+
+              cur_url = cur_url->next;
+              if (u->ignore_when_downloading)
+                ++*count;
+              else if (!parse_input_url (u, iri, &iu))
+                {
+                  ++*count;
+                  status = URLERROR;
+                }
+              else if (host_connection_free_p (ctx, n, iu.parsed))
+                {
+                  next = iu;
+                  found = true;
+                }
+              else
+                waiting[n_waiting++] = iu;
+            }
+          if (found && opt.quota && total_downloaded_bytes > opt.quota)
+            {
+              status = QUOTEXC;
+              stop = true;
+              url_free (next.parsed);
+              iri_free (next.i);
+              found = false;
+            }
+        }
+
+      if (found)
+        {
+          int err;
+
+          for (i = 0; ctx[i].used; i++)
+            ;
+          ctx[i].used = 1;
+          ctx[i].terminated = 0;
+          ctx[i].url_parsed = next.parsed;
+          ctx[i].i = next.i;
+          ctx[i].url = next.parsed->url;
+          ctx[i].file = ctx[i].redirected = NULL;
+          ctx[i].retr_sem = &retr_sem;
+          ++*count;
+
+          err = pthread_create (&ctx[i].thread, NULL, retrieve_input_url,
+                                &ctx[i]);
+          if (err)
+            {
+              /* Retrieve it in this thread instead.  */
+              ctx[i].thread = pthread_self ();
+              retrieve_input_url (&ctx[i]);
+            }
+          busy++;
+          continue;
+        }
+
+      if (!busy)
+        {
+          if (!input_ready && !stop)
+            continue;
+          break;
+        }
+
+      /* Wait for a retrieval to end, or, if the input has no URL
+         ready, for a while before looking at it again.  */
+      if (!input_ready && !stop && busy < n)
+        {
+          struct timespec ts;
+          int res;
+
+          clock_gettime (CLOCK_REALTIME, &ts);
+          ts.tv_nsec += INPUT_POLL_NS;
+          if (ts.tv_nsec >= 1000000000)
+            {
+              ts.tv_sec++;
+              ts.tv_nsec -= 1000000000;
+            }
+          while ((res = sem_timedwait (&retr_sem, &ts)) < 0 && errno == EINTR)
+            ;
+          if (res < 0)
+            continue;
+        }
+      else
+        while (sem_wait (&retr_sem) < 0 && errno == EINTR)
+          ;
+      for (i = 0; !(ctx[i].used && ctx[i].terminated); i++)
+        ;
+      if (!pthread_equal (ctx[i].thread, pthread_self ()))
+        pthread_join (ctx[i].thread, NULL);
+
+      status = ctx[i].status;
+      delete_after_input_url (ctx[i].file, &ctx[i].dt);
+
+      xfree_null (ctx[i].file);
+      xfree_null (ctx[i].redirected);
+      url_free (ctx[i].url_parsed);
+      iri_free (ctx[i].i);
+      ctx[i].used = 0;
+      busy--;
+    }
+
+  if (stop)
+    status = QUOTEXC;
+  for (i = 0; i < n_waiting; i++)
+    {
+      url_free (waiting[i].parsed);
+      iri_free (waiting[i].i);
+    }
+  sem_destroy (&retr_sem);
+  xfree (waiting);
+  xfree (ctx);
+  free_urlpos (url_list);
+
+  return status;
+}
+#endif /* ENABLE_THREADS */
+
 /* Find the URLs in the file and call retrieve_url() for each of them.
    If HTML is true, treat the file as HTML, and construct the URLs
    accordingly.
@@ -1017,6 +1534,7 @@ retrieve_from_file (const char *file, bool html, int *count)
 {
   uerr_t status;
   struct urlpos *url_list, *cur_url;
+  struct url_file *uf = NULL;
   struct iri *iri = iri_new();
 
   char *input_file, *url_file = NULL;
@@ -1307,69 +1825,87 @@ retrieve_from_file (const char *file, bool html, int *count)
   else
     {
 #endif
-      url_list = (html ? get_urls_html (input_file, NULL, NULL, iri)
-                  : get_urls_file (input_file));
+      /* The URLs of a plain list are read a batch at a time, so that
+         the list may be as long as a pipe keeps it going.  */
+      if (html)
+        url_list = get_urls_html (input_file, NULL, NULL, iri, NULL);
+      else
+        {
+          uf = open_urls_file (input_file);
+          url_list = uf ? read_urls_file (uf, INPUT_BATCH, true) : NULL;
+        }
 
       xfree_null (url_file);
 
-      for (cur_url = url_list; cur_url; cur_url = cur_url->next, ++*count)
+#ifdef ENABLE_THREADS
+      if (parallel_input_p ())
         {
-          char *filename = NULL, *new_file = NULL;
-          int dt;
-          struct iri *tmpiri = iri_dup (iri);
-          struct url *parsed_url = NULL;
-
-          if (cur_url->ignore_when_downloading)
-            continue;
+          status = retrieve_urls_parallel (url_list, uf, iri, count);
+          url_list = NULL;
+        }
+#endif
 
-          if (opt.quota && total_downloaded_bytes > opt.quota)
+      while (url_list)
+        {
+          for (cur_url = url_list; cur_url; cur_url = cur_url->next, ++*count)
             {
-              status = QUOTEXC;
-              break;
-            }
+              char *filename = NULL, *new_file = NULL;
+              int dt;
+              struct iri *tmpiri = iri_dup (iri);
+              struct url *parsed_url = NULL;
 
-          parsed_url = url_parse (cur_url->url->url, NULL, tmpiri, true);
+              if (cur_url->ignore_when_downloading)
+                continue;
 
-          if ((opt.recursive || opt.page_requisites)
-              && (cur_url->url->scheme != SCHEME_FTP || getproxy (cur_url->url)))
-            {
-              int old_follow_ftp = opt.follow_ftp;
+              if (opt.quota && total_downloaded_bytes > opt.quota)
+                {
+                  status = QUOTEXC;
+                  break;
+                }
 
-              /* Turn opt.follow_ftp on in case of recursive FTP retrieval */
-              if (cur_url->url->scheme == SCHEME_FTP)
-                opt.follow_ftp = 1;
+              parsed_url = url_parse (cur_url->url->url, NULL, tmpiri, true);
 
-              status = retrieve_tree (parsed_url ? parsed_url : cur_url->url,
-                                  tmpiri);
+              if ((opt.recursive || opt.page_requisites)
+                  && (cur_url->url->scheme != SCHEME_FTP
+                      || getproxy (cur_url->url)))
+                {
+                  int old_follow_ftp = opt.follow_ftp;
 
-              opt.follow_ftp = old_follow_ftp;
-            }
-          else
-            status = retrieve_url (parsed_url ? parsed_url : cur_url->url,
-                                   cur_url->url->url, &filename,
-                                   &new_file, NULL, &dt, opt.recursive, tmpiri,
-                                   true, NULL);
+                  /* Turn opt.follow_ftp on in case of recursive FTP
+                     retrieval */
+                  if (cur_url->url->scheme == SCHEME_FTP)
+                    opt.follow_ftp = 1;
 
-          if (parsed_url)
-              url_free (parsed_url);
+                  status = retrieve_tree (parsed_url
+                                          ? parsed_url : cur_url->url,
+                                          tmpiri);
 
-          if (filename && opt.delete_after && file_exists_p (filename))
-            {
-              DEBUGP (("\
-Removing file due to --delete-after in retrieve_from_file():\n"));
-              logprintf (LOG_VERBOSE, _("Removing %s.\n"), filename);
-              if (unlink (filename))
-                logprintf (LOG_NOTQUIET, "unlink: %s\n", strerror (errno));
-              dt &= ~RETROKF;
+                  opt.follow_ftp = old_follow_ftp;
+                }
+              else
+                status = retrieve_url (parsed_url ? parsed_url : cur_url->url,
+                                       cur_url->url->url, &filename,
+                                       &new_file, NULL, &dt, opt.recursive,
+                                       tmpiri, true, NULL);
+
+              if (parsed_url)
+                  url_free (parsed_url);
+
+              delete_after_input_url (filename, &dt);
+
+              xfree_null (new_file);
+              xfree_null (filename);
+              iri_free (tmpiri);
             }
 
-          xfree_null (new_file);
-          xfree_null (filename);
-          iri_free (tmpiri);
+          /* Free the linked list of URL-s.  */
+          free_urlpos (url_list);
+          url_list = NULL;
+          if (uf && status != QUOTEXC)
+            url_list = read_urls_file (uf, INPUT_BATCH, true);
         }
-
-      /* Free the linked list of URL-s.  */
-      free_urlpos (url_list);
+      if (uf)
+        close_urls_file (uf);
 #ifdef ENABLE_METALINK
     }
 #endif
@@ -1438,15 +1974,25 @@ sleep_between_retrievals (int count)
 void
 free_urlpos (struct urlpos *l)
 {
+  /* Lists built by the link extractors live in a per-document arena,
+     which is released in one go after the walk.  */
+  struct arena *arena = l ? l->arena : NULL;
+
   while (l)
     {
       struct urlpos *next = l->next;
-      if (l->url)
-        url_free (l->url);
       xfree_null (l->local_name);
-      xfree (l);
+      if (!l->arena)
+        {
+          if (l->url)
+            url_free (l->url);
+          xfree_null (l->link);
+          xfree (l);
+        }
       l = next;
     }
+  if (arena)
+    arena_free (arena);
 }
 
 /* Rotate FNAME opt.backups times */
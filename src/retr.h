@@ -41,6 +41,9 @@ extern double total_download_time;
 extern FILE *output_stream;
 extern bool output_stream_regular;
 
+void count_downloads (int, SUM_SIZE_INT);
+void count_download_time (double);
+
 /* Flags for fd_read_body. */
 enum {
   rb_read_exactly  = 1,
@@ -50,8 +53,10 @@ enum {
   rb_chunked_transfer_encoding = 4
 };
 
+struct warc_digests;
+
 int fd_read_body (const char *, int, FILE *, wgint, wgint, wgint *, wgint *,
-                  double *, int, FILE *);
+                  double *, int, FILE *, struct warc_digests *);
 
 typedef const char *(*hunk_terminator_t) (const char *, const char *, int);
 
@@ -61,6 +66,10 @@ char *fd_read_line (int);
 uerr_t retrieve_url (struct url *, const char *, char **, char **,
                      const char *, int *, bool, struct iri *, bool, struct range *);
 uerr_t retrieve_from_file (const char *, bool, int *);
+#ifdef ENABLE_THREADS
+uerr_t retrieve_segmented (struct url *, const char *, char **, char **,
+                           int *, struct iri *);
+#endif
 
 const char *retr_rate (wgint, double);
 double calc_rate (wgint, double, int *);
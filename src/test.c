@@ -46,7 +46,21 @@ const char *test_cmd_spec_restrict_file_names();
 const char *test_path_simplify ();
 const char *test_append_uri_pathel();
 const char *test_are_urls_equal();
+const char *test_url_parse_arena();
+const char *test_intern_string();
+const char *test_frontier_spill();
+const char *test_frontier_links();
+const char *test_warc_digests();
+const char *test_warc_cdx_dedup();
 const char *test_is_robots_txt_url();
+const char *test_res_match_path();
+const char *test_hash_table();
+const char *test_chash_table();
+const char *test_cookie_header();
+const char *test_ftp_parse_mlsd();
+const char *test_read_urls_file();
+const char *test_metrics_write();
+const char *test_convert_links();
 
 const char *program_argstring = "TEST";
 
@@ -63,7 +77,21 @@ all_tests()
   mu_run_test (test_path_simplify);
   mu_run_test (test_append_uri_pathel);
   mu_run_test (test_are_urls_equal);
+  mu_run_test (test_url_parse_arena);
+  mu_run_test (test_intern_string);
+  mu_run_test (test_frontier_spill);
+  mu_run_test (test_frontier_links);
+  mu_run_test (test_warc_digests);
+  mu_run_test (test_warc_cdx_dedup);
   mu_run_test (test_is_robots_txt_url);
+  mu_run_test (test_res_match_path);
+  mu_run_test (test_hash_table);
+  mu_run_test (test_chash_table);
+  mu_run_test (test_cookie_header);
+  mu_run_test (test_ftp_parse_mlsd);
+  mu_run_test (test_read_urls_file);
+  mu_run_test (test_metrics_write);
+  mu_run_test (test_convert_links);
 
   return NULL;
 }
@@ -73,6 +73,8 @@ enum url_scheme {
   SCHEME_INVALID
 };
 
+struct arena;			/* forward declaration */
+
 /* Structure containing info on a URL.  */
 struct url
 {
@@ -95,6 +97,15 @@ struct url
   /* Username and password (unquoted). */
   char *user;
   char *passwd;
+
+  /* Arena the structure and its fields were allocated from, or NULL
+     if they are on the heap.  Arena-allocated URLs are released along
+     with their arena, so url_free leaves them alone.  */
+  struct arena *arena;
+
+  /* Size of the heap block holding the structure and the fields
+     url_parse stored with it.  */
+  size_t block_size;
 };
 
 /* Function declarations */
@@ -104,6 +115,8 @@ char *url_escape_unsafe_and_reserved (const char *);
 void url_unescape (char *);
 
 struct url *url_parse (const char *, int *, struct iri *iri, bool percent_encode);
+struct url *url_parse_arena (const char *, int *, struct iri *iri,
+                             bool percent_encode, struct arena *);
 char *url_error (const char *, int);
 char *url_full_path (const struct url *);
 void url_set_dir (struct url *, const char *);
@@ -119,6 +132,7 @@ void scheme_disable (enum url_scheme);
 
 char *url_string (const struct url *, enum url_auth_mode);
 char *url_file_name (const struct url *, char *);
+void url_cleanup (void);
 
 char *uri_merge (const char *, const char *);
 
@@ -832,7 +832,12 @@ make_directory (const char *directory)
          of intermediate directories to fail, as the initial path components
          are not necessarily directories!  */
       if (!file_exists_p (dir))
-        ret = mkdir (dir, 0777);
+        {
+          ret = mkdir (dir, 0777);
+          /* Another thread may have created it meanwhile.  */
+          if (ret < 0 && errno == EEXIST && file_exists_p (dir))
+            ret = 0;
+        }
       else
         ret = 0;
       if (quit)
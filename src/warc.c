@@ -42,6 +42,10 @@ as that of the covered work.  */
 #include <sha1.h>
 #include <base32.h>
 #include <unistd.h>
+#include <errno.h>
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
 #ifdef HAVE_LIBZ
 #include <zlib.h>
 #endif
@@ -78,17 +82,9 @@ static FILE *warc_manifest_fp;
 /* The current WARC file (or NULL, if WARC is disabled). */
 static FILE *warc_current_file;
 
-#ifdef HAVE_LIBZ
-/* The gzip stream for the current WARC file
-   (or NULL, if WARC or gzip is disabled). */
-static gzFile warc_current_gzfile;
-
-/* The offset of the current gzip record in the WARC file. */
-static off_t warc_current_gzfile_offset;
-
-/* The uncompressed size (so far) of the current record. */
-static off_t warc_current_gzfile_uncompressed_size;
-# endif
+/* The size of the current WARC file.  Records are only ever appended
+   to it, so this is also where the next record will go.  */
+static off_t warc_current_file_offset;
 
 /* This is true until a warc_write_* method fails. */
 static bool warc_write_ok;
@@ -97,7 +93,7 @@ static bool warc_write_ok;
 static FILE *warc_current_cdx_file;
 
 /* The record id of the warcinfo record of the current WARC file.  */
-static char *warc_current_warcinfo_uuid_str;
+static char warc_current_warcinfo_uuid_str[48];
 
 /* The file name of the current WARC file. */
 static char *warc_current_filename;
@@ -107,140 +103,224 @@ static char *warc_current_filename;
    WARC file's filename. */
 static int warc_current_file_number;
 
-/* The table of CDX records, if deduplication is enabled. */
-struct hash_table * warc_cdx_dedup_table;
+/* The CDX file used for deduplication, if enabled, and a sorted
+   index of its records.  See warc_load_cdx_dedup_file.  */
+static struct file_memory *warc_cdx_dedup_file;
+static struct file_memory *warc_cdx_dedup_index_file;
+static struct warc_cdx_index_entry *warc_cdx_dedup_index;
+static size_t warc_cdx_dedup_count;
+
+/* The fields of the CDX file that hold the original url, the payload
+   digest and the record id.  */
+static int warc_cdx_field_original_url;
+static int warc_cdx_field_checksum;
+static int warc_cdx_field_record_id;
 
 static bool warc_start_new_file (bool meta);
 
 
-struct warc_cdx_record
+/* The CDX index is a header followed by an array of entries, one for
+   each record of the CDX file, sorted by the first bytes of the
+   payload digest.  It is built the first time a CDX file is used and
+   saved next to it, so that later runs only need to map it into
+   memory.  Only the records that match a lookup are read from the
+   CDX file itself.  */
+
+#define WARC_CDX_INDEX_MAGIC "WGETCDX1"
+#define WARC_CDX_INDEX_SUFFIX ".idx"
+
+struct warc_cdx_index_header
 {
-  char *url;
-  char *uuid;
-  char digest[SHA1_DIGEST_SIZE];
+  char magic[8];                /* WARC_CDX_INDEX_MAGIC */
+  uint32_t byte_order;          /* 0x01020304 in native byte order */
+  uint32_t entry_size;          /* sizeof (struct warc_cdx_index_entry) */
+  uint64_t cdx_size;            /* size of the CDX file it indexes */
+  int64_t cdx_mtime;            /* modification time of the CDX file */
+  uint64_t count;               /* number of entries */
 };
 
-static unsigned long
-warc_hash_sha1_digest (const void *key)
+struct warc_cdx_index_entry
 {
-  /* We just use some of the first bytes of the digest. */
-  unsigned long v = 0;
-  memcpy (&v, key, sizeof (unsigned long));
-  return v;
-}
+  uint64_t key;                 /* first bytes of the payload digest */
+  uint64_t offset;              /* offset of the line in the CDX file */
+};
 
-static int
-warc_cmp_sha1_digest (const void *digest1, const void *digest2)
-{
-  return !memcmp (digest1, digest2, SHA1_DIGEST_SIZE);
-}
 
+/* WARC records are not written to the WARC file as they are built.
+   Each record is first built in a buffer of its own, compressed into
+   a complete GZIP member if compression is enabled, and then
+   committed to the file as a whole.  Downloading threads can thus
+   build records at the same time, and only the commit is serialized.
 
+   When several threads are downloading, commits go through a queue.
+   A pool of compressor threads compresses the queued records, and a
+   writer thread appends each record, once it is compressed, with a
+   single write and prints its CDX line.  Records leave the queue in
+   the order in which they were committed, so that the CDX file lists
+   them in the order in which they appear in the WARC file.  The
+   writer thread also opens a new WARC file when the current one grows
+   past opt.warc_maxsize.
 
-/* Writes SIZE bytes from BUFFER to the current WARC file,
-   through gzwrite if compression is enabled.
-   Returns the number of uncompressed bytes written.  */
-static size_t
-warc_write_buffer (const char *buffer, size_t size)
+   The first lines of a record, the version line and the
+   WARC-Warcinfo-ID header, are only added when the record is written
+   out, once the file it goes to is known.  A compressed record is
+   then completed into a GZIP member: its first lines go into a stored
+   deflate block ahead of the compressed rest.  */
+
+/* A record is kept in memory up to this size, and continues in a
+   temporary file beyond it.  */
+#define WARC_RECORD_MEMORY (1024 * 1024)
+
+/* Threads committing records wait while the queue holds more than
+   this many bytes.  */
+#define WARC_QUEUE_MEMORY (64 * 1024 * 1024)
+
+/* The most compressor threads that are started.  */
+#define WARC_MAX_COMPRESSORS 16
+
+struct warc_record
 {
+  bool ok;                      /* false if building the record failed */
+  bool warcinfo_id;             /* whether the record names the warcinfo
+                                   record of its file */
+
+  /* The record without its first lines, compressed if COMPRESSED is
+     set.  The first SIZE bytes are in DATA, the remaining SPILL_SIZE
+     bytes in SPILL.  */
+  char *data;
+  size_t size, allocated;
+  FILE *spill;
+  off_t spill_size;
+
 #ifdef HAVE_LIBZ
-  if (warc_current_gzfile)
-    {
-      warc_current_gzfile_uncompressed_size += size;
-      return gzwrite (warc_current_gzfile, buffer, size);
-    }
-  else
+  /* If COMPRESSED is set, DATA and SPILL hold a raw deflate stream,
+     and these are the CRC-32 and the size of the data it holds.  */
+  bool compressed;
+  uLong crc;
+  off_t uncompressed_size;
 #endif
-    return fwrite (buffer, 1, size, warc_current_file);
-}
 
-/* Writes STR to the current WARC file.
-   Returns false and set warc_write_ok to false if there
-   is an error.  */
-static bool
-warc_write_string (const char *str)
-{
-  if (!warc_write_ok)
-    return false;
+  /* The CDX line of the record without the offset, file name and
+     record id, which are added when the record is committed, or NULL
+     if the record does not go to the CDX file.  */
+  char *cdx_line;
+  char cdx_record_id[48];
 
-  size_t n = strlen (str);
-  if (n != warc_write_buffer (str, n))
-    warc_write_ok = false;
+  /* The queue.  A record is ready once it has been compressed.  */
+  struct warc_record *next;
+  size_t queued_size;
+  bool ready;
+};
 
-  return warc_write_ok;
-}
+#ifdef ENABLE_THREADS
+/* The queue of records waiting for the writer thread.  The lock also
+   protects warc_current_warcinfo_uuid_str.  Records from
+   WARC_COMPRESS_NEXT on are waiting for a compressor thread.  */
+static pthread_mutex_t warc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t warc_queue_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t warc_queue_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t warc_queue_room = PTHREAD_COND_INITIALIZER;
+static struct warc_record *warc_queue_head, *warc_queue_tail;
+static struct warc_record *warc_compress_next;
+static size_t warc_queue_size;
+static bool warc_writer_running, warc_writer_stopping;
+static pthread_t warc_writer;
+static pthread_t warc_compressors[WARC_MAX_COMPRESSORS];
+static int warc_compressor_count;
+# define WARC_LOCK pthread_mutex_lock (&warc_lock)
+# define WARC_UNLOCK pthread_mutex_unlock (&warc_lock)
+#else
+# define WARC_LOCK
+# define WARC_UNLOCK
+#endif
 
+/* Appends SIZE bytes to the data of REC, moving on to a temporary
+   file once the record outgrows WARC_RECORD_MEMORY.  */
+static void
+warc_record_output (struct warc_record *rec, const char *buffer, size_t size)
+{
+  if (!rec->spill && rec->size + size > WARC_RECORD_MEMORY)
+    {
+      rec->spill = warc_tempfile ();
+      if (rec->spill == NULL)
+        {
+          rec->ok = false;
+          return;
+        }
+    }
 
-#define EXTRA_GZIP_HEADER_SIZE 14
-#define GZIP_STATIC_HEADER_SIZE  10
-#define FLG_FEXTRA          0x04
-#define OFF_FLG             3
+  if (rec->spill)
+    {
+      if (fwrite (buffer, 1, size, rec->spill) != size)
+        rec->ok = false;
+      rec->spill_size += size;
+      return;
+    }
 
-/* Starts a new WARC record.  Writes the version header.
-   If opt.warc_maxsize is set and the current file is becoming
-   too large, this will open a new WARC file.
+  if (rec->size + size > rec->allocated)
+    {
+      rec->allocated = rec->allocated * 2;
+      if (rec->allocated < rec->size + size)
+        rec->allocated = rec->size + size;
+      rec->data = xrealloc (rec->data, rec->allocated);
+    }
+  memcpy (rec->data + rec->size, buffer, size);
+  rec->size += size;
+}
 
-   If compression is enabled, this will start a new
-   gzip stream in the current WARC file.
+/* Writes SIZE bytes from BUFFER to REC.
+   Returns the number of bytes written.  */
+static size_t
+warc_write_buffer (struct warc_record *rec, const char *buffer, size_t size)
+{
+  warc_record_output (rec, buffer, size);
+  return rec->ok ? size : 0;
+}
 
-   Returns false and set warc_write_ok to false if there
-   is an error.  */
+/* Writes STR to REC.
+   Returns false and marks REC as failed if there is an error.  */
 static bool
-warc_write_start_record (void)
+warc_write_string (struct warc_record *rec, const char *str)
 {
-  if (!warc_write_ok)
+  if (!rec->ok)
     return false;
 
-  fflush (warc_current_file);
-  if (opt.warc_maxsize > 0 && ftello (warc_current_file) >= opt.warc_maxsize)
-    warc_start_new_file (false);
-
-#ifdef HAVE_LIBZ
-  /* Start a GZIP stream, if required. */
-  if (opt.warc_compression_enabled)
-    {
-      /* Record the starting offset of the new record. */
-      warc_current_gzfile_offset = ftello (warc_current_file);
+  size_t n = strlen (str);
+  if (n != warc_write_buffer (rec, str, n))
+    rec->ok = false;
 
-      /* Reserve space for the extra GZIP header field.
-         In warc_write_end_record we will fill this space
-         with information about the uncompressed and
-         compressed size of the record. */
-      fseek (warc_current_file, EXTRA_GZIP_HEADER_SIZE, SEEK_CUR);
-      fflush (warc_current_file);
+  return rec->ok;
+}
 
-      /* Start a new GZIP stream. */
-      warc_current_gzfile = gzdopen (dup (fileno (warc_current_file)), "wb9");
-      warc_current_gzfile_uncompressed_size = 0;
 
-      if (warc_current_gzfile == NULL)
-        {
-          logprintf (LOG_NOTQUIET,
-_("Error opening GZIP stream to WARC file.\n"));
-          warc_write_ok = false;
-          return false;
-        }
-    }
-#endif
+/* Starts a new WARC record.  The version header is added by
+   warc_write_out.
 
-  warc_write_string ("WARC/1.0\r\n");
-  return warc_write_ok;
+   The record is returned even if there is an error, in which case
+   it is marked as failed.  */
+static struct warc_record *
+warc_write_start_record (void)
+{
+  struct warc_record *rec = xnew0 (struct warc_record);
+  rec->ok = warc_write_ok;
+  return rec;
 }
 
-/* Writes a WARC header to the current WARC record.
+/* Writes a WARC header to REC.
    This method may be run after warc_write_start_record and
    before warc_write_block_from_file.  */
 static bool
-warc_write_header (const char *name, const char *value)
+warc_write_header (struct warc_record *rec, const char *name,
+                   const char *value)
 {
   if (value)
     {
-      warc_write_string (name);
-      warc_write_string (": ");
-      warc_write_string (value);
-      warc_write_string ("\r\n");
+      warc_write_string (rec, name);
+      warc_write_string (rec, ": ");
+      warc_write_string (rec, value);
+      warc_write_string (rec, "\r\n");
     }
-  return warc_write_ok;
+  return rec->ok;
 }
 
 /* Copies the contents of DATA_IN to the WARC record.
@@ -248,162 +328,599 @@ warc_write_header (const char *name, const char *value)
    Run this method after warc_write_header,
    then run warc_write_end_record. */
 static bool
-warc_write_block_from_file (FILE *data_in)
+warc_write_block_from_file (struct warc_record *rec, FILE *data_in)
 {
   /* Add the Content-Length header. */
   char content_length[MAX_INT_TO_STRING_LEN(off_t)];
   fseeko (data_in, 0L, SEEK_END);
   number_to_string (content_length, ftello (data_in));
-  warc_write_header ("Content-Length", content_length);
+  warc_write_header (rec, "Content-Length", content_length);
 
   /* End of the WARC header section. */
-  warc_write_string ("\r\n");
+  warc_write_string (rec, "\r\n");
 
   if (fseeko (data_in, 0L, SEEK_SET) != 0)
-    warc_write_ok = false;
+    rec->ok = false;
 
   /* Copy the data in the file to the WARC record. */
   char buffer[BUFSIZ];
   size_t s;
-  while (warc_write_ok && (s = fread (buffer, 1, BUFSIZ, data_in)) > 0)
+  while (rec->ok && (s = fread (buffer, 1, BUFSIZ, data_in)) > 0)
     {
-      if (warc_write_buffer (buffer, s) < s)
-        warc_write_ok = false;
+      if (warc_write_buffer (rec, buffer, s) < s)
+        rec->ok = false;
     }
 
-  return warc_write_ok;
+  return rec->ok;
 }
 
-/* Run this method to close the current WARC record.
-
-   If compression is enabled, this method closes the
-   current GZIP stream and fills the extra GZIP header
-   with the uncompressed and compressed length of the
-   record. */
+/* Run this method to finish REC.  */
 static bool
-warc_write_end_record (void)
+warc_write_end_record (struct warc_record *rec)
 {
-  warc_write_buffer ("\r\n\r\n", 4);
+  warc_write_buffer (rec, "\r\n\r\n", 4);
+  return rec->ok;
+}
+
 
 #ifdef HAVE_LIBZ
-  /* We start a new gzip stream for each record.  */
-  if (warc_write_ok && warc_current_gzfile)
+/* A GZIP member header with the FEXTRA flag set, followed by the
+   extra field that holds the WARC 'skip length' data.  */
+#define EXTRA_GZIP_HEADER_SIZE 14
+#define GZIP_STATIC_HEADER_SIZE  10
+#define FLG_FEXTRA          0x04
+#define OFF_FLG             3
+#define OFF_XFL             8
+#define OFF_OS              9
+
+/* Runs SIZE bytes from BUFFER through ZS with FLUSH, and appends the
+   output to REC.  */
+static bool
+warc_record_deflate (struct warc_record *rec, z_stream *zs,
+                     const char *buffer, size_t size, int flush)
+{
+  char out[16384];
+  int ret;
+
+  zs->next_in = (Bytef *) buffer;
+  zs->avail_in = size;
+  do
     {
-      if (gzclose (warc_current_gzfile) != Z_OK)
+      zs->next_out = (Bytef *) out;
+      zs->avail_out = sizeof (out);
+      ret = deflate (zs, flush);
+      if (ret == Z_STREAM_ERROR)
         {
-          warc_write_ok = false;
+          rec->ok = false;
           return false;
         }
+      warc_record_output (rec, out, sizeof (out) - zs->avail_out);
+    }
+  while (flush == Z_FINISH ? ret != Z_STREAM_END : zs->avail_out == 0);
 
-      fflush (warc_current_file);
-      fseeko (warc_current_file, 0, SEEK_END);
-
-      /* The WARC standard suggests that we add 'skip length' data in the
-         extra header field of the GZIP stream.
-
-         In warc_write_start_record we reserved space for this extra header.
-         This extra space starts at warc_current_gzfile_offset and fills
-         EXTRA_GZIP_HEADER_SIZE bytes.  The static GZIP header starts at
-         warc_current_gzfile_offset + EXTRA_GZIP_HEADER_SIZE.
-
-         We need to do three things:
-         1. Move the static GZIP header to warc_current_gzfile_offset;
-         2. Set the FEXTRA flag in the GZIP header;
-         3. Write the extra GZIP header after the static header, that is,
-            starting at warc_current_gzfile_offset + GZIP_STATIC_HEADER_SIZE.
-      */
-
-      /* Calculate the uncompressed and compressed sizes. */
-      off_t current_offset = ftello (warc_current_file);
-      off_t uncompressed_size = current_offset - warc_current_gzfile_offset;
-      off_t compressed_size = warc_current_gzfile_uncompressed_size;
-
-      /* Go back to the static GZIP header. */
-      fseeko (warc_current_file, warc_current_gzfile_offset
-              + EXTRA_GZIP_HEADER_SIZE, SEEK_SET);
-
-      /* Read the header. */
-      char static_header[GZIP_STATIC_HEADER_SIZE];
-      size_t result = fread (static_header, 1, GZIP_STATIC_HEADER_SIZE,
-                             warc_current_file);
-      if (result != GZIP_STATIC_HEADER_SIZE)
+  return rec->ok;
+}
+
+/* Replaces the contents of the finished record REC with a raw
+   deflate stream that holds them, compressed at
+   opt.warc_compression_level.  warc_write_out completes it into a
+   GZIP member.  */
+static bool
+warc_compress_record (struct warc_record *rec)
+{
+  char *in = rec->data;
+  size_t in_size = rec->size;
+  FILE *in_spill = rec->spill;
+  off_t uncompressed_size = rec->size + rec->spill_size;
+  char buffer[BUFSIZ];
+  uLong crc;
+  z_stream zs;
+
+  rec->data = NULL;
+  rec->size = rec->allocated = 0;
+  rec->spill = NULL;
+  rec->spill_size = 0;
+
+  /* Produce a raw deflate stream; the header and the trailer of the
+     member are written by warc_write_out.  */
+  memset (&zs, 0, sizeof (zs));
+  if (deflateInit2 (&zs, opt.warc_compression_level, Z_DEFLATED,
+                    -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      logprintf (LOG_NOTQUIET,
+_("Error opening GZIP stream to WARC file.\n"));
+      rec->ok = false;
+      goto out;
+    }
+
+  crc = crc32 (0L, Z_NULL, 0);
+  crc = crc32 (crc, (const Bytef *) in, in_size);
+  warc_record_deflate (rec, &zs, in, in_size, Z_NO_FLUSH);
+  if (in_spill)
+    {
+      size_t s;
+
+      if (fseeko (in_spill, 0L, SEEK_SET) != 0)
+        rec->ok = false;
+      while (rec->ok && (s = fread (buffer, 1, BUFSIZ, in_spill)) > 0)
+        {
+          crc = crc32 (crc, (const Bytef *) buffer, s);
+          warc_record_deflate (rec, &zs, buffer, s, Z_NO_FLUSH);
+        }
+      if (ferror (in_spill))
+        rec->ok = false;
+    }
+  warc_record_deflate (rec, &zs, NULL, 0, Z_FINISH);
+  deflateEnd (&zs);
+  rec->compressed = true;
+  rec->crc = crc;
+  rec->uncompressed_size = uncompressed_size;
+
+ out:
+  xfree_null (in);
+  if (in_spill)
+    fclose (in_spill);
+  return rec->ok;
+}
+
+/* Builds the header of the GZIP member that holds the compressed
+   record REC, preceded by the FIRST_SIZE bytes of its first lines at
+   FIRST, in HEAD, and the trailer of the member in TRAILER.  The
+   header carries the 'skip length' data that the WARC standard
+   suggests in its extra field: the compressed and the uncompressed
+   length of the record.  It ends with the first lines, in a stored
+   deflate block that the compressed rest of the record follows.
+   Returns the size of the header.  */
+static size_t
+warc_gzip_frame (const struct warc_record *rec, const char *first,
+                 size_t first_size, char *head, char *trailer)
+{
+  int level = opt.warc_compression_level;
+  char *extra_header = head + GZIP_STATIC_HEADER_SIZE;
+  char *block = extra_header + EXTRA_GZIP_HEADER_SIZE;
+  size_t head_size = block + 5 + first_size - head;
+  off_t member_size = head_size + rec->size + rec->spill_size + 8;
+  off_t uncompressed_size = first_size + rec->uncompressed_size;
+  uLong crc;
+
+  /* The static header: magic, deflate, flags, no modification time,
+     and the same XFL and OS bytes that zlib writes.  */
+  memset (head, 0, GZIP_STATIC_HEADER_SIZE);
+  head[0] = 0x1f;
+  head[1] = 0x8b;
+  head[2] = Z_DEFLATED;
+  head[OFF_FLG] = FLG_FEXTRA;
+  head[OFF_XFL] = level == 9 ? 2 : level < 2 ? 4 : 0;
+  head[OFF_OS] = 3;
+
+  /* XLEN, the length of the extra header fields.  */
+  extra_header[0]  = ((EXTRA_GZIP_HEADER_SIZE - 2) & 255);
+  extra_header[1]  = ((EXTRA_GZIP_HEADER_SIZE - 2) >> 8) & 255;
+  /* The extra header field identifier for the WARC skip length. */
+  extra_header[2]  = 's';
+  extra_header[3]  = 'l';
+  /* The size of the field value (8 bytes).  */
+  extra_header[4]  = (8 & 255);
+  extra_header[5]  = ((8 >> 8) & 255);
+  /* The size of the GZIP member.  */
+  extra_header[6]  = (member_size & 255);
+  extra_header[7]  = (member_size >> 8) & 255;
+  extra_header[8]  = (member_size >> 16) & 255;
+  extra_header[9]  = (member_size >> 24) & 255;
+  /* The size of the uncompressed record.  */
+  extra_header[10] = (uncompressed_size & 255);
+  extra_header[11] = (uncompressed_size >> 8) & 255;
+  extra_header[12] = (uncompressed_size >> 16) & 255;
+  extra_header[13] = (uncompressed_size >> 24) & 255;
+
+  /* A stored block that is not the last one: a zero BFINAL bit and
+     BTYPE, padding to the byte boundary, LEN and its complement.  */
+  block[0] = 0;
+  block[1] = first_size & 255;
+  block[2] = (first_size >> 8) & 255;
+  block[3] = ~first_size & 255;
+  block[4] = (~first_size >> 8) & 255;
+  memcpy (block + 5, first, first_size);
+
+  /* The GZIP trailer: CRC-32 and size of the uncompressed data.  */
+  crc = crc32 (crc32 (0L, Z_NULL, 0), (const Bytef *) first, first_size);
+  crc = crc32_combine (crc, rec->crc, rec->uncompressed_size);
+  trailer[0] = crc & 255;
+  trailer[1] = (crc >> 8) & 255;
+  trailer[2] = (crc >> 16) & 255;
+  trailer[3] = (crc >> 24) & 255;
+  trailer[4] = uncompressed_size & 255;
+  trailer[5] = (uncompressed_size >> 8) & 255;
+  trailer[6] = (uncompressed_size >> 16) & 255;
+  trailer[7] = (uncompressed_size >> 24) & 255;
+
+  return head_size;
+}
+#endif /* HAVE_LIBZ */
+
+/* Compresses REC if compression is enabled.  */
+static bool
+warc_finish_record (struct warc_record *rec)
+{
+#ifdef HAVE_LIBZ
+  if (rec->ok && opt.warc_compression_enabled)
+    return warc_compress_record (rec);
+#endif
+  return rec->ok;
+}
+
+static void
+warc_free_record (struct warc_record *rec)
+{
+  if (rec->spill)
+    fclose (rec->spill);
+  xfree_null (rec->data);
+  xfree_null (rec->cdx_line);
+  xfree (rec);
+}
+
+/* Writes SIZE bytes from BUFFER to the current WARC file.  */
+static bool
+warc_write_fully (const char *buffer, size_t size)
+{
+  int fd = fileno (warc_current_file);
+
+  while (size > 0)
+    {
+      ssize_t n = write (fd, buffer, size);
+      if (n < 0)
         {
-          warc_write_ok = false;
+          if (errno == EINTR)
+            continue;
           return false;
         }
+      buffer += n;
+      size -= n;
+    }
+  return true;
+}
+
+/* Appends the finished record REC to the current WARC file, opening
+   a new file first if opt.warc_maxsize is set and the current file
+   is becoming too large, and adds the CDX line of REC to the CDX
+   file.  REC is freed.
 
-      /* Set the FEXTRA flag in the flags byte of the header. */
-      static_header[OFF_FLG] = static_header[OFF_FLG] | FLG_FEXTRA;
-
-      /* Write the header back to the file, but starting at
-         warc_current_gzfile_offset. */
-      fseeko (warc_current_file, warc_current_gzfile_offset, SEEK_SET);
-      fwrite (static_header, 1, GZIP_STATIC_HEADER_SIZE, warc_current_file);
-
-      /* Prepare the extra GZIP header. */
-      char extra_header[EXTRA_GZIP_HEADER_SIZE];
-      /* XLEN, the length of the extra header fields.  */
-      extra_header[0]  = ((EXTRA_GZIP_HEADER_SIZE - 2) & 255);
-      extra_header[1]  = ((EXTRA_GZIP_HEADER_SIZE - 2) >> 8) & 255;
-      /* The extra header field identifier for the WARC skip length. */
-      extra_header[2]  = 's';
-      extra_header[3]  = 'l';
-      /* The size of the field value (8 bytes).  */
-      extra_header[4]  = (8 & 255);
-      extra_header[5]  = ((8 >> 8) & 255);
-      /* The size of the uncompressed record.  */
-      extra_header[6]  = (uncompressed_size & 255);
-      extra_header[7]  = (uncompressed_size >> 8) & 255;
-      extra_header[8]  = (uncompressed_size >> 16) & 255;
-      extra_header[9]  = (uncompressed_size >> 24) & 255;
-      /* The size of the compressed record.  */
-      extra_header[10] = (compressed_size & 255);
-      extra_header[11] = (compressed_size >> 8) & 255;
-      extra_header[12] = (compressed_size >> 16) & 255;
-      extra_header[13] = (compressed_size >> 24) & 255;
-
-      /* Write the extra header after the static header. */
-      fseeko (warc_current_file, warc_current_gzfile_offset
-              + GZIP_STATIC_HEADER_SIZE, SEEK_SET);
-      fwrite (extra_header, 1, EXTRA_GZIP_HEADER_SIZE, warc_current_file);
-
-      /* Done, move back to the end of the file. */
-      fflush (warc_current_file);
-      fseeko (warc_current_file, 0, SEEK_END);
+   This is only ever called by one thread at a time: the writer
+   thread if there is one, and the committing thread otherwise.  */
+static void
+warc_write_out (struct warc_record *rec)
+{
+  /* The version line and the WARC-Warcinfo-ID header.  */
+  char first[80];
+  const char *head = first;
+  size_t head_size;
+#ifdef HAVE_LIBZ
+  char gzip_head[GZIP_STATIC_HEADER_SIZE + EXTRA_GZIP_HEADER_SIZE + 5
+                 + sizeof (first)];
+  char trailer[8];
+#endif
+  off_t offset;
+  bool ok;
+
+  if (!rec->ok)
+    {
+      warc_write_ok = false;
+      warc_free_record (rec);
+      return;
     }
-#endif /* HAVE_LIBZ */
 
-  return warc_write_ok;
+  if (warc_write_ok && opt.warc_maxsize > 0
+      && warc_current_file_offset >= opt.warc_maxsize)
+    warc_start_new_file (false);
+
+  /* Only now is the file known whose warcinfo record REC names.  */
+  strcpy (first, "WARC/1.0\r\n");
+  if (rec->warcinfo_id)
+    {
+      WARC_LOCK;
+      sprintf (first + strlen (first), "WARC-Warcinfo-ID: %s\r\n",
+               warc_current_warcinfo_uuid_str);
+      WARC_UNLOCK;
+    }
+  head_size = strlen (first);
+#ifdef HAVE_LIBZ
+  if (rec->compressed)
+    {
+      head_size = warc_gzip_frame (rec, first, head_size, gzip_head,
+                                   trailer);
+      head = gzip_head;
+    }
+#endif
+
+  offset = warc_current_file_offset;
+  ok = (warc_write_ok && warc_write_fully (head, head_size)
+        && warc_write_fully (rec->data, rec->size));
+  if (ok && rec->spill)
+    {
+      char buffer[BUFSIZ];
+      size_t s;
+
+      ok = fseeko (rec->spill, 0L, SEEK_SET) == 0;
+      while (ok && (s = fread (buffer, 1, BUFSIZ, rec->spill)) > 0)
+        ok = warc_write_fully (buffer, s);
+      if (ferror (rec->spill))
+        ok = false;
+    }
+  warc_current_file_offset += head_size + rec->size + rec->spill_size;
+#ifdef HAVE_LIBZ
+  if (rec->compressed)
+    {
+      ok = ok && warc_write_fully (trailer, sizeof (trailer));
+      warc_current_file_offset += sizeof (trailer);
+    }
+#endif
+  if (!ok)
+    warc_write_ok = false;
+
+  if (warc_write_ok && rec->cdx_line && warc_current_cdx_file)
+    {
+      char offset_string[MAX_INT_TO_STRING_LEN(off_t)];
+      number_to_string (offset_string, offset);
+
+      fprintf (warc_current_cdx_file, "%s %s %s %s\n", rec->cdx_line,
+               offset_string, warc_current_filename, rec->cdx_record_id);
+      fflush (warc_current_cdx_file);
+    }
+
+  warc_free_record (rec);
+}
+
+#ifdef ENABLE_THREADS
+static void *
+warc_compressor_thread (void *arg)
+{
+  (void) arg;
+
+  while (1)
+    {
+      struct warc_record *rec;
+
+      WARC_LOCK;
+      while (!warc_compress_next && !warc_writer_stopping)
+        pthread_cond_wait (&warc_queue_work, &warc_lock);
+      rec = warc_compress_next;
+      if (rec)
+        warc_compress_next = rec->next;
+      WARC_UNLOCK;
+
+      if (!rec)
+        break;
+      warc_finish_record (rec);
+
+      WARC_LOCK;
+      rec->ready = true;
+      if (rec == warc_queue_head)
+        pthread_cond_signal (&warc_queue_ready);
+      WARC_UNLOCK;
+    }
+
+  return NULL;
+}
+
+static void *
+warc_writer_thread (void *arg)
+{
+  (void) arg;
+
+  while (1)
+    {
+      struct warc_record *rec;
+
+      WARC_LOCK;
+      while (warc_queue_head
+             ? !warc_queue_head->ready
+             : !warc_writer_stopping)
+        pthread_cond_wait (&warc_queue_ready, &warc_lock);
+      rec = warc_queue_head;
+      if (rec)
+        {
+          warc_queue_head = rec->next;
+          if (!warc_queue_head)
+            warc_queue_tail = NULL;
+          warc_queue_size -= rec->queued_size;
+          pthread_cond_broadcast (&warc_queue_room);
+        }
+      WARC_UNLOCK;
+
+      if (!rec)
+        break;
+      warc_write_out (rec);
+    }
+
+  return NULL;
+}
+
+/* Starts the writer thread, and the compressor threads if compression
+   is enabled.  */
+static void
+warc_start_writer (void)
+{
+  warc_writer_stopping = false;
+  if (pthread_create (&warc_writer, NULL, warc_writer_thread, NULL) != 0)
+    return;
+  warc_writer_running = true;
+
+  if (opt.warc_compression_enabled)
+    {
+      long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+      int count = opt.jobs;
+
+      if (cpus > 0 && count > cpus)
+        count = cpus;
+      if (count > WARC_MAX_COMPRESSORS)
+        count = WARC_MAX_COMPRESSORS;
+      while (warc_compressor_count < count
+             && pthread_create (&warc_compressors[warc_compressor_count],
+                                NULL, warc_compressor_thread, NULL) == 0)
+        warc_compressor_count++;
+    }
 }
 
+/* Waits for the writer thread to write out the queue, and stops it
+   along with the compressor threads.  */
+static void
+warc_stop_writer (void)
+{
+  int i;
+
+  if (!warc_writer_running)
+    return;
+
+  WARC_LOCK;
+  warc_writer_stopping = true;
+  pthread_cond_broadcast (&warc_queue_work);
+  pthread_cond_signal (&warc_queue_ready);
+  WARC_UNLOCK;
+
+  for (i = 0; i < warc_compressor_count; i++)
+    pthread_join (warc_compressors[i], NULL);
+  warc_compressor_count = 0;
+  pthread_join (warc_writer, NULL);
+  warc_writer_running = false;
+}
+#endif /* ENABLE_THREADS */
+
+/* Commits the finished record REC to the WARC file, either by
+   handing it to the compressor and writer threads or by compressing
+   and writing it out at once.  REC is freed.
+   Returns false if REC could not be built or written.  */
+static bool
+warc_commit_record (struct warc_record *rec)
+{
+  if (!rec->ok)
+    {
+      warc_write_ok = false;
+      warc_free_record (rec);
+      return false;
+    }
+
+#ifdef ENABLE_THREADS
+  WARC_LOCK;
+  if (warc_writer_running)
+    {
+      while (warc_queue_size > WARC_QUEUE_MEMORY && warc_queue_head)
+        pthread_cond_wait (&warc_queue_room, &warc_lock);
+      rec->queued_size = rec->size;
+      rec->ready = warc_compressor_count == 0;
+      if (warc_queue_tail)
+        warc_queue_tail->next = rec;
+      else
+        warc_queue_head = rec;
+      warc_queue_tail = rec;
+      warc_queue_size += rec->queued_size;
+      if (rec->ready)
+        {
+          if (rec == warc_queue_head)
+            pthread_cond_signal (&warc_queue_ready);
+        }
+      else
+        {
+          if (!warc_compress_next)
+            warc_compress_next = rec;
+          pthread_cond_signal (&warc_queue_work);
+        }
+      WARC_UNLOCK;
+      return warc_write_ok;
+    }
+  WARC_UNLOCK;
+#endif
+
+  warc_finish_record (rec);
+  warc_write_out (rec);
+  return warc_write_ok;
+}
 
 /* Writes the WARC-Date header for the given timestamp to
-   the current WARC record.
+   REC.
    If timestamp is NULL, the current time will be used.  */
 static bool
-warc_write_date_header (const char *timestamp)
+warc_write_date_header (struct warc_record *rec, const char *timestamp)
 {
+  char current_timestamp[21];
   if (timestamp == NULL)
     {
-      char current_timestamp[21];
       warc_timestamp (current_timestamp);
       timestamp = current_timestamp;
     }
-  return warc_write_header ("WARC-Date", timestamp);
+  return warc_write_header (rec, "WARC-Date", timestamp);
 }
 
 /* Writes the WARC-IP-Address header for the given IP to
-   the current WARC record.  If IP is NULL, no header will
+   REC.  If IP is NULL, no header will
    be written.  */
 static bool
-warc_write_ip_header (ip_address *ip)
+warc_write_ip_header (struct warc_record *rec, ip_address *ip)
 {
   if (ip != NULL)
-    return warc_write_header ("WARC-IP-Address", print_address (ip));
+    return warc_write_header (rec, "WARC-IP-Address", print_address (ip));
   else
-    return warc_write_ok;
+    return rec->ok;
+}
+
+
+/* Prepares DIGESTS for a record whose payload starts at
+   PAYLOAD_OFFSET (or that has no payload, if PAYLOAD_OFFSET < 0).  */
+void
+warc_digests_init (struct warc_digests *digests, off_t payload_offset)
+{
+  sha1_init_ctx (&digests->block);
+  digests->size = 0;
+  digests->payload_offset = payload_offset;
+  digests->in_payload = false;
+}
+
+/* Adds the next SIZE bytes of the record, at BUF, to DIGESTS.  */
+void
+warc_digests_update (struct warc_digests *digests, const char *buf,
+                     size_t size)
+{
+  if (!digests->in_payload && digests->payload_offset >= 0
+      && digests->size + (off_t) size >= digests->payload_offset)
+    {
+      /* Crossing into the payload: remember the digest of what came
+         before it, which is the block digest of a revisit record.  */
+      size_t head_size = digests->payload_offset - digests->size;
+      sha1_process_bytes (buf, head_size, &digests->block);
+      digests->size += head_size;
+      buf += head_size;
+      size -= head_size;
+
+      digests->head = digests->block;
+      sha1_init_ctx (&digests->payload);
+      digests->in_payload = true;
+    }
+
+  sha1_process_bytes (buf, size, &digests->block);
+  if (digests->in_payload)
+    sha1_process_bytes (buf, size, &digests->payload);
+  digests->size += size;
 }
 
+/* Writes the block digest, the digest of the part before the payload
+   and the payload digest of DIGESTS to RES_BLOCK, RES_HEAD and
+   RES_PAYLOAD.  DIGESTS itself is left untouched.  */
+static void
+warc_digests_finish (const struct warc_digests *digests, void *res_block,
+                     void *res_head, void *res_payload)
+{
+  struct warc_digests d = *digests;
+
+  if (!d.in_payload)
+    {
+      /* The payload is empty.  */
+      d.head = d.block;
+      sha1_init_ctx (&d.payload);
+    }
+
+  sha1_finish_ctx (&d.block, res_block);
+  sha1_finish_ctx (&d.head, res_head);
+  sha1_finish_ctx (&d.payload, res_payload);
+}
 
 /* warc_sha1_stream_with_payload is a modified copy of sha1_stream
    from gnulib/sha1.c.  This version calculates two digests in one go.
@@ -551,7 +1068,8 @@ warc_base32_sha1_digest (char *sha1_digest)
    will also calculate the payload digest of the payload starting at the
    provided offset.  */
 static void
-warc_write_digest_headers (FILE *file, long payload_offset)
+warc_write_digest_headers (struct warc_record *rec, FILE *file,
+                           long payload_offset)
 {
   if (opt.warc_digests_enabled)
     {
@@ -566,13 +1084,13 @@ warc_write_digest_headers (FILE *file, long payload_offset)
           char *digest;
 
           digest = warc_base32_sha1_digest (sha1_res_block);
-          warc_write_header ("WARC-Block-Digest", digest);
+          warc_write_header (rec, "WARC-Block-Digest", digest);
           free (digest);
 
           if (payload_offset >= 0)
             {
               digest = warc_base32_sha1_digest (sha1_res_payload);
-              warc_write_header ("WARC-Payload-Digest", digest);
+              warc_write_header (rec, "WARC-Payload-Digest", digest);
               free (digest);
             }
         }
@@ -653,8 +1171,12 @@ warc_write_warcinfo_record (char *filename)
   /* Write warc-info record as the first record of the file. */
   /* We add the record id of this info record to the other records in the
      file. */
-  warc_current_warcinfo_uuid_str = (char *) malloc (48);
-  warc_uuid_str (warc_current_warcinfo_uuid_str);
+  char warcinfo_uuid_str[48];
+  warc_uuid_str (warcinfo_uuid_str);
+  WARC_LOCK;
+  memcpy (warc_current_warcinfo_uuid_str, warcinfo_uuid_str,
+          sizeof (warcinfo_uuid_str));
+  WARC_UNLOCK;
 
   char timestamp[22];
   warc_timestamp (timestamp);
@@ -663,13 +1185,6 @@ warc_write_warcinfo_record (char *filename)
   filename_copy = strdup (filename);
   filename_basename = strdup (basename (filename_copy));
 
-  warc_write_start_record ();
-  warc_write_header ("WARC-Type", "warcinfo");
-  warc_write_header ("Content-Type", "application/warc-fields");
-  warc_write_header ("WARC-Date", timestamp);
-  warc_write_header ("WARC-Record-ID", warc_current_warcinfo_uuid_str);
-  warc_write_header ("WARC-Filename", filename_basename);
-
   /* Create content.  */
   FILE *warc_tmp = warc_tempfile ();
   if (warc_tmp == NULL)
@@ -679,6 +1194,13 @@ warc_write_warcinfo_record (char *filename)
       return false;
     }
 
+  struct warc_record *rec = warc_write_start_record ();
+  warc_write_header (rec, "WARC-Type", "warcinfo");
+  warc_write_header (rec, "Content-Type", "application/warc-fields");
+  warc_write_header (rec, "WARC-Date", timestamp);
+  warc_write_header (rec, "WARC-Record-ID", warcinfo_uuid_str);
+  warc_write_header (rec, "WARC-Filename", filename_basename);
+
   fprintf (warc_tmp, "software: Wget/%s (%s)\r\n", version_string, OS_TYPE);
   fprintf (warc_tmp, "format: WARC File Format 1.0\r\n");
   fprintf (warc_tmp,
@@ -694,9 +1216,13 @@ warc_write_warcinfo_record (char *filename)
     }
   fprintf(warc_tmp, "\r\n");
 
-  warc_write_digest_headers (warc_tmp, -1);
-  warc_write_block_from_file (warc_tmp);
-  warc_write_end_record ();
+  warc_write_digest_headers (rec, warc_tmp, -1);
+  warc_write_block_from_file (rec, warc_tmp);
+  warc_write_end_record (rec);
+
+  /* This goes straight to the new file, ahead of any queued records. */
+  warc_finish_record (rec);
+  warc_write_out (rec);
 
   if (! warc_write_ok)
     logprintf (LOG_NOTQUIET, _("Error writing warcinfo record to WARC file.\n"));
@@ -726,8 +1252,7 @@ warc_start_new_file (bool meta)
 
   if (warc_current_file != NULL)
     fclose (warc_current_file);
-  
-  free (warc_current_warcinfo_uuid_str);
+
   free (warc_current_filename);
 
   warc_current_file_number++;
@@ -768,8 +1293,10 @@ warc_start_new_file (bool meta)
     {
       logprintf (LOG_NOTQUIET, _("Error opening WARC file %s.\n"),
                  quote (new_filename));
+      warc_write_ok = false;
       return false;
     }
+  warc_current_file_offset = 0;
 
   if (! warc_write_warcinfo_record (new_filename))
     return false;
@@ -858,168 +1385,344 @@ warc_parse_cdx_header (char *lineptr, int *field_num_original_url,
          && *field_num_record_id != -1;
 }
 
-/* Parse the CDX record and add it to the warc_cdx_dedup_table hash table. */
-static void
-warc_process_cdx_line (char *lineptr, int field_num_original_url,
-                       int field_num_checksum, int field_num_record_id)
-{
-  char *original_url = NULL;
-  char *checksum = NULL;
-  char *record_id = NULL;
+#define CDX_FIELDSEP_P(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' \
+                           || (c) == '\n')
 
-  char *token;
-  char *save_ptr;
-  token = strtok_r (lineptr, CDX_FIELDSEP, &save_ptr);
+/* Finds field number FIELD_NUM of the CDX line that starts at LINE and
+   ends at END.  Returns the start of the field and stores its length
+   in *LEN, or returns NULL if the line has no such field.  */
+static const char *
+warc_cdx_field (const char *line, const char *end, int field_num,
+                size_t *len)
+{
+  const char *p = line;
+  int n;
 
-  /* Read this line to get the fields we need. */
-  int field_num = 0;
-  while (token != NULL)
+  for (n = 0; ; n++)
     {
-      char **val;
-      if (field_num == field_num_original_url)
-        val = &original_url;
-      else if (field_num == field_num_checksum)
-        val = &checksum;
-      else if (field_num == field_num_record_id)
-        val = &record_id;
-      else
-        val = NULL;
+      while (p < end && CDX_FIELDSEP_P (*p))
+        p++;
+      if (p == end)
+        return NULL;
+
+      const char *start = p;
+      while (p < end && !CDX_FIELDSEP_P (*p))
+        p++;
+      if (n == field_num)
+        {
+          *len = p - start;
+          return start;
+        }
+    }
+}
 
-      if (val != NULL)
-        *val = strdup (token);
+/* Returns the end of the CDX line at offset OFFSET.  */
+static const char *
+warc_cdx_line_end (const struct file_memory *fm, uint64_t offset)
+{
+  const char *line = fm->content + offset;
+  const char *end = memchr (line, '\n', fm->length - offset);
+  return end != NULL ? end : fm->content + fm->length;
+}
 
-      token = strtok_r (NULL, CDX_FIELDSEP, &save_ptr);
-      field_num++;
-    }
+/* Decodes the payload digest of the CDX line at LINE into DIGEST, which
+   must have room for SHA1_DIGEST_SIZE bytes.  Returns false if the line
+   lacks any of the fields we need or if the digest is not valid.  */
+static bool
+warc_cdx_line_digest (const char *line, const char *end, char *digest)
+{
+  const char *checksum;
+  size_t checksum_l, digest_l;
+  char decoded[BASE32_LENGTH (SHA1_DIGEST_SIZE)];
 
-  if (original_url != NULL && checksum != NULL && record_id != NULL)
+  checksum = warc_cdx_field (line, end, warc_cdx_field_checksum, &checksum_l);
+  if (checksum == NULL || checksum_l != BASE32_LENGTH (SHA1_DIGEST_SIZE))
+    return false;
+
+  digest_l = sizeof (decoded);
+  if (!base32_decode (checksum, checksum_l, decoded, &digest_l)
+      || digest_l != SHA1_DIGEST_SIZE)
+    return false;
+
+  memcpy (digest, decoded, SHA1_DIGEST_SIZE);
+  return true;
+}
+
+static int
+warc_cdx_index_entry_cmp (const void *a, const void *b)
+{
+  const struct warc_cdx_index_entry *e1 = a, *e2 = b;
+  if (e1->key != e2->key)
+    return e1->key < e2->key ? -1 : 1;
+  if (e1->offset != e2->offset)
+    return e1->offset < e2->offset ? -1 : 1;
+  return 0;
+}
+
+/* Builds the index of the CDX file in warc_cdx_dedup_file, starting at
+   the line at offset START.  Returns the sorted entries and stores
+   their number in *COUNT.  */
+static struct warc_cdx_index_entry *
+warc_build_cdx_index (size_t start, size_t *count)
+{
+  const struct file_memory *fm = warc_cdx_dedup_file;
+  struct warc_cdx_index_entry *entries = NULL;
+  size_t size = 0, n = 0;
+  size_t offset = start;
+
+  while (offset < (size_t) fm->length)
     {
-      /* For some extra efficiency, we decode the base32 encoded
-         checksum value.  This should produce exactly SHA1_DIGEST_SIZE
-         bytes.  */
-      size_t checksum_l;
-      char * checksum_v;
-      base32_decode_alloc (checksum, strlen (checksum), &checksum_v,
-                           &checksum_l);
-      free (checksum);
-
-      if (checksum_v != NULL && checksum_l == SHA1_DIGEST_SIZE)
-        {
-          /* This is a valid line with a valid checksum. */
-          struct warc_cdx_record *rec;
-          rec = malloc (sizeof (struct warc_cdx_record));
-          rec->url = original_url;
-          rec->uuid = record_id;
-          memcpy (rec->digest, checksum_v, SHA1_DIGEST_SIZE);
-          hash_table_put (warc_cdx_dedup_table, rec->digest, rec);
-          free (checksum_v);
-        }
-      else
+      const char *line = fm->content + offset;
+      const char *end = warc_cdx_line_end (fm, offset);
+      size_t field_l;
+      char digest[SHA1_DIGEST_SIZE];
+
+      /* Only index the lines that have all three fields.  */
+      if (warc_cdx_line_digest (line, end, digest)
+          && warc_cdx_field (line, end, warc_cdx_field_original_url,
+                             &field_l) != NULL
+          && warc_cdx_field (line, end, warc_cdx_field_record_id,
+                             &field_l) != NULL)
         {
-          free (original_url);
-          free (checksum_v);
-          free (record_id);
+          if (n == size)
+            {
+              size = size ? size * 2 : 1024;
+              entries = xrealloc (entries, size * sizeof *entries);
+            }
+          memcpy (&entries[n].key, digest, sizeof (entries[n].key));
+          entries[n].offset = offset;
+          n++;
         }
+
+      offset = end - fm->content + 1;
     }
-  else
+
+  if (n > 0)
+    qsort (entries, n, sizeof *entries, warc_cdx_index_entry_cmp);
+  *count = n;
+  return entries;
+}
+
+/* Saves the index ENTRIES of COUNT records of the CDX file described
+   by ST to INDEX_FILENAME.  The index is written to a temporary file
+   first, so that a concurrent run never sees a partial index.  */
+static bool
+warc_save_cdx_index (const char *index_filename, const struct_stat *st,
+                     const struct warc_cdx_index_entry *entries, size_t count)
+{
+  struct warc_cdx_index_header header;
+  char *tmp_filename = aprintf ("%s.%lu", index_filename,
+                                (unsigned long) getpid ());
+  FILE *fp = fopen (tmp_filename, "wb");
+  bool ok = fp != NULL;
+
+  if (ok)
     {
-      xfree_null(checksum);
-      xfree_null(original_url);
-      xfree_null(record_id);
+      xzero (header);
+      memcpy (header.magic, WARC_CDX_INDEX_MAGIC, sizeof (header.magic));
+      header.byte_order = 0x01020304;
+      header.entry_size = sizeof (struct warc_cdx_index_entry);
+      header.cdx_size = st->st_size;
+      header.cdx_mtime = st->st_mtime;
+      header.count = count;
+
+      ok = fwrite (&header, sizeof header, 1, fp) == 1
+           && fwrite (entries, sizeof *entries, count, fp) == count;
+      ok = fclose (fp) == 0 && ok;
+      ok = ok && rename (tmp_filename, index_filename) == 0;
+      if (!ok)
+        unlink (tmp_filename);
     }
+
+  xfree (tmp_filename);
+  return ok;
 }
 
-/* Loads the CDX file from opt.warc_cdx_dedup_filename and fills
-   the warc_cdx_dedup_table. */
+/* Maps the index in INDEX_FILENAME into memory, if it exists and was
+   built from the CDX file described by ST.  */
 static bool
-warc_load_cdx_dedup_file (void)
+warc_open_cdx_index (const char *index_filename, const struct_stat *st)
 {
-  FILE *f = fopen (opt.warc_cdx_dedup_filename, "r");
-  if (f == NULL)
+  struct file_memory *fm;
+  struct warc_cdx_index_header header;
+
+  if (!file_exists_p (index_filename))
+    return false;
+  fm = wget_read_file (index_filename);
+  if (fm == NULL)
     return false;
 
-  int field_num_original_url = -1;
-  int field_num_checksum = -1;
-  int field_num_record_id = -1;
+  if (fm->length < (int) sizeof header)
+    goto stale;
+  memcpy (&header, fm->content, sizeof header);
+  if (memcmp (header.magic, WARC_CDX_INDEX_MAGIC, sizeof (header.magic)) != 0
+      || header.byte_order != 0x01020304
+      || header.entry_size != sizeof (struct warc_cdx_index_entry)
+      || header.cdx_size != (uint64_t) st->st_size
+      || header.cdx_mtime != (int64_t) st->st_mtime
+      || header.count != (fm->length - sizeof header) / header.entry_size
+      || (fm->length - sizeof header) % header.entry_size != 0)
+    goto stale;
+
+  warc_cdx_dedup_index_file = fm;
+  warc_cdx_dedup_index = (struct warc_cdx_index_entry *)
+    (fm->content + sizeof header);
+  warc_cdx_dedup_count = header.count;
+  return true;
+
+ stale:
+  wget_read_file_free (fm);
+  return false;
+}
 
-  char *lineptr = NULL;
-  size_t n = 0;
-  ssize_t line_length;
+/* Opens the CDX file opt.warc_cdx_dedup_filename for deduplication.
+   The file is mapped into memory rather than parsed, and looked up
+   through its index, which is built and saved if needed.  */
+static bool
+warc_load_cdx_dedup_file (void)
+{
+  struct_stat st;
+  const char *end;
+  char *header;
+
+  if (stat (opt.warc_cdx_dedup_filename, &st) != 0)
+    return false;
+  warc_cdx_dedup_file = wget_read_file (opt.warc_cdx_dedup_filename);
+  if (warc_cdx_dedup_file == NULL)
+    return false;
 
   /* The first line should contain the CDX header.
      Format:  " CDX x x x x x"
      where x are field type indicators.  For our purposes, we only
      need 'a' (the original url), 'k' (the SHA1 checksum) and
      'u' (the WARC record id). */
-  line_length = getline (&lineptr, &n, f);
-  if (line_length != -1)
-    warc_parse_cdx_header (lineptr, &field_num_original_url,
-                           &field_num_checksum, &field_num_record_id);
-
-  /* If the file contains all three fields, read the complete file. */
-  if (field_num_original_url == -1
-      || field_num_checksum == -1
-      || field_num_record_id == -1)
+  end = warc_cdx_line_end (warc_cdx_dedup_file, 0);
+  header = strdupdelim (warc_cdx_dedup_file->content, end);
+  warc_parse_cdx_header (header, &warc_cdx_field_original_url,
+                         &warc_cdx_field_checksum, &warc_cdx_field_record_id);
+  xfree (header);
+
+  /* If the file contains all three fields, index the complete file. */
+  if (warc_cdx_field_original_url == -1
+      || warc_cdx_field_checksum == -1
+      || warc_cdx_field_record_id == -1)
     {
-      if (field_num_original_url == -1)
+      if (warc_cdx_field_original_url == -1)
         logprintf (LOG_NOTQUIET,
 _("CDX file does not list original urls. (Missing column 'a'.)\n"));
-      if (field_num_checksum == -1)
+      if (warc_cdx_field_checksum == -1)
         logprintf (LOG_NOTQUIET,
 _("CDX file does not list checksums. (Missing column 'k'.)\n"));
-      if (field_num_record_id == -1)
+      if (warc_cdx_field_record_id == -1)
         logprintf (LOG_NOTQUIET,
 _("CDX file does not list record ids. (Missing column 'u'.)\n"));
+
+      wget_read_file_free (warc_cdx_dedup_file);
+      warc_cdx_dedup_file = NULL;
     }
   else
     {
-      /* Initialize the table. */
-      warc_cdx_dedup_table = hash_table_new (1000, warc_hash_sha1_digest,
-                                             warc_cmp_sha1_digest);
-
-      do
+      char *index_filename = concat_strings (opt.warc_cdx_dedup_filename,
+                                             WARC_CDX_INDEX_SUFFIX,
+                                             (char *) 0);
+      if (!warc_open_cdx_index (index_filename, &st))
         {
-          line_length = getline (&lineptr, &n, f);
-          if (line_length != -1)
-            {
-              warc_process_cdx_line (lineptr, field_num_original_url,
-                            field_num_checksum, field_num_record_id);
-            }
-
+          logprintf (LOG_VERBOSE, _("Indexing CDX file %s.\n"),
+                     quote (opt.warc_cdx_dedup_filename));
+          warc_cdx_dedup_index
+            = warc_build_cdx_index (end - warc_cdx_dedup_file->content + 1,
+                                    &warc_cdx_dedup_count);
+          if (!warc_save_cdx_index (index_filename, &st, warc_cdx_dedup_index,
+                                    warc_cdx_dedup_count))
+            DEBUGP (("Could not save the CDX index to %s: %s\n",
+                     quote (index_filename), strerror (errno)));
         }
-      while (line_length != -1);
+      xfree (index_filename);
 
       /* Print results. */
-      int nrecords = hash_table_count (warc_cdx_dedup_table);
-      logprintf (LOG_VERBOSE, ngettext ("Loaded %d record from CDX.\n\n",
-                                        "Loaded %d records from CDX.\n\n",
-                                         nrecords),
-                              nrecords);
+      logprintf (LOG_VERBOSE, ngettext ("Loaded %lu record from CDX.\n\n",
+                                        "Loaded %lu records from CDX.\n\n",
+                                        warc_cdx_dedup_count),
+                 (unsigned long) warc_cdx_dedup_count);
     }
 
-  free (lineptr);
-  fclose (f);
-
   return true;
 }
+
+/* Frees the CDX file and index opened by warc_load_cdx_dedup_file.  */
+static void
+warc_close_cdx_dedup_file (void)
+{
+  if (warc_cdx_dedup_index_file != NULL)
+    {
+      wget_read_file_free (warc_cdx_dedup_index_file);
+      warc_cdx_dedup_index_file = NULL;
+    }
+  else
+    xfree_null (warc_cdx_dedup_index);
+  warc_cdx_dedup_index = NULL;
+  warc_cdx_dedup_count = 0;
+
+  if (warc_cdx_dedup_file != NULL)
+    {
+      wget_read_file_free (warc_cdx_dedup_file);
+      warc_cdx_dedup_file = NULL;
+    }
+}
 #undef CDX_FIELDSEP
+#undef CDX_FIELDSEP_P
 
-/* Returns the existing duplicate CDX record for the given url and payload
-   digest.  Returns NULL if the url is not found or if the payload digest
-   does not match, or if CDX deduplication is disabled. */
-static struct warc_cdx_record *
-warc_find_duplicate_cdx_record (char *url, char *sha1_digest_payload)
+/* Returns the record id of an existing CDX record for the given url
+   and payload digest, which the caller should free.  Returns NULL if
+   there is no such record, or if CDX deduplication is disabled. */
+static char *
+warc_find_duplicate_cdx_record (const char *url,
+                                const char *sha1_digest_payload)
 {
-  if (warc_cdx_dedup_table == NULL)
+  const struct warc_cdx_index_entry *index = warc_cdx_dedup_index;
+  size_t lo = 0, hi = warc_cdx_dedup_count;
+  size_t url_l = strlen (url);
+  uint64_t key;
+
+  if (warc_cdx_dedup_file == NULL)
     return NULL;
 
-  struct warc_cdx_record *rec_existing
-    = hash_table_get (warc_cdx_dedup_table, sha1_digest_payload);
+  /* Find the first entry with this key.  */
+  memcpy (&key, sha1_digest_payload, sizeof (key));
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (index[mid].key < key)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
 
-  if (rec_existing && strcmp (rec_existing->url, url) == 0)
-    return rec_existing;
-  else
-    return NULL;
+  /* Check the full digest and the url of every record with this key.  */
+  for (; lo < warc_cdx_dedup_count && index[lo].key == key; lo++)
+    {
+      const char *line = warc_cdx_dedup_file->content + index[lo].offset;
+      const char *end = warc_cdx_line_end (warc_cdx_dedup_file,
+                                           index[lo].offset);
+      const char *field;
+      size_t field_l;
+      char digest[SHA1_DIGEST_SIZE];
+
+      if (!warc_cdx_line_digest (line, end, digest)
+          || memcmp (digest, sha1_digest_payload, SHA1_DIGEST_SIZE) != 0)
+        continue;
+
+      field = warc_cdx_field (line, end, warc_cdx_field_original_url,
+                              &field_l);
+      if (field == NULL || field_l != url_l || memcmp (field, url, url_l) != 0)
+        continue;
+
+      field = warc_cdx_field (line, end, warc_cdx_field_record_id, &field_l);
+      if (field != NULL)
+        return strdupdelim (field, field + field_l);
+    }
+
+  return NULL;
 }
 
 /* Initializes the WARC writer (if opt.warc_filename is set).
@@ -1078,6 +1781,11 @@ warc_init (void)
               exit(1);
             }
         }
+
+#ifdef ENABLE_THREADS
+      if (opt.jobs > 1)
+        warc_start_writer ();
+#endif
     }
 }
 
@@ -1116,6 +1824,8 @@ warc_write_metadata (void)
 
   if (warc_log_fp != NULL)
     {
+      /* Make sure the log file has everything logged so far.  */
+      logflush ();
       warc_write_resource_record (NULL,
                               "metadata://gnu.org/software/wget/warc/wget.log",
                                   NULL, manifest_uuid, NULL, "text/plain",
@@ -1132,14 +1842,17 @@ warc_write_metadata (void)
 void
 warc_close (void)
 {
+#ifdef ENABLE_THREADS
+  warc_stop_writer ();
+#endif
   if (warc_current_file != NULL)
     {
       warc_write_metadata ();
-      free (warc_current_warcinfo_uuid_str);
       fclose (warc_current_file);
     }
   if (warc_current_cdx_file != NULL)
     fclose (warc_current_cdx_file);
+  warc_close_cdx_dedup_file ();
   if (warc_log_fp != NULL)
     {
       fclose (warc_log_fp);
@@ -1198,24 +1911,25 @@ bool
 warc_write_request_record (char *url, char *timestamp_str, char *record_uuid,
                            ip_address *ip, FILE *body, off_t payload_offset)
 {
-  warc_write_start_record ();
-  warc_write_header ("WARC-Type", "request");
-  warc_write_header ("WARC-Target-URI", url);
-  warc_write_header ("Content-Type", "application/http;msgtype=request");
-  warc_write_date_header (timestamp_str);
-  warc_write_header ("WARC-Record-ID", record_uuid);
-  warc_write_ip_header (ip);
-  warc_write_header ("WARC-Warcinfo-ID", warc_current_warcinfo_uuid_str);
-  warc_write_digest_headers (body, payload_offset);
-  warc_write_block_from_file (body);
-  warc_write_end_record ();
+  struct warc_record *rec = warc_write_start_record ();
+  warc_write_header (rec, "WARC-Type", "request");
+  warc_write_header (rec, "WARC-Target-URI", url);
+  warc_write_header (rec, "Content-Type", "application/http;msgtype=request");
+  warc_write_date_header (rec, timestamp_str);
+  warc_write_header (rec, "WARC-Record-ID", record_uuid);
+  warc_write_ip_header (rec, ip);
+  rec->warcinfo_id = true;
+  warc_write_digest_headers (rec, body, payload_offset);
+  warc_write_block_from_file (rec, body);
+  warc_write_end_record (rec);
 
   fclose (body);
 
-  return warc_write_ok;
+  return warc_commit_record (rec);
 }
 
-/* Writes a response record to the CDX file.
+/* Prepares the CDX line of a response record.
+   rec  is the response record,
    url  is the target uri of the request/response,
    timestamp_str  is the timestamp of the request that generated this response,
                   (generated with warc_timestamp),
@@ -1223,15 +1937,14 @@ warc_write_request_record (char *url, char *timestamp_str, char *record_uuid,
    response_code  is the HTTP response code (will be printed to CDX),
    payload_digest  is the sha1 digest of the payload,
    redirect_location  is the contents of the Location: header, or NULL (will be printed to CDX),
-   offset  is the position of the WARC record in the WARC file,
-   warc_filename  is the filename of the WARC,
    response_uuid  is the uuid of the response.
-   Returns true on success, false on error. */
-static bool
-warc_write_cdx_record (const char *url, const char *timestamp_str,
+   The line is completed with the offset of the record and the
+   filename of the WARC when the record is committed.  */
+static void
+warc_write_cdx_record (struct warc_record *rec, const char *url,
+                       const char *timestamp_str,
                        const char *mime_type, int response_code,
                        const char *payload_digest, const char *redirect_location,
-                       off_t offset, const char *warc_filename,
                        const char *response_uuid)
 {
   /* Transform the timestamp. */
@@ -1256,17 +1969,12 @@ warc_write_cdx_record (const char *url, const char *timestamp_str,
   if (redirect_location == NULL || strlen(redirect_location) == 0)
     redirect_location = "-";
 
-  char offset_string[MAX_INT_TO_STRING_LEN(off_t)];
-  number_to_string (offset_string, offset);
-
-  /* Print the CDX line. */
-  fprintf (warc_current_cdx_file, "%s %s %s %s %d %s %s - %s %s %s\n", url,
-           timestamp_str_cdx, url, mime_type, response_code, checksum,
-           redirect_location, offset_string, warc_current_filename,
-           response_uuid);
-  fflush (warc_current_cdx_file);
-
-  return true;
+  /* Prepare the CDX line. */
+  rec->cdx_line = aprintf ("%s %s %s %s %d %s %s -", url, timestamp_str_cdx,
+                           url, mime_type, response_code, checksum,
+                           redirect_location);
+  snprintf (rec->cdx_record_id, sizeof (rec->cdx_record_id), "%s",
+            response_uuid);
 }
 
 /* Writes a revisit record to the WARC file.
@@ -1279,43 +1987,50 @@ warc_write_cdx_record (const char *url, const char *timestamp_str,
                  (generated with warc_uuid_str),
    payload_digest  is the sha1 digest of the payload,
    ip  is the ip address of the server (or NULL),
-   body  is a pointer to a file containing the response headers (without payload).
+   body  is a pointer to a file containing the response headers (without payload),
+   sha1_res_block  is the sha1 digest of body, or NULL to compute it here.
    Calling this function will close body.
    Returns true on success, false on error. */
 static bool
 warc_write_revisit_record (char *url, char *timestamp_str,
                            char *concurrent_to_uuid, char *payload_digest,
-                           char *refers_to, ip_address *ip, FILE *body)
+                           char *refers_to, ip_address *ip, FILE *body,
+                           char *sha1_res_block)
 {
   char revisit_uuid [48];
   warc_uuid_str (revisit_uuid);
 
   char *block_digest = NULL;
-  char sha1_res_block[SHA1_DIGEST_SIZE];
-  sha1_stream (body, sha1_res_block);
+  char sha1_res_body[SHA1_DIGEST_SIZE];
+  if (sha1_res_block == NULL)
+    {
+      rewind (body);
+      sha1_stream (body, sha1_res_body);
+      sha1_res_block = sha1_res_body;
+    }
   block_digest = warc_base32_sha1_digest (sha1_res_block);
 
-  warc_write_start_record ();
-  warc_write_header ("WARC-Type", "revisit");
-  warc_write_header ("WARC-Record-ID", revisit_uuid);
-  warc_write_header ("WARC-Warcinfo-ID", warc_current_warcinfo_uuid_str);
-  warc_write_header ("WARC-Concurrent-To", concurrent_to_uuid);
-  warc_write_header ("WARC-Refers-To", refers_to);
-  warc_write_header ("WARC-Profile", "http://netpreserve.org/warc/1.0/revisit/identical-payload-digest");
-  warc_write_header ("WARC-Truncated", "length");
-  warc_write_header ("WARC-Target-URI", url);
-  warc_write_date_header (timestamp_str);
-  warc_write_ip_header (ip);
-  warc_write_header ("Content-Type", "application/http;msgtype=response");
-  warc_write_header ("WARC-Block-Digest", block_digest);
-  warc_write_header ("WARC-Payload-Digest", payload_digest);
-  warc_write_block_from_file (body);
-  warc_write_end_record ();
+  struct warc_record *rec = warc_write_start_record ();
+  warc_write_header (rec, "WARC-Type", "revisit");
+  warc_write_header (rec, "WARC-Record-ID", revisit_uuid);
+  rec->warcinfo_id = true;
+  warc_write_header (rec, "WARC-Concurrent-To", concurrent_to_uuid);
+  warc_write_header (rec, "WARC-Refers-To", refers_to);
+  warc_write_header (rec, "WARC-Profile", "http://netpreserve.org/warc/1.0/revisit/identical-payload-digest");
+  warc_write_header (rec, "WARC-Truncated", "length");
+  warc_write_header (rec, "WARC-Target-URI", url);
+  warc_write_date_header (rec, timestamp_str);
+  warc_write_ip_header (rec, ip);
+  warc_write_header (rec, "Content-Type", "application/http;msgtype=response");
+  warc_write_header (rec, "WARC-Block-Digest", block_digest);
+  warc_write_header (rec, "WARC-Payload-Digest", payload_digest);
+  warc_write_block_from_file (rec, body);
+  warc_write_end_record (rec);
 
   fclose (body);
   free (block_digest);
 
-  return warc_write_ok;
+  return warc_commit_record (rec);
 }
 
 /* Writes a response record to the WARC file.
@@ -1326,6 +2041,9 @@ warc_write_revisit_record (char *url, char *timestamp_str,
                  (generated with warc_uuid_str),
    ip  is the ip address of the server (or NULL),
    body  is a pointer to a file containing the response headers and body.
+   payload_offset  is where the response body starts in body,
+   digests  are the digests of body as it was written, or NULL to compute
+            them by reading body back,
    mime_type  is the mime type of the response body (will be printed to CDX),
    response_code  is the HTTP response code (will be printed to CDX),
    redirect_location  is the contents of the Location: header, or NULL (will be printed to CDX),
@@ -1334,26 +2052,43 @@ warc_write_revisit_record (char *url, char *timestamp_str,
 bool
 warc_write_response_record (char *url, char *timestamp_str,
                             char *concurrent_to_uuid, ip_address *ip,
-                            FILE *body, off_t payload_offset, char *mime_type,
-                            int response_code, char *redirect_location)
+                            FILE *body, off_t payload_offset,
+                            const struct warc_digests *digests,
+                            char *mime_type, int response_code,
+                            char *redirect_location)
 {
   char *block_digest = NULL;
   char *payload_digest = NULL;
   char sha1_res_block[SHA1_DIGEST_SIZE];
+  char sha1_res_head[SHA1_DIGEST_SIZE];
   char sha1_res_payload[SHA1_DIGEST_SIZE];
 
   if (opt.warc_digests_enabled)
     {
-      /* Calculate the block and payload digests. */
-      rewind (body);
-      if (warc_sha1_stream_with_payload (body, sha1_res_block, sha1_res_payload,
-          payload_offset) == 0)
+      bool have_digests;
+
+      /* Get the block and payload digests, reading them back from BODY
+         only if they were not computed as it was written. */
+      if (digests != NULL)
+        {
+          warc_digests_finish (digests, sha1_res_block, sha1_res_head,
+                               sha1_res_payload);
+          have_digests = true;
+        }
+      else
+        {
+          rewind (body);
+          have_digests = warc_sha1_stream_with_payload (body, sha1_res_block,
+                           sha1_res_payload, payload_offset) == 0;
+        }
+
+      if (have_digests)
         {
           /* Decide (based on url + payload digest) if we have seen this
              data before. */
-          struct warc_cdx_record *rec_existing;
-          rec_existing = warc_find_duplicate_cdx_record (url, sha1_res_payload);
-          if (rec_existing != NULL)
+          char *refers_to;
+          refers_to = warc_find_duplicate_cdx_record (url, sha1_res_payload);
+          if (refers_to != NULL)
             {
               bool result;
 
@@ -1361,19 +2096,24 @@ warc_write_response_record (char *url, char *timestamp_str,
               logprintf (LOG_VERBOSE,
           _("Found exact match in CDX file. Saving revisit record to WARC.\n"));
 
-              /* Remove the payload from the file. */
+              /* Remove the payload from the file, so that it is never
+                 copied into the WARC. */
               if (payload_offset > 0)
                 {
                   if (ftruncate (fileno (body), payload_offset) == -1)
-                    return false;
+                    {
+                      xfree (refers_to);
+                      return false;
+                    }
                 }
 
               /* Send the original payload digest. */
               payload_digest = warc_base32_sha1_digest (sha1_res_payload);
               result = warc_write_revisit_record (url, timestamp_str,
-                         concurrent_to_uuid, payload_digest, rec_existing->uuid,
-                         ip, body);
+                         concurrent_to_uuid, payload_digest, refers_to,
+                         ip, body, digests != NULL ? sha1_res_head : NULL);
               free (payload_digest);
+              xfree (refers_to);
 
               return result;
             }
@@ -1388,37 +2128,33 @@ warc_write_response_record (char *url, char *timestamp_str,
   char response_uuid [48];
   warc_uuid_str (response_uuid);
 
-  fseeko (warc_current_file, 0L, SEEK_END);
-  off_t offset = ftello (warc_current_file);
-
-  warc_write_start_record ();
-  warc_write_header ("WARC-Type", "response");
-  warc_write_header ("WARC-Record-ID", response_uuid);
-  warc_write_header ("WARC-Warcinfo-ID", warc_current_warcinfo_uuid_str);
-  warc_write_header ("WARC-Concurrent-To", concurrent_to_uuid);
-  warc_write_header ("WARC-Target-URI", url);
-  warc_write_date_header (timestamp_str);
-  warc_write_ip_header (ip);
-  warc_write_header ("WARC-Block-Digest", block_digest);
-  warc_write_header ("WARC-Payload-Digest", payload_digest);
-  warc_write_header ("Content-Type", "application/http;msgtype=response");
-  warc_write_block_from_file (body);
-  warc_write_end_record ();
+  struct warc_record *rec = warc_write_start_record ();
+  warc_write_header (rec, "WARC-Type", "response");
+  warc_write_header (rec, "WARC-Record-ID", response_uuid);
+  rec->warcinfo_id = true;
+  warc_write_header (rec, "WARC-Concurrent-To", concurrent_to_uuid);
+  warc_write_header (rec, "WARC-Target-URI", url);
+  warc_write_date_header (rec, timestamp_str);
+  warc_write_ip_header (rec, ip);
+  warc_write_header (rec, "WARC-Block-Digest", block_digest);
+  warc_write_header (rec, "WARC-Payload-Digest", payload_digest);
+  warc_write_header (rec, "Content-Type", "application/http;msgtype=response");
+  warc_write_block_from_file (rec, body);
+  warc_write_end_record (rec);
 
   fclose (body);
 
-  if (warc_write_ok && opt.warc_cdx_enabled)
+  if (opt.warc_cdx_enabled)
     {
       /* Add this record to the CDX. */
-      warc_write_cdx_record (url, timestamp_str, mime_type, response_code,
-      payload_digest, redirect_location, offset, warc_current_filename,
-      response_uuid);
+      warc_write_cdx_record (rec, url, timestamp_str, mime_type,
+      response_code, payload_digest, redirect_location, response_uuid);
     }
 
   free (block_digest);
   free (payload_digest);
 
-  return warc_write_ok;
+  return warc_commit_record (rec);
 }
 
 /* Writes a resource or metadata record to the WARC file.
@@ -1449,22 +2185,22 @@ warc_write_record (const char *record_type, char *resource_uuid,
   if (content_type == NULL)
     content_type = "application/octet-stream";
 
-  warc_write_start_record ();
-  warc_write_header ("WARC-Type", record_type);
-  warc_write_header ("WARC-Record-ID", resource_uuid);
-  warc_write_header ("WARC-Warcinfo-ID", warc_current_warcinfo_uuid_str);
-  warc_write_header ("WARC-Concurrent-To", concurrent_to_uuid);
-  warc_write_header ("WARC-Target-URI", url);
-  warc_write_date_header (timestamp_str);
-  warc_write_ip_header (ip);
-  warc_write_digest_headers (body, payload_offset);
-  warc_write_header ("Content-Type", content_type);
-  warc_write_block_from_file (body);
-  warc_write_end_record ();
+  struct warc_record *rec = warc_write_start_record ();
+  warc_write_header (rec, "WARC-Type", record_type);
+  warc_write_header (rec, "WARC-Record-ID", resource_uuid);
+  rec->warcinfo_id = true;
+  warc_write_header (rec, "WARC-Concurrent-To", concurrent_to_uuid);
+  warc_write_header (rec, "WARC-Target-URI", url);
+  warc_write_date_header (rec, timestamp_str);
+  warc_write_ip_header (rec, ip);
+  warc_write_digest_headers (rec, body, payload_offset);
+  warc_write_header (rec, "Content-Type", content_type);
+  warc_write_block_from_file (rec, body);
+  warc_write_end_record (rec);
 
   fclose (body);
 
-  return warc_write_ok;
+  return warc_commit_record (rec);
 }
 
 /* Writes a resource record to the WARC file.
@@ -1510,3 +2246,132 @@ warc_write_metadata_record (char *record_uuid, const char *url,
       record_uuid, url, timestamp_str, concurrent_to_uuid,
       ip, content_type, body, payload_offset);
 }
+
+#ifdef TESTING
+
+#include "test.h"
+
+const char *
+test_warc_digests (void)
+{
+  static const char record[] =
+    "HTTP/1.1 200 OK\r\nContent-Length: 26\r\n\r\n"
+    "abcdefghijklmnopqrstuvwxyz";
+  size_t record_size = sizeof (record) - 1;
+  size_t head_size = strstr (record, "\r\n\r\n") + 4 - record;
+  char expect_block[SHA1_DIGEST_SIZE], expect_head[SHA1_DIGEST_SIZE];
+  char expect_payload[SHA1_DIGEST_SIZE], expect_empty[SHA1_DIGEST_SIZE];
+  char res_block[SHA1_DIGEST_SIZE], res_head[SHA1_DIGEST_SIZE];
+  char res_payload[SHA1_DIGEST_SIZE];
+  struct warc_digests digests;
+  size_t step, i;
+
+  sha1_buffer (record, record_size, expect_block);
+  sha1_buffer (record, head_size, expect_head);
+  sha1_buffer (record + head_size, record_size - head_size, expect_payload);
+  sha1_buffer ("", 0, expect_empty);
+
+  /* Feed the record in pieces of every size, so that the payload
+     boundary falls inside, at the start and at the end of a piece.  */
+  for (step = 1; step <= record_size; step++)
+    {
+      warc_digests_init (&digests, head_size);
+      for (i = 0; i < record_size; i += step)
+        warc_digests_update (&digests, record + i,
+                             step < record_size - i ? step : record_size - i);
+      warc_digests_finish (&digests, res_block, res_head, res_payload);
+
+      mu_assert ("test_warc_digests: wrong block digest",
+                 memcmp (res_block, expect_block, SHA1_DIGEST_SIZE) == 0);
+      mu_assert ("test_warc_digests: wrong head digest",
+                 memcmp (res_head, expect_head, SHA1_DIGEST_SIZE) == 0);
+      mu_assert ("test_warc_digests: wrong payload digest",
+                 memcmp (res_payload, expect_payload, SHA1_DIGEST_SIZE) == 0);
+    }
+
+  /* A record that ends where the payload would start.  */
+  warc_digests_init (&digests, head_size);
+  warc_digests_update (&digests, record, head_size);
+  warc_digests_finish (&digests, res_block, res_head, res_payload);
+  mu_assert ("test_warc_digests: wrong digest of empty payload",
+             memcmp (res_payload, expect_empty, SHA1_DIGEST_SIZE) == 0
+             && memcmp (res_block, expect_head, SHA1_DIGEST_SIZE) == 0);
+
+  return NULL;
+}
+
+const char *
+test_warc_cdx_dedup (void)
+{
+  char dir[] = "/tmp/wget-cdx-XXXXXX";
+  char digest1[SHA1_DIGEST_SIZE], digest2[SHA1_DIGEST_SIZE];
+  char *checksum1, *checksum2, *cdx_filename, *index_filename, *id;
+  char *saved_filename = opt.warc_cdx_dedup_filename;
+  FILE *fp;
+  int pass;
+
+  mu_assert ("test_warc_cdx_dedup: mkdtemp failed", mkdtemp (dir) != NULL);
+  cdx_filename = concat_strings (dir, "/a.cdx", (char *) 0);
+  index_filename = concat_strings (cdx_filename, WARC_CDX_INDEX_SUFFIX,
+                                   (char *) 0);
+
+  sha1_buffer ("one", 3, digest1);
+  sha1_buffer ("two", 3, digest2);
+  checksum1 = warc_base32_sha1_digest (digest1);
+  checksum2 = warc_base32_sha1_digest (digest2);
+
+  /* Two urls with the same payload, and a line without a checksum.  */
+  fp = fopen (cdx_filename, "w");
+  mu_assert ("test_warc_cdx_dedup: fopen failed", fp != NULL);
+  fprintf (fp, " CDX a b a m s k r M V g u\n");
+  fprintf (fp, "http://a/ 0 http://a/ text/html 200 %s - - 0 a.warc <id1>\n",
+           checksum1 + 5);
+  fprintf (fp, "http://b/ 0 http://b/ text/html 200 %s - - 0 a.warc <id2>\n",
+           checksum1 + 5);
+  fprintf (fp, "http://c/ 0 http://c/ text/html 200 - - - 0 a.warc <id3>\n");
+  fprintf (fp, "http://d/ 0 http://d/ text/html 200 %s - - 0 a.warc <id4>",
+           checksum2 + 5);
+  fclose (fp);
+
+  /* The first pass builds the index, the second one maps it.  */
+  opt.warc_cdx_dedup_filename = cdx_filename;
+  for (pass = 0; pass < 2; pass++)
+    {
+      mu_assert ("test_warc_cdx_dedup: load failed",
+                 warc_load_cdx_dedup_file ());
+      mu_assert ("test_warc_cdx_dedup: wrong record count",
+                 warc_cdx_dedup_count == 3);
+      mu_assert ("test_warc_cdx_dedup: index not saved",
+                 file_exists_p (index_filename));
+      mu_assert ("test_warc_cdx_dedup: index not mapped",
+                 (warc_cdx_dedup_index_file != NULL) == (pass == 1));
+
+      id = warc_find_duplicate_cdx_record ("http://b/", digest1);
+      mu_assert ("test_warc_cdx_dedup: wrong record for b",
+                 id != NULL && strcmp (id, "<id2>") == 0);
+      xfree (id);
+      id = warc_find_duplicate_cdx_record ("http://d/", digest2);
+      mu_assert ("test_warc_cdx_dedup: wrong record for d",
+                 id != NULL && strcmp (id, "<id4>") == 0);
+      xfree (id);
+      mu_assert ("test_warc_cdx_dedup: url must match",
+                 warc_find_duplicate_cdx_record ("http://d/", digest1) == NULL);
+      mu_assert ("test_warc_cdx_dedup: digest must match",
+                 warc_find_duplicate_cdx_record ("http://a/", digest2) == NULL);
+
+      warc_close_cdx_dedup_file ();
+    }
+  opt.warc_cdx_dedup_filename = saved_filename;
+
+  unlink (index_filename);
+  unlink (cdx_filename);
+  rmdir (dir);
+  xfree (index_filename);
+  xfree (cdx_filename);
+  free (checksum1);
+  free (checksum2);
+
+  return NULL;
+}
+
+#endif /* TESTING */
@@ -4,6 +4,21 @@
 
 #include "host.h"
 
+#include <sha1.h>
+
+/* Running block and payload digests of a record body, kept up to date
+   while the body is written to its temporary file so that the file
+   does not have to be read back to digest it.  */
+struct warc_digests
+{
+  struct sha1_ctx block;        /* Everything written so far. */
+  struct sha1_ctx head;         /* The part before the payload. */
+  struct sha1_ctx payload;      /* The payload, once reached. */
+  off_t size;                   /* Number of bytes digested. */
+  off_t payload_offset;         /* Where the payload starts. */
+  bool in_payload;
+};
+
 void warc_init (void);
 void warc_close (void);
 void warc_timestamp (char *timestamp);
@@ -11,11 +26,16 @@ void warc_uuid_str (char *id_str);
 
 FILE * warc_tempfile (void);
 
+void warc_digests_init (struct warc_digests *digests, off_t payload_offset);
+void warc_digests_update (struct warc_digests *digests, const char *buf,
+  size_t size);
+
 bool warc_write_request_record (char *url, char *timestamp_str,
   char *concurrent_to_uuid, ip_address *ip, FILE *body, off_t payload_offset);
 bool warc_write_response_record (char *url, char *timestamp_str,
   char *concurrent_to_uuid, ip_address *ip, FILE *body, off_t payload_offset,
-  char *mime_type, int response_code, char *redirect_location);
+  const struct warc_digests *digests, char *mime_type, int response_code,
+  char *redirect_location);
 bool warc_write_resource_record (char *resource_uuid, const char *url,
   const char *timestamp_str, const char *concurrent_to_uuid, ip_address *ip,
   const char *content_type, FILE *body, off_t payload_offset);